@@ -1,5 +1,6 @@
 #cmakedefine HAVE_GMTIME @HAVE_GMTIME@
 #cmakedefine HAVE_LOCALTIME @HAVE_LOCALTIME@
+#cmakedefine HAVE_LOCALTIME_R @HAVE_LOCALTIME_R@
 #cmakedefine HAVE_MALLOC_H @HAVE_MALLOC_H@
 #cmakedefine HAVE_MKTIME @HAVE_MKTIME@
 #cmakedefine HAVE_SQLLEN @HAVE_SQLLEN@
@@ -98,7 +98,9 @@ static int odbc_debuglevel = 0;
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <wchar.h>
 #include <assert.h>
+#include <errno.h>
 
 #ifndef NULL
 #define NULL 0
@@ -118,6 +120,12 @@ static int odbc_debuglevel = 0;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 #define LOCK() pthread_mutex_lock(&mutex)
 #define UNLOCK() pthread_mutex_unlock(&mutex)
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+#define SIGNAL_POOL() pthread_cond_broadcast(&pool_cond)
+static pthread_rwlock_t connection_lock = PTHREAD_RWLOCK_INITIALIZER;
+#define RDLOCK_CONNECTIONS() pthread_rwlock_rdlock(&connection_lock)
+#define WRLOCK_CONNECTIONS() pthread_rwlock_wrlock(&connection_lock)
+#define UNLOCK_CONNECTIONS() pthread_rwlock_unlock(&connection_lock)
 #if __WINDOWS__
 static CRITICAL_SECTION context_mutex;
 #define INIT_CONTEXT_LOCK() InitializeCriticalSection(&context_mutex)
@@ -132,17 +140,15 @@ static pthread_mutex_t context_mutex = PTHREAD_MUTEX_INITIALIZER;
 #else /*multi-threaded*/
 #define LOCK()
 #define UNLOCK()
+#define SIGNAL_POOL()
+#define RDLOCK_CONNECTIONS()
+#define WRLOCK_CONNECTIONS()
+#define UNLOCK_CONNECTIONS()
 #define LOCK_CONTEXTS()
 #define UNLOCK_CONTEXTS()
 #define INIT_CONTEXT_LOCK()
 #endif /*multi-threaded*/
 
-#if !defined(HAVE_TIMEGM) && defined(HAVE_MKTIME) && defined(USE_UTC)
-#define EMULATE_TIMEGM
-static time_t timegm(struct tm *tm);
-#define HAVE_TIMEGM
-#endif
-
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 Work around bug in MS SQL Server  that doesn't allow for SQLGetData() on
 SQLColumns(). Grrr!
@@ -186,6 +192,30 @@ static atom_t	 ATOM_relative;
 static atom_t	 ATOM_bookmark;
 static atom_t	 ATOM_strict;
 static atom_t	 ATOM_relaxed;
+static atom_t	 ATOM_column;
+static atom_t	 ATOM_text;
+static atom_t	 ATOM_rational;
+static atom_t	 ATOM_success;
+static atom_t	 ATOM_success_with_info;
+static atom_t	 ATOM_error;
+static atom_t	 ATOM_unused;
+static atom_t	 ATOM_no_info;
+static atom_t	 ATOM_infinite;
+static atom_t	 ATOM_time_limit_exceeded;
+static atom_t	 ATOM_local;
+static atom_t	 ATOM_utc;
+static atom_t	 ATOM_dict;
+static atom_t	 ATOM_columns;
+static atom_t	 ATOM_csv;
+static atom_t	 ATOM_tsv;
+static atom_t	 ATOM_json;
+static atom_t	 ATOM_truncate;
+static atom_t	 ATOM_count;
+static atom_t	 ATOM_sum;
+static atom_t	 ATOM_min;
+static atom_t	 ATOM_max;
+static atom_t	 ATOM_bag;
+static atom_t	 ATOM_set;
 
 static functor_t FUNCTOR_timestamp7;	/* timestamp/7 */
 static functor_t FUNCTOR_time3;		/* time/7 */
@@ -198,8 +228,6 @@ static functor_t FUNCTOR_existence_error2; /* existence_error(Term, Expected) */
 static functor_t FUNCTOR_representation_error1; /* representation_error(What) */
 static functor_t FUNCTOR_resource_error1; /* resource_error(Error) */
 static functor_t FUNCTOR_permission_error3;
-static functor_t FUNCTOR_odbc_statement1; /* $odbc_statement(Id) */
-static functor_t FUNCTOR_odbc_connection1;
 static functor_t FUNCTOR_encoding1;
 static functor_t FUNCTOR_user1;
 static functor_t FUNCTOR_password1;
@@ -226,6 +254,39 @@ static functor_t FUNCTOR_findall2;	/* findall(Term, row(...)) */
 static functor_t FUNCTOR_affected1;
 static functor_t FUNCTOR_fetch1;
 static functor_t FUNCTOR_wide_column_threshold1;	/* set max_nogetdata */
+static functor_t FUNCTOR_fetch_size1;	/* rows per SQLFetch() */
+static functor_t FUNCTOR_binding1;	/* binding(row|column) */
+static functor_t FUNCTOR_batch2;	/* batch(Affected, StatusList) */
+static functor_t FUNCTOR_load2;		/* load(Loaded, Rejected) */
+static functor_t FUNCTOR_batch_size1;	/* rows per SQLExecute() */
+static functor_t FUNCTOR_commit1;	/* commit after N rows */
+static functor_t FUNCTOR_progress1;	/* progress(:Goal) */
+static functor_t FUNCTOR_statement_cache1;
+static functor_t FUNCTOR_statement_cache_threshold1;
+static functor_t FUNCTOR_statement_pool1;
+static functor_t FUNCTOR_size1;
+static functor_t FUNCTOR_entries1;
+static functor_t FUNCTOR_hits1;
+static functor_t FUNCTOR_misses1;
+static functor_t FUNCTOR_evictions1;
+static functor_t FUNCTOR_min_size1;
+static functor_t FUNCTOR_max_size1;
+static functor_t FUNCTOR_idle_timeout1;
+static functor_t FUNCTOR_wait_timeout1;
+static functor_t FUNCTOR_validate1;
+static functor_t FUNCTOR_timeout1;
+static functor_t FUNCTOR_timezone1;
+static functor_t FUNCTOR_decimal1;
+static functor_t FUNCTOR_stream1;
+static functor_t FUNCTOR_row_format1;	/* row_format(row|dict|columns) */
+static functor_t FUNCTOR_duplicate_key1;
+static functor_t FUNCTOR_aggregate2;	/* aggregate(Spec, row(...)) */
+static functor_t FUNCTOR_plus2;
+static functor_t FUNCTOR_format1;	/* format(csv|tsv|json) */
+static functor_t FUNCTOR_header1;	/* header(Bool) */
+static functor_t FUNCTOR_max_rows1;
+static functor_t FUNCTOR_max_bytes1;
+static functor_t FUNCTOR_on_limit1;	/* on_limit(error|truncate) */
 
 #define SQL_PL_DEFAULT  0		/* don't change! */
 #define SQL_PL_ATOM	1		/* return as atom */
@@ -236,8 +297,17 @@ static functor_t FUNCTOR_wide_column_threshold1;	/* set max_nogetdata */
 #define SQL_PL_TIME	6		/* return as time/3 structure */
 #define SQL_PL_DATE	7		/* return as date/3 structure */
 #define SQL_PL_TIMESTAMP 8		/* return as timestamp/7 structure */
+#define SQL_PL_STREAM	9		/* return as input stream */
+
+#define DECIMAL_TEXT	 0		/* DECIMAL/NUMERIC as text */
+#define DECIMAL_FLOAT	 1		/* as integer or float */
+#define DECIMAL_RATIONAL 2		/* as integer or rational */
+#define IS_DECIMAL_TYPE(t) ((t) == SQL_DECIMAL || (t) == SQL_NUMERIC)
 
 #define PARAM_BUFSIZE (SQLLEN)sizeof(double)
+#define ROW_ALIGN(n) (((n)+sizeof(double)-1) & ~(sizeof(double)-1))
+#define CACHE_LINE   64
+#define COL_ALIGN(n) (((n)+CACHE_LINE-1) & ~(size_t)(CACHE_LINE-1))
 
 typedef uintptr_t code;
 
@@ -248,12 +318,21 @@ typedef struct
   SWORD	       scale;			/* Scale */
   SQLPOINTER   ptr_value;		/* ptr to value */
   SQLLEN       length_ind;		/* length/indicator of value */
+  SQLLEN      *ind_ptr;			/* length/indicator in rowset */
   SQLLEN       len_value;		/* length of value (as parameter)  */
   term_t       put_data;		/* data to put there */
   struct
   { atom_t table;			/* Table name */
     atom_t column;			/* column name */
   } source;				/* origin of the data */
+  struct
+  { char      *data;			/* SQLGetData() scratch buffer */
+    size_t     size;			/* allocated size of data */
+    size_t     hint;			/* initial size (octet length) */
+    size_t     peak;			/* largest value in this window */
+    unsigned   rows;			/* rows in this window */
+  } getdata;				/* reused over rows (unbound cols) */
+  struct atom_cache *atoms;		/* recent text -> atom (result) */
   char	       buf[PARAM_BUFSIZE];	/* Small buffer for simple cols */
 } parameter;
 
@@ -275,9 +354,17 @@ typedef struct
 typedef struct
 { int references;			/* reference count */
   unsigned flags;			/* misc flags */
+  struct row_filter *filter;		/* tests on bound row(...) arguments */
   code     codes[1];			/* executable code */
 } findall;
 
+typedef struct
+{ int references;			/* reference count */
+  int size;				/* # keys (= # columns) */
+  atom_t *keys;				/* column names in standard order */
+  int *slots;				/* column -> index in keys */
+} dict_layout;
+
 typedef struct connection
 { long	       magic;			/* magic code */
   atom_t       alias;			/* alias name of the connection */
@@ -289,10 +376,36 @@ typedef struct connection
   SQLULEN      max_nogetdata;		/* handle as long field if larger */
   IOENC	       encoding;		/* Character encoding to use */
   int	       rep_flag;		/* REP_* for encoding */
+  SQLULEN      fetch_size;		/* default # rows per SQLFetch() */
+  double       timeout;			/* default timeout(Seconds) (0: none) */
+  int	       tz_local;		/* timestamps are in local time */
+  int	       tz_offset;		/* else seconds east of UTC */
+  int	       decimal;			/* DECIMAL_* conversion mode */
+  int	       stmt_cache_size;		/* max # cached statements */
+  int	       stmt_cache_threshold;	/* prepare after # executions */
+  int	       stmt_cache_count;	/* # entries in the cache */
+  struct cached_stmt *stmt_cache;	/* most recently used statement */
+  struct cached_stmt *stmt_cache_tail;	/* least recently used statement */
+  int	       stmt_pool_size;		/* max # idle statement handles */
+  int	       stmt_pool_count;		/* # idle statement handles */
+  HSTMT	      *stmt_pool;		/* idle statement handles */
+  struct context *statements;		/* statements with a blob */
+  atom_t       symbol;			/* <odbc_connection> blob (or 0) */
+  struct odbc_pool *pool;		/* pool we belong to */
+  struct connection *next_idle;		/* next idle connection in pool */
+  double       idle_since;		/* returned to the pool at */
+  int	       checked_out;		/* acquired from the pool */
+  struct
+  { int64_t    hits;			/* used a prepared statement */
+    int64_t    misses;			/* executed directly */
+    int64_t    evictions;		/* dropped from the cache */
+  } stmt_cache_statistics;
   struct connection *next;		/* next in chain */
+  struct connection *next_alias;	/* next in alias hash bucket */
+  struct connection *next_dsn;		/* next in DSN hash bucket */
 } connection;
 
-typedef struct
+typedef struct context
 { long	       magic;			/* magic code */
   connection  *connection;		/* connection used */
   HENV	       henv;			/* ODBC environment */
@@ -312,15 +425,60 @@ typedef struct
   unsigned     flags;			/* general flags */
   nulldef     *null;			/* Prolog null value */
   findall     *findall;			/* compiled code to create result */
+  dict_layout *dict;			/* keys for row_format(dict) */
+  struct row_filter *filter;		/* tests on the bound Row arguments */
+  struct aggregate *aggregate;		/* aggregate(Spec, Row) option */
+  term_t       row_values;		/* row fetched by a filter (0: none) */
   SQLULEN      max_nogetdata;		/* handle as long field if larger */
+  SQLULEN      fetch_size;		/* # rows per SQLFetch() */
+  double       timeout;			/* timeout(Seconds) (0: none) */
+  int	       decimal;			/* DECIMAL_* conversion mode */
+  SQLULEN      max_rows;		/* max_rows(N) (0: none) */
+  int64_t      max_bytes;		/* max_bytes(N) (0: none) */
+  SQLULEN      rows_counted;		/* rows returned by this execution */
+  int64_t      bytes_counted;		/* column data of these rows */
+  double       deadline;		/* odbc_time() limit (0: none) */
+  SQLULEN      rows_fetched;		/* # rows in current rowset */
+  SQLULEN      row;			/* current row in rowset */
+  size_t       row_size;		/* bytes per row in rowset (0: by column) */
+  char	      *rowset;			/* bound rows (block cursor) */
+  SQLUSMALLINT *row_status;		/* status of rows in rowset */
   struct context *clones;		/* chain of clones */
+  struct context *next_clone;		/* next in parent's chain */
+  struct context *parent;		/* statement we are a clone of */
+  int	       thread;			/* thread that last used the clone */
+  atom_t       symbol;			/* <odbc_statement> blob (or 0) */
+  struct context *next_statement;	/* next in connection->statements */
+  struct context *next_collected;	/* next in collected_statements */
+  struct column_stream *streams;	/* open streams on the current row */
+  struct
+  { int64_t    executions;		/* # odbc_execute/3 calls */
+    int64_t    rows;			/* # rows fetched */
+  } stmt_statistics;
 } context;
 
 static struct
 { long	statements_created;		/* # created statements */
   long  statements_freed;		/* # destroyed statements */
+  long	handles_allocated;		/* # SQLAllocStmt() calls */
+  long	handles_reused;			/* # handles from the pool */
+  long	statements_collected;		/* # freed by atom-GC */
+  long	getdata_bytes;			/* bytes in SQLGetData() buffers */
+  long	getdata_allocations;		/* # (re)allocations of these */
 } statistics;
 
+#define STMT_POOL_SIZE	   8		/* default idle handles/connection */
+#define SIGNAL_CHECK_ROWS 256		/* PL_handle_signals() in fetch loops */
+#define GETDATA_MIN_SIZE  2048		/* initial SQLGetData() buffer */
+#define GETDATA_HINT_MAX  65536		/* max initial size from octet length */
+#define GETDATA_SHRINK_ROWS 256		/* rows between shrink checks */
+#define MAX_CLONES	   8		/* max pooled clones per statement */
+#define MAX_FREE_CONTEXTS 64		/* max # free context structs */
+
+static context *free_contexts;		/* free list of context structs */
+static int	free_context_count;	/* # contexts in free_contexts */
+static context *collected_statements;	/* released by atom-GC */
+
 
 #define CON_MAGIC      0x7c42b620	/* magic code */
 #define CTX_MAGIC      0x7c42b621	/* magic code */
@@ -342,6 +500,14 @@ static struct
 #define CTX_PRIMARYKEY	0x1000		/* this is an SQLPrimaryKeys() statement */
 #define CTX_FOREIGNKEY	0x2000		/* this is an SQLForeignKeys() statement */
 #define CTX_EXECUTING	0x4000		/* Context is currently being used in SQLExecute */
+#define CTX_BIND_COLUMN	0x8000		/* column-wise rowset binding */
+#define CTX_TIMEOUT	0x10000		/* SQL_ATTR_QUERY_TIMEOUT was set */
+#define CTX_STREAMS	0x20000		/* has columns of type stream */
+#define CTX_DICT	0x40000		/* return rows as dicts */
+#define CTX_COLUMN_LISTS 0x80000	/* return a list per column */
+#define CTX_TRUNCATE	0x100000	/* on_limit(truncate) */
+#define CTX_MAX_ROWS	0x200000	/* SQL_ATTR_MAX_ROWS was set */
+#define CTX_LISTED	0x400000	/* in connection->statements */
 
 #define FND_SIZE(n)	((size_t)&((findall*)NULL)->codes[n])
 
@@ -358,13 +524,37 @@ static int pl_put_row(term_t, context *);
 static int pl_put_column(context *c, int nth, term_t col);
 static SWORD CvtSqlToCType(context *ctxt, SQLSMALLINT, SQLSMALLINT);
 static void free_context(context *ctx);
+static void unlink_statement_symbol(context *ctxt);
+static void unlink_statement(context *ctxt);
+static void free_collected_statements(void);
+static int  free_statements(connection *cn);
+static void free_collected_pools(void);
 static void close_context(context *ctx);
 static void unmark_and_close_context(context *ctx);
+static int  mark_fetching(context *ctxt);
+static void invalidate_column_streams(context *ctxt);
+static int  fetch_row(context *ctxt);
+static int  compile_row_filter(term_t row, struct row_filter **filterp);
+static void free_findall(findall *in);
+static int  filter_type(term_t t);
+static void free_row_filter(struct row_filter *f);
+static int  row_filter_matches(context *c, struct row_filter *f, int exact);
+static void unmark_fetching(context *ctxt);
+static struct cached_stmt *trim_stmt_cache(connection *cn, int size);
+static void free_cached_stmts(struct cached_stmt *cs);
+static void trim_stmt_pool(connection *cn, int size);
+static void reset_rowset_attributes(HSTMT hstmt);
+static void set_query_timeout(context *ctxt, double seconds);
 static foreign_t odbc_set_connection(connection *cn, term_t option);
 static int get_pltype(term_t t, SWORD *type);
 static SWORD get_sqltype_from_atom(atom_t name, SWORD *type);
 static const char *sql_type_name(SWORD type);
 static const char *sql_c_type_name(SWORD type);
+static foreign_t odbc_export(term_t conn, term_t tquery, term_t stream,
+			     term_t options);
+static foreign_t odbc_load(term_t qid, term_t stream, term_t result,
+			   term_t options);
+static foreign_t odbc_export_decimal(term_t stream, term_t text);
 
 
 		 /*******************************
@@ -431,6 +621,12 @@ odbc_report(HENV henv, HDBC hdbc, HSTMT hstmt, RETCODE rc)
     case SQL_ERROR:
     { term_t ex;
 
+      if ( strcmp((char*)state, "HYT00") == 0 ) /* SQL_ATTR_QUERY_TIMEOUT */
+      { if ( (ex=PL_new_term_ref()) &&
+	     PL_put_atom(ex, ATOM_time_limit_exceeded) )
+	  return PL_raise_exception(ex);
+	return FALSE;
+      }
       if ( (ex=PL_new_term_ref()) &&
 	   PL_unify_term(ex,
 			 PL_FUNCTOR, FUNCTOR_error2,
@@ -586,6 +782,10 @@ typedef int (*AtypeFunc)(term_t t, void *vp);
 	PL_get_typed_arg_ex(i, t, (AtypeFunc)get_encoding, "encoding", n)
 #define get_odbc_version_arg_ex(i, t, n) \
 	PL_get_typed_arg_ex(i, t, (AtypeFunc)get_odbc_version, "odbc_version", n)
+#define get_binding_arg_ex(i, t, n) \
+	PL_get_typed_arg_ex(i, t, (AtypeFunc)get_binding, "binding", n)
+#define get_decimal_mode_arg_ex(i, t, n) \
+	PL_get_typed_arg_ex(i, t, (AtypeFunc)get_decimal_mode, "decimal_mode", n)
 
 /* As above, but applied to an option _value_ that has already been
    extracted (e.g. by PL_scan_options()). */
@@ -667,6 +867,113 @@ put_encoding(term_t t, IOENC enc)
 }
 
 
+static int
+get_decimal_mode(term_t t, int *mode)
+{ atom_t a;
+
+  if ( PL_get_atom(t, &a) )
+  { if ( a == ATOM_text )
+      *mode = DECIMAL_TEXT;
+    else if ( a == ATOM_float )
+      *mode = DECIMAL_FLOAT;
+    else if ( a == ATOM_rational )
+      *mode = DECIMAL_RATIONAL;
+    else
+      return FALSE;
+
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+static int
+get_binding(term_t t, int *by_column)
+{ atom_t a;
+
+  if ( PL_get_atom(t, &a) )
+  { if ( a == ATOM_row )
+    { *by_column = FALSE;
+      return TRUE;
+    } else if ( a == ATOM_column )
+    { *by_column = TRUE;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+
+/* Monotonic time in seconds */
+
+static double
+odbc_time(void)
+{
+#ifdef __WINDOWS__
+  return (double)GetTickCount64()/1000.0;
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec/1000000000.0;
+#else
+  return (double)time(NULL);
+#endif
+}
+
+
+/* Get a time in seconds or `infinite`, which is returned as -1.0 */
+
+static int
+get_timeout_arg_ex(int i, term_t t, double *secs)
+{ term_t a = PL_new_term_ref();
+  atom_t name;
+
+  _PL_get_arg(i, t, a);
+  if ( PL_get_atom(a, &name) && name == ATOM_infinite )
+  { *secs = -1.0;
+    return TRUE;
+  }
+  if ( !PL_get_float(a, secs) )
+    return type_error(a, "float");
+  if ( *secs < 0.0 )
+    return domain_error(a, "nonneg");
+
+  return TRUE;
+}
+
+
+static int
+get_timezone_ex(term_t t, int *local, int *offset)
+{ atom_t a;
+  int west;
+
+  if ( PL_get_atom(t, &a) )
+  { if ( a == ATOM_local )
+    { *local = TRUE;
+      *offset = 0;
+      return TRUE;
+    } else if ( a == ATOM_utc )
+    { *local = FALSE;
+      *offset = 0;
+      return TRUE;
+    }
+    return domain_error(t, "timezone");
+  }
+  if ( PL_get_integer(t, &west) )
+  { if ( west < -24*3600 || west > 24*3600 )
+      return domain_error(t, "timezone");
+    *local = FALSE;
+    *offset = -west;
+    return TRUE;
+  }
+
+  return type_error(t, "timezone");
+}
+
+
 static int
 enc_to_rep(IOENC enc)
 { switch(enc)
@@ -948,9 +1255,9 @@ record. Both approaches are slow and largely  discard the purpose of the
 option, which is to avoid findall/3 and its associated costs in terms of
 copying and memory fragmentation.
 
-The current implementation is incomplete. It does not allow arguments of
-row(...) to be instantiated. Plain instantiation   can always be avoided
-using a proper SELECT statement. Potentionally   useful however would be
+Atomic arguments of row(...) are compiled into a row filter (see ROW
+FILTERS) that skips rows for which the column does not match.  Other
+instantiated arguments are not allowed.  Potentionally useful would be
 the  translation  of   compound   terms,    especially   to   translates
 date/time/timestamp structures to a format for use by the application.
 
@@ -1116,8 +1423,11 @@ compile_findall(term_t all, unsigned flags)
   for(i=1; i<=info.columns; i++)
   { if ( !PL_get_arg(i, info.row, t) )
       return NULL;
-    if ( !PL_is_variable(t) )
-    { type_error(t, "unbound");
+    if ( !PL_is_variable(t) && !filter_type(t) )
+    { if ( PL_is_atomic(t) )
+	domain_error(t, "row_filter");
+      else
+	type_error(t, "atomic");
       return NULL;
     }
   }
@@ -1131,7 +1441,12 @@ compile_findall(term_t all, unsigned flags)
     return NULL;
   f->references = 1;
   f->flags = flags;
+  f->filter = NULL;
   memcpy(f->codes, info.buf, sizeof(code)*info.size);
+  if ( !compile_row_filter(info.row, &f->filter) )
+  { free_findall(f);
+    return NULL;
+  }
 
   return f;
 }
@@ -1187,12 +1502,129 @@ free_findall(findall *in)
 { if ( in && --in->references == 0 )
   { if ( ison(in, CTX_PERSISTENT) )
       unregister_code(in->codes);
+    if ( in->filter )
+      free_row_filter(in->filter);
 
     free(in);
   }
 }
 
 
+			 /*******************************
+			 *	    DICT ROWS		*
+			 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Using row_format(dict), rows are returned as dicts with an unbound tag,
+keyed by the column names.  prepare_result() creates the key atoms once
+per statement and order_dict_layout() sorts them by handle, which is the
+order in which dicts store their keys.  slots[] maps each column to its
+position in this order, such that pl_put_row() can fetch the columns in
+their natural order (required for SQLGetData()) while filling the value
+vector for PL_put_dict() in key order.  The layout is shared with clones.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct
+{ atom_t key;				/* column name */
+  int	 column;			/* 0-based column */
+} dict_key;
+
+
+static dict_layout *
+new_dict_layout(int ncols)
+{ dict_layout *dl;
+  size_t bytes = sizeof(*dl) + ncols*(sizeof(atom_t)+sizeof(int));
+
+  if ( !(dl = odbc_malloc(bytes)) )
+    return NULL;
+  memset(dl, 0, bytes);
+  dl->references = 1;
+  dl->size = ncols;
+  dl->keys = (atom_t*)(dl+1);
+  dl->slots = (int*)(dl->keys+ncols);
+
+  return dl;
+}
+
+
+static dict_layout *
+clone_dict_layout(dict_layout *in)
+{ if ( in )
+    in->references++;
+  return in;
+}
+
+
+static void
+free_dict_layout(dict_layout *dl)
+{ if ( dl && --dl->references == 0 )
+  { int i;
+
+    for(i=0; i<dl->size; i++)
+    { if ( dl->keys[i] )
+	PL_unregister_atom(dl->keys[i]);
+    }
+    free(dl);
+  }
+}
+
+
+static int
+compare_dict_keys(const void *p1, const void *p2)
+{ atom_t k1 = ((const dict_key*)p1)->key;
+  atom_t k2 = ((const dict_key*)p2)->key;
+
+  return k1 < k2 ? -1 : k1 > k2 ? 1 : 0;
+}
+
+
+/* order_dict_layout() sorts the keys of ctxt->dict and fills the slots.
+   Raises error(duplicate_key(Name), _) if two columns have the same
+   name, in which case the layout is discarded.
+*/
+
+static int
+order_dict_layout(context *ctxt)
+{ dict_layout *dl = ctxt->dict;
+  dict_key *tmp;
+  int i;
+
+  if ( !(tmp = odbc_malloc(dl->size*sizeof(*tmp))) )
+    return FALSE;
+  for(i=0; i<dl->size; i++)
+  { tmp[i].key = dl->keys[i];
+    tmp[i].column = i;
+  }
+  qsort(tmp, dl->size, sizeof(*tmp), compare_dict_keys);
+
+  for(i=1; i<dl->size; i++)
+  { if ( tmp[i].key == tmp[i-1].key )
+    { term_t ex;
+      int rc = ( (ex=PL_new_term_ref()) &&
+		 PL_unify_term(ex,
+			       PL_FUNCTOR, FUNCTOR_error2,
+				 PL_FUNCTOR, FUNCTOR_duplicate_key1,
+				   PL_ATOM, tmp[i].key,
+				 PL_VARIABLE) );
+
+      free(tmp);
+      ctxt->dict = NULL;
+      free_dict_layout(dl);
+
+      return rc ? PL_raise_exception(ex) : FALSE;
+    }
+  }
+
+  for(i=0; i<dl->size; i++)
+  { dl->keys[i] = tmp[i].key;
+    dl->slots[tmp[i].column] = i;
+  }
+  free(tmp);
+
+  return TRUE;
+}
+
+
 static code *
 build_term(context *ctxt, code *PC, term_t result)
 { switch((int)*PC++)
@@ -1279,44 +1711,73 @@ put_findall(context *ctxt, term_t result)
 		 *	    CONNECTION		*
 		 *******************************/
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Connections are kept in the chain `connections` for enumeration and in
+two hash tables, keyed by the alias and the DSN atom.  The registry is
+protected by a read/write lock, so concurrent lookups from get_connection()
+do not serialize.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define CONNECTION_BUCKETS 256		/* must be a power of 2 */
+
 static connection *connections;
+static connection *connections_by_alias[CONNECTION_BUCKETS];
+static connection *connections_by_dsn[CONNECTION_BUCKETS];
+
+static unsigned int
+atom_bucket(atom_t a)
+{ uint64_t k = (uint64_t)a * 0x9E3779B97F4A7C15ULL;
+
+  return (unsigned int)(k >> 32) & (CONNECTION_BUCKETS-1);
+}
+
 
 static connection *
-find_connection(atom_t alias)
+find_connection_unlocked(atom_t alias)
 { connection *c;
 
-  LOCK();
-  for(c=connections; c; c=c->next)
+  for(c=connections_by_alias[atom_bucket(alias)]; c; c=c->next_alias)
   { if ( c->alias == alias )
-    { UNLOCK();
       return c;
-    }
   }
-  UNLOCK();
 
   return NULL;
 }
 
 
+static connection *
+find_connection(atom_t alias)
+{ connection *c;
+
+  RDLOCK_CONNECTIONS();
+  c = find_connection_unlocked(alias);
+  UNLOCK_CONNECTIONS();
+
+  return c;
+}
+
+
 static connection *
 find_connection_from_dsn(atom_t dsn)
 { connection *c;
 
-  LOCK();
-  for(c=connections; c; c=c->next)
+  RDLOCK_CONNECTIONS();
+  for(c=connections_by_dsn[atom_bucket(dsn)]; c; c=c->next_dsn)
   { if ( c->dsn == dsn )
-    { UNLOCK();
-      return c;
-    }
+      break;
   }
-  UNLOCK();
+  UNLOCK_CONNECTIONS();
 
-  return NULL;
+  return c;
 }
 
 
+/* Connections of a pool are not   added   to  connections_by_dsn, such
+   that odbc_connect/3 using open(once) cannot pick them up.
+*/
+
 static connection *
-alloc_connection(atom_t alias, atom_t dsn)
+alloc_connection(atom_t alias, atom_t dsn, struct odbc_pool *pool)
 { connection *c;
 
   if ( alias && find_connection(alias) )
@@ -1327,43 +1788,163 @@ alloc_connection(atom_t alias, atom_t dsn)
   memset(c, 0, sizeof(*c));
   c->alias = alias;
   c->magic = CON_MAGIC;
+  c->pool = pool;
   if ( alias )
     PL_register_atom(alias);
   c->dsn = dsn;
   PL_register_atom(dsn);
   c->max_nogetdata = MAX_NOGETDATA;
+  c->fetch_size = 1;
+  c->stmt_cache_threshold = 2;
+  c->stmt_pool_size = STMT_POOL_SIZE;
+#ifndef USE_UTC
+  c->tz_local = TRUE;
+#endif
 
-  LOCK();
+  WRLOCK_CONNECTIONS();
+  if ( alias && find_connection_unlocked(alias) )
+  { UNLOCK_CONNECTIONS();		/* lost a race */
+    PL_unregister_atom(alias);
+    PL_unregister_atom(dsn);
+    free(c);
+    return NULL;
+  }
   c->next = connections;
   connections = c;
-  UNLOCK();
+  if ( alias )
+  { unsigned int k = atom_bucket(alias);
+
+    c->next_alias = connections_by_alias[k];
+    connections_by_alias[k] = c;
+  }
+  if ( !pool )
+  { unsigned int k = atom_bucket(dsn);
+
+    c->next_dsn = connections_by_dsn[k];
+    connections_by_dsn[k] = c;
+  }
+  UNLOCK_CONNECTIONS();
 
   return c;
 }
 
 
+/* Give an anonymous connection an alias.  Fails if the alias is in use */
+
+static int
+set_connection_alias(connection *c, atom_t alias)
+{ unsigned int k = atom_bucket(alias);
+
+  WRLOCK_CONNECTIONS();
+  if ( find_connection_unlocked(alias) )
+  { UNLOCK_CONNECTIONS();
+    return FALSE;
+  }
+  c->alias = alias;
+  PL_register_atom(alias);
+  c->next_alias = connections_by_alias[k];
+  connections_by_alias[k] = c;
+  UNLOCK_CONNECTIONS();
+
+  return TRUE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Connections without an alias  are  represented   as  a  blob of type
+odbc_connection that holds a pointer to  the connection. The blob is
+created lazily and  kept  in  cn->symbol   without  a  reference, so the
+connection always maps to the same  handle.   If  the  connection is
+closed the pointer in the blob is  cleared, such that stale handles
+raise an existence error. If the  blob   is  garbage collected we merely
+forget about it: the connection is  still reachable through the registry
+and must be closed explicitly. cn->symbol is protected by LOCK().
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+release_connection_symbol(atom_t symbol)
+{ connection **ref = PL_blob_data(symbol, NULL, NULL);
+  connection *cn;
+
+  LOCK();
+  if ( (cn = *ref) && cn->symbol == symbol )
+    cn->symbol = 0;
+  *ref = NULL;
+  UNLOCK();
+
+  return TRUE;
+}
+
+
+static int
+write_connection_symbol(IOSTREAM *s, atom_t symbol, int flags)
+{ connection **ref = PL_blob_data(symbol, NULL, NULL);
+
+  Sfprintf(s, "<odbc_connection>(%p)", *ref);
+  return TRUE;
+}
+
+
+static PL_blob_t connection_blob =
+{ PL_BLOB_MAGIC,
+  0,
+  "odbc_connection",
+  release_connection_symbol,
+  NULL,
+  write_connection_symbol
+};
+
+
 static void
-free_connection(connection *c)
+unlink_connection_symbol(connection *cn)
 { LOCK();
-  if ( c == connections )
-    connections = c->next;
-  else
-  { connection *c2;
+  if ( cn->symbol )
+  { connection **ref = PL_blob_data(cn->symbol, NULL, NULL);
 
-    for(c2 = connections; c2; c2 = c2->next)
-    { if ( c2->next == c )
-      { c2->next = c->next;
+    *ref = NULL;
+    cn->symbol = 0;
+  }
+  UNLOCK();
+}
+
+
+static void
+free_connection(connection *c)
+{ connection **cp;
+
+  unlink_connection_symbol(c);
+  WRLOCK_CONNECTIONS();
+  for(cp = &connections; *cp; cp = &(*cp)->next)
+  { if ( *cp == c )
+    { *cp = c->next;
+      break;
+    }
+  }
+  if ( c->alias )
+  { for(cp = &connections_by_alias[atom_bucket(c->alias)];
+	*cp;
+	cp = &(*cp)->next_alias)
+    { if ( *cp == c )
+      { *cp = c->next_alias;
 	break;
       }
     }
   }
-  UNLOCK();
+  for(cp = &connections_by_dsn[atom_bucket(c->dsn)]; *cp; cp = &(*cp)->next_dsn)
+  { if ( *cp == c )
+    { *cp = c->next_dsn;
+      break;
+    }
+  }
+  UNLOCK_CONNECTIONS();
 
   if ( c->alias )
     PL_unregister_atom(c->alias);
   if ( c->dsn )
     PL_unregister_atom(c->dsn);
   free_nulldef(c->null);
+  if ( c->stmt_pool )
+    free(c->stmt_pool);
 
   free(c);
 }
@@ -1373,17 +1954,15 @@ static int
 get_connection(term_t tcid, connection **cn)
 { atom_t alias;
   connection *c;
+  PL_blob_t *type;
+  void *data;
 
-  if ( PL_is_functor(tcid, FUNCTOR_odbc_connection1) )
-  { term_t a = PL_new_term_ref();
-    void *ptr;
-
-    _PL_get_arg(1, tcid, a);
-    if ( !PL_get_pointer(a, &ptr) )
-      return type_error(tcid, "odbc_connection");
-    c = ptr;
+  free_collected_statements();
+  free_collected_pools();
+  if ( PL_get_blob(tcid, &data, NULL, &type) && type == &connection_blob )
+  { c = *(connection**)data;
 
-    if ( c->magic != CON_MAGIC )
+    if ( !c || c->magic != CON_MAGIC )
       return existence_error(tcid, "odbc_connection");
   } else
   { if ( !PL_get_atom(tcid, &alias) )
@@ -1400,11 +1979,37 @@ get_connection(term_t tcid, connection **cn)
 
 static int
 unify_connection(term_t t, connection *cn)
-{ if ( cn->alias )
+{ atom_t symbol;
+
+  if ( cn->alias )
     return PL_unify_atom(t, cn->alias);
 
-  return PL_unify_term(t, PL_FUNCTOR, FUNCTOR_odbc_connection1,
-			    PL_POINTER, cn);
+  LOCK();
+  if ( (symbol = cn->symbol) )
+  { UNLOCK();
+    return PL_unify_atom(t, symbol);
+  }
+  UNLOCK();
+
+  { term_t tmp = PL_new_term_ref();
+
+    if ( !PL_unify_blob(tmp, &cn, sizeof(cn), &connection_blob) ||
+	 !PL_get_atom(tmp, &symbol) )
+      return FALSE;
+
+    LOCK();
+    if ( cn->symbol )			/* lost a race */
+    { connection **ref = PL_blob_data(symbol, NULL, NULL);
+
+      *ref = NULL;
+      symbol = cn->symbol;
+    } else
+    { cn->symbol = symbol;
+    }
+    UNLOCK();
+
+    return PL_unify_atom(t, symbol);
+  }
 }
 
 
@@ -1421,7 +2026,7 @@ odbc_connect(+DSN, -Connection, +Options)
 	    Alias-name for the connection.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-#define MAX_AFTER_OPTIONS 10
+#define MAX_AFTER_OPTIONS 16
 
 static PL_option_t connect_options[] =
 { PL_OPTION("user",			OPT_TERM),
@@ -1439,11 +2044,20 @@ static PL_option_t connect_options[] =
   PL_OPTION("access_mode",		OPT_TERM),
   PL_OPTION("cursor_type",		OPT_TERM),
   PL_OPTION("wide_column_threshold",	OPT_TERM),
+  PL_OPTION("fetch_size",		OPT_TERM),
+  PL_OPTION("binding",			OPT_TERM),
+  PL_OPTION("statement_cache",		OPT_TERM),
+  PL_OPTION("statement_cache_threshold", OPT_TERM),
+  PL_OPTION("statement_pool",		OPT_TERM),
+  PL_OPTION("timeout",			OPT_TERM),
+  PL_OPTION("timezone",			OPT_TERM),
+  PL_OPTION("decimal",			OPT_TERM),
   PL_OPTIONS_END
 };
 
-static foreign_t
-pl_odbc_connect(term_t tdsource, term_t cid, term_t options)
+static int
+connect_data_source(term_t tdsource, term_t cid, term_t options,
+		    struct odbc_pool *pool)
 {  atom_t dsn;
    const char *dsource;			/* odbc data source */
    char *uid = NULL;			/* user id */
@@ -1462,7 +2076,9 @@ pl_odbc_connect(term_t tdsource, term_t cid, term_t options)
    term_t mars_o = 0, pool_mode_o = 0, odbc_version_o = 0, open_o = 0;
    term_t silent_o = 0, encoding_o = 0;
    term_t auto_commit = 0, null_o = 0, access_mode = 0;
-   term_t cursor_type = 0, wide_column_threshold = 0;
+   term_t cursor_type = 0, wide_column_threshold = 0, fetch_size = 0;
+   term_t binding = 0, stmt_cache = 0, stmt_cache_threshold = 0;
+   term_t stmt_pool = 0, timeout = 0, timezone = 0, decimal = 0;
    term_t after_open = PL_new_term_refs(MAX_AFTER_OPTIONS);
    int i, nafter = 0;
    int silent = FALSE;
@@ -1476,7 +2092,10 @@ pl_odbc_connect(term_t tdsource, term_t cid, term_t options)
 			 &user, &password, &alias_o, &driver_string_o,
 			 &mars_o, &pool_mode_o, &odbc_version_o, &open_o,
 			 &silent_o, &encoding_o, &auto_commit, &null_o,
-			 &access_mode, &cursor_type, &wide_column_threshold) )
+			 &access_mode, &cursor_type, &wide_column_threshold,
+			 &fetch_size, &binding,
+			 &stmt_cache, &stmt_cache_threshold, &stmt_pool,
+			 &timeout, &timezone, &decimal) )
      return FALSE;
 
    if ( user            && !get_name_ex(user, &uid) )
@@ -1527,16 +2146,42 @@ pl_odbc_connect(term_t tdsource, term_t cid, term_t options)
 	!PL_cons_functor(after_open+nafter++, FUNCTOR_wide_column_threshold1,
 			 wide_column_threshold) )
      return FALSE;
+   if ( fetch_size &&
+	!PL_cons_functor(after_open+nafter++, FUNCTOR_fetch_size1,
+			 fetch_size) )
+     return FALSE;
+   if ( binding &&
+	!PL_cons_functor(after_open+nafter++, FUNCTOR_binding1, binding) )
+     return FALSE;
+   if ( stmt_cache &&
+	!PL_cons_functor(after_open+nafter++, FUNCTOR_statement_cache1,
+			 stmt_cache) )
+     return FALSE;
+   if ( stmt_cache_threshold &&
+	!PL_cons_functor(after_open+nafter++,
+			 FUNCTOR_statement_cache_threshold1,
+			 stmt_cache_threshold) )
+     return FALSE;
+   if ( stmt_pool &&
+	!PL_cons_functor(after_open+nafter++, FUNCTOR_statement_pool1,
+			 stmt_pool) )
+     return FALSE;
+   if ( timeout &&
+	!PL_cons_functor(after_open+nafter++, FUNCTOR_timeout1, timeout) )
+     return FALSE;
+   if ( timezone &&
+	!PL_cons_functor(after_open+nafter++, FUNCTOR_timezone1, timezone) )
+     return FALSE;
+   if ( decimal &&
+	!PL_cons_functor(after_open+nafter++, FUNCTOR_decimal1, decimal) )
+     return FALSE;
 
    if ( !open )
      open = alias ? ATOM_once : ATOM_multiple;
    if ( open == ATOM_once && (cn = find_connection_from_dsn(dsn)) )
    { if ( alias && cn->alias != alias )
      { if ( !cn->alias )
-       { if ( !find_connection(alias) )
-	 { cn->alias = alias;
-	   PL_register_atom(alias);
-	 } else
+       { if ( !set_connection_alias(cn, alias) )
 	   return PL_warning("Alias already in use");
        } else
 	 return PL_warning("Cannot redefined connection alias");
@@ -1627,7 +2272,7 @@ pl_odbc_connect(term_t tdsource, term_t cid, term_t options)
      return FALSE;
    }
 
-   if ( !(cn=alloc_connection(alias, dsn)) )
+   if ( !(cn=alloc_connection(alias, dsn, pool)) )
    { SQLFreeConnect(hdbc);
      return FALSE;
    }
@@ -1657,6 +2302,12 @@ pl_odbc_connect(term_t tdsource, term_t cid, term_t options)
 }
 
 
+static foreign_t
+pl_odbc_connect(term_t tdsource, term_t cid, term_t options)
+{ return connect_data_source(tdsource, cid, options, NULL);
+}
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 odbc_disconnect(+Connection)
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
@@ -1668,12 +2319,15 @@ odbc_disconnect(+Connection)
 	}
 
 
-static foreign_t
-pl_odbc_disconnect(term_t conn)
-{ connection *cn;
+static int
+close_connection(connection *cn)
+{ struct cached_stmt *evicted;
 
-  if ( !get_connection(conn, &cn) )
-    return FALSE;
+  LOCK();
+  evicted = trim_stmt_cache(cn, 0);	/* free cached statements */
+  trim_stmt_pool(cn, 0);		/* free idle statement handles */
+  UNLOCK();
+  free_cached_stmts(evicted);
 
   TRY_CN(cn, SQLDisconnect(cn->hdbc));  /* Disconnect from the data source */
   TRY_CN(cn, SQLFreeConnect(cn->hdbc)); /* Free the connection handle */
@@ -1683,6 +2337,21 @@ pl_odbc_disconnect(term_t conn)
 }
 
 
+static foreign_t
+pl_odbc_disconnect(term_t conn)
+{ connection *cn;
+
+  if ( !get_connection(conn, &cn) )
+    return FALSE;
+  if ( cn->pool )
+    return permission_error("disconnect", "pooled_connection", conn);
+  if ( !free_statements(cn) )
+    return context_error(conn, "in_use", "connection");
+
+  return close_connection(cn);
+}
+
+
 static int
 add_cid_dsn_pair(term_t list, connection *cn)
 { term_t cnterm = PL_new_term_ref();
@@ -1720,21 +2389,36 @@ odbc_current_connections(term_t cid, term_t dsn, term_t pairs)
     return FALSE;
   }
 
-  LOCK();
+  RDLOCK_CONNECTIONS();
   for(cn=connections; cn; cn=cn->next)
   { if ( (!dsn_a || cn->dsn == dsn_a) )
     { if ( !add_cid_dsn_pair(tail, cn) )
-      { UNLOCK();
+      { UNLOCK_CONNECTIONS();
 	return FALSE;
       }
     }
   }
-  UNLOCK();
+  UNLOCK_CONNECTIONS();
 
   return PL_unify_nil(tail);
 }
 
 
+/* flush_stmt_cache() drops the cached statements of cn, which were
+   prepared using the old statement defaults of the connection.
+*/
+
+static void
+flush_stmt_cache(connection *cn)
+{ struct cached_stmt *evicted;
+
+  LOCK();
+  evicted = trim_stmt_cache(cn, 0);
+  UNLOCK();
+  free_cached_stmts(evicted);
+}
+
+
 static foreign_t
 odbc_set_connection(connection *cn, term_t option)
 { RETCODE rc;
@@ -1785,6 +2469,7 @@ odbc_set_connection(connection *cn, term_t option)
       return FALSE;
 
     set(cn, CTX_SILENT);
+    flush_stmt_cache(cn);
 
     return TRUE;
   } else if ( PL_is_functor(option, FUNCTOR_encoding1) )
@@ -1802,6 +2487,7 @@ odbc_set_connection(connection *cn, term_t option)
 
     _PL_get_arg(1, option, a);
     cn->null = nulldef_spec(a);
+    flush_stmt_cache(cn);
 
     return TRUE;
   } else if ( PL_is_functor(option, FUNCTOR_wide_column_threshold1) )
@@ -1811,6 +2497,97 @@ odbc_set_connection(connection *cn, term_t option)
       return FALSE;
     DEBUG(2, Sdprintf("Using wide_column_threshold = %d\n", val));
     cn->max_nogetdata = val;
+    flush_stmt_cache(cn);
+
+    return TRUE;
+  } else if ( PL_is_functor(option, FUNCTOR_fetch_size1) )
+  { int val;
+
+    if ( !get_int_arg_ex(1, option, &val) )
+      return FALSE;
+    if ( val < 1 )
+      return domain_error(option, "fetch_size");
+    cn->fetch_size = val;
+    flush_stmt_cache(cn);
+
+    return TRUE;
+  } else if ( PL_is_functor(option, FUNCTOR_binding1) )
+  { int by_column;
+
+    if ( !get_binding_arg_ex(1, option, &by_column) )
+      return FALSE;
+    if ( by_column )
+      set(cn, CTX_BIND_COLUMN);
+    else
+      clear(cn, CTX_BIND_COLUMN);
+    flush_stmt_cache(cn);
+
+    return TRUE;
+  } else if ( PL_is_functor(option, FUNCTOR_statement_cache1) )
+  { struct cached_stmt *evicted;
+    int val;
+
+    if ( !get_int_arg_ex(1, option, &val) )
+      return FALSE;
+    if ( val < 0 )
+      return domain_error(option, "statement_cache");
+    LOCK();
+    cn->stmt_cache_size = val;
+    evicted = trim_stmt_cache(cn, val);
+    UNLOCK();
+    free_cached_stmts(evicted);
+
+    return TRUE;
+  } else if ( PL_is_functor(option, FUNCTOR_statement_cache_threshold1) )
+  { int val;
+
+    if ( !get_int_arg_ex(1, option, &val) )
+      return FALSE;
+    if ( val < 1 )
+      return domain_error(option, "statement_cache_threshold");
+    cn->stmt_cache_threshold = val;
+
+    return TRUE;
+  } else if ( PL_is_functor(option, FUNCTOR_statement_pool1) )
+  { int val;
+
+    if ( !get_int_arg_ex(1, option, &val) )
+      return FALSE;
+    if ( val < 0 )
+      return domain_error(option, "statement_pool");
+    LOCK();
+    trim_stmt_pool(cn, val);
+    cn->stmt_pool_size = val;
+    UNLOCK();
+
+    return TRUE;
+  } else if ( PL_is_functor(option, FUNCTOR_timeout1) )
+  { double secs;
+
+    if ( !get_timeout_arg_ex(1, option, &secs) )
+      return FALSE;
+    cn->timeout = (secs < 0.0 ? 0.0 : secs);
+    flush_stmt_cache(cn);
+
+    return TRUE;
+  } else if ( PL_is_functor(option, FUNCTOR_timezone1) )
+  { term_t a = PL_new_term_ref();
+    int local, offset;
+
+    _PL_get_arg(1, option, a);
+    if ( !get_timezone_ex(a, &local, &offset) )
+      return FALSE;
+    cn->tz_local = local;
+    cn->tz_offset = offset;
+
+    return TRUE;
+  } else if ( PL_is_functor(option, FUNCTOR_decimal1) )
+  { int mode;
+
+    if ( !get_decimal_mode_arg_ex(1, option, &mode) )
+      return FALSE;
+    cn->decimal = mode;
+    flush_stmt_cache(cn);
 
     return TRUE;
   } else
@@ -1819,6 +2596,11 @@ odbc_set_connection(connection *cn, term_t option)
   if ( (rc=SQLSetConnectOption(cn->hdbc, opt, optval)) != SQL_SUCCESS )
     return odbc_report(henv, cn->hdbc, NULL, rc);
 
+  LOCK();				/* idle handles have the old defaults */
+  trim_stmt_pool(cn, 0);
+  UNLOCK();
+  flush_stmt_cache(cn);
+
   return TRUE;
 }
 
@@ -1841,7 +2623,7 @@ Options for SQLGetInfo() from http://msdn.microsoft.com/library/default.asp?url=
 typedef struct
 { const char *name;
   UWORD id;
-  enum { text, sword, ioenc } type;
+  enum { text, sword, ioenc, stmt_cache } type;
   functor_t functor;
 } conn_option;
 
@@ -1854,9 +2636,33 @@ static conn_option conn_option_list[] =
   { "driver_version",      SQL_DRIVER_VER, text },
   { "active_statements",   SQL_ACTIVE_STATEMENTS, sword },
   { "encoding",		   0, ioenc },
+  { "statement_cache_statistics", 0, stmt_cache },
   { NULL, 0 }
 };
 
+static int
+put_stmt_cache_statistics(term_t t, connection *cn)
+{ int rc;
+
+  LOCK();
+  rc = PL_unify_term(t,
+		     PL_LIST, 5,
+		       PL_FUNCTOR, FUNCTOR_size1,
+			 PL_INT, cn->stmt_cache_size,
+		       PL_FUNCTOR, FUNCTOR_entries1,
+			 PL_INT, cn->stmt_cache_count,
+		       PL_FUNCTOR, FUNCTOR_hits1,
+			 PL_INT64, cn->stmt_cache_statistics.hits,
+		       PL_FUNCTOR, FUNCTOR_misses1,
+			 PL_INT64, cn->stmt_cache_statistics.misses,
+		       PL_FUNCTOR, FUNCTOR_evictions1,
+			 PL_INT64, cn->stmt_cache_statistics.evictions);
+  UNLOCK();
+
+  return rc;
+}
+
+
 static foreign_t
 odbc_get_connection(term_t conn, term_t option, control_t h)
 { connection *cn;
@@ -1907,6 +2713,9 @@ find:
 
       if ( opt->type == ioenc )
       { put_encoding(val, cn->encoding);
+      } else if ( opt->type == stmt_cache )
+      { if ( !put_stmt_cache_statistics(val, cn) )
+	  return FALSE;
       } else
       { if ( (rc=SQLGetInfo(cn->hdbc, opt->id,
 			    buf, sizeof(buf), &len)) != SQL_SUCCESS )
@@ -1984,1887 +2793,6496 @@ odbc_end_transaction(term_t conn, term_t action)
 
 
 		 /*******************************
-		 *	CONTEXT (STATEMENTS)	*
+		 *	  CONNECTION POOLS	*
 		 *******************************/
 
-static context** executing_contexts = NULL;
-static int executing_context_size = 0;
-
-static context *
-new_context(connection *cn)
-{ context *ctxt = odbc_malloc(sizeof(context));
-  RETCODE rc;
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+A pool keeps a set of anonymous connections to the same data source.
+odbc_with_connection/3 checks out  a  connection   using  the  foreign
+predicate '$odbc_pool_acquire'/2 and  returns  it   to  the  pool using
+'$odbc_pool_release'/2.  Idle connections are kept  on a stack, such that
+the most recently used connection, whose   statement cache is warm, is
+used first.  Idle connections exceeding   min_size  that have not been
+used for idle_timeout seconds are closed.  If all max_size connections
+are in use, acquiring waits for  a   connection  to  be released,
+checking for signals every POOL_WAIT_SLICE seconds.
+
+A pool is a blob of type odbc_pool.   If the blob is garbage collected,
+the pool is queued in collected_pools.  The next ODBC call closes its
+idle connections and frees it, as   we cannot talk to the driver from
+atom-GC.  All pool fields and the pool   fields of the connections are
+protected by LOCK().
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-  if ( !ctxt )
-    return NULL;
-  memset(ctxt, 0, sizeof(*ctxt));
-  ctxt->magic = CTX_MAGIC;
-  ctxt->henv  = henv;
-  ctxt->connection = cn;
-  ctxt->null = cn->null;
-  ctxt->flags = cn->flags;
-  ctxt->max_nogetdata = cn->max_nogetdata;
-  if ( (rc=SQLAllocStmt(cn->hdbc, &ctxt->hstmt)) != SQL_SUCCESS )
-  { odbc_report(henv, cn->hdbc, NULL, rc);
-    free(ctxt);
-    return NULL;
-  }
-  statistics.statements_created++;
+#define POOL_MAGIC	   0x7c42b623	/* magic code */
+#define POOL_MAX_SIZE	   10		/* default max_size */
+#define POOL_IDLE_TIMEOUT  300.0	/* default idle_timeout */
+#define POOL_STMT_CACHE	   32		/* default statement_cache */
+#define POOL_WAIT_SLICE	   0.25		/* check signals while waiting */
+
+typedef struct odbc_pool
+{ long	       magic;			/* POOL_MAGIC */
+  atom_t       dsn;			/* data source */
+  record_t     options;			/* options for odbc_connect/3 */
+  int	       min_size;		/* keep at least this many */
+  int	       max_size;		/* never more than this many */
+  double       idle_timeout;		/* close idle after (< 0: never) */
+  double       wait_timeout;		/* max wait in acquire (< 0: infinite) */
+  int	       validate;		/* check SQL_ATTR_CONNECTION_DEAD */
+  int	       closed;			/* odbc_pool_destroy/1 was called */
+  int	       size;			/* # connections (idle + in use) */
+  int	       in_use;			/* # checked out connections */
+  int	       idle_count;		/* # idle connections */
+  int	       waiting;			/* # threads waiting */
+  connection  *idle;			/* idle connections, MRU first */
+  struct odbc_pool *next_collected;	/* next in collected_pools */
+  struct
+  { int64_t    checkouts;		/* # successful acquires */
+    int64_t    connects;		/* # connections opened */
+    int64_t    discarded;		/* # dead or expired connections */
+    int64_t    waits;			/* # acquires that had to wait */
+    double     wait_time;		/* total time waiting */
+    double     max_wait_time;		/* longest wait */
+    double     checkout_time;		/* total acquire latency */
+    double     max_checkout_time;	/* slowest acquire */
+  } statistics;
+} odbc_pool;
+
+static odbc_pool *collected_pools;	/* released by atom-GC */
+
+
+/* Close a connection of a pool that is dead or expired. Errors are
+   ignored as the connection may be broken.  If a statement prepared
+   on the connection is still running the connection is leaked rather
+   than freed under the statement.
+*/
 
-  return ctxt;
-}
+static void
+discard_connection(connection *cn)
+{ struct cached_stmt *evicted;
 
+  if ( !free_statements(cn) )
+    return;
 
-static void
-unmark_and_close_context(context *ctxt)
-{ int self = PL_thread_self();
+  LOCK();
+  evicted = trim_stmt_cache(cn, 0);
+  trim_stmt_pool(cn, 0);
+  UNLOCK();
+  free_cached_stmts(evicted);
 
-  LOCK_CONTEXTS();
-  clear(ctxt, CTX_EXECUTING);
-  if ( self >= 0 )
-    executing_contexts[self] = NULL;
-  UNLOCK_CONTEXTS();
-  close_context(ctxt);
+  SQLDisconnect(cn->hdbc);
+  SQLFreeConnect(cn->hdbc);
+  free_connection(cn);
 }
 
+
 static void
-close_context(context *ctxt)
-{ clear(ctxt, CTX_INUSE);
+discard_connections(connection *cn)
+{ connection *next;
 
-  if ( ctxt->flags & CTX_PERSISTENT )
-  { if ( ctxt->hstmt )
-    { ctxt->rc = SQLFreeStmt(ctxt->hstmt, SQL_CLOSE);
-      if ( ctxt->rc == SQL_ERROR )
-	report_status(ctxt);
-    }
-  } else
-    free_context(ctxt);
+  for(; cn; cn=next)
+  { next = cn->next_idle;
+    discard_connection(cn);
+  }
 }
 
 
 static void
-free_parameters(int n, parameter *params)
-{ if ( n && params )
-  { parameter *p = params;
-    int i;
+free_pool(odbc_pool *pool)
+{ connection *cn;
 
-    for (i=0; i<n; i++, p++)
-    { if ( p->ptr_value &&
-	   p->ptr_value != (SQLPOINTER)p->buf &&
-	   p->len_value != SQL_LEN_DATA_AT_EXEC(0) ) /* Using SQLPutData() */
-	free(p->ptr_value);
-      if ( p->source.table )
-	PL_unregister_atom(p->source.table);
-      if ( p->source.column )
-	PL_unregister_atom(p->source.column);
-    }
+  LOCK();
+  cn = pool->idle;
+  pool->idle = NULL;
+  UNLOCK();
 
-    free(params);
+  discard_connections(cn);
+
+  if ( pool->in_use == 0 )		/* should always be the case */
+  { pool->magic = 0;
+    PL_unregister_atom(pool->dsn);
+    PL_erase(pool->options);
+    free(pool);
   }
 }
 
 
 static void
-free_context(context *ctx)
-{ if ( ctx->magic != CTX_MAGIC )
-  { if ( ctx->magic == CTX_FREEMAGIC )
-      Sdprintf("ODBC: Trying to free context twice: %p\n", ctx);
-    else
-      Sdprintf("ODBC: Trying to free non-context: %p\n", ctx);
+free_collected_pools(void)
+{ odbc_pool *pool, *next;
 
+  if ( !collected_pools )		/* unlocked test */
     return;
-  }
 
-  ctx->magic = CTX_FREEMAGIC;
+  LOCK();
+  pool = collected_pools;
+  collected_pools = NULL;
+  UNLOCK();
 
-  if ( ctx->hstmt )
-  { ctx->rc = SQLFreeStmt(ctx->hstmt, SQL_DROP);
-    if ( ctx->rc == SQL_ERROR )
-      report_status(ctx);
+  for(; pool; pool=next)
+  { next = pool->next_collected;
+    free_pool(pool);
   }
+}
 
-  free_parameters(ctx->NumCols,   ctx->result);
-  free_parameters(ctx->NumParams, ctx->params);
-  if ( ison(ctx, CTX_SQLMALLOCED) )
-    PL_free(ctx->sqltext.a);
-  if ( ison(ctx, CTX_OWNNULL) )
-    free_nulldef(ctx->null);
-  if ( ctx->findall )
-    free_findall(ctx->findall);
-  free(ctx);
 
-  statistics.statements_freed++;
+static int
+release_pool_symbol(atom_t symbol)
+{ odbc_pool *pool = *(odbc_pool**)PL_blob_data(symbol, NULL, NULL);
+
+  LOCK();
+  pool->closed = TRUE;
+  pool->next_collected = collected_pools;
+  collected_pools = pool;
+  UNLOCK();
+
+  return TRUE;
 }
 
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-clone_context()
+static int
+write_pool_symbol(IOSTREAM *s, atom_t symbol, int flags)
+{ odbc_pool *pool = *(odbc_pool**)PL_blob_data(symbol, NULL, NULL);
 
-Create a clone of a context, so we   can have the same statement running
-multiple times. Is there really no better   way  to handle this? Can't I
-have multiple cursors on one statement?
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+  Sfprintf(s, "<odbc_pool>(%p)", pool);
+  return TRUE;
+}
 
-static context *
-clone_context(context *in)
-{ context *new;
-  size_t bytes = (in->sqllen+1)*in->char_width;
 
-  if ( !(new = new_context(in->connection)) )
-    return NULL;
-					/* Copy SQL statement */
-  if ( !(new->sqltext.a = PL_malloc(bytes)) )
+static PL_blob_t pool_blob =
+{ PL_BLOB_MAGIC,
+  0,
+  "odbc_pool",
+  release_pool_symbol,
+  NULL,
+  write_pool_symbol
+};
+
+
+static int
+get_pool(term_t t, odbc_pool **poolp)
+{ PL_blob_t *type;
+  void *data;
+
+  free_collected_pools();
+  if ( PL_get_blob(t, &data, NULL, &type) && type == &pool_blob )
+  { odbc_pool *pool = *(odbc_pool**)data;
+
+    if ( pool->magic != POOL_MAGIC || pool->closed )
+      return existence_error(t, "odbc_pool");
+
+    *poolp = pool;
+    return TRUE;
+  }
+
+  return type_error(t, "odbc_pool");
+}
+
+
+static int
+pool_connect(odbc_pool *pool, connection **cnp)
+{ fid_t fid = PL_open_foreign_frame();
+  term_t av = PL_new_term_refs(3);
+  int rc;
+
+  rc = ( PL_put_atom(av+0, pool->dsn) &&
+	 PL_recorded(pool->options, av+2) &&
+	 connect_data_source(av+0, av+1, av+2, pool) &&
+	 get_connection(av+1, cnp) );
+  PL_close_foreign_frame(fid);
+
+  return rc;
+}
+
+
+/* Unlink the idle connections that expired.  Must be called with
+   LOCK() held.  The returned chain must be discarded after releasing
+   the lock.
+*/
+
+static connection *
+expire_idle_connections(odbc_pool *pool, double now)
+{ connection **cp = &pool->idle;
+  connection *cn, *expired = NULL;
+
+  if ( pool->idle_timeout < 0.0 )
     return NULL;
-  new->sqllen = in->sqllen;
-  new->char_width = in->char_width;
-  memcpy(new->sqltext.a, in->sqltext.a, bytes);
-  set(new, CTX_SQLMALLOCED);
 
-					/* Prepare the statement */
-  if ( new->char_width == 1 )
-  { TRY(new,
-	SQLPrepareA(new->hstmt, new->sqltext.a, new->sqllen),
-	close_context(new));
-  } else
-  { TRY(new,
-	SQLPrepareW(new->hstmt, new->sqltext.w, new->sqllen),
-	close_context(new));
+  while( (cn = *cp) )
+  { if ( pool->size > pool->min_size &&
+	 now - cn->idle_since > pool->idle_timeout )
+    { *cp = cn->next_idle;
+      cn->next_idle = expired;
+      expired = cn;
+      pool->size--;
+      pool->idle_count--;
+      pool->statistics.discarded++;
+    } else
+    { cp = &cn->next_idle;
+    }
   }
 
-					/* Copy parameter declarations */
-  if ( (new->NumParams = in->NumParams) > 0 )
-  { int pn;
-    parameter *p;
+  return expired;
+}
 
-    if ( !(new->params = odbc_malloc(sizeof(parameter)*new->NumParams)) )
-      return NULL;
-    memcpy(new->params, in->params, sizeof(parameter)*new->NumParams);
 
-    for(p=new->params, pn=1; pn<=new->NumParams; pn++, p++)
-    { SQLLEN *vlenptr = NULL;
+static int
+connection_is_dead(connection *cn)
+{
+#ifdef SQL_ATTR_CONNECTION_DEAD
+  SQLUINTEGER dead = SQL_CD_FALSE;
 
-      switch(p->cTypeID)
-      { case SQL_C_CHAR:
-	case SQL_C_WCHAR:
-	case SQL_C_BINARY:
-	  /* if p->length_ind == 0 then we are using SQLPutData
-	     and must not overwrite the index stored in ptr_value with
-	     a buffer of 0 length!
-	  */
-	  if ( p->length_ind != 0 && !(p->ptr_value = odbc_malloc(p->length_ind+1)) )
-	    return NULL;
-	  vlenptr = &p->len_value;
-	  break;
-	case SQL_C_DATE:
-	case SQL_C_TYPE_DATE:
-	case SQL_C_TIME:
-	case SQL_C_TYPE_TIME:
-	case SQL_C_TIMESTAMP:
-	  if ( !(p->ptr_value = odbc_malloc(p->len_value)) )
-	    return NULL;
-	  break;
-	case SQL_C_SLONG:
-	case SQL_C_SBIGINT:
-	case SQL_C_DOUBLE:
-	  p->ptr_value = (SQLPOINTER)p->buf;
-	  break;
-      }
+  if ( SQLGetConnectAttr(cn->hdbc, SQL_ATTR_CONNECTION_DEAD,
+			 &dead, SQL_IS_UINTEGER, NULL) == SQL_SUCCESS )
+    return dead == SQL_CD_TRUE;
+#endif
 
-      TRY(new, SQLBindParameter(new->hstmt,		/* hstmt */
-				(SWORD)pn,			/* ipar */
-				SQL_PARAM_INPUT,	/* fParamType */
-				p->cTypeID,		/* fCType */
-				p->sqlTypeID,		/* fSqlType */
-				p->length_ind,		/* cbColDef */
-				p->scale,		/* ibScale */
-				p->ptr_value,		/* rgbValue */
-				0,			/* cbValueMax */
-				vlenptr),		/* pcbValue */
-	  close_context(new));
-    }
+  return FALSE;
+}
+
+
+#if defined(_REENTRANT) && defined(O_PLMT)
+/* Wait for a connection to be released. Must be called with LOCK() held */
+
+static void
+wait_pool(double seconds)
+{ struct timespec deadline;
+  long nsec;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += (time_t)seconds;
+  nsec = deadline.tv_nsec + (long)((seconds-(double)(time_t)seconds)*1e9);
+  if ( nsec >= 1000000000 )
+  { deadline.tv_sec++;
+    nsec -= 1000000000;
   }
+  deadline.tv_nsec = nsec;
 
-					/* Copy result columns */
-  new->db_row = in->db_row;		/* the row/N functor */
+  pthread_cond_timedwait(&pool_cond, &mutex, &deadline);
+}
+#endif
 
-  if ( in->result )
-  { new->NumCols = in->NumCols;
-    if ( !(new->result  = odbc_malloc(in->NumCols*sizeof(parameter))) )
-      return NULL;
-    memcpy(new->result, in->result, in->NumCols*sizeof(parameter));
 
-    if ( ison(in, CTX_BOUND) )
-    { parameter *p = new->result;
-      int i;
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+odbc_pool_create(+DSN, -Pool, +Options)
+    Create a pool of connections to DSN.  Options not processed by
+    the pool are passed to odbc_connect/3.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-      for(i = 1; i <= new->NumCols; i++, p++)
-      { if ( p->len_value > PARAM_BUFSIZE )
-	{ if ( !(p->ptr_value = odbc_malloc(p->len_value)) )
-	    return NULL;
-	} else
-	  p->ptr_value = (SQLPOINTER)p->buf;
+static foreign_t
+odbc_pool_create(term_t dsn, term_t tpool, term_t options)
+{ atom_t dsn_a;
+  odbc_pool *pool;
+  int min_size = 0, max_size = POOL_MAX_SIZE;
+  double idle_timeout = POOL_IDLE_TIMEOUT, wait_timeout = -1.0;
+  int validate = TRUE, stmt_cache = FALSE;
+  term_t tail  = PL_copy_term_ref(options);
+  term_t head  = PL_new_term_ref();
+  term_t copts = PL_new_term_ref();
+  term_t ctail = PL_copy_term_ref(copts);
+  term_t chead = PL_new_term_ref();
+  int i;
 
-	TRY(new, SQLBindCol(new->hstmt, (SWORD)i,
-			    p->cTypeID,
-			    p->ptr_value,
-			    p->len_value,
-			    &p->length_ind),
-	    close_context(new));
-      }
+  if ( !PL_get_atom(dsn, &dsn_a) )
+    return type_error(dsn, "atom");
 
-      set(new, CTX_BOUND);
+  while( PL_get_list(tail, head, tail) )
+  { if ( PL_is_functor(head, FUNCTOR_min_size1) )
+    { if ( !get_int_arg_ex(1, head, &min_size) )
+	return FALSE;
+      if ( min_size < 0 )
+	return domain_error(head, "odbc_pool_option");
+    } else if ( PL_is_functor(head, FUNCTOR_max_size1) )
+    { if ( !get_int_arg_ex(1, head, &max_size) )
+	return FALSE;
+      if ( max_size < 1 )
+	return domain_error(head, "odbc_pool_option");
+    } else if ( PL_is_functor(head, FUNCTOR_idle_timeout1) )
+    { if ( !get_timeout_arg_ex(1, head, &idle_timeout) )
+	return FALSE;
+    } else if ( PL_is_functor(head, FUNCTOR_wait_timeout1) )
+    { if ( !get_timeout_arg_ex(1, head, &wait_timeout) )
+	return FALSE;
+    } else if ( PL_is_functor(head, FUNCTOR_validate1) )
+    { if ( !get_bool_arg_ex(1, head, &validate) )
+	return FALSE;
+    } else if ( PL_is_functor(head, FUNCTOR_alias1) ||
+		PL_is_functor(head, FUNCTOR_open1) )
+    { return domain_error(head, "odbc_pool_option");
+    } else
+    { if ( PL_is_functor(head, FUNCTOR_statement_cache1) )
+	stmt_cache = TRUE;
+      if ( !PL_unify_list(ctail, chead, ctail) ||
+	   !PL_unify(chead, head) )
+	return FALSE;
     }
   }
+  if ( !PL_get_nil(tail) )
+    return type_error(tail, "list");
+  if ( min_size > max_size )
+    return domain_error(options, "odbc_pool_options");
+  if ( !stmt_cache )			/* warm caches are the point */
+  { if ( !PL_unify_list(ctail, chead, ctail) ||
+	 !PL_unify_term(chead, PL_FUNCTOR, FUNCTOR_statement_cache1,
+				 PL_INT, POOL_STMT_CACHE) )
+      return FALSE;
+  }
+  if ( !PL_unify_nil(ctail) )
+    return FALSE;
 
-  new->null    = clone_nulldef(in->null);
-  new->findall = clone_findall(in->findall);
-
-  return new;
-}
-
+  if ( !(pool = odbc_malloc(sizeof(*pool))) )
+    return FALSE;
+  memset(pool, 0, sizeof(*pool));
+  pool->magic        = POOL_MAGIC;
+  pool->dsn          = dsn_a;
+  pool->options      = PL_record(copts);
+  pool->min_size     = min_size;
+  pool->max_size     = max_size;
+  pool->idle_timeout = idle_timeout;
+  pool->wait_timeout = wait_timeout;
+  pool->validate     = validate;
+  PL_register_atom(dsn_a);
+
+  if ( !PL_unify_blob(tpool, &pool, sizeof(pool), &pool_blob) )
+  { PL_unregister_atom(dsn_a);
+    PL_erase(pool->options);
+    free(pool);
+    return FALSE;
+  }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-The string is malloced by Prolog and   this probably poses problems when
-using on Windows, where each DLL  has   its  own memory pool. SWI-Prolog
-5.0.9 introduces PL_malloc(), PL_realloc()  and   PL_free()  for foreign
-code to synchronise this problem.
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+  for(i=0; i<min_size; i++)		/* blob release frees on error */
+  { connection *cn;
+    double now = odbc_time();
 
-static int
-get_sql_text(context *ctxt, term_t tquery)
-{ if ( PL_is_functor(tquery, FUNCTOR_minus2) )
-  { if ( !formatted_string(ctxt, tquery) )
+    if ( !pool_connect(pool, &cn) )
       return FALSE;
-  } else
-  { size_t qlen;
+    LOCK();
+    cn->idle_since = now;
+    cn->next_idle = pool->idle;
+    pool->idle = cn;
+    pool->idle_count++;
+    pool->size++;
+    pool->statistics.connects++;
+    UNLOCK();
+  }
 
-    if ( ctxt->connection->encoding == ENC_SQLWCHAR )
-    { wchar_t *ws;
+  return TRUE;
+}
 
-#if SIZEOF_SQLWCHAR != SIZEOF_WCHAR_T
-      if ( PL_get_wchars(tquery, &qlen, &ws, CVT_ATOM|CVT_STRING))
-      { wchar_t *es = ws+qlen;
-	SQLWCHAR *o, *q;
 
-	q = PL_malloc((qlen+1)*sizeof(SQLWCHAR));
-	for(o=q; ws<es;)
-	  *o++ = *ws++;
-	*o = 0;
-	ctxt->sqltext.w = q;
-#else
-      if ( PL_get_wchars(tquery, &qlen, &ws, CVT_ATOM|CVT_STRING|BUF_MALLOC))
-      { ctxt->sqltext.w = (SQLWCHAR *)ws;
-#endif
-	set(ctxt, CTX_SQLMALLOCED);
-	ctxt->sqllen = (SQLINTEGER)qlen;
-	ctxt->char_width = sizeof(SQLWCHAR);
-      } else
-	return type_error(tquery, "atom_or_format");
-    } else
-    { char *s;
-      int rep = ctxt->connection->rep_flag;
+static foreign_t
+odbc_pool_destroy(term_t tpool)
+{ odbc_pool *pool;
+  connection *idle;
 
-      if ( PL_get_nchars(tquery, &qlen, &s, CVT_ATOM|CVT_STRING|BUF_MALLOC|rep))
-      { ctxt->sqltext.a = (unsigned char*)s;
-	ctxt->sqllen = (SQLINTEGER)qlen;
-	ctxt->char_width = sizeof(char);
-	set(ctxt, CTX_SQLMALLOCED);
-      } else
-	return type_error(tquery, "atom_or_format");
-    }
-  }
+  if ( !get_pool(tpool, &pool) )
+    return FALSE;
+
+  LOCK();
+  pool->closed = TRUE;
+  idle = pool->idle;
+  pool->idle = NULL;
+  pool->size -= pool->idle_count;
+  pool->idle_count = 0;
+  SIGNAL_POOL();
+  UNLOCK();
+  discard_connections(idle);
 
   return TRUE;
 }
 
 
-static int
-max_qualifier_length(connection *cn)
-{ if ( isoff(cn, CTX_GOT_QLEN) )
-  { SQLUSMALLINT len;
-    SWORD plen;
-    RETCODE rc;
+static foreign_t
+odbc_pool_acquire(term_t tpool, term_t conn)
+{ odbc_pool *pool;
+  connection *cn, *expired;
+  double start = odbc_time(), wait_start = 0.0, now;
 
-    if ( (rc=SQLGetInfo(cn->hdbc, SQL_MAX_QUALIFIER_NAME_LEN,
-			&len, sizeof(len), &plen)) == SQL_SUCCESS )
-    { /*Sdprintf("SQL_MAX_QUALIFIER_NAME_LEN = %d\n", (int)len);*/
-      cn->max_qualifier_length = (int)len; /* 0: unknown */
+  if ( !get_pool(tpool, &pool) )
+    return FALSE;
+
+  for(;;)
+  { LOCK();
+    if ( pool->closed )
+    { UNLOCK();
+      return existence_error(tpool, "odbc_pool");
+    }
+    expired = expire_idle_connections(pool, odbc_time());
+
+    if ( (cn = pool->idle) )
+    { pool->idle = cn->next_idle;
+      pool->idle_count--;
+      pool->in_use++;
+      cn->next_idle = NULL;
+      UNLOCK();
+      discard_connections(expired);
+
+      if ( pool->validate && connection_is_dead(cn) )
+      { LOCK();
+	pool->in_use--;
+	pool->size--;
+	pool->statistics.discarded++;
+	UNLOCK();
+	discard_connection(cn);
+	continue;
+      }
+      break;
+    } else if ( pool->size < pool->max_size )
+    { pool->size++;
+      pool->in_use++;
+      UNLOCK();
+      discard_connections(expired);
+
+      if ( !pool_connect(pool, &cn) )
+      { LOCK();
+	pool->size--;
+	pool->in_use--;
+	SIGNAL_POOL();
+	UNLOCK();
+	return FALSE;
+      }
+      LOCK();
+      pool->statistics.connects++;
+      UNLOCK();
+      break;
     } else
-    { odbc_report(henv, cn->hdbc, NULL, rc);
-      cn->max_qualifier_length = -1;
+    {
+#if defined(_REENTRANT) && defined(O_PLMT)
+      double slice = POOL_WAIT_SLICE;
+
+      now = odbc_time();
+      if ( !wait_start )
+	wait_start = now;
+      if ( pool->wait_timeout >= 0.0 )
+      { double left = start + pool->wait_timeout - now;
+
+	if ( left <= 0.0 )
+	{ UNLOCK();
+	  discard_connections(expired);
+	  return resource_error("odbc_pool_connections");
+	}
+	if ( left < slice )
+	  slice = left;
+      }
+      pool->waiting++;
+      wait_pool(slice);
+      pool->waiting--;
+      UNLOCK();
+      discard_connections(expired);
+      if ( PL_handle_signals() < 0 )
+	return FALSE;
+#else
+      UNLOCK();
+      discard_connections(expired);
+      return resource_error("odbc_pool_connections");
+#endif
     }
+  }
 
-    set(cn, CTX_GOT_QLEN);
+  now = odbc_time();
+  LOCK();
+  cn->checked_out = TRUE;
+  pool->statistics.checkouts++;
+  pool->statistics.checkout_time += now-start;
+  if ( now-start > pool->statistics.max_checkout_time )
+    pool->statistics.max_checkout_time = now-start;
+  if ( wait_start )
+  { pool->statistics.waits++;
+    pool->statistics.wait_time += now-wait_start;
+    if ( now-wait_start > pool->statistics.max_wait_time )
+      pool->statistics.max_wait_time = now-wait_start;
   }
+  UNLOCK();
 
-  return cn->max_qualifier_length;
+  return unify_connection(conn, cn);
 }
 
 
-static int
-prepare_result(context *ctxt)
-{ SQLSMALLINT i;
-  SQLCHAR nameBuffer[NameBufferLength];
-  SQLSMALLINT nameLength, dataType, decimalDigits, nullable;
-  SQLULEN columnSize;			/* was SQLUINTEGER */
-  parameter *ptr_result;
-  SQLSMALLINT ncol;
+static foreign_t
+odbc_pool_release(term_t tpool, term_t conn)
+{ odbc_pool *pool;
+  connection *cn, *expired = NULL;
+  PL_blob_t *type;
+  void *data;
+  int closed, broken;
+
+  if ( !PL_get_blob(tpool, &data, NULL, &type) || type != &pool_blob )
+    return type_error(tpool, "odbc_pool");
+  pool = *(odbc_pool**)data;
+  if ( !get_connection(conn, &cn) )
+    return FALSE;
 
-  SQLNumResultCols(ctxt->hstmt, &ncol);
-  if ( ncol == 0 )
-    return TRUE;			/* no results */
+  LOCK();
+  if ( cn->pool != pool || !cn->checked_out )
+  { UNLOCK();
+    return permission_error("release", "odbc_connection", conn);
+  }
+  UNLOCK();
+					/* do not pass an open transaction */
+  broken = (SQLTransact(henv, cn->hdbc, SQL_ROLLBACK) == SQL_ERROR);
 
-  if ( ctxt->result )			/* specified types */
-  { if ( ncol != ctxt->NumCols )
-      return PL_warning("# columns mismatch"); /* TBD: exception */
+  LOCK();
+  cn->checked_out = FALSE;
+  pool->in_use--;
+  if ( !(closed = (pool->closed || broken)) )
+  { double now = odbc_time();
+
+    cn->idle_since = now;
+    cn->next_idle = pool->idle;
+    pool->idle = cn;
+    pool->idle_count++;
+    expired = expire_idle_connections(pool, now);
   } else
-  { ctxt->NumCols = ncol;
-    ctxt->db_row = PL_new_functor(ATOM_row, ctxt->NumCols);
-    if ( !(ctxt->result = odbc_malloc(sizeof(parameter)*ctxt->NumCols)) )
-      return FALSE;
-    memset(ctxt->result, 0, sizeof(parameter)*ctxt->NumCols);
+  { pool->size--;
+    if ( broken )
+      pool->statistics.discarded++;
   }
+  SIGNAL_POOL();
+  UNLOCK();
 
-  ptr_result = ctxt->result;
-  for(i = 1; i <= ctxt->NumCols; i++, ptr_result++)
-  { SQLDescribeCol(ctxt->hstmt, i,
-		   nameBuffer, NameBufferLength, &nameLength,
-		   &dataType, &columnSize, &decimalDigits,
-		   &nullable);
+  if ( closed )
+    discard_connection(cn);
+  discard_connections(expired);
 
-    if ( ison(ctxt, CTX_SOURCE) )
-    { SQLLEN ival;			/* was DWORD */
+  return TRUE;
+}
 
-      ptr_result->source.column = PL_new_atom_nchars(nameLength,
-						     (char*)nameBuffer);
-      if ( (ctxt->rc=SQLColAttributes(ctxt->hstmt, i,
-				      SQL_COLUMN_TABLE_NAME,
-				      nameBuffer,
-				      NameBufferLength, &nameLength,
-				      &ival)) == SQL_SUCCESS )
-      { ptr_result->source.table = PL_new_atom_nchars(nameLength,
-						      (char*)nameBuffer);
-      } else
-      { if ( !report_status(ctxt) )		/* TBD: May close ctxt */
-	  return FALSE;
-	ptr_result->source.table = ATOM_;
-	PL_register_atom(ATOM_);
-      }
-    }
 
-    ptr_result->sqlTypeID = dataType;
-    ptr_result->cTypeID = CvtSqlToCType(ctxt, dataType, ptr_result->plTypeID);
-    if (ptr_result->cTypeID == CVNERR)
-    { free_context(ctxt);
-      return PL_warning("odbc_query/2: column type not managed");
-    }
+static foreign_t
+odbc_pool_statistics(term_t tpool, term_t stats)
+{ odbc_pool *pool;
+  odbc_pool copy;
 
-    DEBUG(1, Sdprintf("prepare_result(): column %d, "
-		      "sqlTypeID = %d (%s), cTypeID = %d (%s), "
-		      "columnSize = %zu\n",
-		      i,
-		      ptr_result->sqlTypeID, sql_type_name(ptr_result->sqlTypeID),
-		      ptr_result->cTypeID, sql_c_type_name(ptr_result->cTypeID),
-		      (size_t)columnSize));
+  if ( !get_pool(tpool, &pool) )
+    return FALSE;
 
-    if ( ison(ctxt, CTX_TABLES) )
-    { switch (ptr_result->sqlTypeID)
-      { case SQL_LONGVARCHAR:
-	case SQL_VARCHAR:
-	{ int qlen = max_qualifier_length(ctxt->connection);
+  LOCK();
+  copy = *pool;
+  UNLOCK();
 
-	  if ( qlen > 0 )
-	  { /*Sdprintf("Using SQL_MAX_QUALIFIER_NAME_LEN = %d\n", qlen);*/
-	    ptr_result->len_value = qlen+1; /* play safe */
-	    goto bind;
-	  } else if ( qlen < 0 )	/* error getting it */
-	    return FALSE;
-	}
-      }
-    }
+  return PL_unify_term(stats,
+		       PL_LIST, 9,
+			 PL_FUNCTOR, FUNCTOR_size1, PL_INT, copy.size,
+			 PL_FUNCTOR_CHARS, "idle", 1, PL_INT, copy.idle_count,
+			 PL_FUNCTOR_CHARS, "in_use", 1, PL_INT, copy.in_use,
+			 PL_FUNCTOR_CHARS, "waiting", 1, PL_INT, copy.waiting,
+			 PL_FUNCTOR_CHARS, "checkouts", 1,
+			   PL_INT64, copy.statistics.checkouts,
+			 PL_FUNCTOR_CHARS, "connects", 1,
+			   PL_INT64, copy.statistics.connects,
+			 PL_FUNCTOR_CHARS, "discarded", 1,
+			   PL_INT64, copy.statistics.discarded,
+			 PL_FUNCTOR_CHARS, "wait_time", 3,
+			   PL_INT64, copy.statistics.waits,
+			   PL_FLOAT, copy.statistics.wait_time,
+			   PL_FLOAT, copy.statistics.max_wait_time,
+			 PL_FUNCTOR_CHARS, "checkout_time", 2,
+			   PL_FLOAT, copy.statistics.checkout_time,
+			   PL_FLOAT, copy.statistics.max_checkout_time);
+}
 
-    switch (ptr_result->sqlTypeID)
-    { case SQL_LONGVARCHAR:
-      case SQL_LONGVARBINARY:
-      { if ( columnSize > ctxt->max_nogetdata || columnSize == 0 )
-	{ use_sql_get_data:
-	  DEBUG(2,
-		Sdprintf("Wide SQL_LONGVAR* column %d: using SQLGetData()\n", i));
-	  ptr_result->ptr_value = NULL;	/* handle using SQLGetData() */
-	  continue;
-	}
-	ptr_result->len_value = sizeof(char)*(columnSize+1);
-	goto bind;
-      }
-    }
 
-    switch (ptr_result->cTypeID)
-    { case SQL_C_CHAR:
-	if ( columnSize == 0 )
-	  goto use_sql_get_data;
-	columnSize += 2;		/* decimal dot and '-' sign */
-	/*FALLTHROUGH*/
-      case SQL_C_BINARY:
-	if ( columnSize > ctxt->max_nogetdata || columnSize == 0 )
-	  goto use_sql_get_data;
-	ptr_result->len_value = sizeof(char)*(columnSize+1)*((ctxt->connection->encoding == ENC_UTF8)?4:1);
-	break;
-      case SQL_C_WCHAR:
-	if ( columnSize > ctxt->max_nogetdata || columnSize == 0 )
-	  goto use_sql_get_data;
-	ptr_result->len_value = sizeof(wchar_t)*(columnSize+1);
-	break;
-      case SQL_C_SLONG:
-	ptr_result->len_value = sizeof(SQLINTEGER);
-	break;
-      case SQL_C_SBIGINT:
-	ptr_result->len_value = sizeof(SQLBIGINT);
-	break;
-      case SQL_C_DOUBLE:
-	ptr_result->len_value = sizeof(SQLDOUBLE);
-	break;
-      case SQL_C_TYPE_DATE:
-	ptr_result->len_value = sizeof(DATE_STRUCT);
-	break;
-      case SQL_C_TYPE_TIME:
-	ptr_result->len_value = sizeof(TIME_STRUCT);
-	break;
-      case SQL_C_TIMESTAMP:
-	ptr_result->len_value = sizeof(SQL_TIMESTAMP_STRUCT);
-	break;
-      default:
-	Sdprintf("Oops: %s:%d: cTypeID = %d\n",
-		 __FILE__, __LINE__, ptr_result->cTypeID);
-	assert(0);
-	return FALSE;			/* make compiler happy */
-    }
+		 /*******************************
+		 *	CONTEXT (STATEMENTS)	*
+		 *******************************/
 
-  bind:
-    if ( ptr_result->len_value <= PARAM_BUFSIZE )
-      ptr_result->ptr_value = (SQLPOINTER)ptr_result->buf;
-    else
-    { if ( !(ptr_result->ptr_value = odbc_malloc(ptr_result->len_value)) )
-	return FALSE;
-    }
+static context** executing_contexts = NULL;
+static int executing_context_size = 0;
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Statement handles and context structures are recycled.  If a context  is
+freed, its statement handle is reset  using   SQL_CLOSE,  SQL_UNBIND and
+SQL_RESET_PARAMS and kept in the  pool   of  idle  handles of the
+connection (statement_pool(Size)).  The  context   structure  itself is
+kept on a global free list.   Both  are   protected  by  LOCK().  The
+pool of a connection is emptied if a connection attribute is changed as
+statement handles inherit their defaults from the connection when they
+are allocated.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static context *
+alloc_context(void)
+{ context *ctxt;
 
-    TRY(ctxt, SQLBindCol(ctxt->hstmt, i,
-			 ptr_result->cTypeID,
-			 ptr_result->ptr_value,
-			 ptr_result->len_value,
-			 &ptr_result->length_ind),
-       (void)0);
+  LOCK();
+  if ( (ctxt = free_contexts) )
+  { free_contexts = ctxt->clones;
+    free_context_count--;
   }
+  UNLOCK();
 
-  return TRUE;
+  if ( !ctxt && !(ctxt = odbc_malloc(sizeof(context))) )
+    return NULL;
+  memset(ctxt, 0, sizeof(*ctxt));
+
+  return ctxt;
 }
 
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-odbc_row()  is  the  final  call  from  the  various  query  predicates,
-returning a result row or, in case  of findall, the whole result-set. It
-must call close_context() if we are  done   with  the  context due to an
-error or the last result.
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+static void
+free_context_struct(context *ctxt)
+{ LOCK();
+  if ( free_context_count < MAX_FREE_CONTEXTS )
+  { ctxt->clones = free_contexts;	/* re-use as link */
+    free_contexts = ctxt;
+    free_context_count++;
+    ctxt = NULL;
+  }
+  UNLOCK();
 
-static foreign_t
-odbc_row(context *ctxt, term_t trow)
-{ term_t local_trow;
-  fid_t fid;
+  if ( ctxt )
+    free(ctxt);
+}
 
-  if ( !ison(ctxt, CTX_BOUND) )
-  { if ( !prepare_result(ctxt) )
-    { close_context(ctxt);
-      return FALSE;
-    }
-    set(ctxt, CTX_BOUND);
-  }
 
-  if ( !ctxt->result )			/* not a SELECT statement */
-  { SQLLEN rows = 0;			/* was DWORD */
-    int rval;
+static HSTMT
+pooled_stmt_handle(connection *cn)
+{ HSTMT hstmt = NULL;
 
-    if ( ctxt->rc != SQL_NO_DATA_FOUND )
-      ctxt->rc = SQLRowCount(ctxt->hstmt, &rows);
-    if ( ctxt->rc == SQL_SUCCESS ||
-	 ctxt->rc == SQL_SUCCESS_WITH_INFO ||
-	 ctxt->rc == SQL_NO_DATA_FOUND )
-      rval = PL_unify_term(trow,
-			   PL_FUNCTOR, FUNCTOR_affected1,
-			     PL_LONG, (long)rows);
-    else
-      rval = TRUE;
+  LOCK();
+  if ( cn->stmt_pool_count > 0 )
+    hstmt = cn->stmt_pool[--cn->stmt_pool_count];
+  UNLOCK();
 
-    close_context(ctxt);
+  return hstmt;
+}
 
-    return rval;
-  }
 
-  if ( ctxt->rc == SQL_NO_DATA_FOUND )
-  { close_context(ctxt);
+/* release_stmt_handle() returns the handle of ctxt to the pool of its
+   connection.  Returns FALSE if the handle must be dropped.
+*/
+
+static int
+release_stmt_handle(context *ctxt)
+{ connection *cn = ctxt->connection;
+  HSTMT hstmt = ctxt->hstmt;
+  int rc = FALSE;
+
+  if ( cn->stmt_pool_size == 0 ||
+       cn->stmt_pool_count >= cn->stmt_pool_size )
+    return FALSE;			/* unlocked test */
+
+  if ( SQLFreeStmt(hstmt, SQL_CLOSE) != SQL_SUCCESS ||
+       SQLFreeStmt(hstmt, SQL_UNBIND) != SQL_SUCCESS ||
+       SQLFreeStmt(hstmt, SQL_RESET_PARAMS) != SQL_SUCCESS )
     return FALSE;
+  if ( ctxt->rowset )
+    reset_rowset_attributes(hstmt);
+  if ( ison(ctxt, CTX_TIMEOUT) )
+    SQLSetStmtAttr(hstmt, SQL_ATTR_QUERY_TIMEOUT, (SQLPOINTER)0, 0);
+  if ( ison(ctxt, CTX_MAX_ROWS) &&
+       SQLSetStmtAttr(hstmt, SQL_ATTR_MAX_ROWS,
+		      (SQLPOINTER)0, 0) == SQL_ERROR )
+    return FALSE;			/* would truncate later queries */
+
+  LOCK();
+  if ( !cn->stmt_pool )
+    cn->stmt_pool = malloc(cn->stmt_pool_size*sizeof(HSTMT));
+  if ( cn->stmt_pool && cn->stmt_pool_count < cn->stmt_pool_size )
+  { cn->stmt_pool[cn->stmt_pool_count++] = hstmt;
+    rc = TRUE;
   }
+  UNLOCK();
 
-  if ( ctxt->findall )			/* findall: return the whole set */
-  { term_t tail = PL_copy_term_ref(trow);
-    term_t head = PL_new_term_ref();
-    term_t tmp  = PL_new_term_ref();
+  return rc;
+}
 
-    for(;;)
-    { ctxt->rc = SQLFetch(ctxt->hstmt);
 
-      switch(ctxt->rc)
-      { case SQL_NO_DATA_FOUND:
-	  close_context(ctxt);
-	  return PL_unify_nil(tail);
-	case SQL_SUCCESS:
-	  break;
-	default:
-	  if ( !report_status(ctxt) )
-	  { close_context(ctxt);
-	    return FALSE;
-	  }
-      }
+/* Drop idle statement handles until at most `size` remain.  Must be
+   called with LOCK() held.
+*/
 
-      if ( !PL_unify_list(tail, head, tail) ||
-	   !put_findall(ctxt, tmp) ||
-	   !PL_unify(head, tmp) )
-      { close_context(ctxt);
-	return FALSE;
-      }
-    }
-  }
+static void
+trim_stmt_pool(connection *cn, int size)
+{ if ( size != cn->stmt_pool_size )
+    size = 0;				/* re-allocated with the new size */
 
-  local_trow = PL_new_term_ref();
-  fid = PL_open_foreign_frame();
+  while( cn->stmt_pool_count > size )
+    SQLFreeStmt(cn->stmt_pool[--cn->stmt_pool_count], SQL_DROP);
 
-  for(;;)				/* normal non-deterministic access */
-  { if ( ison(ctxt, CTX_PREFETCHED) )
-    { clear(ctxt, CTX_PREFETCHED);
-    } else
-    { TRY(ctxt, SQLFetch(ctxt->hstmt), close_context(ctxt));
-      if ( ctxt->rc == SQL_NO_DATA_FOUND )
-      { close_context(ctxt);
-	return FALSE;
-      }
-    }
+  if ( size == 0 && cn->stmt_pool )
+  { free(cn->stmt_pool);
+    cn->stmt_pool = NULL;
+  }
+}
 
-    if ( !pl_put_row(local_trow, ctxt) )
-    { close_context(ctxt);
-      return FALSE;			/* with pending exception */
-    }
 
-    if ( !PL_unify(trow, local_trow) )
-    { PL_rewind_foreign_frame(fid);
-      continue;
-    }
+static context *
+new_context(connection *cn)
+{ context *ctxt = alloc_context();
+  RETCODE rc;
 
-					/* success! */
-					/* pre-fetch to get determinism */
-    ctxt->rc = SQLFetch(ctxt->hstmt);
-    switch(ctxt->rc)
-    { case SQL_NO_DATA_FOUND:		/* no alternative */
-	close_context(ctxt);
-	return TRUE;
-      case SQL_SUCCESS_WITH_INFO:
-	report_status(ctxt);		/* Always returns TRUE */
-	/*FALLTHROUGH*/
-      case SQL_SUCCESS:
-	set(ctxt, CTX_PREFETCHED);
-	PL_retry_address(ctxt);
-      default:
-	if ( !report_status(ctxt) )
-	{ close_context(ctxt);
-	  return FALSE;
-	}
-	return TRUE;
+  if ( !ctxt )
+    return NULL;
+  ctxt->magic = CTX_MAGIC;
+  ctxt->henv  = henv;
+  ctxt->connection = cn;
+  ctxt->null = cn->null;
+  ctxt->flags = cn->flags;
+  ctxt->max_nogetdata = cn->max_nogetdata;
+  ctxt->fetch_size = cn->fetch_size;
+  ctxt->decimal = cn->decimal;
+  if ( (ctxt->hstmt = pooled_stmt_handle(cn)) )
+  { statistics.handles_reused++;
+  } else
+  { if ( (rc=SQLAllocStmt(cn->hdbc, &ctxt->hstmt)) != SQL_SUCCESS )
+    { odbc_report(henv, cn->hdbc, NULL, rc);
+      free_context_struct(ctxt);
+      return NULL;
     }
+    statistics.handles_allocated++;
   }
+  statistics.statements_created++;
+  if ( cn->timeout > 0.0 )
+    set_query_timeout(ctxt, cn->timeout);
+
+  return ctxt;
+}
+
+
+static void
+unmark_and_close_context(context *ctxt)
+{ int self = PL_thread_self();
+
+  LOCK_CONTEXTS();
+  clear(ctxt, CTX_EXECUTING);
+  if ( self >= 0 )
+    executing_contexts[self] = NULL;
+  UNLOCK_CONTEXTS();
+  close_context(ctxt);
 }
 
+/* release_context() clears CTX_INUSE of a persistent statement after
+   its cursor was closed, such that another thread cannot pick it up
+   while we are still using it.  Returns FALSE if the statement was
+   made non-persistent meanwhile (evicted from the statement cache or
+   freed), in which case the caller must free it.
+*/
 
 static int
-set_column_types(context *ctxt, term_t option)
-{ term_t tail = PL_new_term_ref();
-  term_t head = PL_new_term_ref();
-  parameter *p;
-  int ntypes;
+release_context(context *ctxt)
+{ int keep;
 
-  if ( !PL_get_arg(1, option, tail) ||
-       (ntypes = list_length(tail)) < 0 )
-    return FALSE;			/* not a proper list */
+  LOCK();
+  if ( (keep = ison(ctxt, CTX_PERSISTENT)) )
+    clear(ctxt, CTX_INUSE);
+  UNLOCK();
 
-  ctxt->NumCols = ntypes;
-  ctxt->db_row = PL_new_functor(ATOM_row, ctxt->NumCols);
-  if ( !(ctxt->result = odbc_malloc(sizeof(parameter)*ctxt->NumCols)) )
-    return FALSE;
-  memset(ctxt->result, 0, sizeof(parameter)*ctxt->NumCols);
+  return keep;
+}
 
-  for(p = ctxt->result; PL_get_list(tail, head, tail); p++)
-  { if ( !get_pltype(head, &p->plTypeID) )
-      return FALSE;
+
+static void
+close_context(context *ctxt)
+{ if ( ison(ctxt, CTX_EXECUTING) )
+    unmark_fetching(ctxt);
+  if ( ctxt->streams )
+    invalidate_column_streams(ctxt);
+  if ( ctxt->filter )
+  { free_row_filter(ctxt->filter);
+    ctxt->filter = NULL;
   }
-  if ( !PL_get_nil(tail) )
-    return type_error(tail, "list");
+  ctxt->row_values = 0;
 
-  return TRUE;
+  if ( ctxt->flags & CTX_PERSISTENT )
+  { if ( ctxt->hstmt )
+    { ctxt->rc = SQLFreeStmt(ctxt->hstmt, SQL_CLOSE);
+      if ( ctxt->rc == SQL_ERROR )
+	report_status(ctxt);
+    }
+    ctxt->row = 0;
+    ctxt->rows_fetched = 0;
+    ctxt->rows_counted = 0;
+    ctxt->bytes_counted = 0;
+    if ( release_context(ctxt) )
+      return;
+  }
+
+  free_context(ctxt);
 }
 
 
-static int
-set_statement_options(context *ctxt, term_t options)
-{ /* Options are scanned by hand rather than through PL_scan_options()
-     because findall(Template, Row) is an arity-2 option that the generic
-     option scanner cannot express.  As a consequence these options are
-     not available as a dict.
-  */
-  if ( !PL_get_nil(options) )
-  { term_t tail = PL_copy_term_ref(options);
-    term_t head = PL_new_term_ref();
-
-    while(PL_get_list(tail, head, tail))
-    { if ( PL_is_functor(head, FUNCTOR_types1) )
-      { if ( !set_column_types(ctxt, head) )
-	  return FALSE;
-      } else if ( PL_is_functor(head, FUNCTOR_null1) )
-      { term_t arg = PL_new_term_ref();
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Result columns that are returned as atoms keep a small hash table from
+the bytes of short values to their atom.  This avoids converting and
+looking up the atom for each row of low-cardinality columns such as
+codes and states.  The cache holds a reference to each of its atoms.
+It is filled with the first ATOM_CACHE_FILL distinct values and never
+replaces entries.  If it is full and most lookups miss, the column has
+too many distinct values and the cache is disabled.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-	_PL_get_arg(1, head, arg);
-	ctxt->null = nulldef_spec(arg);
-	set(ctxt, CTX_OWNNULL);
-      } else if ( PL_is_functor(head, FUNCTOR_source1) )
-      { int val;
+#define ATOM_CACHE_SIZE	 64		/* slots (power of 2) */
+#define ATOM_CACHE_FILL	 48		/* max entries */
+#define ATOM_CACHE_TEXT	 32		/* max bytes of a value */
+#define ATOM_CACHE_CHECK 1024		/* lookups between hit-rate checks */
 
-	if ( !get_bool_arg_ex(1, head, &val) )
-	  return FALSE;
+typedef struct atom_cache_entry
+{ atom_t       atom;			/* cached atom (0: empty slot) */
+  unsigned int hash;			/* hash of text */
+  unsigned int length;			/* bytes in text */
+  char	       text[ATOM_CACHE_TEXT];	/* value as returned by the driver */
+} atom_cache_entry;
 
-	if ( val )
-	  set(ctxt, CTX_SOURCE);
-      } else if ( PL_is_functor(head, FUNCTOR_findall2) )
-      { if ( !(ctxt->findall = compile_findall(head, ctxt->flags)) )
-	  return FALSE;
-      } else if ( PL_is_functor(head, FUNCTOR_fetch1) )
-      { atom_t a;
+typedef struct atom_cache
+{ int	       count;			/* # used slots */
+  int	       disabled;		/* too many distinct values */
+  unsigned int lookups;			/* # lookups in this window */
+  unsigned int misses;			/* # misses in this window */
+  atom_cache_entry entries[ATOM_CACHE_SIZE];
+} atom_cache;
 
-	if ( !get_atom_arg_ex(1, head, &a) )
-	  return FALSE;
-	if ( a == ATOM_auto )
-	  clear(ctxt, CTX_NOAUTO);
-	else if ( a == ATOM_fetch )
-	  set(ctxt, CTX_NOAUTO);
-	else
-	{ term_t a = PL_new_term_ref();
-	  _PL_get_arg(1, head, a);
-	  return domain_error(a, "fetch");
-	}
-      } else if ( PL_is_functor(head, FUNCTOR_wide_column_threshold1) )
-      { int val;
 
-	if ( !get_int_arg_ex(1, head, &val) )
-	  return FALSE;
+static void
+free_atom_cache(atom_cache *ac)
+{ int i;
 
-	ctxt->max_nogetdata = val;
-      } else
-	return domain_error(head, "odbc_option");
-    }
-    if ( !PL_get_nil(tail) )
-      return type_error(tail, "list");
+  for(i=0; i<ATOM_CACHE_SIZE; i++)
+  { if ( ac->entries[i].atom )
+      PL_unregister_atom(ac->entries[i].atom);
   }
-
-  return TRUE;
+  free(ac);
 }
 
 
-/* This is not thread-safe: You must hold the lock when entering! */
-static int
-mark_context_as_executing(int self, context* ctxt)
-{ if ( self >= executing_context_size )
-  { int old_size = executing_context_size;
-    int i;
+/* cached_atom() returns the atom for the len bytes at s in encoding rep,
+   or 0 if the value is not cached and could not be added.
+*/
 
-    executing_context_size = 16;
-    while (self >= executing_context_size)
-      executing_context_size <<= 1;
+static atom_t
+cached_atom(parameter *p, int rep, size_t len, const char *s)
+{ atom_cache *ac = p->atoms;
+  atom_cache_entry *e;
+  unsigned int h = 2166136261U;		/* FNV-1a */
+  size_t i;
+  atom_t a;
 
-    if ( executing_contexts == NULL )
-    { executing_contexts = odbc_malloc(executing_context_size * sizeof(context*));
-      if ( executing_contexts == NULL )
-	return FALSE;
-    } else
-    { context** tmp = odbc_realloc(executing_contexts,
-				   executing_context_size * sizeof(context*));
-      if ( tmp == NULL )
-	return FALSE;
-      executing_contexts = tmp;
-    }
-    for (i = old_size; i < executing_context_size; i++)
-      executing_contexts[i] = NULL;
+  if ( len > ATOM_CACHE_TEXT )
+    return 0;
+  if ( !ac )
+  { if ( !(ac = malloc(sizeof(*ac))) )
+      return 0;
+    memset(ac, 0, sizeof(*ac));
+    p->atoms = ac;
+  } else if ( ac->disabled )
+    return 0;
+
+  for(i=0; i<len; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619U;
+
+  ac->lookups++;
+  for(i=h&(ATOM_CACHE_SIZE-1); (e=&ac->entries[i])->atom;
+      i=(i+1)&(ATOM_CACHE_SIZE-1))
+  { if ( e->hash == h && e->length == len && memcmp(e->text, s, len) == 0 )
+      return e->atom;
   }
 
-  if ( self >= 0 )
-    executing_contexts[self] = ctxt;
-  set(ctxt, CTX_EXECUTING);
+  ac->misses++;
+  if ( ac->count < ATOM_CACHE_FILL )
+  { if ( !(a = PL_new_atom_mbchars(rep, len, s)) )
+      return 0;
+    e->atom   = a;			/* the reference is the cache's */
+    e->hash   = h;
+    e->length = (unsigned int)len;
+    memcpy(e->text, s, len);
+    ac->count++;
 
-  return TRUE;
-}
+    return a;
+  }
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-odbc_query(+Conn, +SQL, -Row)
-    Execute an SQL query, returning the result-rows 1-by-1 on
-    backtracking
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+  if ( ac->lookups >= ATOM_CACHE_CHECK )
+  { if ( ac->misses > ac->lookups/2 )
+      ac->disabled = TRUE;
+    ac->lookups = 0;
+    ac->misses = 0;
+  }
 
-static foreign_t
-pl_odbc_query(term_t conn, term_t tquery, term_t trow, term_t options,
-	      control_t handle)
-{ context *ctxt;
+  return 0;
+}
 
-  switch( PL_foreign_control(handle) )
-  { case PL_FIRST_CALL:
-    { connection *cn;
-      int self = PL_thread_self();
-      if ( !get_connection(conn, &cn) )
-	return FALSE;
 
-      if ( !(ctxt = new_context(cn)) )
-	return FALSE;
-      if ( !get_sql_text(ctxt, tquery) )
-      { free_context(ctxt);
-	return FALSE;
-      }
+static void
+free_parameters(int n, parameter *params)
+{ if ( n && params )
+  { parameter *p = params;
+    int i;
 
-      if ( !set_statement_options(ctxt, options) )
-      { free_context(ctxt);
-	return FALSE;
-      }
-      set(ctxt, CTX_INUSE);
-      LOCK_CONTEXTS();
-      if (!mark_context_as_executing(self, ctxt))
-      { UNLOCK_CONTEXTS();
-	return FALSE;
-      }
-      UNLOCK_CONTEXTS();
-      if ( ctxt->char_width == 1 )
-      { TRY(ctxt,
-	    SQLExecDirectA(ctxt->hstmt, ctxt->sqltext.a, ctxt->sqllen),
-	    unmark_and_close_context(ctxt));
-      } else
-      { TRY(ctxt,
-	    SQLExecDirectW(ctxt->hstmt, ctxt->sqltext.w, ctxt->sqllen),
-	    unmark_and_close_context(ctxt));
+    for (i=0; i<n; i++, p++)
+    { if ( p->ptr_value &&
+	   p->ptr_value != (SQLPOINTER)p->buf &&
+	   p->len_value != SQL_LEN_DATA_AT_EXEC(0) ) /* Using SQLPutData() */
+	free(p->ptr_value);
+      if ( p->getdata.data )
+      { statistics.getdata_bytes -= (long)p->getdata.size;
+	free(p->getdata.data);
       }
-      LOCK_CONTEXTS();
-      clear(ctxt, CTX_EXECUTING);
-      if ( self >= 0 )
-	executing_contexts[self] = NULL;
-      UNLOCK_CONTEXTS();
-      return odbc_row(ctxt, trow);
+      if ( p->source.table )
+	PL_unregister_atom(p->source.table);
+      if ( p->source.column )
+	PL_unregister_atom(p->source.column);
+      if ( p->atoms )
+	free_atom_cache(p->atoms);
     }
-    case PL_REDO:
-      return odbc_row(PL_foreign_context_address(handle), trow);
 
-    default:
-    case PL_PRUNED:
-      free_context(PL_foreign_context_address(handle));
-      return TRUE;
+    free(params);
   }
 }
 
 
-		 /*******************************
-		 *	DICTIONARY SUPPORT	*
-		 *******************************/
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Block cursors.  If fetch_size > 1 and all result columns can be bound,
+the result columns are bound into a single block (the rowset) holding
+fetch_size rows and SQLFetch() fills the entire block.  By default the
+block is bound row-wise, where each row is laid out as below.  The
+indicator immediately precedes the value and values are aligned on a
+double:
 
-static foreign_t
-odbc_tables(term_t conn, term_t row, control_t handle)
-{ switch( PL_foreign_control(handle) )
-  { case PL_FIRST_CALL:
-    { connection *cn;
-      context *ctxt;
+	[<indicator><value>]...
 
-      if ( !get_connection(conn, &cn) )
-	return FALSE;
+Using binding(column) (CTX_BIND_COLUMN), the block is bound column-wise.
+Each column has a contiguous array of fetch_size values, followed by an
+array of fetch_size indicators.  Both arrays start at a cache line:
 
-      if ( !(ctxt = new_context(cn)) )
-	return FALSE;
-      ctxt->null = NULL;		/* use default $null$ */
-      set(ctxt, CTX_TABLES);
-      TRY(ctxt,
-	  SQLTables(ctxt->hstmt, NULL,0,NULL,0,NULL,0,NULL,0),
-	  close_context(ctxt));
+	[<value>...][<indicator>...]...
 
-      return odbc_row(ctxt, row);
-    }
-    case PL_REDO:
-      return odbc_row(PL_foreign_context_address(handle), row);
+The parameter's ptr_value and ind_ptr point at the first row.  The
+current row is selected using ctxt->row, where the stride is row_size
+for row-wise binding and the size of the element for column-wise
+binding (row_size is 0).
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-    case PL_PRUNED:
-      free_context(PL_foreign_context_address(handle));
-      return TRUE;
+static void
+reset_rowset_attributes(HSTMT hstmt)
+{ SQLSetStmtAttr(hstmt, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER)1, 0);
+  SQLSetStmtAttr(hstmt, SQL_ATTR_ROW_BIND_TYPE,
+		 (SQLPOINTER)SQL_BIND_BY_COLUMN, 0);
+  SQLSetStmtAttr(hstmt, SQL_ATTR_ROW_STATUS_PTR, NULL, 0);
+  SQLSetStmtAttr(hstmt, SQL_ATTR_ROWS_FETCHED_PTR, NULL, 0);
+}
 
-    default:
-      assert(0);
-      return FALSE;
+
+static void
+free_rowset(context *ctxt)
+{ if ( ctxt->rowset )
+  { parameter *p = ctxt->result;
+    int i;
+
+    for(i=0; i<ctxt->NumCols; i++, p++)
+    { p->ptr_value = NULL;		/* points into the rowset */
+      p->ind_ptr = NULL;
+    }
+
+    free(ctxt->rowset);
+    ctxt->rowset = NULL;
+  }
+  if ( ctxt->row_status )
+  { free(ctxt->row_status);
+    ctxt->row_status = NULL;
   }
+  ctxt->row = 0;
+  ctxt->rows_fetched = 0;
 }
 
 
-static foreign_t
-pl_odbc_column(term_t conn, term_t db, term_t row, control_t handle)
-{ switch( PL_foreign_control(handle) )
-  { case PL_FIRST_CALL:
-    { connection *cn;
-      context *ctxt;
-      size_t len;
-      char *s;
+/* bind_rowset() binds the result columns as a block of fetch_size rows.
+   It returns FALSE if this is not possible, in which case the caller
+   must bind the columns for fetching a single row.  No exception is
+   raised.
+*/
 
-      if ( !get_connection(conn, &cn) )
-	return FALSE;
-					/* TBD: Unicode version */
-      if ( !PL_get_nchars(db, &len, &s, CVT_ATOM|CVT_STRING|cn->rep_flag) )
-	return type_error(db, "atom");
+static int
+bind_rowset(context *ctxt)
+{ parameter *p;
+  size_t row_size = 0, size, offset;
+  SQLULEN rows = ctxt->fetch_size;
+  int by_column = ison(ctxt, CTX_BIND_COLUMN);
+  SQLSMALLINT i;
+  HSTMT hstmt = ctxt->hstmt;
+  char *base;
+
+  for(i=0, p=ctxt->result; i<ctxt->NumCols; i++, p++)
+    row_size = ROW_ALIGN(row_size+sizeof(SQLLEN)) + p->len_value;
+  row_size = ROW_ALIGN(row_size);
+
+  if ( rows > ((size_t)-1)/2/row_size )
+    goto failed;
+  if ( by_column )
+  { size = CACHE_LINE-1;		/* align the base */
+    for(i=0, p=ctxt->result; i<ctxt->NumCols; i++, p++)
+      size += COL_ALIGN(rows*p->len_value) + COL_ALIGN(rows*sizeof(SQLLEN));
+  } else
+  { size = rows*row_size;
+  }
 
-      if ( !(ctxt = new_context(cn)) )
-	return FALSE;
-      ctxt->null = NULL;		/* use default $null$ */
-      set(ctxt, CTX_COLUMNS);
-#ifdef SQL_SERVER_BUG
-      ctxt->max_nogetdata = 8192;	/* > the 4K width column for the name */
-#endif
-      TRY(ctxt,
-	  SQLColumns(ctxt->hstmt, NULL, 0, NULL, 0,
-		     (SQLCHAR*)s, (SWORD)len, NULL, 0),
-	  close_context(ctxt));
+  if ( !(ctxt->rowset = malloc(size)) ||
+       !(ctxt->row_status = malloc(rows*sizeof(SQLUSMALLINT))) )
+    goto failed;
+  ctxt->row_size = by_column ? 0 : row_size;
+
+  if ( SQLSetStmtAttr(hstmt, SQL_ATTR_ROW_BIND_TYPE,
+		      (SQLPOINTER)ctxt->row_size, 0) != SQL_SUCCESS ||
+       SQLSetStmtAttr(hstmt, SQL_ATTR_ROW_ARRAY_SIZE,
+		      (SQLPOINTER)rows, 0) != SQL_SUCCESS ||
+       SQLSetStmtAttr(hstmt, SQL_ATTR_ROW_STATUS_PTR,
+		      ctxt->row_status, 0) != SQL_SUCCESS ||
+       SQLSetStmtAttr(hstmt, SQL_ATTR_ROWS_FETCHED_PTR,
+		      &ctxt->rows_fetched, 0) != SQL_SUCCESS )
+    goto failed;
+
+  if ( by_column )
+    base = (char*)COL_ALIGN((uintptr_t)ctxt->rowset);
+  else
+    base = ctxt->rowset;
+
+  offset = 0;
+  for(i=0, p=ctxt->result; i<ctxt->NumCols; i++, p++)
+  { if ( by_column )
+    { p->ptr_value = base + offset;
+      offset += COL_ALIGN(rows*p->len_value);
+      p->ind_ptr   = (SQLLEN*)(base + offset);
+      offset += COL_ALIGN(rows*sizeof(SQLLEN));
+    } else
+    { offset = ROW_ALIGN(offset+sizeof(SQLLEN));
+      p->ptr_value = base + offset;
+      p->ind_ptr   = (SQLLEN*)(base + offset - sizeof(SQLLEN));
+      offset += p->len_value;
+    }
 
-      return odbc_row(ctxt, row);
+    if ( SQLBindCol(hstmt, (SQLUSMALLINT)(i+1), p->cTypeID,
+		    p->ptr_value, p->len_value, p->ind_ptr) != SQL_SUCCESS )
+    { SQLFreeStmt(hstmt, SQL_UNBIND);
+      goto failed;
     }
-    case PL_REDO:
-      return odbc_row(PL_foreign_context_address(handle), row);
+  }
 
-    case PL_PRUNED:
-      free_context(PL_foreign_context_address(handle));
-      return TRUE;
+  DEBUG(1, Sdprintf("Bound %d columns %s as rowset of %lu rows (%zd bytes)\n",
+		    ctxt->NumCols, by_column ? "by column" : "by row",
+		    (unsigned long)rows, size));
+  return TRUE;
 
-    default:
-      assert(0);
-      return FALSE;
-  }
+failed:
+  DEBUG(1, Sdprintf("Could not bind rowset; using single row fetch\n"));
+  free_rowset(ctxt);
+  reset_rowset_attributes(hstmt);
+  return FALSE;
 }
 
 
-static foreign_t
-odbc_primary_key(term_t conn, term_t table, term_t row, control_t handle)
-{ switch( PL_foreign_control(handle) )
-  { case PL_FIRST_CALL:
-    { connection *cn;
-      context *ctxt;
-      size_t len;
-      char *s;
+static int
+bind_column(context *ctxt, SQLSMALLINT i, parameter *p)
+{ if ( p->len_value <= PARAM_BUFSIZE )
+    p->ptr_value = (SQLPOINTER)p->buf;
+  else if ( !(p->ptr_value = odbc_malloc(p->len_value)) )
+    return FALSE;
 
-      if ( !get_connection(conn, &cn) )
-	return FALSE;
-					/* TBD: Unicode version */
-      if ( !PL_get_nchars(table, &len, &s, CVT_ATOM|CVT_STRING|cn->rep_flag) )
-	return type_error(table, "atom");
+  TRY(ctxt, SQLBindCol(ctxt->hstmt, i,
+		       p->cTypeID,
+		       p->ptr_value,
+		       p->len_value,
+		       &p->length_ind),
+      (void)0);
 
-      if ( !(ctxt = new_context(cn)) )
-	return FALSE;
-      ctxt->null = NULL;		/* use default $null$ */
-      set(ctxt, CTX_PRIMARYKEY);
-      TRY(ctxt,
-	  SQLPrimaryKeys(ctxt->hstmt, NULL, 0, NULL, 0,
-		     (SQLCHAR*)s, (SWORD)len),
-	  close_context(ctxt));
+  return TRUE;
+}
 
-      return odbc_row(ctxt, row);
+
+/* bind_columns() binds all columns that are not fetched using
+   SQLGetData() for fetching a single row, dropping the rowset if
+   there is one.
+*/
+
+static int
+bind_columns(context *ctxt)
+{ parameter *p;
+  SQLSMALLINT i;
+
+  if ( ctxt->rowset )
+  { SQLFreeStmt(ctxt->hstmt, SQL_UNBIND);
+    free_rowset(ctxt);
+    reset_rowset_attributes(ctxt->hstmt);
+  }
+
+  for(i=1, p=ctxt->result; i<=ctxt->NumCols; i++, p++)
+  { if ( p->len_value > 0 && !p->ptr_value )
+    { if ( !bind_column(ctxt, i, p) )
+	return FALSE;
     }
-    case PL_REDO:
-      return odbc_row(PL_foreign_context_address(handle), row);
+  }
 
-    case PL_PRUNED:
-      free_context(PL_foreign_context_address(handle));
-      return TRUE;
+  return TRUE;
+}
 
-    default:
-      assert(0);
-      return FALSE;
+
+static SQLPOINTER
+column_value(context *ctxt, parameter *p)
+{ if ( ctxt->rowset )
+  { if ( ctxt->row_size )
+      return (char*)p->ptr_value + ctxt->row*ctxt->row_size;
+    return (char*)p->ptr_value + ctxt->row*p->len_value;
   }
+
+  return p->ptr_value;
 }
 
-static foreign_t
-odbc_foreign_key(term_t conn, term_t pktable, term_t fktable, term_t row, control_t handle)
-{ switch( PL_foreign_control(handle) )
-  { case PL_FIRST_CALL:
-    { connection *cn;
-      context *ctxt;
-      size_t lpkt = 0;
-      char *spkt = 0;
-      size_t lpkf = 0;
-      char *spkf = 0;
 
-      if ( !get_connection(conn, &cn) )
-	return FALSE;
+static SQLLEN
+column_length(context *ctxt, parameter *p)
+{ if ( ctxt->rowset )
+  { if ( ctxt->row_size )
+      return *(SQLLEN*)((char*)p->ind_ptr + ctxt->row*ctxt->row_size);
+    return p->ind_ptr[ctxt->row];
+  }
 
-      int nt = 0;
-      if ( PL_get_nchars(pktable, &lpkt, &spkt, CVT_ATOM|CVT_STRING|cn->rep_flag) )
-	++nt;
-      if ( PL_get_nchars(fktable, &lpkf, &spkf, CVT_ATOM|CVT_STRING|cn->rep_flag) )
-	++nt;
-      if (!nt)
-	return resource_error("set at least PkTable or FkTable");
+  return p->length_ind;
+}
 
-      if ( !(ctxt = new_context(cn)) )
-	return FALSE;
-      ctxt->null = NULL;		/* use default $null$ */
-      set(ctxt, CTX_FOREIGNKEY);
-      TRY(ctxt,
-	  SQLForeignKeys(ctxt->hstmt, NULL, 0, NULL, 0,
-		     (SQLCHAR*)spkt, (SWORD)lpkt, NULL, 0, NULL, 0, (SQLCHAR*)spkf, (SWORD)lpkf),
-	  close_context(ctxt));
 
-      return odbc_row(ctxt, row);
-    }
-    case PL_REDO:
-      return odbc_row(PL_foreign_context_address(handle), row);
+static int
+row_error(context *ctxt)
+{ term_t ex;
 
-    case PL_PRUNED:
-      free_context(PL_foreign_context_address(handle));
-      return TRUE;
+  if ( (ex=PL_new_term_ref()) &&
+       PL_unify_term(ex,
+		     PL_FUNCTOR, FUNCTOR_error2,
+		       PL_FUNCTOR, FUNCTOR_odbc3,
+			 PL_CHARS,   "01S01",
+			 PL_INTEGER, 0L,
+			 PL_STRING,  "Error in row",
+		       PL_VARIABLE) )
+    return PL_raise_exception(ex);
 
-    default:
-      assert(0);
-      return FALSE;
-  }
+  return FALSE;
 }
 
 
-static foreign_t
-odbc_types(term_t conn, term_t sqltype, term_t row, control_t handle)
-{ switch( PL_foreign_control(handle) )
-  { case PL_FIRST_CALL:
-    { connection *cn;
-      context *ctxt;
-      atom_t tname;
-      SWORD type;
-      int v;
+			 /*******************************
+			 *	    ROW FILTERS		*
+			 *******************************/
 
-      if ( PL_get_integer(sqltype, &v) )
-      { type = v;
-      } else
-      { if ( !PL_get_atom(sqltype, &tname) )
-	  return type_error(sqltype, "sql_type");
-	if ( tname == ATOM_all_types )
-	  type = SQL_ALL_TYPES;
-	else if ( !get_sqltype_from_atom(tname, &type) )
-	  return domain_error(sqltype, "sql_type");
-      }
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+If the Row argument is partially instantiated,   as  in odbc_query(C,
+'SELECT * FROM marks', row(X, 6)), most rows  are rejected by PL_unify()
+after the complete row term has been built.  Instead, the atomic
+arguments of the row are compiled into a row_filter: tests that compare
+the value with the data in the bound column buffers before any Prolog
+term is created.
+
+A test returns FILTER_MAYBE if the raw data   does not allow for a quick
+decision.  This applies to columns fetched using SQLGetData(), date and
+time columns, multibyte text and decimal columns converted to numbers.
+In the backtracking path such rows are passed to PL_unify() as before.
+The findall(Template, row(...)) and aggregate(Spec, row(...)) options
+have no final unification, so there we create the column value and
+unify it with the test value.  Columns fetched using SQLGetData() must
+be read in column order and only once.  If such a column must be
+tested, we therefore fetch the whole row in column order into
+ctxt->row_values, from which pl_put_column() then takes the values for
+the test as well as for the template.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-      if ( !get_connection(conn, &cn) )
-	return FALSE;
-      if ( !(ctxt = new_context(cn)) )
-	return FALSE;
-      ctxt->null = NULL;		/* use default $null$ */
-      TRY(ctxt,
-	  SQLGetTypeInfo(ctxt->hstmt, type),
-	  close_context(ctxt));
+#define FILTER_NO	0		/* row cannot match */
+#define FILTER_YES	1		/* column matches */
+#define FILTER_MAYBE	2		/* need to unify */
 
-      return odbc_row(ctxt, row);
-    }
-    case PL_REDO:
-      return odbc_row(PL_foreign_context_address(handle), row);
+typedef struct
+{ int	   column;			/* 0-based column */
+  int	   type;			/* PL_INTEGER, PL_FLOAT, PL_ATOM, PL_STRING */
+  union
+  { int64_t i;				/* PL_INTEGER */
+    double  f;				/* PL_FLOAT */
+    atom_t  a;				/* PL_ATOM */
+  } value;
+  size_t   len;				/* # characters in text */
+  wchar_t *text;			/* text of PL_ATOM and PL_STRING */
+} row_test;
 
-    case PL_PRUNED:
-      free_context(PL_foreign_context_address(handle));
-      return TRUE;
+typedef struct row_filter
+{ int	   count;			/* # tests */
+  row_test tests[1];			/* the tests */
+} row_filter;
+
+#define FILTER_SIZE(n)	((size_t)&((row_filter*)NULL)->tests[n])
+
+
+/* filter_type() returns the test type for a row argument or 0 if we
+   cannot test on the argument.
+*/
+
+static int
+filter_type(term_t t)
+{ int64_t v;
 
+  switch(PL_term_type(t))
+  { case PL_INTEGER:
+      return PL_get_int64(t, &v) ? PL_INTEGER : 0;
+    case PL_FLOAT:
+      return PL_FLOAT;
+    case PL_ATOM:
+      return PL_ATOM;
+    case PL_STRING:
+      return PL_STRING;
     default:
-      assert(0);
-      return FALSE;
+      return 0;
   }
 }
 
 
-static foreign_t
-odbc_data_sources(term_t list)
-{ UCHAR dsn[SQL_MAX_DSN_LENGTH];
-  UCHAR description[1024];
-  SWORD dsnlen, dlen;
-  UWORD dir = SQL_FETCH_FIRST;
-  RETCODE rc;
-  term_t tail = PL_copy_term_ref(list);
-  term_t head = PL_new_term_ref();
-
-  LOCK();
-  if ( !henv )
-  { SQLAllocEnv(&henv);		/* Allocate an environment handle */
-    SQLSetEnvAttr(henv,
-		  SQL_ATTR_ODBC_VERSION,
-		  (SQLPOINTER) SQL_OV_ODBC3,
-		  0);
-  }
-  UNLOCK();
+static void
+free_row_filter(row_filter *f)
+{ int i;
 
-  for(;; dir=SQL_FETCH_NEXT)
-  { rc = SQLDataSources(henv,
-			dir,
-			dsn, sizeof(dsn)-1, &dsnlen,
-			description, sizeof(description)-1, &dlen);
-    switch(rc)
-    { case SQL_SUCCESS:
-      { if ( PL_unify_list(tail, head, tail) &&
-	     PL_unify_term(head, PL_FUNCTOR, FUNCTOR_data_source2,
-				   PL_NCHARS, (size_t)dsnlen, dsn,
-				   PL_NCHARS, (size_t)dlen, description) )
-	  continue;
+  for(i=0; i<f->count; i++)
+  { row_test *t = &f->tests[i];
 
-	return FALSE;
-      }
-      case SQL_NO_DATA_FOUND:
-	return PL_unify_nil(tail);
-      default:
-	odbc_report(henv, NULL, NULL, rc);
-	return FALSE;
-    }
+    if ( t->type == PL_ATOM )
+      PL_unregister_atom(t->value.a);
+    if ( t->text )
+      free(t->text);
   }
+  free(f);
 }
 
 
-		 /*******************************
-		 *	COMPILE STATEMENTS	*
-		 *******************************/
+/* compile_row_filter() sets *filterp to the tests for the arguments of
+   row or NULL if there is nothing to test.
+*/
 
 static int
-unifyStmt(term_t id, context *ctxt)
-{ return PL_unify_term(id, PL_FUNCTOR, FUNCTOR_odbc_statement1,
-			     PL_POINTER, ctxt);
+compile_row_filter(term_t row, row_filter **filterp)
+{ term_t arg = PL_new_term_ref();
+  row_filter *f;
+  atom_t name;
+  size_t arity, i;
+  int count = 0;
+
+  *filterp = NULL;
+  if ( !PL_get_name_arity(row, &name, &arity) )
+    return TRUE;
+  for(i=1; i<=arity; i++)
+  { _PL_get_arg(i, row, arg);
+    if ( filter_type(arg) )
+      count++;
+  }
+  if ( count == 0 )
+    return TRUE;
+
+  if ( !(f = odbc_malloc(FILTER_SIZE(count))) )
+    return FALSE;
+  memset(f, 0, FILTER_SIZE(count));
+
+  for(i=1; i<=arity; i++)
+  { row_test *t = &f->tests[f->count];
+    wchar_t *w;
+
+    _PL_get_arg(i, row, arg);
+    if ( !(t->type = filter_type(arg)) )
+      continue;
+    t->column = (int)i-1;
+    f->count++;
+
+    switch(t->type)
+    { case PL_INTEGER:
+	PL_get_int64(arg, &t->value.i);
+	continue;
+      case PL_FLOAT:
+	PL_get_float(arg, &t->value.f);
+	continue;
+      case PL_ATOM:
+	PL_get_atom(arg, &t->value.a);
+	PL_register_atom(t->value.a);
+	break;
+    }
+
+    if ( !PL_get_wchars(arg, &t->len, &w, CVT_ATOM|CVT_STRING|CVT_EXCEPTION) ||
+	 !(t->text = odbc_malloc((t->len+1)*sizeof(wchar_t))) )
+    { free_row_filter(f);
+      return FALSE;
+    }
+    memcpy(t->text, w, (t->len+1)*sizeof(wchar_t));
+  }
+
+  *filterp = f;
+  return TRUE;
 }
 
 
-static bool
-getStmt(term_t id, context **ctxt)
-{ if ( PL_is_functor(id, FUNCTOR_odbc_statement1) )
-  { term_t a = PL_new_term_ref();
-    void *ptr;
+/* test_text() compares len bytes of column text in representation rep.
+   For UTF-8 we can only decide as long as the text is ASCII.
+*/
 
-    _PL_get_arg(1, id, a);
-    if ( PL_get_pointer(a, &ptr) )
-    { *ctxt = ptr;
+static int
+test_text(const row_test *t, const char *s, size_t len, int rep)
+{ size_t i;
 
-      if ( (*ctxt)->magic != CTX_MAGIC )
-	return existence_error(id, "odbc_statement_handle");
+  if ( rep != REP_ISO_LATIN_1 && rep != REP_UTF8 )
+    return FILTER_MAYBE;
 
-      return true;
-    }
+  for(i=0; i<len; i++)
+  { unsigned int c = ((const unsigned char*)s)[i];
+
+    if ( c >= 0x80 && rep == REP_UTF8 )
+      return FILTER_MAYBE;
+    if ( i >= t->len || (wchar_t)c != t->text[i] )
+      return FILTER_NO;
   }
 
-  return type_error(id, "odbc_statement_handle");
+  return i == t->len ? FILTER_YES : FILTER_NO;
 }
 
 
-typedef struct
-{ SWORD  type;				/* SQL_* */
-  const char *text;			/* same as text */
-  atom_t name;				/* Prolog name */
-} sqltypedef;
+/* test_wtext() compares with SQL_C_WCHAR data.  put_wchars() maps each
+   SQLWCHAR to a character, so this is exact.
+*/
 
-static sqltypedef sqltypes[] =
-{ { SQL_BIGINT,	       "bigint" },
-  { SQL_BINARY,	       "binary" },
-  { SQL_BIT,	       "bit" },
-  { SQL_CHAR,	       "char" },
-  { SQL_DATE,	       "date" },
-  { SQL_DECIMAL,       "decimal" },
-  { SQL_DOUBLE,	       "double" },
-  { SQL_FLOAT,	       "float" },
-  { SQL_INTEGER,       "integer" },
-  { SQL_LONGVARBINARY, "longvarbinary" },
-  { SQL_LONGVARCHAR,   "longvarchar" },
-  { SQL_NUMERIC,       "numeric" },
-  { SQL_REAL,	       "real" },
-  { SQL_SMALLINT,      "smallint" },
-  { SQL_TIME,	       "time" },
-  { SQL_TIMESTAMP,     "timestamp" },
-  { SQL_TINYINT,       "tinyint" },
-  { SQL_VARBINARY,     "varbinary" },
-  { SQL_VARCHAR,       "varchar" },
-  { SQL_WCHAR,         "nchar" },
-  { SQL_WLONGVARCHAR,  "longnvarchar" },
-  { SQL_WVARCHAR,      "nvarchar" },
-  { 0,		       NULL }
-};
+static int
+test_wtext(const row_test *t, const SQLWCHAR *s, size_t len)
+{ size_t i;
+
+  if ( len != t->len )
+    return FILTER_NO;
+  for(i=0; i<len; i++)
+  { if ( (wchar_t)s[i] != t->text[i] )
+      return FILTER_NO;
+  }
 
+  return FILTER_YES;
+}
 
-static SWORD
-get_sqltype_from_atom(atom_t name, SWORD *type)
-{ sqltypedef *def;
 
-  for(def=sqltypes; def->text; def++)
-  { if ( !def->name )
-      def->name = PL_new_atom(def->text);
-    if ( def->name == name )
-    { *type = def->type;
-      return TRUE;
+static int
+test_column(context *c, const row_test *t)
+{ parameter *p;
+  SQLPOINTER value;
+  SQLLEN length;
+  int want;
+
+  if ( t->column >= c->NumCols || ison(c, CTX_SOURCE) )
+    return FILTER_NO;			/* row/N or column/3 do not unify */
+  p = &c->result[t->column];
+  if ( !p->ptr_value )
+    return FILTER_MAYBE;		/* SQLGetData() or stream */
+
+  value  = column_value(c, p);
+  length = column_length(c, p);
+
+  if ( length == SQL_NULL_DATA )
+  { nulldef *nd = c->null;
+
+    if ( !nd )
+      return FILTER_MAYBE;
+    switch(nd->nulltype)
+    { case NULL_ATOM:
+	return ( t->type == PL_ATOM && t->value.a == nd->nullvalue.atom
+		 ? FILTER_YES : FILTER_NO );
+      case NULL_FUNCTOR:
+	return FILTER_NO;
+      default:
+	return FILTER_MAYBE;
     }
   }
 
-  return FALSE;
+  switch(p->cTypeID)
+  { case SQL_C_SLONG:
+      if ( t->type != PL_INTEGER )
+	return FILTER_NO;
+      return t->value.i == *(SQLINTEGER*)value ? FILTER_YES : FILTER_NO;
+    case SQL_C_SBIGINT:
+      if ( t->type != PL_INTEGER )
+	return FILTER_NO;
+      return t->value.i == *(SQLBIGINT*)value ? FILTER_YES : FILTER_NO;
+    case SQL_C_DOUBLE:
+    { SQLDOUBLE d = *(SQLDOUBLE*)value;
+
+      if ( t->type != PL_FLOAT )
+	return FILTER_NO;
+      if ( memcmp(&d, &t->value.f, sizeof(d)) == 0 )
+	return FILTER_YES;
+      return d == t->value.f ? FILTER_MAYBE : FILTER_NO;	/* 0.0 vs -0.0 */
+    }
+    case SQL_C_CHAR:
+    case SQL_C_WCHAR:
+    case SQL_C_BINARY:
+      if ( length < 0 || length > p->len_value )
+	return FILTER_MAYBE;		/* truncated */
+      switch(p->plTypeID)
+      { case SQL_PL_DEFAULT:
+	  if ( p->cTypeID == SQL_C_CHAR && c->decimal != DECIMAL_TEXT &&
+	       IS_DECIMAL_TYPE(p->sqlTypeID) )
+	    return FILTER_MAYBE;
+	  /*FALLTHROUGH*/
+	case SQL_PL_ATOM:
+	  want = PL_ATOM;
+	  break;
+	case SQL_PL_STRING:
+	  want = PL_STRING;
+	  break;
+	default:
+	  return FILTER_MAYBE;
+      }
+      if ( t->type != want )
+	return FILTER_NO;
+      if ( p->cTypeID == SQL_C_WCHAR )
+	return test_wtext(t, value, length/sizeof(SQLWCHAR));
+      return test_text(t, value, length,
+		       p->cTypeID == SQL_C_BINARY ? REP_ISO_LATIN_1
+						  : c->connection->rep_flag);
+    default:
+      return FILTER_MAYBE;
+  }
+}
+
+
+/* unify_row_test() decides a FILTER_MAYBE test by creating the column
+   value.  Returns -1 on an exception.
+*/
+
+static int
+unify_row_test(context *c, const row_test *t)
+{ fid_t fid;
+  term_t col, val;
+  int rc;
+
+  if ( !(fid = PL_open_foreign_frame()) )
+    return -1;
+  col = PL_new_term_ref();
+  val = PL_new_term_ref();
+
+  switch(t->type)
+  { case PL_INTEGER:
+      rc = PL_put_int64(val, t->value.i);
+      break;
+    case PL_FLOAT:
+      rc = PL_put_float(val, t->value.f);
+      break;
+    case PL_ATOM:
+      rc = PL_put_atom(val, t->value.a);
+      break;
+    default:
+      rc = PL_unify_wchars(val, PL_STRING, t->len, t->text);
+  }
+  if ( !rc || !pl_put_column(c, t->column, col) )
+  { PL_close_foreign_frame(fid);
+    return -1;
+  }
+  rc = PL_unify(col, val);
+  PL_discard_foreign_frame(fid);
+
+  return rc;
+}
+
+
+/* clear_row_values() discards the row fetched for the previous row by
+   row_filter_matches().
+*/
+
+static void
+clear_row_values(context *c)
+{ if ( c->row_values )
+  { PL_reset_term_refs(c->row_values);
+    c->row_values = 0;
+  }
+}
+
+
+/* fetch_row_values() fetches all columns of the current row in column
+   order into c->row_values.
+*/
+
+static int
+fetch_row_values(context *c)
+{ term_t values;
+  int i;
+
+  if ( !(values = PL_new_term_refs(c->NumCols)) )
+    return FALSE;
+  for(i=0; i<c->NumCols; i++)
+  { if ( !pl_put_column(c, i, values+i) )
+      return FALSE;
+  }
+  c->row_values = values;
+
+  return TRUE;
+}
+
+
+/* row_filter_matches() returns FALSE if the current row is rejected by
+   f.  If exact is FALSE, TRUE means the row may match.  Otherwise we
+   unify undecided tests and -1 is returned on an exception.  If an
+   undecided test is on a column that is not bound, the row is fetched
+   into c->row_values first; the caller must call clear_row_values()
+   before fetching the next row.
+*/
+
+static int
+row_filter_matches(context *c, row_filter *f, int exact)
+{ int i, maybe = FALSE, unbound = FALSE;
+
+  for(i=0; i<f->count; i++)
+  { row_test *t = &f->tests[i];
+
+    switch(test_column(c, t))
+    { case FILTER_NO:
+	return FALSE;
+      case FILTER_MAYBE:
+	maybe = TRUE;
+	if ( !c->result[t->column].ptr_value )
+	  unbound = TRUE;
+    }
+  }
+
+  if ( exact && maybe )
+  { if ( unbound && !fetch_row_values(c) )
+      return -1;
+
+    for(i=0; i<f->count; i++)
+    { row_test *t = &f->tests[i];
+
+      if ( test_column(c, t) == FILTER_MAYBE )
+      { int rc = unify_row_test(c, t);
+
+	if ( rc != TRUE )
+	  return rc;
+      }
+    }
+  }
+
+  return TRUE;
+}
+
+
+			 /*******************************
+			 *	    AGGREGATES		*
+			 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The statement option aggregate(Spec, row(...)) returns a single value
+computed over the result set, similar to aggregate_all/3.  Spec is one of
+count, sum(X), min(X), max(X), bag(X) or set(X), where X appears as an
+argument of the row term.  Atomic row arguments filter the rows (see
+ROW FILTERS).
+
+Integer and float columns are aggregated from the bound buffers.  Other
+columns are converted to Prolog, after which integers and floats are
+handled the same way.  Other values (big integers, rationals, text,
+dates) make sum/1 use Prolog arithmetic and min/1 and max/1 use the
+standard order of terms.  sum/1, min/1 and max/1 ignore SQL NULL.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define AGGR_COUNT	0
+#define AGGR_SUM	1
+#define AGGR_MIN	2
+#define AGGR_MAX	3
+#define AGGR_BAG	4
+#define AGGR_SET	5
+
+#define NUM_NONE	0		/* no value */
+#define NUM_INT		1		/* int64_t */
+#define NUM_FLOAT	2		/* double */
+#define NUM_TERM	3		/* Prolog term */
+
+typedef struct aggregate
+{ int	      references;		/* reference count */
+  int	      op;			/* AGGR_* */
+  int	      column;			/* 0-based column (-1: count) */
+  row_filter *filter;			/* atomic row(...) arguments */
+} aggregate;
+
+typedef struct
+{ int	      kind;			/* NUM_* */
+  int64_t     i;
+  double      f;
+} aggr_num;
+
+typedef struct
+{ int64_t     count;			/* # rows */
+  aggr_num    best;			/* min or max so far */
+  int64_t     isum;			/* integer part of sum */
+  double      fsum;			/* float part of sum */
+  int	      floats;			/* fsum is used */
+  term_t      term;			/* NUM_TERM best or sum */
+  int	      has_term;			/* term is valid */
+  term_t      list;			/* bag or set */
+  term_t      tail;			/* open tail of list */
+  term_t      head;			/* list cell */
+  term_t      tmp;			/* column value */
+} aggr_state;
+
+
+static aggregate *
+compile_aggregate(term_t option)
+{ term_t spec = PL_new_term_ref();
+  term_t row  = PL_new_term_ref();
+  term_t arg  = PL_new_term_ref();
+  term_t var  = 0;
+  aggregate *ag;
+  atom_t name;
+  size_t arity, i;
+  int op, column = -1;
+
+  _PL_get_arg(1, option, spec);
+  _PL_get_arg(2, option, row);
+
+  if ( !PL_get_name_arity(spec, &name, &arity) )
+    goto bad_spec;
+  if ( arity == 0 && name == ATOM_count )
+  { op = AGGR_COUNT;
+  } else if ( arity == 1 )
+  { if ( name == ATOM_sum )
+      op = AGGR_SUM;
+    else if ( name == ATOM_min )
+      op = AGGR_MIN;
+    else if ( name == ATOM_max )
+      op = AGGR_MAX;
+    else if ( name == ATOM_bag )
+      op = AGGR_BAG;
+    else if ( name == ATOM_set )
+      op = AGGR_SET;
+    else
+      goto bad_spec;
+    var = PL_new_term_ref();
+    _PL_get_arg(1, spec, var);
+    if ( !PL_is_variable(var) )
+      goto bad_spec;
+  } else
+    goto bad_spec;
+
+  if ( !PL_get_name_arity(row, &name, &arity) )
+  { type_error(row, "compound");
+    return NULL;
+  }
+  for(i=1; i<=arity; i++)
+  { _PL_get_arg(i, row, arg);
+    if ( PL_is_variable(arg) )
+    { if ( var && column < 0 && PL_compare(arg, var) == 0 )
+	column = (int)i-1;
+    } else if ( !filter_type(arg) )
+    { if ( PL_is_atomic(arg) )
+	domain_error(arg, "row_filter");
+      else
+	type_error(arg, "atomic");
+      return NULL;
+    }
+  }
+  if ( var && column < 0 )
+    goto bad_spec;			/* X is not a row argument */
+
+  if ( !(ag = odbc_malloc(sizeof(*ag))) )
+    return NULL;
+  ag->references = 1;
+  ag->op = op;
+  ag->column = column;
+  if ( !compile_row_filter(row, &ag->filter) )
+  { free(ag);
+    return NULL;
+  }
+
+  return ag;
+
+bad_spec:
+  domain_error(spec, "aggregate");
+  return NULL;
+}
+
+
+static aggregate *
+clone_aggregate(aggregate *in)
+{ if ( in )
+    in->references++;
+  return in;
+}
+
+
+static void
+free_aggregate(aggregate *ag)
+{ if ( ag && --ag->references == 0 )
+  { if ( ag->filter )
+      free_row_filter(ag->filter);
+    free(ag);
+  }
+}
+
+
+/* compare_num() compares two native numbers in the standard order of
+   terms: by value and Float < Int if they compare equal.
+*/
+
+static int
+compare_num(const aggr_num *n1, const aggr_num *n2)
+{ double d1, d2;
+
+  if ( n1->kind == NUM_INT && n2->kind == NUM_INT )
+    return n1->i < n2->i ? -1 : n1->i > n2->i ? 1 : 0;
+
+  d1 = n1->kind == NUM_INT ? (double)n1->i : n1->f;
+  d2 = n2->kind == NUM_INT ? (double)n2->i : n2->f;
+  if ( d1 < d2 )
+    return -1;
+  if ( d1 > d2 )
+    return 1;
+  if ( n1->kind == n2->kind )
+    return 0;
+
+  return n1->kind == NUM_FLOAT ? -1 : 1;
+}
+
+
+static int
+put_num(term_t t, const aggr_num *n)
+{ if ( n->kind == NUM_INT )
+    return PL_put_int64(t, n->i);
+  return PL_put_float(t, n->f);
+}
+
+
+/* get_aggregate_value() gets the value of the aggregated column.  It
+   returns 0 for SQL NULL, NUM_INT or NUM_FLOAT with the value in n,
+   NUM_TERM with the value in st->tmp or -1 on an exception.
+*/
+
+static int
+get_aggregate_value(context *c, aggr_state *st, int column, aggr_num *n)
+{ parameter *p = &c->result[column];
+
+  if ( p->ptr_value )
+  { SQLPOINTER value = column_value(c, p);
+    SQLLEN length = column_length(c, p);
+
+    if ( length == SQL_NULL_DATA )
+      return 0;
+
+    switch(p->cTypeID)
+    { case SQL_C_SLONG:
+	n->i = *(SQLINTEGER*)value;
+	return (n->kind = NUM_INT);
+      case SQL_C_SBIGINT:
+	n->i = *(SQLBIGINT*)value;
+	return (n->kind = NUM_INT);
+      case SQL_C_DOUBLE:
+	n->f = *(SQLDOUBLE*)value;
+	return (n->kind = NUM_FLOAT);
+    }
+  }
+
+  if ( !pl_put_column(c, column, st->tmp) )
+    return -1;
+  if ( is_sql_null(st->tmp, c->null) )
+    return 0;
+  if ( PL_is_integer(st->tmp) && PL_get_int64(st->tmp, &n->i) )
+    return (n->kind = NUM_INT);
+  if ( PL_is_float(st->tmp) && PL_get_float(st->tmp, &n->f) )
+    return (n->kind = NUM_FLOAT);
+
+  return NUM_TERM;
+}
+
+
+/* add_term() adds t to the Prolog part of the sum using is/2 */
+
+static int
+add_term(aggr_state *st, term_t t)
+{ static predicate_t pred = 0;
+  term_t av;
+
+  if ( !st->has_term )
+  { st->has_term = TRUE;
+    return PL_put_term(st->term, t);
+  }
+
+  if ( !pred )
+    pred = PL_predicate("is", 2, "system");
+
+  return ( (av = PL_new_term_refs(2)) &&
+	   PL_cons_functor(av+1, FUNCTOR_plus2, st->term, t) &&
+	   PL_call_predicate(NULL, PL_Q_PASS_EXCEPTION, pred, av) &&
+	   PL_put_term(st->term, av+0) );
+}
+
+
+static int
+add_sum(aggr_state *st, int kind, const aggr_num *n)
+{ switch(kind)
+  { case NUM_INT:
+      if ( (n->i > 0 && st->isum > INT64_MAX - n->i) ||
+	   (n->i < 0 && st->isum < INT64_MIN - n->i) )
+      { term_t t = PL_new_term_ref();	/* overflow: move to Prolog */
+
+	if ( !PL_put_int64(t, st->isum) || !add_term(st, t) )
+	  return FALSE;
+	st->isum = n->i;
+      } else
+      { st->isum += n->i;
+      }
+      return TRUE;
+    case NUM_FLOAT:
+      st->fsum += n->f;
+      st->floats = TRUE;
+      return TRUE;
+    default:
+      return add_term(st, st->tmp);
+  }
+}
+
+
+static int
+add_best(aggr_state *st, int op, int kind, const aggr_num *n)
+{ term_t t;
+  int cmp;
+
+  if ( st->best.kind == NUM_NONE )
+  { if ( kind == NUM_TERM )
+    { st->best.kind = NUM_TERM;
+      return PL_put_term(st->term, st->tmp);
+    }
+    st->best = *n;
+    return TRUE;
+  }
+
+  if ( kind != NUM_TERM && st->best.kind != NUM_TERM )
+  { cmp = compare_num(n, &st->best);
+    if ( op == AGGR_MAX ? cmp > 0 : cmp < 0 )
+      st->best = *n;
+    return TRUE;
+  }
+
+  if ( st->best.kind != NUM_TERM )	/* move best to Prolog */
+  { if ( !put_num(st->term, &st->best) )
+      return FALSE;
+    st->best.kind = NUM_TERM;
+  }
+  if ( kind == NUM_TERM )
+    t = st->tmp;
+  else if ( !(t = PL_new_term_ref()) || !put_num(t, n) )
+    return FALSE;
+
+  cmp = PL_compare(t, st->term);
+  if ( op == AGGR_MAX ? cmp > 0 : cmp < 0 )
+    return PL_put_term(st->term, t);
+
+  return TRUE;
+}
+
+
+static int
+aggregate_row(context *c, aggr_state *st)
+{ aggregate *ag = c->aggregate;
+  aggr_num n;
+  fid_t fid;
+  int kind, rc;
+
+  switch(ag->op)
+  { case AGGR_COUNT:
+      st->count++;
+      return TRUE;
+    case AGGR_BAG:
+    case AGGR_SET:
+      return ( PL_unify_list(st->tail, st->head, st->tail) &&
+	       pl_put_column(c, ag->column, st->tmp) &&
+	       PL_unify(st->head, st->tmp) );
+  }
+
+  if ( !(fid = PL_open_foreign_frame()) )
+    return FALSE;
+  switch((kind = get_aggregate_value(c, st, ag->column, &n)))
+  { case 0:				/* NULL */
+      PL_discard_foreign_frame(fid);
+      return TRUE;
+    case -1:
+      PL_close_foreign_frame(fid);
+      return FALSE;
+  }
+  if ( ag->op == AGGR_SUM )
+    rc = add_sum(st, kind, &n);
+  else
+    rc = add_best(st, ag->op, kind, &n);
+					/* keep data referenced by st->term */
+  if ( rc && kind != NUM_TERM && !st->has_term && st->best.kind != NUM_TERM )
+    PL_discard_foreign_frame(fid);
+  else
+    PL_close_foreign_frame(fid);
+
+  return rc;
+}
+
+
+static int
+unify_aggregate(context *c, aggr_state *st, term_t result)
+{ switch(c->aggregate->op)
+  { case AGGR_COUNT:
+      return PL_unify_int64(result, st->count);
+    case AGGR_SUM:
+    { term_t t;
+
+      if ( !st->has_term )
+      { if ( st->floats )
+	  return PL_unify_float(result, (double)st->isum + st->fsum);
+	return PL_unify_int64(result, st->isum);
+      }
+      if ( !(t = PL_new_term_ref()) ||
+	   !PL_put_int64(t, st->isum) ||
+	   !add_term(st, t) )
+	return FALSE;
+      if ( st->floats &&
+	   ( !PL_put_float(t, st->fsum) || !add_term(st, t) ) )
+	return FALSE;
+      return PL_unify(result, st->term);
+    }
+    case AGGR_MIN:
+    case AGGR_MAX:
+      if ( st->best.kind == NUM_NONE )
+	return FALSE;			/* as aggregate_all/3 */
+      if ( st->best.kind != NUM_TERM && !put_num(st->term, &st->best) )
+	return FALSE;
+      return PL_unify(result, st->term);
+    case AGGR_BAG:
+      return PL_unify_nil(st->tail);
+    case AGGR_SET:
+    { static predicate_t pred = 0;
+      term_t av;
+
+      if ( !pred )
+	pred = PL_predicate("sort", 2, "system");
+      return ( PL_unify_nil(st->tail) &&
+	       (av = PL_new_term_refs(2)) &&
+	       PL_put_term(av+0, st->list) &&
+	       PL_call_predicate(NULL, PL_Q_PASS_EXCEPTION, pred, av) &&
+	       PL_unify(result, av+1) );
+    }
+    default:
+      assert(0);
+      return FALSE;
+  }
+}
+
+
+/* aggregate_rows() is the aggregate counterpart of the findall loop in
+   odbc_row().  It fetches all rows and closes the statement.
+*/
+
+static int
+aggregate_rows(context *ctxt, term_t result)
+{ aggregate *ag = ctxt->aggregate;
+  aggr_state st;
+  unsigned int n = 0;
+
+  memset(&st, 0, sizeof(st));
+  if ( !(st.term = PL_new_term_ref()) ||
+       !(st.head = PL_new_term_ref()) ||
+       !(st.tmp  = PL_new_term_ref()) )
+    goto error;
+  if ( ag->op == AGGR_BAG )
+    st.list = result;
+  else if ( !(st.list = PL_new_term_ref()) )
+    goto error;
+  st.tail = PL_copy_term_ref(st.list);
+
+  for(;;)
+  { if ( (++n % SIGNAL_CHECK_ROWS) == 0 && PL_handle_signals() < 0 )
+      goto error;
+
+    clear_row_values(ctxt);
+    switch(fetch_row(ctxt))
+    { case FALSE:
+      { int rc = unify_aggregate(ctxt, &st, result);
+
+	close_context(ctxt);		/* may free ctxt->aggregate */
+	return rc;
+      }
+      case TRUE:
+	break;
+      default:
+	goto error;
+    }
+
+    if ( ag->filter )
+    { int rc = row_filter_matches(ctxt, ag->filter, TRUE);
+
+      if ( rc < 0 )
+	goto error;
+      if ( !rc )
+	continue;
+    }
+
+    if ( !aggregate_row(ctxt, &st) )
+      goto error;
+  }
+
+error:
+  close_context(ctxt);
+  return FALSE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The timeout(Seconds) option is  passed   to  the  driver as
+SQL_ATTR_QUERY_TIMEOUT, which bounds  the  time   waiting  for  the
+server.  As drivers generally do not apply it to fetching the rows, the
+fetch loops also check a deadline that is set when the statement is
+executed.  Both raise time_limit_exceeded, as call_with_time_limit/2.
+CTX_TIMEOUT tells release_stmt_handle() to reset the attribute.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static void
+set_query_timeout(context *ctxt, double seconds)
+{ SQLULEN secs = (SQLULEN)ceil(seconds);
+
+  ctxt->timeout = seconds;
+  if ( secs == 0 && isoff(ctxt, CTX_TIMEOUT) )
+    return;
+					/* unsupported: only our deadline */
+  if ( SQLSetStmtAttr(ctxt->hstmt, SQL_ATTR_QUERY_TIMEOUT,
+		      (SQLPOINTER)secs, 0) != SQL_ERROR )
+  { if ( secs )
+      set(ctxt, CTX_TIMEOUT);
+    else
+      clear(ctxt, CTX_TIMEOUT);
+  }
+}
+
+
+/* set_max_rows() asks the server to stop after max_rows, or one more
+   row if we must raise an error when the limit is exceeded.  If the
+   driver does not support SQL_ATTR_MAX_ROWS, only fetch_row() enforces
+   the limit.  CTX_MAX_ROWS tells release_stmt_handle() to reset the
+   attribute before the handle is reused.
+*/
+
+static void
+set_max_rows(context *ctxt)
+{ SQLULEN rows = ctxt->max_rows;
+
+  if ( isoff(ctxt, CTX_TRUNCATE) )
+    rows++;
+  if ( SQLSetStmtAttr(ctxt->hstmt, SQL_ATTR_MAX_ROWS,
+		      (SQLPOINTER)rows, 0) != SQL_ERROR )
+    set(ctxt, CTX_MAX_ROWS);
+}
+
+
+static void
+start_deadline(context *ctxt)
+{ ctxt->deadline = ( ctxt->timeout > 0.0 ? odbc_time()+ctxt->timeout : 0.0 );
+}
+
+
+static int
+deadline_exceeded(context *ctxt)
+{ if ( ctxt->deadline > 0.0 && odbc_time() > ctxt->deadline )
+  { term_t ex;
+
+    if ( (ex=PL_new_term_ref()) &&
+	 PL_put_atom(ex, ATOM_time_limit_exceeded) )
+      PL_raise_exception(ex);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+static int
+sql_fetch(context *ctxt)
+{ ctxt->rc = SQLFetch(ctxt->hstmt);
+
+  switch(ctxt->rc)
+  { case SQL_SUCCESS:
+      return TRUE;
+    case SQL_NO_DATA_FOUND:
+      return FALSE;
+    default:
+      return report_status(ctxt) ? TRUE : -1;
+  }
+}
+
+
+/* check_row_limits() accounts a fetched row for max_rows(N) and
+   max_bytes(N).  Data of columns that are read using SQLGetData() is
+   added by get_column_data(), so it counts for the next row.  Returns
+   FALSE to truncate the result and -1 after raising an exception.
+*/
+
+static int
+check_row_limits(context *ctxt)
+{ const char *limit = NULL;
+
+  if ( ctxt->max_rows && ++ctxt->rows_counted > ctxt->max_rows )
+  { limit = "max_rows";
+  } else if ( ctxt->max_bytes )
+  { parameter *p;
+    int i;
+
+    for(i=0, p=ctxt->result; i<ctxt->NumCols; i++, p++)
+    { if ( p->ptr_value )
+      { SQLLEN len = column_length(ctxt, p);
+
+	if ( len > 0 )
+	  ctxt->bytes_counted += len;
+      }
+    }
+    if ( ctxt->bytes_counted > ctxt->max_bytes )
+      limit = "max_bytes";
+  }
+
+  if ( !limit )
+    return TRUE;
+  if ( ison(ctxt, CTX_TRUNCATE) )
+    return FALSE;
+  resource_error(limit);
+  return -1;
+}
+
+
+/* fetch_row() makes the next row of the result set available to
+   pl_put_column().  It returns TRUE if there is a row, FALSE at the
+   end of the result set and -1 on an error, leaving an exception.
+*/
+
+static int
+fetch_row(context *ctxt)
+{ if ( ctxt->streams )
+    invalidate_column_streams(ctxt);
+
+  if ( !ctxt->rowset )
+  { int rc;
+
+    if ( deadline_exceeded(ctxt) )
+      return -1;
+    if ( (rc=sql_fetch(ctxt)) == TRUE )
+    { ctxt->stmt_statistics.rows++;
+      if ( ctxt->max_rows || ctxt->max_bytes )
+	rc = check_row_limits(ctxt);
+    }
+    return rc;
+  }
+
+  for(;;)
+  { if ( ++ctxt->row >= ctxt->rows_fetched )
+    { int rc;
+
+      ctxt->row = 0;
+      ctxt->rows_fetched = 0;
+      if ( deadline_exceeded(ctxt) )
+	return -1;
+      if ( (rc=sql_fetch(ctxt)) != TRUE )
+	return rc;
+      if ( ctxt->rows_fetched == 0 )
+	return FALSE;
+    }
+
+    switch(ctxt->row_status[ctxt->row])
+    { case SQL_ROW_NOROW:
+	continue;
+      case SQL_ROW_ERROR:
+	row_error(ctxt);
+	return -1;
+      default:
+	ctxt->stmt_statistics.rows++;
+	if ( ctxt->max_rows || ctxt->max_bytes )
+	  return check_row_limits(ctxt);
+	return TRUE;
+    }
+  }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Clones of a prepared statement that are created by odbc_execute/3 if the
+statement is in use are kept in the chain `clones` of the statement (up
+to MAX_CLONES).  Such clones are persistent and are marked CTX_INUSE
+while running.  If the statement is freed, idle clones are freed with it
+and running clones are detached, so they are freed when done.  The
+chains are protected by LOCK().
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static void
+unlink_clone(context *ctxt)
+{ context *parent;
+
+  LOCK();
+  if ( (parent = ctxt->parent) )
+  { context **cp;
+
+    for(cp = &parent->clones; *cp; cp = &(*cp)->next_clone)
+    { if ( *cp == ctxt )
+      { *cp = ctxt->next_clone;
+	break;
+      }
+    }
+    ctxt->parent = NULL;
+    ctxt->next_clone = NULL;
+  }
+  UNLOCK();
+}
+
+
+static void
+free_clones(context *ctxt)
+{ context *c, *next, *idle = NULL;
+
+  LOCK();
+  c = ctxt->clones;
+  ctxt->clones = NULL;
+  for(; c; c=next)
+  { next = c->next_clone;
+    c->parent = NULL;
+    c->next_clone = NULL;
+
+    if ( ison(c, CTX_INUSE) )
+    { clear(c, CTX_PERSISTENT);		/* freed by close_context() */
+    } else
+    { c->next_clone = idle;
+      idle = c;
+    }
+  }
+  UNLOCK();
+
+  for(c=idle; c; c=next)
+  { next = c->next_clone;
+    c->next_clone = NULL;
+    free_context(c);
+  }
+}
+
+
+static void
+free_context(context *ctx)
+{ if ( ctx->magic != CTX_MAGIC )
+  { if ( ctx->magic == CTX_FREEMAGIC )
+      Sdprintf("ODBC: Trying to free context twice: %p\n", ctx);
+    else
+      Sdprintf("ODBC: Trying to free non-context: %p\n", ctx);
+
+    return;
+  }
+
+  ctx->magic = CTX_FREEMAGIC;
+
+  if ( ctx->streams )
+    invalidate_column_streams(ctx);
+  if ( ctx->symbol || ison(ctx, CTX_LISTED) )
+    unlink_statement(ctx);
+  if ( ctx->parent )
+    unlink_clone(ctx);
+  if ( ctx->clones )
+    free_clones(ctx);
+
+  if ( ctx->hstmt && !release_stmt_handle(ctx) )
+  { ctx->rc = SQLFreeStmt(ctx->hstmt, SQL_DROP);
+    if ( ctx->rc == SQL_ERROR )
+      report_status(ctx);
+  }
+
+  free_rowset(ctx);
+  free_parameters(ctx->NumCols,   ctx->result);
+  free_parameters(ctx->NumParams, ctx->params);
+  if ( ison(ctx, CTX_SQLMALLOCED) )
+    PL_free(ctx->sqltext.a);
+  if ( ison(ctx, CTX_OWNNULL) )
+    free_nulldef(ctx->null);
+  if ( ctx->findall )
+    free_findall(ctx->findall);
+  if ( ctx->dict )
+    free_dict_layout(ctx->dict);
+  if ( ctx->filter )
+    free_row_filter(ctx->filter);
+  if ( ctx->aggregate )
+    free_aggregate(ctx->aggregate);
+  free_context_struct(ctx);
+
+  statistics.statements_freed++;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+clone_context()
+
+Create a clone of a context, so we   can have the same statement running
+multiple times. Is there really no better   way  to handle this? Can't I
+have multiple cursors on one statement?
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static context *
+clone_context(context *in)
+{ context *new;
+  size_t bytes = (in->sqllen+1)*in->char_width;
+
+  if ( !(new = new_context(in->connection)) )
+    return NULL;
+  if ( in->timeout != new->timeout )
+    set_query_timeout(new, in->timeout);
+  new->decimal = in->decimal;
+  new->max_rows = in->max_rows;
+  new->max_bytes = in->max_bytes;
+  set(new, in->flags & CTX_TRUNCATE);
+  if ( new->max_rows )
+    set_max_rows(new);
+					/* Copy SQL statement */
+  if ( !(new->sqltext.a = PL_malloc(bytes)) )
+    return NULL;
+  new->sqllen = in->sqllen;
+  new->char_width = in->char_width;
+  memcpy(new->sqltext.a, in->sqltext.a, bytes);
+  set(new, CTX_SQLMALLOCED);
+
+					/* Prepare the statement */
+  if ( new->char_width == 1 )
+  { TRY(new,
+	SQLPrepareA(new->hstmt, new->sqltext.a, new->sqllen),
+	close_context(new));
+  } else
+  { TRY(new,
+	SQLPrepareW(new->hstmt, new->sqltext.w, new->sqllen),
+	close_context(new));
+  }
+
+					/* Copy parameter declarations */
+  if ( (new->NumParams = in->NumParams) > 0 )
+  { int pn;
+    parameter *p;
+
+    if ( !(new->params = odbc_malloc(sizeof(parameter)*new->NumParams)) )
+      return NULL;
+    memcpy(new->params, in->params, sizeof(parameter)*new->NumParams);
+
+    for(p=new->params, pn=1; pn<=new->NumParams; pn++, p++)
+    { SQLLEN *vlenptr = NULL;
+
+      switch(p->cTypeID)
+      { case SQL_C_CHAR:
+	case SQL_C_WCHAR:
+	case SQL_C_BINARY:
+	  /* if p->length_ind == 0 then we are using SQLPutData
+	     and must not overwrite the index stored in ptr_value with
+	     a buffer of 0 length!
+	  */
+	  if ( p->length_ind != 0 && !(p->ptr_value = odbc_malloc(p->length_ind+1)) )
+	    return NULL;
+	  vlenptr = &p->len_value;
+	  break;
+	case SQL_C_DATE:
+	case SQL_C_TYPE_DATE:
+	case SQL_C_TIME:
+	case SQL_C_TYPE_TIME:
+	case SQL_C_TIMESTAMP:
+	  if ( !(p->ptr_value = odbc_malloc(p->len_value)) )
+	    return NULL;
+	  break;
+	case SQL_C_SLONG:
+	case SQL_C_SBIGINT:
+	case SQL_C_DOUBLE:
+	  p->ptr_value = (SQLPOINTER)p->buf;
+	  break;
+      }
+
+      TRY(new, SQLBindParameter(new->hstmt,		/* hstmt */
+				(SWORD)pn,			/* ipar */
+				SQL_PARAM_INPUT,	/* fParamType */
+				p->cTypeID,		/* fCType */
+				p->sqlTypeID,		/* fSqlType */
+				p->length_ind,		/* cbColDef */
+				p->scale,		/* ibScale */
+				p->ptr_value,		/* rgbValue */
+				0,			/* cbValueMax */
+				vlenptr),		/* pcbValue */
+	  close_context(new));
+    }
+  }
+
+					/* Copy result columns */
+  new->db_row = in->db_row;		/* the row/N functor */
+
+  if ( in->result )
+  { new->NumCols = in->NumCols;
+    if ( !(new->result  = odbc_malloc(in->NumCols*sizeof(parameter))) )
+      return NULL;
+    memcpy(new->result, in->result, in->NumCols*sizeof(parameter));
+    if ( ison(in, CTX_STREAMS) )
+      set(new, CTX_STREAMS);
+    { parameter *p = new->result;
+      int i;
+
+      for(i = 0; i < new->NumCols; i++, p++)
+      { p->getdata.data = NULL;		/* scratch buffers are not shared */
+	p->getdata.size = 0;
+	p->getdata.peak = 0;
+	p->getdata.rows = 0;
+	p->atoms = NULL;
+      }
+    }
+
+    if ( ison(in, CTX_BOUND) )
+    { parameter *p = new->result;
+      int i;
+
+      for(i = 0; i < new->NumCols; i++, p++)
+      { p->ptr_value = NULL;		/* not shared with `in' */
+	p->ind_ptr = NULL;
+      }
+
+      new->fetch_size = in->fetch_size;
+      if ( ison(in, CTX_BIND_COLUMN) )
+	set(new, CTX_BIND_COLUMN);
+      else
+	clear(new, CTX_BIND_COLUMN);
+      if ( !(in->rowset && bind_rowset(new)) &&
+	   !bind_columns(new) )
+      { close_context(new);
+	return NULL;
+      }
+
+      set(new, CTX_BOUND);
+    }
+  }
+
+  new->null    = clone_nulldef(in->null);
+  new->findall = clone_findall(in->findall);
+  new->dict    = clone_dict_layout(in->dict);
+  new->aggregate = clone_aggregate(in->aggregate);
+  set(new, in->flags & (CTX_DICT|CTX_COLUMN_LISTS));
+
+  return new;
+}
+
+
+/* acquire_clone() returns a clone of ctxt that is marked CTX_INUSE.  An
+   idle clone from the pool is preferred, where we prefer a clone that
+   was last used by the calling thread.  Otherwise a new clone is made,
+   which is added to the pool if there is room.  CTX_INUSE of pooled
+   clones is only changed under LOCK(); close_context() releases them
+   using release_context().
+*/
+
+static context *
+acquire_clone(context *ctxt)
+{ int self = PL_thread_self();
+  context *c, *idle = NULL;
+  int count = 0;
+
+  LOCK();
+  for(c=ctxt->clones; c; c=c->next_clone)
+  { count++;
+    if ( isoff(c, CTX_INUSE) && (!idle || c->thread == self) )
+      idle = c;
+  }
+  if ( idle )
+  { set(idle, CTX_INUSE);
+    idle->thread = self;
+    UNLOCK();
+    DEBUG(2, Sdprintf("Re-using clone %p of %p\n", idle, ctxt));
+    return idle;
+  }
+  UNLOCK();
+
+  if ( !(c = clone_context(ctxt)) )
+    return NULL;
+  set(c, CTX_INUSE);
+  c->thread = self;
+
+  LOCK();
+  if ( count < MAX_CLONES && ctxt->magic == CTX_MAGIC )
+  { set(c, CTX_PERSISTENT);
+    c->parent = ctxt;
+    c->next_clone = ctxt->clones;
+    ctxt->clones = c;
+  }
+  UNLOCK();
+
+  return c;
+}
+
+
+/* claim_statement() marks ctxt CTX_INUSE.  Fails if it is in use.  The
+   statement is released using close_context() or release_context().
+*/
+
+static int
+claim_statement(context *ctxt)
+{ int rc;
+
+  LOCK();
+  if ( (rc = isoff(ctxt, CTX_INUSE)) )
+    set(ctxt, CTX_INUSE);
+  UNLOCK();
+
+  return rc;
+}
+
+
+/* acquire_statement() marks the prepared statement ctxt CTX_INUSE and
+   returns it.  If it is already in use, a clone is returned, unless
+   the statement is fetched by hand.  Returns NULL if the statement
+   cannot be used.
+*/
+
+static context *
+acquire_statement(context *ctxt)
+{ if ( claim_statement(ctxt) )
+    return ctxt;
+  if ( ison(ctxt, CTX_NOAUTO) )
+    return NULL;
+
+  return acquire_clone(ctxt);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The string is malloced by Prolog and   this probably poses problems when
+using on Windows, where each DLL  has   its  own memory pool. SWI-Prolog
+5.0.9 introduces PL_malloc(), PL_realloc()  and   PL_free()  for foreign
+code to synchronise this problem.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+get_sql_text(context *ctxt, term_t tquery)
+{ if ( PL_is_functor(tquery, FUNCTOR_minus2) )
+  { if ( !formatted_string(ctxt, tquery) )
+      return FALSE;
+  } else
+  { size_t qlen;
+
+    if ( ctxt->connection->encoding == ENC_SQLWCHAR )
+    { wchar_t *ws;
+
+#if SIZEOF_SQLWCHAR != SIZEOF_WCHAR_T
+      if ( PL_get_wchars(tquery, &qlen, &ws, CVT_ATOM|CVT_STRING))
+      { wchar_t *es = ws+qlen;
+	SQLWCHAR *o, *q;
+
+	q = PL_malloc((qlen+1)*sizeof(SQLWCHAR));
+	for(o=q; ws<es;)
+	  *o++ = *ws++;
+	*o = 0;
+	ctxt->sqltext.w = q;
+#else
+      if ( PL_get_wchars(tquery, &qlen, &ws, CVT_ATOM|CVT_STRING|BUF_MALLOC))
+      { ctxt->sqltext.w = (SQLWCHAR *)ws;
+#endif
+	set(ctxt, CTX_SQLMALLOCED);
+	ctxt->sqllen = (SQLINTEGER)qlen;
+	ctxt->char_width = sizeof(SQLWCHAR);
+      } else
+	return type_error(tquery, "atom_or_format");
+    } else
+    { char *s;
+      int rep = ctxt->connection->rep_flag;
+
+      if ( PL_get_nchars(tquery, &qlen, &s, CVT_ATOM|CVT_STRING|BUF_MALLOC|rep))
+      { ctxt->sqltext.a = (unsigned char*)s;
+	ctxt->sqllen = (SQLINTEGER)qlen;
+	ctxt->char_width = sizeof(char);
+	set(ctxt, CTX_SQLMALLOCED);
+      } else
+	return type_error(tquery, "atom_or_format");
+    }
+  }
+
+  return TRUE;
+}
+
+
+static int
+max_qualifier_length(connection *cn)
+{ if ( isoff(cn, CTX_GOT_QLEN) )
+  { SQLUSMALLINT len;
+    SWORD plen;
+    RETCODE rc;
+
+    if ( (rc=SQLGetInfo(cn->hdbc, SQL_MAX_QUALIFIER_NAME_LEN,
+			&len, sizeof(len), &plen)) == SQL_SUCCESS )
+    { /*Sdprintf("SQL_MAX_QUALIFIER_NAME_LEN = %d\n", (int)len);*/
+      cn->max_qualifier_length = (int)len; /* 0: unknown */
+    } else
+    { odbc_report(henv, cn->hdbc, NULL, rc);
+      cn->max_qualifier_length = -1;
+    }
+
+    set(cn, CTX_GOT_QLEN);
+  }
+
+  return cn->max_qualifier_length;
+}
+
+
+static int
+prepare_result(context *ctxt)
+{ SQLSMALLINT i;
+  SQLCHAR nameBuffer[NameBufferLength];
+  SQLSMALLINT nameLength, dataType, decimalDigits, nullable;
+  SQLULEN columnSize;			/* was SQLUINTEGER */
+  parameter *ptr_result;
+  SQLSMALLINT ncol;
+  int defer_bind = ( ctxt->fetch_size > 1 && isoff(ctxt, CTX_NOAUTO) );
+  int getdata = FALSE;
+  dict_layout *dl = NULL;
+
+  SQLNumResultCols(ctxt->hstmt, &ncol);
+  if ( ncol == 0 )
+    return TRUE;			/* no results */
+
+  if ( ctxt->result )			/* specified types */
+  { if ( ncol != ctxt->NumCols )
+      return PL_warning("# columns mismatch"); /* TBD: exception */
+  } else
+  { ctxt->NumCols = ncol;
+    ctxt->db_row = PL_new_functor(ATOM_row, ctxt->NumCols);
+    if ( !(ctxt->result = odbc_malloc(sizeof(parameter)*ctxt->NumCols)) )
+      return FALSE;
+    memset(ctxt->result, 0, sizeof(parameter)*ctxt->NumCols);
+  }
+  if ( ison(ctxt, CTX_DICT) && !ctxt->dict )
+  { if ( !(dl = new_dict_layout(ctxt->NumCols)) )
+      return FALSE;
+    ctxt->dict = dl;			/* freed with ctxt on error */
+  }
+
+  ptr_result = ctxt->result;
+  for(i = 1; i <= ctxt->NumCols; i++, ptr_result++)
+  { SQLDescribeCol(ctxt->hstmt, i,
+		   nameBuffer, NameBufferLength, &nameLength,
+		   &dataType, &columnSize, &decimalDigits,
+		   &nullable);
+
+    if ( dl )
+    { if ( nameLength >= NameBufferLength )
+	nameLength = NameBufferLength-1; /* truncated */
+      dl->keys[i-1] = PL_new_atom_mbchars(ctxt->connection->rep_flag,
+					  nameLength, (char*)nameBuffer);
+    }
+
+    if ( ison(ctxt, CTX_SOURCE) )
+    { SQLLEN ival;			/* was DWORD */
+
+      ptr_result->source.column = PL_new_atom_nchars(nameLength,
+						     (char*)nameBuffer);
+      if ( (ctxt->rc=SQLColAttributes(ctxt->hstmt, i,
+				      SQL_COLUMN_TABLE_NAME,
+				      nameBuffer,
+				      NameBufferLength, &nameLength,
+				      &ival)) == SQL_SUCCESS )
+      { ptr_result->source.table = PL_new_atom_nchars(nameLength,
+						      (char*)nameBuffer);
+      } else
+      { if ( !report_status(ctxt) )		/* TBD: May close ctxt */
+	  return FALSE;
+	ptr_result->source.table = ATOM_;
+	PL_register_atom(ATOM_);
+      }
+    }
+
+    ptr_result->sqlTypeID = dataType;
+    ptr_result->cTypeID = CvtSqlToCType(ctxt, dataType, ptr_result->plTypeID);
+    if (ptr_result->cTypeID == CVNERR)
+    { free_context(ctxt);
+      return PL_warning("odbc_query/2: column type not managed");
+    }
+
+    DEBUG(1, Sdprintf("prepare_result(): column %d, "
+		      "sqlTypeID = %d (%s), cTypeID = %d (%s), "
+		      "columnSize = %zu\n",
+		      i,
+		      ptr_result->sqlTypeID, sql_type_name(ptr_result->sqlTypeID),
+		      ptr_result->cTypeID, sql_c_type_name(ptr_result->cTypeID),
+		      (size_t)columnSize));
+
+    if ( ison(ctxt, CTX_TABLES) )
+    { switch (ptr_result->sqlTypeID)
+      { case SQL_LONGVARCHAR:
+	case SQL_VARCHAR:
+	{ int qlen = max_qualifier_length(ctxt->connection);
+
+	  if ( qlen > 0 )
+	  { /*Sdprintf("Using SQL_MAX_QUALIFIER_NAME_LEN = %d\n", qlen);*/
+	    ptr_result->len_value = qlen+1; /* play safe */
+	    goto bind;
+	  } else if ( qlen < 0 )	/* error getting it */
+	    return FALSE;
+	}
+      }
+    }
+
+    if ( ptr_result->plTypeID == SQL_PL_STREAM )
+      goto use_sql_get_data;
+
+    switch (ptr_result->sqlTypeID)
+    { case SQL_LONGVARCHAR:
+      case SQL_LONGVARBINARY:
+      { if ( columnSize > ctxt->max_nogetdata || columnSize == 0 )
+	{ SQLLEN octets;
+
+	use_sql_get_data:
+	  DEBUG(2,
+		Sdprintf("Wide SQL_LONGVAR* column %d: using SQLGetData()\n", i));
+	  ptr_result->ptr_value = NULL;	/* handle using SQLGetData() */
+	  ptr_result->len_value = 0;
+	  if ( SQLColAttribute(ctxt->hstmt, i, SQL_DESC_OCTET_LENGTH,
+			       NULL, 0, NULL, &octets) == SQL_SUCCESS &&
+	       octets > 0 && octets <= GETDATA_HINT_MAX )
+	    ptr_result->getdata.hint = octets + sizeof(SQLWCHAR);
+	  getdata = TRUE;
+	  continue;
+	}
+	ptr_result->len_value = sizeof(char)*(columnSize+1);
+	goto bind;
+      }
+    }
+
+    switch (ptr_result->cTypeID)
+    { case SQL_C_CHAR:
+	if ( columnSize == 0 )
+	  goto use_sql_get_data;
+	columnSize += 2;		/* decimal dot and '-' sign */
+	/*FALLTHROUGH*/
+      case SQL_C_BINARY:
+	if ( columnSize > ctxt->max_nogetdata || columnSize == 0 )
+	  goto use_sql_get_data;
+	ptr_result->len_value = sizeof(char)*(columnSize+1)*((ctxt->connection->encoding == ENC_UTF8)?4:1);
+	break;
+      case SQL_C_WCHAR:
+	if ( columnSize > ctxt->max_nogetdata || columnSize == 0 )
+	  goto use_sql_get_data;
+	ptr_result->len_value = sizeof(wchar_t)*(columnSize+1);
+	break;
+      case SQL_C_SLONG:
+	ptr_result->len_value = sizeof(SQLINTEGER);
+	break;
+      case SQL_C_SBIGINT:
+	ptr_result->len_value = sizeof(SQLBIGINT);
+	break;
+      case SQL_C_DOUBLE:
+	ptr_result->len_value = sizeof(SQLDOUBLE);
+	break;
+      case SQL_C_TYPE_DATE:
+	ptr_result->len_value = sizeof(DATE_STRUCT);
+	break;
+      case SQL_C_TYPE_TIME:
+	ptr_result->len_value = sizeof(TIME_STRUCT);
+	break;
+      case SQL_C_TIMESTAMP:
+	ptr_result->len_value = sizeof(SQL_TIMESTAMP_STRUCT);
+	break;
+      default:
+	Sdprintf("Oops: %s:%d: cTypeID = %d\n",
+		 __FILE__, __LINE__, ptr_result->cTypeID);
+	assert(0);
+	return FALSE;			/* make compiler happy */
+    }
+
+  bind:
+    if ( !defer_bind && !bind_column(ctxt, i, ptr_result) )
+      return FALSE;
+  }
+
+  if ( dl && !order_dict_layout(ctxt) )
+    return FALSE;
+
+  if ( defer_bind )			/* SQLGetData() requires single rows */
+  { if ( getdata || !bind_rowset(ctxt) )
+      return bind_columns(ctxt);
+  }
+
+  return TRUE;
+}
+
+
+/* column_lists() implements row_format(columns), returning the result-set
+   as a list holding a list of values for each column.  The values are
+   added to the open tail of their column list as the rows are fetched.
+*/
+
+static int
+column_lists(context *ctxt, term_t result)
+{ int ncols = ctxt->NumCols;
+  term_t lists = PL_new_term_refs(ncols);
+  term_t tails = PL_new_term_refs(ncols);
+  term_t head  = PL_new_term_ref();
+  term_t tmp   = PL_new_term_ref();
+  term_t all   = PL_new_term_ref();
+  unsigned int n = 0;
+  int i;
+
+  for(i=0; i<ncols; i++)
+    PL_put_term(tails+i, lists+i);
+
+  for(;;)
+  { if ( (++n % SIGNAL_CHECK_ROWS) == 0 && PL_handle_signals() < 0 )
+      goto error;
+
+    switch(fetch_row(ctxt))
+    { case FALSE:
+	close_context(ctxt);
+	PL_put_nil(all);
+	for(i=ncols-1; i>=0; i--)
+	{ if ( !PL_unify_nil(tails+i) ||
+	       !PL_cons_list(all, lists+i, all) )
+	    return FALSE;
+	}
+	return PL_unify(result, all);
+      case TRUE:
+	break;
+      default:
+	goto error;
+    }
+
+    for(i=0; i<ncols; i++)
+    { if ( !PL_unify_list(tails+i, head, tails+i) ||
+	   !pl_put_column(ctxt, i, tmp) ||
+	   !PL_unify(head, tmp) )
+	goto error;
+    }
+  }
+
+error:
+  close_context(ctxt);
+  return FALSE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+odbc_row()  is  the  final  call  from  the  various  query  predicates,
+returning a result row or, in case  of findall, the whole result-set. It
+must call close_context() if we are  done   with  the  context due to an
+error or the last result.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static foreign_t
+odbc_row(context *ctxt, term_t trow)
+{ term_t local_trow;
+  fid_t fid;
+  unsigned int skipped = 0;
+
+  if ( !ison(ctxt, CTX_BOUND) )
+  { if ( !prepare_result(ctxt) )
+    { close_context(ctxt);
+      return FALSE;
+    }
+    set(ctxt, CTX_BOUND);
+  }
+
+  if ( !ctxt->result )			/* not a SELECT statement */
+  { SQLLEN rows = 0;			/* was DWORD */
+    int rval;
+
+    if ( ctxt->rc != SQL_NO_DATA_FOUND )
+      ctxt->rc = SQLRowCount(ctxt->hstmt, &rows);
+    if ( ctxt->rc == SQL_SUCCESS ||
+	 ctxt->rc == SQL_SUCCESS_WITH_INFO ||
+	 ctxt->rc == SQL_NO_DATA_FOUND )
+      rval = PL_unify_term(trow,
+			   PL_FUNCTOR, FUNCTOR_affected1,
+			     PL_LONG, (long)rows);
+    else
+      rval = TRUE;
+
+    close_context(ctxt);
+
+    return rval;
+  }
+
+  if ( ctxt->rc == SQL_NO_DATA_FOUND )
+  { close_context(ctxt);
+    return FALSE;
+  }
+
+  if ( !mark_fetching(ctxt) )		/* close_context() unmarks */
+  { close_context(ctxt);
+    return FALSE;
+  }
+
+  if ( ctxt->findall )			/* findall: return the whole set */
+  { term_t tail = PL_copy_term_ref(trow);
+    term_t head = PL_new_term_ref();
+    term_t tmp  = PL_new_term_ref();
+    unsigned int n = 0;
+
+    for(;;)
+    { if ( (++n % SIGNAL_CHECK_ROWS) == 0 && PL_handle_signals() < 0 )
+      { close_context(ctxt);
+	return FALSE;
+      }
+
+      clear_row_values(ctxt);
+      switch(fetch_row(ctxt))
+      { case FALSE:
+	  close_context(ctxt);
+	  return PL_unify_nil(tail);
+	case TRUE:
+	  break;
+	default:
+	  close_context(ctxt);
+	  return FALSE;
+      }
+
+      if ( ctxt->findall->filter )
+      { int rc = row_filter_matches(ctxt, ctxt->findall->filter, TRUE);
+
+	if ( rc < 0 )
+	{ close_context(ctxt);
+	  return FALSE;
+	}
+	if ( !rc )
+	  continue;
+      }
+
+      if ( !PL_unify_list(tail, head, tail) ||
+	   !put_findall(ctxt, tmp) ||
+	   !PL_unify(head, tmp) )
+      { close_context(ctxt);
+	return FALSE;
+      }
+    }
+  }
+
+  if ( ctxt->aggregate )		/* aggregate: return a single value */
+    return aggregate_rows(ctxt, trow);
+  if ( ison(ctxt, CTX_COLUMN_LISTS) )	/* row_format(columns) */
+    return column_lists(ctxt, trow);
+
+  if ( !ctxt->filter && !ctxt->dict && PL_is_functor(trow, ctxt->db_row) &&
+       !compile_row_filter(trow, &ctxt->filter) )
+  { close_context(ctxt);
+    return FALSE;
+  }
+
+  local_trow = PL_new_term_ref();
+  fid = PL_open_foreign_frame();
+
+  for(;;)				/* normal non-deterministic access */
+  { if ( ison(ctxt, CTX_PREFETCHED) )
+    { clear(ctxt, CTX_PREFETCHED);
+    } else if ( fetch_row(ctxt) != TRUE )
+    { close_context(ctxt);
+      return FALSE;			/* end or pending exception */
+    }
+
+    if ( ctxt->filter && !row_filter_matches(ctxt, ctxt->filter, FALSE) )
+    { if ( (++skipped % SIGNAL_CHECK_ROWS) == 0 && PL_handle_signals() < 0 )
+      { close_context(ctxt);
+	return FALSE;
+      }
+      continue;				/* cannot unify */
+    }
+
+    if ( !pl_put_row(local_trow, ctxt) )
+    { close_context(ctxt);
+      return FALSE;			/* with pending exception */
+    }
+
+    if ( !PL_unify(trow, local_trow) )
+    { PL_rewind_foreign_frame(fid);
+      if ( PL_handle_signals() < 0 )
+      { close_context(ctxt);
+	return FALSE;
+      }
+      continue;
+    }
+
+					/* success! */
+    if ( ison(ctxt, CTX_STREAMS) )	/* pre-fetch invalidates the streams */
+    { unmark_fetching(ctxt);
+      PL_retry_address(ctxt);
+    }
+					/* pre-fetch to get determinism */
+    for(;;)
+    { switch(fetch_row(ctxt))
+      { case FALSE:			/* no alternative */
+	  close_context(ctxt);
+	  return TRUE;
+	case TRUE:
+	  if ( ctxt->filter && !row_filter_matches(ctxt, ctxt->filter, FALSE) )
+	  { if ( (++skipped % SIGNAL_CHECK_ROWS) == 0 &&
+		 PL_handle_signals() < 0 )
+	    { close_context(ctxt);
+	      return FALSE;
+	    }
+	    continue;
+	  }
+	  set(ctxt, CTX_PREFETCHED);
+	  unmark_fetching(ctxt);
+	  PL_retry_address(ctxt);
+	default:
+	  close_context(ctxt);
+	  return FALSE;
+      }
+    }
+  }
+}
+
+
+static int
+set_column_types(context *ctxt, term_t option)
+{ term_t tail = PL_new_term_ref();
+  term_t head = PL_new_term_ref();
+  parameter *p;
+  int ntypes;
+
+  if ( !PL_get_arg(1, option, tail) ||
+       (ntypes = list_length(tail)) < 0 )
+    return FALSE;			/* not a proper list */
+
+  ctxt->NumCols = ntypes;
+  ctxt->db_row = PL_new_functor(ATOM_row, ctxt->NumCols);
+  if ( !(ctxt->result = odbc_malloc(sizeof(parameter)*ctxt->NumCols)) )
+    return FALSE;
+  memset(ctxt->result, 0, sizeof(parameter)*ctxt->NumCols);
+
+  for(p = ctxt->result; PL_get_list(tail, head, tail); p++)
+  { if ( !get_pltype(head, &p->plTypeID) )
+      return FALSE;
+    if ( p->plTypeID == SQL_PL_STREAM )
+      set(ctxt, CTX_STREAMS);
+  }
+  if ( !PL_get_nil(tail) )
+    return type_error(tail, "list");
+
+  return TRUE;
+}
+
+
+static int
+set_statement_options(context *ctxt, term_t options)
+{ /* Options are scanned by hand rather than through PL_scan_options()
+     because findall(Template, Row) is an arity-2 option that the generic
+     option scanner cannot express.  As a consequence these options are
+     not available as a dict.
+  */
+  if ( !PL_get_nil(options) )
+  { term_t tail = PL_copy_term_ref(options);
+    term_t head = PL_new_term_ref();
+
+    while(PL_get_list(tail, head, tail))
+    { if ( PL_is_functor(head, FUNCTOR_types1) )
+      { if ( !set_column_types(ctxt, head) )
+	  return FALSE;
+      } else if ( PL_is_functor(head, FUNCTOR_null1) )
+      { term_t arg = PL_new_term_ref();
+
+	_PL_get_arg(1, head, arg);
+	ctxt->null = nulldef_spec(arg);
+	set(ctxt, CTX_OWNNULL);
+      } else if ( PL_is_functor(head, FUNCTOR_source1) )
+      { int val;
+
+	if ( !get_bool_arg_ex(1, head, &val) )
+	  return FALSE;
+
+	if ( val )
+	  set(ctxt, CTX_SOURCE);
+      } else if ( PL_is_functor(head, FUNCTOR_findall2) )
+      { if ( !(ctxt->findall = compile_findall(head, ctxt->flags)) )
+	  return FALSE;
+      } else if ( PL_is_functor(head, FUNCTOR_aggregate2) )
+      { if ( !(ctxt->aggregate = compile_aggregate(head)) )
+	  return FALSE;
+      } else if ( PL_is_functor(head, FUNCTOR_row_format1) )
+      { atom_t a;
+
+	if ( !get_atom_arg_ex(1, head, &a) )
+	  return FALSE;
+	clear(ctxt, CTX_DICT|CTX_COLUMN_LISTS);
+	if ( a == ATOM_dict )
+	  set(ctxt, CTX_DICT);
+	else if ( a == ATOM_columns )
+	  set(ctxt, CTX_COLUMN_LISTS);
+	else if ( a != ATOM_row )
+	{ term_t a = PL_new_term_ref();
+	  _PL_get_arg(1, head, a);
+	  return domain_error(a, "row_format");
+	}
+      } else if ( PL_is_functor(head, FUNCTOR_fetch1) )
+      { atom_t a;
+
+	if ( !get_atom_arg_ex(1, head, &a) )
+	  return FALSE;
+	if ( a == ATOM_auto )
+	  clear(ctxt, CTX_NOAUTO);
+	else if ( a == ATOM_fetch )
+	  set(ctxt, CTX_NOAUTO);
+	else
+	{ term_t a = PL_new_term_ref();
+	  _PL_get_arg(1, head, a);
+	  return domain_error(a, "fetch");
+	}
+      } else if ( PL_is_functor(head, FUNCTOR_wide_column_threshold1) )
+      { int val;
+
+	if ( !get_int_arg_ex(1, head, &val) )
+	  return FALSE;
+
+	ctxt->max_nogetdata = val;
+      } else if ( PL_is_functor(head, FUNCTOR_fetch_size1) )
+      { int val;
+
+	if ( !get_int_arg_ex(1, head, &val) )
+	  return FALSE;
+	if ( val < 1 )
+	  return domain_error(head, "fetch_size");
+
+	ctxt->fetch_size = val;
+      } else if ( PL_is_functor(head, FUNCTOR_decimal1) )
+      { int mode;
+
+	if ( !get_decimal_mode_arg_ex(1, head, &mode) )
+	  return FALSE;
+	ctxt->decimal = mode;
+      } else if ( PL_is_functor(head, FUNCTOR_binding1) )
+      { int by_column;
+
+	if ( !get_binding_arg_ex(1, head, &by_column) )
+	  return FALSE;
+	if ( by_column )
+	  set(ctxt, CTX_BIND_COLUMN);
+	else
+	  clear(ctxt, CTX_BIND_COLUMN);
+      } else if ( PL_is_functor(head, FUNCTOR_timeout1) )
+      { double secs;
+
+	if ( !get_timeout_arg_ex(1, head, &secs) )
+	  return FALSE;
+	set_query_timeout(ctxt, secs < 0.0 ? 0.0 : secs);
+      } else if ( PL_is_functor(head, FUNCTOR_max_rows1) ||
+		  PL_is_functor(head, FUNCTOR_max_bytes1) )
+      { term_t a = PL_new_term_ref();
+	int64_t val;
+
+	_PL_get_arg(1, head, a);
+	if ( !PL_get_int64_ex(a, &val) )
+	  return FALSE;
+	if ( val < 0 )
+	  return domain_error(head, "not_less_than_zero");
+	if ( PL_is_functor(head, FUNCTOR_max_rows1) )
+	  ctxt->max_rows = (SQLULEN)val;
+	else
+	  ctxt->max_bytes = val;
+      } else if ( PL_is_functor(head, FUNCTOR_on_limit1) )
+      { atom_t a;
+
+	if ( !get_atom_arg_ex(1, head, &a) )
+	  return FALSE;
+	if ( a == ATOM_truncate )
+	  set(ctxt, CTX_TRUNCATE);
+	else if ( a == ATOM_error )
+	  clear(ctxt, CTX_TRUNCATE);
+	else
+	{ term_t a = PL_new_term_ref();
+	  _PL_get_arg(1, head, a);
+	  return domain_error(a, "on_limit");
+	}
+      } else
+	return domain_error(head, "odbc_option");
+    }
+    if ( !PL_get_nil(tail) )
+      return type_error(tail, "list");
+    if ( ctxt->max_rows )
+      set_max_rows(ctxt);
+    if ( ctxt->findall && ison(ctxt, CTX_STREAMS) )
+      return permission_error("findall", "stream_column", options);
+    if ( ctxt->findall && ison(ctxt, CTX_DICT) )
+      return permission_error("findall", "dict_row", options);
+    if ( ctxt->aggregate && ctxt->findall )
+      return permission_error("aggregate", "findall", options);
+    if ( ctxt->aggregate && ison(ctxt, CTX_STREAMS) )
+      return permission_error("aggregate", "stream_column", options);
+    if ( ison(ctxt, CTX_COLUMN_LISTS) )
+    { if ( ctxt->findall )
+	return permission_error("findall", "column_lists", options);
+      if ( ctxt->aggregate )
+	return permission_error("aggregate", "column_lists", options);
+      if ( ison(ctxt, CTX_STREAMS) )
+	return permission_error("column_lists", "stream_column", options);
+    }
+  }
+
+  return TRUE;
+}
+
+
+/* This is not thread-safe: You must hold the lock when entering! */
+static int
+mark_context_as_executing(int self, context* ctxt)
+{ if ( self >= executing_context_size )
+  { int old_size = executing_context_size;
+    int i;
+
+    executing_context_size = 16;
+    while (self >= executing_context_size)
+      executing_context_size <<= 1;
+
+    if ( executing_contexts == NULL )
+    { executing_contexts = odbc_malloc(executing_context_size * sizeof(context*));
+      if ( executing_contexts == NULL )
+	return FALSE;
+    } else
+    { context** tmp = odbc_realloc(executing_contexts,
+				   executing_context_size * sizeof(context*));
+      if ( tmp == NULL )
+	return FALSE;
+      executing_contexts = tmp;
+    }
+    for (i = old_size; i < executing_context_size; i++)
+      executing_contexts[i] = NULL;
+  }
+
+  if ( self >= 0 )
+    executing_contexts[self] = ctxt;
+  set(ctxt, CTX_EXECUTING);
+
+  return TRUE;
+}
+
+
+/* mark_fetching() and unmark_fetching() register ctxt as the statement
+   of the calling thread while we are fetching its rows, such that
+   odbc_cancel_thread/1 can also cancel SQLFetch() and SQLGetData().
+*/
+
+static int
+mark_fetching(context *ctxt)
+{ int rc;
+
+  LOCK_CONTEXTS();
+  rc = mark_context_as_executing(PL_thread_self(), ctxt);
+  UNLOCK_CONTEXTS();
+
+  return rc;
+}
+
+
+static void
+unmark_fetching(context *ctxt)
+{ int self = PL_thread_self();
+
+  LOCK_CONTEXTS();
+  clear(ctxt, CTX_EXECUTING);
+  if ( self >= 0 && self < executing_context_size &&
+       executing_contexts[self] == ctxt )
+    executing_contexts[self] = NULL;
+  UNLOCK_CONTEXTS();
+}
+
+		 /*******************************
+		 *	  STATEMENT CACHE	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+If the connection has statement_cache(Size) with Size  > 0, odbc_query/4
+keeps the statements for SQL texts that are atoms prepared. The cache is
+an LRU chain on the  connection  that  is   keyed  by  the  SQL atom and
+the options, where options  that  are  variants   (=@=)  are the same.
+An entry is created  the  first  time  a   text  is  executed.  Once the
+text has been executed statement_cache_threshold times, the statement is
+prepared using SQLPrepare() and further calls only use SQLExecute().
+The statement is persistent and thus keeps its result columns bound, so
+prepare_result() is called only once.  A cached statement copies the
+statement defaults of the connection,  so odbc_set_connection/2 flushes
+the cache if one of these changes.
+
+The chain is protected by LOCK().  A cached statement that is running is
+marked CTX_INUSE, which is set and  cleared under LOCK() as well (see
+release_context()).  Running the same query while it is in use (e.g.,
+a nested query) uses a new statement that is executed directly.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct cached_stmt
+{ atom_t	sql;			/* SQL text */
+  record_t	options;		/* statement options (0: []) */
+  unsigned int	seen;			/* # times executed */
+  context      *ctxt;			/* prepared statement */
+  struct cached_stmt *previous;		/* more recently used */
+  struct cached_stmt *next;		/* less recently used */
+} cached_stmt;
+
+
+static void
+unlink_cached_stmt(connection *cn, cached_stmt *cs)
+{ if ( cs->previous )
+    cs->previous->next = cs->next;
+  else
+    cn->stmt_cache = cs->next;
+  if ( cs->next )
+    cs->next->previous = cs->previous;
+  else
+    cn->stmt_cache_tail = cs->previous;
+
+  cs->previous = cs->next = NULL;
+  cn->stmt_cache_count--;
+}
+
+
+static void
+link_cached_stmt(connection *cn, cached_stmt *cs)
+{ cs->previous = NULL;
+  cs->next = cn->stmt_cache;
+  if ( cn->stmt_cache )
+    cn->stmt_cache->previous = cs;
+  else
+    cn->stmt_cache_tail = cs;
+  cn->stmt_cache = cs;
+  cn->stmt_cache_count++;
+}
+
+
+static void
+free_cached_stmt(cached_stmt *cs)
+{ PL_unregister_atom(cs->sql);
+  if ( cs->options )
+    PL_erase(cs->options);
+  if ( cs->ctxt )
+    free_context(cs->ctxt);
+  free(cs);
+}
+
+
+static void
+free_cached_stmts(cached_stmt *cs)
+{ cached_stmt *next;
+
+  for(; cs; cs=next)
+  { next = cs->next;
+    free_cached_stmt(cs);
+  }
+}
+
+
+/* Drop least recently used entries until the cache holds at most `size`
+   entries.  Must be called with LOCK() held.  As free_context() uses
+   LOCK() as well, the dropped entries are returned as a chain that
+   must be freed using free_cached_stmts() after releasing the lock.
+*/
+
+static cached_stmt *
+trim_stmt_cache(connection *cn, int size)
+{ cached_stmt *evicted = NULL;
+
+  while( cn->stmt_cache_count > size )
+  { cached_stmt *cs = cn->stmt_cache_tail;
+
+    unlink_cached_stmt(cn, cs);
+    cn->stmt_cache_statistics.evictions++;
+    if ( cs->ctxt && ison(cs->ctxt, CTX_INUSE) )
+    { clear(cs->ctxt, CTX_PERSISTENT);	/* freed by close_context() */
+      cs->ctxt = NULL;
+    }
+    cs->next = evicted;
+    evicted = cs;
+  }
+
+  return evicted;
+}
+
+
+/* same_options() is true if options is a variant of the options of cs,
+   such that findall(Row, row(...)) templates with fresh variables hit
+   the cache.
+*/
+
+static int
+same_options(cached_stmt *cs, term_t options)
+{ if ( !cs->options )
+  { return PL_get_nil(options);
+  } else
+  { static predicate_t pred = 0;
+    term_t av = PL_new_term_refs(2);
+    int rc;
+
+    if ( !pred )
+      pred = PL_predicate("=@=", 2, "system");
+    rc = ( PL_recorded(cs->options, av+0) &&
+	   PL_put_term(av+1, options) &&
+	   PL_call_predicate(NULL, PL_Q_NODEBUG, pred, av) );
+    PL_reset_term_refs(av);
+    return rc;
+  }
+}
+
+
+static cached_stmt *
+find_cached_stmt(connection *cn, atom_t sql, term_t options)
+{ cached_stmt *cs;
+
+  for(cs=cn->stmt_cache; cs; cs=cs->next)
+  { if ( cs->sql == sql && same_options(cs, options) )
+      return cs;
+  }
+
+  return NULL;
+}
+
+
+static context *
+prepare_cached_statement(connection *cn, term_t tquery, term_t options)
+{ context *ctxt;
+
+  if ( !(ctxt = new_context(cn)) )
+    return NULL;
+  set(ctxt, CTX_PERSISTENT);		/* compile options to outlive the call */
+  if ( !get_sql_text(ctxt, tquery) ||
+       !set_statement_options(ctxt, options) )
+  { free_context(ctxt);
+    return NULL;
+  }
+
+  if ( ctxt->char_width == 1 )
+    ctxt->rc = SQLPrepareA(ctxt->hstmt, ctxt->sqltext.a, ctxt->sqllen);
+  else
+    ctxt->rc = SQLPrepareW(ctxt->hstmt, ctxt->sqltext.w, ctxt->sqllen);
+  if ( !report_status(ctxt) )
+  { free_context(ctxt);
+    return NULL;
+  }
+
+  return ctxt;
+}
+
+
+/* cached_statement() sets *ctxtp to a prepared statement for `sql` that
+   is marked CTX_INUSE and ready for SQLExecute(), or NULL if the query
+   must be executed directly.  Returns FALSE with an exception on error.
+*/
+
+static int
+cached_statement(connection *cn, term_t tquery, atom_t sql, term_t options,
+		 context **ctxtp)
+{ cached_stmt *cs, *evicted = NULL;
+  context *ctxt;
+  int prepare = FALSE;
+
+  *ctxtp = NULL;
+
+  LOCK();
+  if ( (cs = find_cached_stmt(cn, sql, options)) )
+  { if ( cs != cn->stmt_cache )
+    { unlink_cached_stmt(cn, cs);
+      link_cached_stmt(cn, cs);
+    }
+    cs->seen++;
+
+    if ( cs->ctxt )
+    { if ( isoff(cs->ctxt, CTX_INUSE) )
+      { set(cs->ctxt, CTX_INUSE);
+	cn->stmt_cache_statistics.hits++;
+	*ctxtp = cs->ctxt;
+      } else
+      { cn->stmt_cache_statistics.misses++;
+      }
+      UNLOCK();
+      return TRUE;
+    }
+  } else
+  { if ( !(cs = malloc(sizeof(*cs))) )
+    { UNLOCK();
+      return TRUE;			/* just do not cache */
+    }
+    memset(cs, 0, sizeof(*cs));
+    cs->sql = sql;
+    PL_register_atom(sql);
+    if ( !PL_get_nil(options) )
+      cs->options = PL_record(options);
+    cs->seen = 1;
+    link_cached_stmt(cn, cs);
+    evicted = trim_stmt_cache(cn, cn->stmt_cache_size);
+  }
+
+  cn->stmt_cache_statistics.misses++;
+  prepare = ( cs->seen >= (unsigned int)cn->stmt_cache_threshold );
+  UNLOCK();
+  free_cached_stmts(evicted);
+
+  if ( !prepare )
+    return TRUE;
+  if ( !(ctxt = prepare_cached_statement(cn, tquery, options)) )
+    return FALSE;
+
+  LOCK();				/* may have changed in the meanwhile */
+  if ( (cs = find_cached_stmt(cn, sql, options)) && !cs->ctxt )
+    cs->ctxt = ctxt;
+  else
+    clear(ctxt, CTX_PERSISTENT);	/* use once */
+  set(ctxt, CTX_INUSE);
+  UNLOCK();
+
+  DEBUG(1, Sdprintf("Prepared cached statement for %s\n",
+		    PL_atom_chars(sql)));
+  *ctxtp = ctxt;
+
+  return TRUE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+odbc_query(+Conn, +SQL, -Row)
+    Execute an SQL query, returning the result-rows 1-by-1 on
+    backtracking
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static foreign_t
+pl_odbc_query(term_t conn, term_t tquery, term_t trow, term_t options,
+	      control_t handle)
+{ context *ctxt;
+
+  switch( PL_foreign_control(handle) )
+  { case PL_FIRST_CALL:
+    { connection *cn;
+      int self = PL_thread_self();
+      atom_t sql;
+
+      if ( !get_connection(conn, &cn) )
+	return FALSE;
+
+      if ( cn->stmt_cache_size > 0 &&
+	   PL_get_atom(tquery, &sql) )
+      { if ( !cached_statement(cn, tquery, sql, options, &ctxt) )
+	  return FALSE;
+
+	if ( ctxt )
+	{ clear(ctxt, CTX_PREFETCHED);
+	  start_deadline(ctxt);
+	  LOCK_CONTEXTS();
+	  if ( !mark_context_as_executing(self, ctxt) )
+	  { UNLOCK_CONTEXTS();
+	    close_context(ctxt);
+	    return FALSE;
+	  }
+	  UNLOCK_CONTEXTS();
+	  TRY(ctxt,
+	      SQLExecute(ctxt->hstmt),
+	      unmark_and_close_context(ctxt));
+	  LOCK_CONTEXTS();
+	  clear(ctxt, CTX_EXECUTING);
+	  if ( self >= 0 )
+	    executing_contexts[self] = NULL;
+	  UNLOCK_CONTEXTS();
+	  return odbc_row(ctxt, trow);
+	}
+      }
+
+      if ( !(ctxt = new_context(cn)) )
+	return FALSE;
+      if ( !get_sql_text(ctxt, tquery) )
+      { free_context(ctxt);
+	return FALSE;
+      }
+
+      if ( !set_statement_options(ctxt, options) )
+      { free_context(ctxt);
+	return FALSE;
+      }
+      set(ctxt, CTX_INUSE);
+      start_deadline(ctxt);
+      LOCK_CONTEXTS();
+      if (!mark_context_as_executing(self, ctxt))
+      { UNLOCK_CONTEXTS();
+	return FALSE;
+      }
+      UNLOCK_CONTEXTS();
+      if ( ctxt->char_width == 1 )
+      { TRY(ctxt,
+	    SQLExecDirectA(ctxt->hstmt, ctxt->sqltext.a, ctxt->sqllen),
+	    unmark_and_close_context(ctxt));
+      } else
+      { TRY(ctxt,
+	    SQLExecDirectW(ctxt->hstmt, ctxt->sqltext.w, ctxt->sqllen),
+	    unmark_and_close_context(ctxt));
+      }
+      LOCK_CONTEXTS();
+      clear(ctxt, CTX_EXECUTING);
+      if ( self >= 0 )
+	executing_contexts[self] = NULL;
+      UNLOCK_CONTEXTS();
+      return odbc_row(ctxt, trow);
+    }
+    case PL_REDO:
+      return odbc_row(PL_foreign_context_address(handle), trow);
+
+    default:
+    case PL_PRUNED:
+      close_context(PL_foreign_context_address(handle));
+      return TRUE;
+  }
+}
+
+
+		 /*******************************
+		 *	DICTIONARY SUPPORT	*
+		 *******************************/
+
+static foreign_t
+odbc_tables(term_t conn, term_t row, control_t handle)
+{ switch( PL_foreign_control(handle) )
+  { case PL_FIRST_CALL:
+    { connection *cn;
+      context *ctxt;
+
+      if ( !get_connection(conn, &cn) )
+	return FALSE;
+
+      if ( !(ctxt = new_context(cn)) )
+	return FALSE;
+      ctxt->null = NULL;		/* use default $null$ */
+      set(ctxt, CTX_TABLES);
+      TRY(ctxt,
+	  SQLTables(ctxt->hstmt, NULL,0,NULL,0,NULL,0,NULL,0),
+	  close_context(ctxt));
+
+      return odbc_row(ctxt, row);
+    }
+    case PL_REDO:
+      return odbc_row(PL_foreign_context_address(handle), row);
+
+    case PL_PRUNED:
+      free_context(PL_foreign_context_address(handle));
+      return TRUE;
+
+    default:
+      assert(0);
+      return FALSE;
+  }
+}
+
+
+static foreign_t
+pl_odbc_column(term_t conn, term_t db, term_t row, control_t handle)
+{ switch( PL_foreign_control(handle) )
+  { case PL_FIRST_CALL:
+    { connection *cn;
+      context *ctxt;
+      size_t len;
+      char *s;
+
+      if ( !get_connection(conn, &cn) )
+	return FALSE;
+					/* TBD: Unicode version */
+      if ( !PL_get_nchars(db, &len, &s, CVT_ATOM|CVT_STRING|cn->rep_flag) )
+	return type_error(db, "atom");
+
+      if ( !(ctxt = new_context(cn)) )
+	return FALSE;
+      ctxt->null = NULL;		/* use default $null$ */
+      set(ctxt, CTX_COLUMNS);
+#ifdef SQL_SERVER_BUG
+      ctxt->max_nogetdata = 8192;	/* > the 4K width column for the name */
+#endif
+      TRY(ctxt,
+	  SQLColumns(ctxt->hstmt, NULL, 0, NULL, 0,
+		     (SQLCHAR*)s, (SWORD)len, NULL, 0),
+	  close_context(ctxt));
+
+      return odbc_row(ctxt, row);
+    }
+    case PL_REDO:
+      return odbc_row(PL_foreign_context_address(handle), row);
+
+    case PL_PRUNED:
+      free_context(PL_foreign_context_address(handle));
+      return TRUE;
+
+    default:
+      assert(0);
+      return FALSE;
+  }
+}
+
+
+static foreign_t
+odbc_primary_key(term_t conn, term_t table, term_t row, control_t handle)
+{ switch( PL_foreign_control(handle) )
+  { case PL_FIRST_CALL:
+    { connection *cn;
+      context *ctxt;
+      size_t len;
+      char *s;
+
+      if ( !get_connection(conn, &cn) )
+	return FALSE;
+					/* TBD: Unicode version */
+      if ( !PL_get_nchars(table, &len, &s, CVT_ATOM|CVT_STRING|cn->rep_flag) )
+	return type_error(table, "atom");
+
+      if ( !(ctxt = new_context(cn)) )
+	return FALSE;
+      ctxt->null = NULL;		/* use default $null$ */
+      set(ctxt, CTX_PRIMARYKEY);
+      TRY(ctxt,
+	  SQLPrimaryKeys(ctxt->hstmt, NULL, 0, NULL, 0,
+		     (SQLCHAR*)s, (SWORD)len),
+	  close_context(ctxt));
+
+      return odbc_row(ctxt, row);
+    }
+    case PL_REDO:
+      return odbc_row(PL_foreign_context_address(handle), row);
+
+    case PL_PRUNED:
+      free_context(PL_foreign_context_address(handle));
+      return TRUE;
+
+    default:
+      assert(0);
+      return FALSE;
+  }
+}
+
+static foreign_t
+odbc_foreign_key(term_t conn, term_t pktable, term_t fktable, term_t row, control_t handle)
+{ switch( PL_foreign_control(handle) )
+  { case PL_FIRST_CALL:
+    { connection *cn;
+      context *ctxt;
+      size_t lpkt = 0;
+      char *spkt = 0;
+      size_t lpkf = 0;
+      char *spkf = 0;
+
+      if ( !get_connection(conn, &cn) )
+	return FALSE;
+
+      int nt = 0;
+      if ( PL_get_nchars(pktable, &lpkt, &spkt, CVT_ATOM|CVT_STRING|cn->rep_flag) )
+	++nt;
+      if ( PL_get_nchars(fktable, &lpkf, &spkf, CVT_ATOM|CVT_STRING|cn->rep_flag) )
+	++nt;
+      if (!nt)
+	return resource_error("set at least PkTable or FkTable");
+
+      if ( !(ctxt = new_context(cn)) )
+	return FALSE;
+      ctxt->null = NULL;		/* use default $null$ */
+      set(ctxt, CTX_FOREIGNKEY);
+      TRY(ctxt,
+	  SQLForeignKeys(ctxt->hstmt, NULL, 0, NULL, 0,
+		     (SQLCHAR*)spkt, (SWORD)lpkt, NULL, 0, NULL, 0, (SQLCHAR*)spkf, (SWORD)lpkf),
+	  close_context(ctxt));
+
+      return odbc_row(ctxt, row);
+    }
+    case PL_REDO:
+      return odbc_row(PL_foreign_context_address(handle), row);
+
+    case PL_PRUNED:
+      free_context(PL_foreign_context_address(handle));
+      return TRUE;
+
+    default:
+      assert(0);
+      return FALSE;
+  }
+}
+
+
+static foreign_t
+odbc_types(term_t conn, term_t sqltype, term_t row, control_t handle)
+{ switch( PL_foreign_control(handle) )
+  { case PL_FIRST_CALL:
+    { connection *cn;
+      context *ctxt;
+      atom_t tname;
+      SWORD type;
+      int v;
+
+      if ( PL_get_integer(sqltype, &v) )
+      { type = v;
+      } else
+      { if ( !PL_get_atom(sqltype, &tname) )
+	  return type_error(sqltype, "sql_type");
+	if ( tname == ATOM_all_types )
+	  type = SQL_ALL_TYPES;
+	else if ( !get_sqltype_from_atom(tname, &type) )
+	  return domain_error(sqltype, "sql_type");
+      }
+
+      if ( !get_connection(conn, &cn) )
+	return FALSE;
+      if ( !(ctxt = new_context(cn)) )
+	return FALSE;
+      ctxt->null = NULL;		/* use default $null$ */
+      TRY(ctxt,
+	  SQLGetTypeInfo(ctxt->hstmt, type),
+	  close_context(ctxt));
+
+      return odbc_row(ctxt, row);
+    }
+    case PL_REDO:
+      return odbc_row(PL_foreign_context_address(handle), row);
+
+    case PL_PRUNED:
+      free_context(PL_foreign_context_address(handle));
+      return TRUE;
+
+    default:
+      assert(0);
+      return FALSE;
+  }
+}
+
+
+static foreign_t
+odbc_data_sources(term_t list)
+{ UCHAR dsn[SQL_MAX_DSN_LENGTH];
+  UCHAR description[1024];
+  SWORD dsnlen, dlen;
+  UWORD dir = SQL_FETCH_FIRST;
+  RETCODE rc;
+  term_t tail = PL_copy_term_ref(list);
+  term_t head = PL_new_term_ref();
+
+  LOCK();
+  if ( !henv )
+  { SQLAllocEnv(&henv);		/* Allocate an environment handle */
+    SQLSetEnvAttr(henv,
+		  SQL_ATTR_ODBC_VERSION,
+		  (SQLPOINTER) SQL_OV_ODBC3,
+		  0);
+  }
+  UNLOCK();
+
+  for(;; dir=SQL_FETCH_NEXT)
+  { rc = SQLDataSources(henv,
+			dir,
+			dsn, sizeof(dsn)-1, &dsnlen,
+			description, sizeof(description)-1, &dlen);
+    switch(rc)
+    { case SQL_SUCCESS:
+      { if ( PL_unify_list(tail, head, tail) &&
+	     PL_unify_term(head, PL_FUNCTOR, FUNCTOR_data_source2,
+				   PL_NCHARS, (size_t)dsnlen, dsn,
+				   PL_NCHARS, (size_t)dlen, description) )
+	  continue;
+
+	return FALSE;
+      }
+      case SQL_NO_DATA_FOUND:
+	return PL_unify_nil(tail);
+      default:
+	odbc_report(henv, NULL, NULL, rc);
+	return FALSE;
+    }
+  }
+}
+
+
+		 /*******************************
+		 *	COMPILE STATEMENTS	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Prepared statements are represented as a  blob of type odbc_statement
+that holds a pointer to the context.   The blob is referenced from
+ctxt->symbol (without a reference).  odbc_free_statement/1 clears the
+pointer, such that using the handle afterwards raises an existence
+error.  If the blob is garbage  collected   before  the statement was
+freed, the statement is freed as well,  so forgotten statements no
+longer leak.  The release hook runs inside atom-GC, where we cannot talk
+to the driver or raise exceptions.  It   therefore  only  queues the
+statement in collected_statements, which is  emptied by the next ODBC
+call.  A statement that is running   is  flagged non-persistent and
+freed by close_context().
+
+Statements with a blob are also  kept   in  the list `statements` of
+their connection, such  that  odbc_disconnect/1   can  free  them.
+ctxt->symbol, the pointer in the blob,  both lists and CTX_LISTED are
+protected by LOCK().
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+release_statement_symbol(atom_t symbol)
+{ context **ref = PL_blob_data(symbol, NULL, NULL);
+  context *ctxt;
+
+  LOCK();
+  if ( (ctxt = *ref) && ctxt->symbol == symbol )
+  { ctxt->symbol = 0;
+    if ( ison(ctxt, CTX_INUSE) )
+    { clear(ctxt, CTX_PERSISTENT);	/* freed by close_context() */
+    } else
+    { ctxt->next_collected = collected_statements;
+      collected_statements = ctxt;
+    }
+    statistics.statements_collected++;
+  }
+  *ref = NULL;
+  UNLOCK();
+
+  return TRUE;
+}
+
+
+/* free_collected_statements() frees the statements queued by
+   release_statement_symbol().  The statements are flagged CTX_INUSE
+   while we free them, so free_statements() will not touch them.
+*/
+
+static void
+free_collected_statements(void)
+{ context *c, *next;
+
+  if ( !collected_statements )		/* unlocked test */
+    return;
+
+  LOCK();
+  c = collected_statements;
+  collected_statements = NULL;
+  for(next=c; next; next=next->next_collected)
+    set(next, CTX_INUSE);
+  UNLOCK();
+
+  for(; c; c=next)
+  { next = c->next_collected;
+    c->next_collected = NULL;
+    free_context(c);
+  }
+}
+
+
+static int
+write_statement_symbol(IOSTREAM *s, atom_t symbol, int flags)
+{ context **ref = PL_blob_data(symbol, NULL, NULL);
+
+  Sfprintf(s, "<odbc_statement>(%p)", *ref);
+  return TRUE;
+}
+
+
+static PL_blob_t statement_blob =
+{ PL_BLOB_MAGIC,
+  0,
+  "odbc_statement",
+  release_statement_symbol,
+  NULL,
+  write_statement_symbol
+};
+
+
+static void
+unlink_statement_symbol_unlocked(context *ctxt)
+{ if ( ctxt->symbol )
+  { context **ref = PL_blob_data(ctxt->symbol, NULL, NULL);
+
+    *ref = NULL;
+    ctxt->symbol = 0;
+  }
+}
+
+
+static void
+unlink_statement_symbol(context *ctxt)
+{ LOCK();
+  unlink_statement_symbol_unlocked(ctxt);
+  UNLOCK();
+}
+
+
+/* unlink_statement() removes a statement that is being freed from its
+   blob and from the statements of its connection.
+*/
+
+static void
+unlink_statement(context *ctxt)
+{ LOCK();
+  unlink_statement_symbol_unlocked(ctxt);
+  if ( ison(ctxt, CTX_LISTED) )
+  { context **cp;
+
+    for(cp = &ctxt->connection->statements; *cp; cp = &(*cp)->next_statement)
+    { if ( *cp == ctxt )
+      { *cp = ctxt->next_statement;
+	break;
+      }
+    }
+    ctxt->next_statement = NULL;
+    clear(ctxt, CTX_LISTED);
+  }
+  UNLOCK();
+}
+
+
+/* free_statements() frees the statements of a connection that is about
+   to be disconnected, including those queued by atom-GC.  Their blobs
+   raise an existence error afterwards.  Fails without freeing anything
+   if one of the statements or its clones is running.
+*/
+
+static int
+free_statements(connection *cn)
+{ context *c, *next, **cp;
+
+  LOCK();
+  for(c=cn->statements; c; c=c->next_statement)
+  { if ( ison(c, CTX_INUSE) )
+    { UNLOCK();
+      return FALSE;
+    }
+    for(next=c->clones; next; next=next->next_clone)
+    { if ( ison(next, CTX_INUSE) )
+      { UNLOCK();
+	return FALSE;
+      }
+    }
+  }
+  for(cp = &collected_statements; *cp; )
+  { if ( (*cp)->connection == cn )
+      *cp = (*cp)->next_collected;
+    else
+      cp = &(*cp)->next_collected;
+  }
+  c = cn->statements;
+  cn->statements = NULL;
+  for(next=c; next; next=next->next_statement)
+  { unlink_statement_symbol_unlocked(next);
+    clear(next, CTX_LISTED);
+  }
+  UNLOCK();
+
+  for(; c; c=next)
+  { next = c->next_statement;
+    c->next_statement = NULL;
+    c->next_collected = NULL;
+    free_context(c);
+  }
+
+  return TRUE;
+}
+
+
+static int
+unifyStmt(term_t id, context *ctxt)
+{ term_t tmp = PL_new_term_ref();
+  atom_t symbol;
+
+  if ( !PL_unify_blob(tmp, &ctxt, sizeof(ctxt), &statement_blob) ||
+       !PL_get_atom(tmp, &symbol) )
+    return FALSE;
+
+  LOCK();
+  ctxt->symbol = symbol;
+  if ( isoff(ctxt, CTX_LISTED) )
+  { ctxt->next_statement = ctxt->connection->statements;
+    ctxt->connection->statements = ctxt;
+    set(ctxt, CTX_LISTED);
+  }
+  UNLOCK();
+
+  return PL_unify_atom(id, symbol);
+}
+
+
+static bool
+getStmt(term_t id, context **ctxt)
+{ PL_blob_t *type;
+  void *data;
+
+  free_collected_statements();
+  if ( PL_get_blob(id, &data, NULL, &type) && type == &statement_blob )
+  { context *c = *(context**)data;
+
+    if ( !c || c->magic != CTX_MAGIC )
+      return existence_error(id, "odbc_statement_handle");
+
+    *ctxt = c;
+    return true;
+  }
+
+  return type_error(id, "odbc_statement_handle");
+}
+
+
+typedef struct
+{ SWORD  type;				/* SQL_* */
+  const char *text;			/* same as text */
+  atom_t name;				/* Prolog name */
+} sqltypedef;
+
+static sqltypedef sqltypes[] =
+{ { SQL_BIGINT,	       "bigint" },
+  { SQL_BINARY,	       "binary" },
+  { SQL_BIT,	       "bit" },
+  { SQL_CHAR,	       "char" },
+  { SQL_DATE,	       "date" },
+  { SQL_DECIMAL,       "decimal" },
+  { SQL_DOUBLE,	       "double" },
+  { SQL_FLOAT,	       "float" },
+  { SQL_INTEGER,       "integer" },
+  { SQL_LONGVARBINARY, "longvarbinary" },
+  { SQL_LONGVARCHAR,   "longvarchar" },
+  { SQL_NUMERIC,       "numeric" },
+  { SQL_REAL,	       "real" },
+  { SQL_SMALLINT,      "smallint" },
+  { SQL_TIME,	       "time" },
+  { SQL_TIMESTAMP,     "timestamp" },
+  { SQL_TINYINT,       "tinyint" },
+  { SQL_VARBINARY,     "varbinary" },
+  { SQL_VARCHAR,       "varchar" },
+  { SQL_WCHAR,         "nchar" },
+  { SQL_WLONGVARCHAR,  "longnvarchar" },
+  { SQL_WVARCHAR,      "nvarchar" },
+  { 0,		       NULL }
+};
+
+
+static SWORD
+get_sqltype_from_atom(atom_t name, SWORD *type)
+{ sqltypedef *def;
+
+  for(def=sqltypes; def->text; def++)
+  { if ( !def->name )
+      def->name = PL_new_atom(def->text);
+    if ( def->name == name )
+    { *type = def->type;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static const char*
+sql_type_name(SWORD type)
+{ sqltypedef *def;
+
+  for(def=sqltypes; def->text; def++)
+  { if ( def->type == type )
+      return (const char*)def->text;
+  }
+
+  return "?";
+}
+
+
+static sqltypedef pltypes[] =
+{ { SQL_PL_DEFAULT,    "default" },
+  { SQL_PL_ATOM,       "atom" },
+  { SQL_PL_STRING,     "string" },
+  { SQL_PL_CODES,      "codes" },
+  { SQL_PL_INTEGER,    "integer" },
+  { SQL_PL_FLOAT,      "float" },
+  { SQL_PL_TIME,       "time" },
+  { SQL_PL_DATE,       "date" },
+  { SQL_PL_TIMESTAMP,  "timestamp" },
+  { SQL_PL_STREAM,     "stream" },
+  { 0,		       NULL }
+};
+
+
+static int
+get_pltype(term_t t, SWORD *type)
+{ atom_t name;
+
+  if ( PL_get_atom(t, &name) )
+  { sqltypedef *def;
+
+    for(def=pltypes; def->text; def++)
+    { if ( !def->name )
+	def->name = PL_new_atom(def->text);
+
+      if ( def->name == name )
+      { *type = def->type;
+	return TRUE;
+      }
+    }
+
+    return domain_error(t, "sql_prolog_type");
+  }
+
+  return type_error(t, "atom");
+}
+
+
+static const char*
+pl_type_name(SWORD type)
+{ sqltypedef *def;
+
+  for(def=pltypes; def->text; def++)
+  { if ( def->type == type )
+      return (const char*)def->text;
+  }
+
+  return "?";
+}
+
+
+static sqltypedef sql_c_types[] =
+{ { SQL_C_WCHAR,     "wchar" },
+  { SQL_C_CHAR,	     "char" },
+  { SQL_C_BINARY,    "binary" },
+  { SQL_C_SLONG,     "slong" },
+  { SQL_C_SBIGINT,   "sbigint" },
+  { SQL_C_DOUBLE,    "double" },
+  { SQL_C_DATE,	     "date" },
+  { SQL_C_TYPE_DATE, "type_date" },
+  { SQL_C_TIME,	     "time" },
+  { SQL_C_TYPE_TIME, "type_time" },
+  { SQL_C_TIMESTAMP, "timestamp" },
+  { 0,		     NULL }
+};
+
+
+static const char*
+sql_c_type_name(SWORD type)
+{ sqltypedef *def;
+
+  for(def=sql_c_types; def->text; def++)
+  { if ( def->type == type )
+      return (const char*)def->text;
+  }
+
+  return "?";
+}
+
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Declare parameters for prepared statements.
+
+odbc_prepare(DSN, 'select * from product where price < ?',
+	     [ integer
+	     ],
+	     Qid,
+	     Options).
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+declare_parameters(context *ctxt, term_t parms)
+{ int nparams;
+  term_t tail = PL_copy_term_ref(parms);
+  term_t head = PL_new_term_ref();
+  parameter *params;
+  SWORD npar;
+  SWORD pn;
+  int character_size = ((ctxt->connection->encoding == ENC_UTF8)?4:1)*sizeof(char);
+
+  TRY(ctxt,
+      SQLNumParams(ctxt->hstmt, &npar),
+      (void)0);
+  if ( (nparams=list_length(parms)) < 0 )
+    return FALSE;
+  if ( npar != nparams )
+    return domain_error(parms, "length"); /* TBD: What error to raise?? */
+
+  ctxt->NumParams = nparams;
+  if ( nparams == 0 )
+    return TRUE;			/* no parameters */
+
+  if ( !(ctxt->params = odbc_malloc(sizeof(parameter)*nparams)) )
+    return FALSE;
+  memset(ctxt->params, 0, sizeof(parameter)*nparams);
+  params = ctxt->params;
+
+  for(params = ctxt->params, pn = 1;
+      PL_get_list(tail, head, tail);
+      params++, pn++)
+  { atom_t name;
+    size_t arity;
+    SWORD sqlType, fNullable;
+    SQLULEN cbColDef = 0;
+    SWORD plType = SQL_PL_DEFAULT;
+    SQLLEN *vlenptr = NULL;		/* pointer to length */
+    int isvar;
+
+    if ( (isvar=PL_is_variable(head)) )
+    { name = ATOM_default;
+      arity = 0;
+    } else
+    { if ( PL_is_functor(head, FUNCTOR_gt2) )
+      { term_t a = PL_new_term_ref();
+
+	_PL_get_arg(1, head, a);
+	if ( !get_pltype(a, &plType) )
+	  return FALSE;
+	if ( plType == SQL_PL_STREAM )
+	  return domain_error(a, "sql_prolog_type");
+
+	_PL_get_arg(2, head, head);
+      }
+
+      if ( !PL_get_name_arity(head, &name, &arity) )
+	return type_error(head, "parameter_type");
+    }
+
+    if ( name != ATOM_default )
+    { int val;
+
+      if ( !get_sqltype_from_atom(name, &sqlType) )
+	return domain_error(head, "parameter_type");
+
+					/* char(N) --> cbColDef */
+      if ( get_int_arg(1, head, &val) )	/* TBD: incomplete */
+	cbColDef = val;
+      if ( get_int_arg(2, head, &val) )	/* decimal(cbColDef, scale) */
+	params->scale = val;
+    } else
+    { TRY(ctxt, SQLDescribeParam(ctxt->hstmt,	/* hstmt */
+				 pn,		/* ipar */
+				 &sqlType,
+				 &cbColDef,     /* Characters - not bytes */
+				 &params->scale,
+				 &fNullable),
+	  (void)0);
+    }
+
+    params->sqlTypeID = sqlType;
+    params->plTypeID  = plType;
+    params->cTypeID   = CvtSqlToCType(ctxt, params->sqlTypeID, plType);
+    params->ptr_value = (SQLPOINTER)params->buf;
+    if ( isvar &&
+	 !PL_unify_term(head, PL_FUNCTOR, FUNCTOR_gt2,
+				PL_CHARS, pl_type_name(plType),
+				PL_CHARS, sql_type_name(sqlType)) )
+      return FALSE;
+
+    DEBUG(1, Sdprintf("param: SQL:%s, Prolog:%s, C:%s, cbColDef=%d, scale=%d\n",
+		      sql_type_name(sqlType),
+		      pl_type_name(plType),
+		      sql_c_type_name(params->cTypeID),
+		      (int)cbColDef, (int)params->scale));
+
+    switch(params->cTypeID)
+    { case SQL_C_WCHAR:
+	character_size = sizeof(SQLWCHAR);
+	/* FALLTHROUGH */
+      case SQL_C_CHAR:
+      case SQL_C_BINARY:
+	if ( cbColDef > 0 )
+	{ if ( params->sqlTypeID == SQL_DECIMAL ||
+	       params->sqlTypeID == SQL_NUMERIC )
+	  { cbColDef += 2*character_size;	/* decimal dot and '-' sign */
+	  }
+	  if ( (cbColDef+1) * character_size > PARAM_BUFSIZE )
+	  { if ( !(params->ptr_value = odbc_malloc((cbColDef+1)*character_size)) )
+	      return FALSE;
+	  }
+	  params->length_ind = cbColDef * character_size;
+	} else				/* unknown, use SQLPutData() */
+	{ params->ptr_value = (SQLPOINTER)(intptr_t)pn;
+	  params->len_value = SQL_LEN_DATA_AT_EXEC(0);
+	  DEBUG(2, Sdprintf("Using SQLPutData() for column %d\n", pn));
+	}
+	vlenptr = &params->len_value;
+	break;
+      case SQL_C_SLONG:
+	params->len_value = sizeof(SQLINTEGER);
+	vlenptr = &params->len_value;
+	break;
+      case SQL_C_SBIGINT:
+	params->len_value = sizeof(SQLBIGINT);
+	vlenptr = &params->len_value;
+	break;
+      case SQL_C_DOUBLE:
+	params->len_value = sizeof(SQLDOUBLE);
+	vlenptr = &params->len_value;
+	break;
+      case SQL_C_DATE:
+      case SQL_C_TYPE_DATE:
+	if ( !(params->ptr_value = odbc_malloc(sizeof(DATE_STRUCT))) )
+	  return FALSE;
+	params->len_value = sizeof(DATE_STRUCT);
+	vlenptr = &params->len_value;
+	break;
+      case SQL_C_TIME:
+      case SQL_C_TYPE_TIME:
+	if ( !(params->ptr_value = odbc_malloc(sizeof(TIME_STRUCT))) )
+	  return FALSE;
+	params->len_value = sizeof(TIME_STRUCT);
+	vlenptr = &params->len_value;
+	break;
+      case SQL_C_TIMESTAMP:
+	if ( !(params->ptr_value = odbc_malloc(sizeof(SQL_TIMESTAMP_STRUCT))) )
+	  return FALSE;
+	params->len_value = sizeof(SQL_TIMESTAMP_STRUCT);
+	vlenptr = &params->len_value;
+	break;
+      default:
+	Sdprintf("declare_parameters(): cTypeID %d not supported\n",
+		 params->cTypeID);
+    }
+
+
+    TRY(ctxt, SQLBindParameter(ctxt->hstmt,		/* hstmt */
+			       (SWORD)pn,		/* ipar */
+			       SQL_PARAM_INPUT,		/* fParamType */
+			       params->cTypeID,		/* fCType */
+			       params->sqlTypeID,	/* fSqlType */
+			       params->length_ind,	/* cbColDef */
+			       params->scale,		/* ibScale */
+			       params->ptr_value,	/* rgbValue */
+			       0,			/* cbValueMax */
+			       vlenptr),		/* pcbValue */
+	(void)0);
+  }
+
+  return TRUE;
+}
+
+
+static foreign_t
+odbc_prepare(term_t conn, term_t sql, term_t parms, term_t qid, term_t options)
+{ connection *cn;
+  context *ctxt;
+
+  if ( !get_connection(conn, &cn) )
+    return FALSE;
+
+  if ( !(ctxt = new_context(cn)) )
+    return FALSE;
+  if ( !get_sql_text(ctxt, sql) )
+  { free_context(ctxt);
+    return FALSE;
+  }
+
+  if ( ctxt->char_width == 1 )
+  { TRY(ctxt,
+	SQLPrepareA(ctxt->hstmt, ctxt->sqltext.a, ctxt->sqllen),
+	close_context(ctxt));
+  } else
+  { TRY(ctxt,
+	SQLPrepareW(ctxt->hstmt, ctxt->sqltext.w, ctxt->sqllen),
+	close_context(ctxt));
+  }
+
+  if ( !declare_parameters(ctxt, parms) )
+  { free_context(ctxt);
+    return FALSE;
+  }
+
+  ctxt->flags |= CTX_PERSISTENT;
+
+  if ( !set_statement_options(ctxt, options) )
+  { free_context(ctxt);
+    return FALSE;
+  }
+
+  return unifyStmt(qid, ctxt);
+}
+
+
+static foreign_t
+odbc_clone_statement(term_t qid, term_t cloneqid)
+{ context *ctxt, *clone;
+
+  if ( !getStmt(qid, &ctxt) )
+    return FALSE;
+  if ( !(clone = clone_context(ctxt)) )
+    return FALSE;
+
+  clone->flags |= CTX_PERSISTENT;
+
+  return unifyStmt(cloneqid, clone);
+}
+
+
+static foreign_t
+odbc_free_statement(term_t qid)
+{ context *ctxt;
+  int running;
+
+  if ( !getStmt(qid, &ctxt) )
+    return FALSE;
+
+  LOCK();
+  unlink_statement_symbol_unlocked(ctxt);
+  if ( (running = ison(ctxt, CTX_INUSE)) )
+    clear(ctxt, CTX_PERSISTENT);	/* oops, delay! */
+  UNLOCK();
+  if ( !running )
+    free_context(ctxt);
+
+  return TRUE;
+}
+
+
+		 /*******************************
+		 *	  TIME CONVERSION	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Conversion between SQL timestamps and  POSIX   time  (seconds after Jan
+1, 1970 UTC).  Civil dates are mapped  to   days  and  back using plain
+arithmetic on the proleptic Gregorian calendar, so we do not need
+mktime(), timegm() or the non-reentrant localtime() and gmtime().
+
+Connections convert in the local time  zone,   in  UTC or using a fixed
+offset (see the connection option timezone(TZ)).  For the local time
+zone the UTC offset is obtained from localtime_r() and cached in
+tz_cache, indexed by the quarter of an hour.  Time zone transitions
+happen at multiples of 15 minutes, so all instants in a quarter have
+the same offset.  Each entry packs the quarter and the offset into a
+single 64-bit word, such that concurrent readers either see a consistent
+entry or a miss.  The cache is not flushed if the TZ environment
+changes.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define TZ_QUANTUM	  900		/* seconds in a cache entry */
+#define TZ_CACHE_SIZE	  256		/* # cache entries */
+#define TZ_OFFSET_BIAS	  0x80000	/* make packed offset positive */
+#define SECS_PER_DAY	  86400
+
+static volatile uint64_t tz_cache[TZ_CACHE_SIZE];
+
+static int64_t
+floor_div(int64_t n, int64_t d)
+{ int64_t q = n/d;
+
+  if ( (n%d) != 0 && ((n < 0) != (d < 0)) )
+    q--;
+
+  return q;
+}
+
+
+/* days_from_civil() and civil_from_days() are due to Howard Hinnant,
+   "chrono-Compatible Low-Level Date Algorithms".
+*/
+
+static int64_t
+days_from_civil(int64_t y, unsigned m, unsigned d)
+{ int64_t era;
+  unsigned yoe, doy, doe;
+
+  y -= (m <= 2);
+  era = floor_div(y, 400);
+  yoe = (unsigned)(y - era*400);
+  doy = (153*(m + (m > 2 ? -3 : 9)) + 2)/5 + d-1;
+  doe = yoe*365 + yoe/4 - yoe/100 + doy;
+
+  return era*146097 + (int64_t)doe - 719468;
+}
+
+
+static void
+civil_from_days(int64_t z, int64_t *yp, unsigned *mp, unsigned *dp)
+{ int64_t era;
+  unsigned doe, yoe, doy, mp0;
+
+  z += 719468;
+  era = floor_div(z, 146097);
+  doe = (unsigned)(z - era*146097);
+  yoe = (doe - doe/1460 + doe/36524 - doe/146096)/365;
+  doy = doe - (365*yoe + yoe/4 - yoe/100);
+  mp0 = (5*doy + 2)/153;
+
+  *dp = doy - (153*mp0 + 2)/5 + 1;
+  *mp = mp0 < 10 ? mp0+3 : mp0-9;
+  *yp = (int64_t)yoe + era*400 + (*mp <= 2);
+}
+
+
+static int
+local_tm(time_t t, struct tm *tm)
+{
+#ifdef HAVE_LOCALTIME_R
+  return localtime_r(&t, tm) != NULL;
+#elif defined(__WINDOWS__)
+  return localtime_s(tm, &t) == 0;
+#else
+  struct tm *ltm;
+  int rc = FALSE;
+
+  LOCK();
+  if ( (ltm = localtime(&t)) )
+  { *tm = *ltm;
+    rc = TRUE;
+  }
+  UNLOCK();
+
+  return rc;
+#endif
+}
+
+
+/* local_utc_offset() returns the offset of local time to UTC in seconds
+   (positive east of Greenwich) at POSIX time t.
+*/
+
+static int
+local_utc_offset(int64_t t)
+{ int64_t q = floor_div(t, TZ_QUANTUM);
+  uint64_t key = (uint64_t)q << 20;
+  volatile uint64_t *ep = &tz_cache[(uint64_t)q % TZ_CACHE_SIZE];
+  uint64_t e = *ep;
+  struct tm tm;
+  int64_t local;
+  int offset;
+
+  if ( e && (e & ~(uint64_t)0xfffff) == key )
+    return (int)(e & 0xfffff) - TZ_OFFSET_BIAS;
+
+  if ( !local_tm((time_t)t, &tm) )
+    return 0;				/* out of range: use UTC */
+  local = ( days_from_civil(tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday)
+							  * SECS_PER_DAY +
+	    tm.tm_hour*3600 + tm.tm_min*60 + tm.tm_sec );
+  offset = (int)(local - t);
+  *ep = key | (uint64_t)(offset + TZ_OFFSET_BIAS);
+
+  return offset;
+}
+
+
+/* stamp_to_epoch() converts a timestamp in the time zone of cn into
+   POSIX time.  The fraction is ignored.  As mktime(), local times in a
+   gap or overlap of a transition are resolved using the offset that
+   applies after the second iteration.
+*/
+
+static int64_t
+stamp_to_epoch(const SQL_TIMESTAMP_STRUCT *ts, const connection *cn)
+{ int64_t civil = ( days_from_civil(ts->year, ts->month, ts->day)
+							  * SECS_PER_DAY +
+		    ts->hour*3600 + ts->minute*60 + ts->second );
+
+  if ( cn->tz_local )
+  { int64_t guess = civil - local_utc_offset(civil);
+
+    return civil - local_utc_offset(guess);
+  }
+
+  return civil - cn->tz_offset;
+}
+
+
+static int
+epoch_to_stamp(int64_t t, long ns, const connection *cn,
+	       SQL_TIMESTAMP_STRUCT *ts)
+{ int64_t local = t + (cn->tz_local ? local_utc_offset(t) : cn->tz_offset);
+  int64_t days = floor_div(local, SECS_PER_DAY);
+  int64_t secs = local - days*SECS_PER_DAY;
+  int64_t y;
+  unsigned m, d;
+
+  civil_from_days(days, &y, &m, &d);
+  if ( y < -32768 || y > 32767 )
+    return FALSE;
+
+  ts->year     = (SQLSMALLINT)y;
+  ts->month    = (SQLUSMALLINT)m;
+  ts->day      = (SQLUSMALLINT)d;
+  ts->hour     = (SQLUSMALLINT)(secs/3600);
+  ts->minute   = (SQLUSMALLINT)((secs/60)%60);
+  ts->second   = (SQLUSMALLINT)(secs%60);
+  ts->fraction = (SQLUINTEGER)ns;
+
+  return TRUE;
+}
+
+
+static char *
+format_digits(char *s, unsigned long v, int digits)
+{ char *e = s+digits;
+
+  while( digits-- > 0 )
+  { s[digits] = (char)('0' + v%10);
+    v /= 10;
+  }
+
+  return e;
+}
+
+
+/* format_timestamp() writes stamp as YYYY-MM-DD HH:MM:SS[.fraction]
+   to s, removing trailing zeros from the fraction.  s must have room
+   for 32 characters.  Returns the length.
+*/
+
+static size_t
+format_timestamp(const SQL_TIMESTAMP_STRUCT *ts, char *s)
+{ char *o = s;
+  int year = ts->year;
+
+  if ( year < 0 )
+  { *o++ = '-';
+    year = -year;
+  }
+  o = format_digits(o, year, year > 9999 ? 5 : 4);
+  *o++ = '-';
+  o = format_digits(o, ts->month, 2);
+  *o++ = '-';
+  o = format_digits(o, ts->day, 2);
+  *o++ = ' ';
+  o = format_digits(o, ts->hour, 2);
+  *o++ = ':';
+  o = format_digits(o, ts->minute, 2);
+  *o++ = ':';
+  o = format_digits(o, ts->second, 2);
+  if ( ts->fraction )
+  { *o++ = '.';
+    o = format_digits(o, ts->fraction, 9);
+    while(o[-1] == '0')
+      o--;
+  }
+  *o = '\0';
+
+  return o-s;
+}
+
+
+static int
+get_date(term_t head, DATE_STRUCT* date)
+{ if ( PL_is_functor(head, FUNCTOR_date3) )
+  { int v;
+
+    if ( !get_int_arg(1, head, &v) ) return FALSE;
+    date->year = v;
+    if ( !get_int_arg(2, head, &v) ) return FALSE;
+    date->month = v;
+    if ( !get_int_arg(3, head, &v) ) return FALSE;
+    date->day = v;
+
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+static int
+get_time(term_t head, TIME_STRUCT* time)
+{ if ( PL_is_functor(head, FUNCTOR_time3) )
+  { int v;
+
+    if ( !get_int_arg(1, head, &v) ) return FALSE;
+    time->hour = v;
+    if ( !get_int_arg(2, head, &v) ) return FALSE;
+    time->minute = v;
+    if ( !get_int_arg(3, head, &v) ) return FALSE;
+    time->second = v;
+
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+static int
+get_timestamp(term_t t, SQL_TIMESTAMP_STRUCT* stamp, const connection *cn)
+{ int64_t secs;
+  double tf;
+
+  if ( PL_is_functor(t, FUNCTOR_timestamp7) )
+  { int v;
+
+    if ( !get_int_arg(1, t, &v) ) return FALSE;
+    stamp->year = v;
+    if ( !get_int_arg(2, t, &v) ) return FALSE;
+    stamp->month = v;
+    if ( !get_int_arg(3, t, &v) ) return FALSE;
+    stamp->day = v;
+    if ( !get_int_arg(4, t, &v) ) return FALSE;
+    stamp->hour = v;
+    if ( !get_int_arg(5, t, &v) ) return FALSE;
+    stamp->minute = v;
+    if ( !get_int_arg(6, t, &v) ) return FALSE;
+    stamp->second = v;
+    if ( !get_int_arg(7, t, &v) ) return FALSE;
+    stamp->fraction = v;
+
+    return TRUE;
+  } else if ( PL_is_integer(t) && PL_get_int64(t, &secs) )
+  { return epoch_to_stamp(secs, 0, cn, stamp);
+  } else if ( PL_get_float(t, &tf) )
+  { double fsecs = floor(tf);
+    long ns;
+
+    if ( fabs(fsecs) > 1e15 )
+      return FALSE;			/* out of range */
+    secs = (int64_t)fsecs;
+    ns = (long)((tf - fsecs) * 1000000000.0 + 0.5);
+    if ( ns >= 1000000000 )
+    { secs++;
+      ns -= 1000000000;
+    }
+
+    return epoch_to_stamp(secs, ns, cn, stamp);
+  } else
+    return FALSE;
+}
+
+
+static int
+try_null(context *ctxt, parameter *prm, term_t val, const char *expected)
+{ if ( is_sql_null(val, ctxt->null) )
+  { prm->len_value = SQL_NULL_DATA;
+
+    return TRUE;
+  } else
+    return type_error(val, expected);
+}
+
+static unsigned int
+plTypeID_convert_flags(int plTypeID, const char** expected)
+{ unsigned int flags;
+
+  switch(plTypeID)
+  { case SQL_PL_DEFAULT:
+      flags = CVT_ATOM|CVT_STRING;
+      *expected = "text";
+      break;
+    case SQL_PL_ATOM:
+      flags = CVT_ATOM;
+      *expected = "atom";
+      break;
+    case SQL_PL_STRING:
+      flags = CVT_STRING;
+      *expected = "string";
+      break;
+    case SQL_PL_CODES:
+      flags = CVT_LIST;
+      *expected = "code_list";
+      break;
+    default:
+      flags = 0; /* keep compiler happy */
+      assert(0);
+  }
+  return flags;
+}
+
+
+static int
+get_datetime(term_t t, size_t *len, char *s, const connection *cn)
+{ SQL_TIMESTAMP_STRUCT stamp;
+
+  if ( *len >= 32 && get_timestamp(t, &stamp, cn) )
+  { *len = format_timestamp(&stamp, s);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+/* get_decimal_text() is the counterpart of put_decimal() for binding
+   Prolog integers and rationals to DECIMAL and NUMERIC parameters.
+   Rationals are written with scale digits, rounding half away from
+   zero.  Rationals of which the numerator or denominator does not fit
+   in 64 bits raise a representation error.
+*/
+
+static int
+get_decimal_text(term_t t, int scale, char *buf, size_t *len)
+{ static predicate_t pred;
+  term_t av;
+  int64_t n, d;
+  uint64_t un, ip, r;
+  char frac[64];
+  int i, carry, nonzero = FALSE;
+  char *o = buf;
+
+  if ( PL_is_integer(t) )
+  { size_t l;
+    char *s;
+
+    if ( !PL_get_nchars(t, &l, &s, CVT_INTEGER) )
+      return FALSE;
+    if ( l+1 > *len )
+      return representation_error(t, "column_width");
+    memcpy(buf, s, l+1);
+    *len = l;
+    return TRUE;
+  }
+
+  if ( !pred )
+    pred = PL_predicate("rational", 3, "system");
+  if ( !(av = PL_new_term_refs(3)) ||
+       !PL_put_term(av+0, t) ||
+       !PL_call_predicate(NULL, PL_Q_PASS_EXCEPTION, pred, av) )
+    return FALSE;
+  if ( !PL_get_int64(av+1, &n) || !PL_get_int64(av+2, &d) ||
+       d <= 0 || d > INT64_MAX/10 || n == INT64_MIN ||
+       scale < 0 || scale >= (int)sizeof(frac) )
+    return representation_error(t, "decimal");
+
+  un = (uint64_t)(n < 0 ? -n : n);
+  ip = un / (uint64_t)d;
+  r  = un % (uint64_t)d;
+  for(i=0; i<scale; i++)
+  { r *= 10;
+    frac[i] = (char)(r / (uint64_t)d);
+    r %= (uint64_t)d;
+  }
+  carry = ( 2*r >= (uint64_t)d );
+  for(i=scale-1; carry && i >= 0; i--)
+  { if ( ++frac[i] == 10 )
+      frac[i] = 0;
+    else
+      carry = FALSE;
+  }
+  if ( carry )
+    ip++;
+  for(i=0; i<scale; i++)
+  { if ( frac[i] )
+      nonzero = TRUE;
+  }
+
+  if ( *len < 24+(size_t)scale )
+    return representation_error(t, "column_width");
+  if ( n < 0 && (ip || nonzero) )
+    *o++ = '-';
+  o += snprintf(o, 22, "%llu", (unsigned long long)ip);
+  if ( scale > 0 )
+  { *o++ = '.';
+    for(i=0; i<scale; i++)
+      *o++ = (char)('0'+frac[i]);
+  }
+  *o = '\0';
+  *len = o-buf;
+
+  return TRUE;
+}
+
+
+/* bind_parameter() converts the Prolog value `head` into the buffer
+   of `prm`.  It is also used by odbc_execute_batch/3, which passes a
+   temporary copy of the parameter that points into the array.
+*/
+
+static int
+bind_parameter(context *ctxt, parameter *prm, term_t head)
+{ switch(prm->cTypeID)
+  { case SQL_C_SLONG:
+    { int32_t val;
+
+      if ( PL_get_integer(head, &val) )
+      { SQLINTEGER sqlval = val;
+	memcpy(prm->ptr_value, &sqlval, sizeof(SQLINTEGER));
+	prm->len_value = sizeof(SQLINTEGER);
+      } else if ( !try_null(ctxt, prm, head, "32 bit integer") )
+	return FALSE;
+      break;
+    }
+    case SQL_C_SBIGINT:
+    { int64_t val;
+
+      if ( PL_get_int64(head, &val) )
+      { SQLBIGINT sqlval = val;
+	memcpy(prm->ptr_value, &sqlval, sizeof(SQLBIGINT));
+	prm->len_value = sizeof(SQLBIGINT);
+      } else if ( !try_null(ctxt, prm, head, "64 bit integer") )
+	return FALSE;
+      break;
+    }
+    case SQL_C_DOUBLE:
+      if ( PL_get_float(head, (double *)prm->ptr_value) )
+	prm->len_value = sizeof(double);
+      else if ( !try_null(ctxt, prm, head, "float") )
+	return FALSE;
+      break;
+    case SQL_C_CHAR:
+    case SQL_C_WCHAR:
+    case SQL_C_BINARY:
+    { SQLLEN len;
+      size_t l;
+      char *s;
+      const char *expected = "text";
+      unsigned int flags = plTypeID_convert_flags(prm->plTypeID, &expected);
+
+					/* check for NULL */
+      if ( is_sql_null(head, ctxt->null) )
+      { prm->len_value = SQL_NULL_DATA;
+	break;
+      }
+      if ( prm->cTypeID == SQL_C_CHAR &&
+	   IS_DECIMAL_TYPE(prm->sqlTypeID) && PL_is_rational(head) )
+      { char buf[128];
+
+	l = sizeof(buf);
+	if ( !get_decimal_text(head, prm->scale, buf, &l) )
+	  return FALSE;
+	if ( (SQLLEN)l > prm->length_ind )
+	  return representation_error(head, "column_width");
+	memcpy(prm->ptr_value, buf, l+1);
+	prm->len_value = l;
+	break;
+      }
+      if ( prm->cTypeID == SQL_C_WCHAR )
+      { wchar_t *ws;
+	size_t ls;
+
+	if ( !PL_get_wchars(head, &ls, &ws, flags) )
+	  return type_error(head, expected);
+	len = ls*sizeof(SQLWCHAR);
+	if (  len > prm->length_ind )
+	{ DEBUG(1, Sdprintf("Column-width (SQL_C_WCHAR) = %zd\n",
+			    (size_t)prm->length_ind));
+	  return representation_error(head, "column_width");
+	}
+	prm->len_value = len;
+#if SIZEOF_SQLWCHAR == SIZEOF_WCHAR_T
+	memcpy(prm->ptr_value, ws, (ls+1)*sizeof(SQLWCHAR));
+#else
+      { wchar_t *es = ws+ls;
+	SQLWCHAR *o;
+
+	for(o=(SQLWCHAR*)prm->ptr_value; ws<es;)
+	  *o++ = *ws++;
+	*o = 0;
+      }
+#endif
+      } else
+      { char datetime_str[128];
+	int rep = (prm->cTypeID == SQL_C_CHAR ? ctxt->connection->rep_flag
+					      : REP_ISO_LATIN_1);
+
+	l = sizeof(datetime_str);
+	s = datetime_str;
+	if ( !PL_get_nchars(head, &l, &s, flags|rep) &&
+	     !get_datetime(head, &l, s, ctxt->connection) )
+	  return type_error(head, expected);
+	len = l;
+	if ( len > prm->length_ind )
+	{ DEBUG(1, Sdprintf("Column-width (SQL_C_CHAR) = %zd\n",
+			    (size_t)prm->length_ind));
+	  return representation_error(head, "column_width");
+	}
+	memcpy(prm->ptr_value, s, len+1);
+	prm->len_value = len;
+      }
+
+      break;
+    }
+    case SQL_C_TYPE_DATE:
+    { if ( get_date(head, (DATE_STRUCT*)prm->ptr_value) )
+	prm->len_value = sizeof(DATE_STRUCT);
+      else if ( !try_null(ctxt, prm, head, "date") )
+	return FALSE;
+      break;
+    }
+    case SQL_C_TYPE_TIME:
+    { if ( get_time(head, (TIME_STRUCT*)prm->ptr_value) )
+	prm->len_value = sizeof(TIME_STRUCT);
+      else if ( !try_null(ctxt, prm, head, "time") )
+	return FALSE;
+      break;
+    }
+    case SQL_C_TIMESTAMP:
+    { if ( get_timestamp(head, (SQL_TIMESTAMP_STRUCT*)prm->ptr_value,
+			 ctxt->connection) )
+	prm->len_value = sizeof(SQL_TIMESTAMP_STRUCT);
+      else if ( !try_null(ctxt, prm, head, "timestamp") )
+	return FALSE;
+      break;
+    }
+    default:
+      return PL_warning("Unknown parameter type: %d", prm->cTypeID);
+  }
+
+  return TRUE;
+}
+
+
+static int
+bind_parameters(context *ctxt, term_t parms)
+{ term_t tail = PL_copy_term_ref(parms);
+  term_t head = PL_new_term_ref();
+  parameter *prm;
+
+  for(prm = ctxt->params; PL_get_list(tail, head, tail); prm++)
+  { if ( prm->len_value == SQL_LEN_DATA_AT_EXEC(0) )
+    { DEBUG(2, Sdprintf("bind_parameters(): Delaying column %zd\n",
+                        (size_t)(prm-ctxt->params+1)));
+      prm->put_data = PL_copy_term_ref(head);
+      continue;
+    }
+
+    if ( !bind_parameter(ctxt, prm, head) )
+      return FALSE;
+  }
+  if ( !PL_get_nil(tail) )
+    return type_error(tail, "list");
+
+  return TRUE;
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+put_stream_data() sends the content of  the   input  stream  In from a
+parameter stream(In) using SQLPutData() in chunks of PUT_DATA_CHUNK
+bytes, so large values never need to be  loaded into a Prolog atom or
+string.  Binary parameters copy the bytes  of   the  stream.  For text
+parameters we read characters and encode   them  as required for the C
+type and encoding of the connection.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define PUT_DATA_CHUNK 8192
+
+static int
+put_data_chunk(context *ctxt, void *data, size_t len)
+{ ctxt->rc = SQLPutData(ctxt->hstmt, data, len);
+
+  return ctxt->rc == SQL_SUCCESS || ctxt->rc == SQL_SUCCESS_WITH_INFO;
+}
+
+
+static int
+get_text_chunk(IOSTREAM *in, parameter *p, int rep, char *buf, size_t *lenp)
+{ char *o = buf, *e = buf+PUT_DATA_CHUNK;
+  mbstate_t mbs;
+
+  memset(&mbs, 0, sizeof(mbs));
+  while( e-o >= MB_LEN_MAX )
+  { int c = Sgetcode(in);
+
+    if ( c == -1 )
+      break;
+
+    if ( p->cTypeID == SQL_C_WCHAR )
+    { SQLWCHAR wc[2];
+      int n = 0;
+
+#if SIZEOF_SQLWCHAR == 2
+      if ( c > 0xffff )			/* MB_LEN_MAX >= 4: room for both */
+      { c -= 0x10000;
+	wc[n++] = (SQLWCHAR)(0xd800+(c>>10));
+	c = 0xdc00+(c&0x3ff);
+      }
+#endif
+      wc[n++] = (SQLWCHAR)c;
+      memcpy(o, wc, n*sizeof(SQLWCHAR));
+      o += n*sizeof(SQLWCHAR);
+    } else if ( rep == REP_UTF8 )
+    { if ( c < 0x80 )
+      { *o++ = (char)c;
+      } else if ( c < 0x800 )
+      { *o++ = (char)(0xc0|(c>>6));
+	*o++ = (char)(0x80|(c&0x3f));
+      } else if ( c < 0x10000 )
+      { *o++ = (char)(0xe0|(c>>12));
+	*o++ = (char)(0x80|((c>>6)&0x3f));
+	*o++ = (char)(0x80|(c&0x3f));
+      } else
+      { *o++ = (char)(0xf0|(c>>18));
+	*o++ = (char)(0x80|((c>>12)&0x3f));
+	*o++ = (char)(0x80|((c>>6)&0x3f));
+	*o++ = (char)(0x80|(c&0x3f));
+      }
+    } else if ( rep == REP_MB )
+    { size_t n = wcrtomb(o, (wchar_t)c, &mbs);
+
+      if ( n == (size_t)-1 )
+	goto repr_error;
+      o += n;
+    } else
+    { if ( c > 0xff )
+	goto repr_error;
+      *o++ = (char)c;
+    }
+  }
+
+  *lenp = o-buf;
+  return TRUE;
+
+repr_error:
+  Sseterr(in, SIO_FERR, "Cannot represent character in ODBC encoding");
+  return FALSE;
+}
+
+
+static int
+put_stream_data(context *ctxt, parameter *p, term_t t)
+{ IOSTREAM *in;
+  term_t a = PL_new_term_ref();
+  int rep = (p->cTypeID == SQL_C_BINARY ? REP_ISO_LATIN_1
+					: ctxt->connection->rep_flag);
+  int rc = TRUE, sent = FALSE;
+
+  _PL_get_arg(1, t, a);
+  if ( !PL_get_stream(a, &in, SIO_INPUT) )
+    return FALSE;
+
+  for(;;)
+  { char buf[PUT_DATA_CHUNK];
+    size_t len;
+
+    if ( PL_handle_signals() < 0 )
+    { rc = FALSE;
+      break;
+    }
+
+    if ( p->cTypeID == SQL_C_BINARY )
+    { len = Sfread(buf, 1, sizeof(buf), in);
+      if ( len == 0 && Sferror(in) )
+	break;
+    } else if ( !get_text_chunk(in, p, rep, buf, &len) )
+      break;
+
+    if ( len == 0 )
+    { if ( !sent && !put_data_chunk(ctxt, buf, 0) ) /* empty stream */
+	rc = report_status(ctxt);
+      break;
+    }
+    if ( !put_data_chunk(ctxt, buf, len) )
+    { rc = report_status(ctxt);
+      break;
+    }
+    sent = TRUE;
+  }
+
+  if ( !PL_release_stream(in) )		/* raises a pending I/O error */
+    rc = FALSE;
+
+  return rc;
+}
+
+
+static foreign_t
+odbc_execute(term_t qid, term_t args, term_t row, control_t handle)
+{ switch( PL_foreign_control(handle) )
+  { case PL_FIRST_CALL:
+    { context *ctxt;
+      int self = PL_thread_self();
+      if ( !getStmt(qid, &ctxt) )
+	return FALSE;
+      ctxt->stmt_statistics.executions++;
+      if ( !(ctxt = acquire_statement(ctxt)) )
+	return context_error(qid, "in_use", "statement");
+
+      if ( !bind_parameters(ctxt, args) )
+      { close_context(ctxt);		/* release statement or clone */
+	return FALSE;
+      }
+
+      clear(ctxt, CTX_PREFETCHED);
+      start_deadline(ctxt);
+      LOCK_CONTEXTS();
+      if (!mark_context_as_executing(self, ctxt))
+      { UNLOCK_CONTEXTS();
+	return FALSE;
+      }
+      UNLOCK_CONTEXTS();
+      ctxt->rc = SQLExecute(ctxt->hstmt);
+      LOCK_CONTEXTS();
+      clear(ctxt, CTX_EXECUTING);
+      if ( self >= 0 )
+	executing_contexts[self] = NULL;
+      UNLOCK_CONTEXTS();
+      while( ctxt->rc == SQL_NEED_DATA )
+      { PTR token;
+
+	if ( (ctxt->rc = SQLParamData(ctxt->hstmt, &token)) == SQL_NEED_DATA )
+	{ parameter *p = &ctxt->params[(intptr_t)token - 1];
+	  size_t len;
+	  char *s;
+
+	  if ( PL_is_functor(p->put_data, FUNCTOR_stream1) )
+	  { if ( !put_stream_data(ctxt, p, p->put_data) )
+	    { SQLCancel(ctxt->hstmt);
+	      close_context(ctxt);
+	      return FALSE;
+	    }
+	  } else if ( is_sql_null(p->put_data, ctxt->null) )
+	  { s = NULL;
+	    len = SQL_NULL_DATA;
+	    SQLPutData(ctxt->hstmt, s, len);
+	  } else
+	  { const char *expected = "text";
+	    unsigned int flags = plTypeID_convert_flags(p->plTypeID, &expected);
+
+	    if ( p->cTypeID == SQL_C_WCHAR )
+	    { wchar_t *ws;
+
+	      if ( !PL_get_wchars(p->put_data, &len, &ws, flags) )
+	      { SQLCancel(ctxt->hstmt);
+		return type_error(p->put_data, expected);
+	      }
+#if SIZEOF_SQLWCHAR == SIZEOF_WCHAR_T
+	      SQLPutData(ctxt->hstmt, ws, len*sizeof(SQLWCHAR));
+#else
+	    { SQLWCHAR fast[256];
+	      SQLWCHAR *tmp;
+	      wchar_t *es = ws+len;
+	      SQLWCHAR *o;
+
+	      if ( len+1 <= sizeof(fast)/sizeof(SQLWCHAR) )
+	      { tmp = fast;
+	      } else
+	      { if ( !(tmp = odbc_malloc((len+1)*sizeof(SQLWCHAR))) )
+		{ SQLCancel(ctxt->hstmt);
+		  return FALSE;
+		}
+	      }
+
+	      for(o=tmp; ws<es;)
+		*o++ = *ws++;
+	      *o = 0;
+	      SQLPutData(ctxt->hstmt, tmp, len*sizeof(SQLWCHAR));
+
+	      if ( tmp != fast )
+		free(tmp);
+	    }
+#endif
+	    } else
+	    { int rep = (p->cTypeID == SQL_C_BINARY ? REP_ISO_LATIN_1
+						    : ctxt->connection->rep_flag);
+
+	      if ( !PL_get_nchars(p->put_data, &len, &s, flags|rep) )
+	      { SQLCancel(ctxt->hstmt);
+		return type_error(p->put_data, expected);
+	      }
+	      SQLPutData(ctxt->hstmt, s, len);
+	    }
+	  }
+	}
+      }
+      if ( !report_status(ctxt) )
+      { close_context(ctxt);
+	return FALSE;
+      }
+
+      if ( ison(ctxt, CTX_NOAUTO) )
+	return TRUE;
+
+      return odbc_row(ctxt, row);
+    }
+
+    case PL_REDO:
+      return odbc_row(PL_foreign_context_address(handle), row);
+
+    case PL_PRUNED:
+      close_context(PL_foreign_context_address(handle));
+      return TRUE;
+
+    default:
+      assert(0);
+      return FALSE;
+  }
 }
 
-static const char*
-sql_type_name(SWORD type)
-{ sqltypedef *def;
 
-  for(def=sqltypes; def->text; def++)
-  { if ( def->type == type )
-      return (const char*)def->text;
-  }
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+odbc_execute_batch(+Statement, +ListOfParamLists, -Result)
+
+Execute a prepared statement for  each  list   of  parameter  values.  The
+parameters are bound column-wise to arrays of   BATCH_SIZE rows and each
+chunk is executed using a  single  SQLExecute()  (SQL_ATTR_PARAMSET_SIZE).
+The values are converted into the   arrays  using bind_parameter() on a
+temporary copy of the parameter that points into the array.
+
+Result is batch(Affected, StatusList), where   StatusList holds the status
+of each row as reported through  SQL_ATTR_PARAM_STATUS_PTR. A failed row
+for which the driver reports a diagnostic record  is represented by the
+error term. An SQL_ERROR  without  failed   rows  is  raised. Parameters
+that are passed using SQLPutData() cannot be used in an array.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-  return "?";
+#define BATCH_SIZE 1024			/* max rows per SQLExecute() */
+
+typedef struct param_array
+{ char	       *values;			/* array of values */
+  SQLLEN       *lengths;		/* array of length/indicators */
+  SQLLEN	element_size;		/* size of a value */
+} param_array;
+
+
+static SQLLEN
+param_element_size(const parameter *prm)
+{ switch(prm->cTypeID)
+  { case SQL_C_CHAR:
+    case SQL_C_BINARY:
+      return prm->length_ind+1;
+    case SQL_C_WCHAR:
+      return prm->length_ind+sizeof(SQLWCHAR);
+    case SQL_C_SLONG:
+      return sizeof(SQLINTEGER);
+    case SQL_C_SBIGINT:
+      return sizeof(SQLBIGINT);
+    case SQL_C_DOUBLE:
+      return sizeof(SQLDOUBLE);
+    case SQL_C_DATE:
+    case SQL_C_TYPE_DATE:
+      return sizeof(DATE_STRUCT);
+    case SQL_C_TIME:
+    case SQL_C_TYPE_TIME:
+      return sizeof(TIME_STRUCT);
+    case SQL_C_TIMESTAMP:
+      return sizeof(SQL_TIMESTAMP_STRUCT);
+    default:
+      return 0;
+  }
 }
 
 
-static sqltypedef pltypes[] =
-{ { SQL_PL_DEFAULT,    "default" },
-  { SQL_PL_ATOM,       "atom" },
-  { SQL_PL_STRING,     "string" },
-  { SQL_PL_CODES,      "codes" },
-  { SQL_PL_INTEGER,    "integer" },
-  { SQL_PL_FLOAT,      "float" },
-  { SQL_PL_TIME,       "time" },
-  { SQL_PL_DATE,       "date" },
-  { SQL_PL_TIMESTAMP,  "timestamp" },
-  { 0,		       NULL }
-};
+static atom_t
+param_status_atom(SQLUSMALLINT status)
+{ switch(status)
+  { case SQL_PARAM_SUCCESS:
+      return ATOM_success;
+    case SQL_PARAM_SUCCESS_WITH_INFO:
+      return ATOM_success_with_info;
+    case SQL_PARAM_ERROR:
+      return ATOM_error;
+    case SQL_PARAM_UNUSED:
+      return ATOM_unused;
+    default:				/* SQL_PARAM_DIAG_UNAVAILABLE */
+      return ATOM_no_info;
+  }
+}
+
 
+/* param_row_errors() is true if the driver flagged one or more rows of
+   an array execution as failed.  If not, an SQL_ERROR from
+   SQLExecute() applies to the statement as a whole.
+*/
 
 static int
-get_pltype(term_t t, SWORD *type)
-{ atom_t name;
+param_row_errors(const SQLUSMALLINT *status, SQLULEN count)
+{ SQLULEN i;
 
-  if ( PL_get_atom(t, &name) )
-  { sqltypedef *def;
+  for(i=0; i<count; i++)
+  { if ( status[i] == SQL_PARAM_ERROR )
+      return TRUE;
+  }
 
-    for(def=pltypes; def->text; def++)
-    { if ( !def->name )
-	def->name = PL_new_atom(def->text);
+  return FALSE;
+}
 
-      if ( def->name == name )
-      { *type = def->type;
-	return TRUE;
-      }
-    }
 
-    return domain_error(t, "sql_prolog_type");
-  }
+/* param_diag_records() sets diag[i] to the first diagnostic record
+   the driver reports for row i of an array execution, or 0 if there is
+   none.  This must be called before the statement is closed.
+*/
 
-  return type_error(t, "atom");
+static void
+param_diag_records(context *ctxt, SQLSMALLINT *diag, SQLULEN count)
+{ SQLULEN i;
+  int rec;
+
+  for(i=0; i<count; i++)
+    diag[i] = 0;
+
+  for(rec=1; rec<=SHRT_MAX; rec++)
+  { SQLLEN row = 0;
+
+    if ( SQLGetDiagField(SQL_HANDLE_STMT, ctxt->hstmt, (SQLSMALLINT)rec,
+			 SQL_DIAG_ROW_NUMBER, &row, 0, NULL) != SQL_SUCCESS )
+      break;
+    if ( row > 0 && (SQLULEN)row <= count && !diag[row-1] )
+      diag[row-1] = (SQLSMALLINT)rec;
+  }
 }
 
 
-static const char*
-pl_type_name(SWORD type)
-{ sqltypedef *def;
+/* unify_param_status() unifies t with the status of a row.  A failed
+   row for which the driver reported a diagnostic record rec becomes
+   error(odbc(State, Native, Message), _).
+*/
 
-  for(def=pltypes; def->text; def++)
-  { if ( def->type == type )
-      return (const char*)def->text;
+static int
+unify_param_status(context *ctxt, term_t t, SQLUSMALLINT status,
+		   SQLSMALLINT rec)
+{ if ( status == SQL_PARAM_ERROR && rec > 0 )
+  { SQLCHAR state[16];
+    SQLINTEGER native;
+    SQLCHAR message[SQL_MAX_MESSAGE_LENGTH+1];
+    SQLSMALLINT msglen;
+    RETCODE rce;
+    term_t s;
+
+    rce = SQLGetDiagRec(SQL_HANDLE_STMT, ctxt->hstmt, rec, state, &native,
+			message, sizeof(message), &msglen);
+    if ( rce == SQL_SUCCESS || rce == SQL_SUCCESS_WITH_INFO )
+    { if ( msglen > SQL_MAX_MESSAGE_LENGTH )
+	msglen = SQL_MAX_MESSAGE_LENGTH;
+
+      return ( (s = PL_new_term_ref()) &&
+	       PL_unify_chars(s, PL_STRING|REP_MB,
+			      (size_t)msglen, (const char*)message) &&
+	       PL_unify_term(t,
+			     PL_FUNCTOR, FUNCTOR_error2,
+			       PL_FUNCTOR, FUNCTOR_odbc3,
+				 PL_CHARS,   state,
+				 PL_INTEGER, (long)native,
+				 PL_TERM,    s,
+			       PL_VARIABLE) );
+    }
   }
 
-  return "?";
+  return PL_unify_atom(t, param_status_atom(status));
 }
 
 
-static sqltypedef sql_c_types[] =
-{ { SQL_C_WCHAR,     "wchar" },
-  { SQL_C_CHAR,	     "char" },
-  { SQL_C_BINARY,    "binary" },
-  { SQL_C_SLONG,     "slong" },
-  { SQL_C_SBIGINT,   "sbigint" },
-  { SQL_C_DOUBLE,    "double" },
-  { SQL_C_DATE,	     "date" },
-  { SQL_C_TYPE_DATE, "type_date" },
-  { SQL_C_TIME,	     "time" },
-  { SQL_C_TYPE_TIME, "type_time" },
-  { SQL_C_TIMESTAMP, "timestamp" },
-  { 0,		     NULL }
-};
-
+static int
+bind_param_arrays(context *ctxt, param_array *arrays,
+		  SQLUSMALLINT *status, SQLULEN *processed)
+{ parameter *prm;
+  int pn;
 
-static const char*
-sql_c_type_name(SWORD type)
-{ sqltypedef *def;
+  TRY(ctxt, SQLSetStmtAttr(ctxt->hstmt, SQL_ATTR_PARAM_BIND_TYPE,
+			   (SQLPOINTER)SQL_PARAM_BIND_BY_COLUMN, 0),
+      (void)0);
+  TRY(ctxt, SQLSetStmtAttr(ctxt->hstmt, SQL_ATTR_PARAM_STATUS_PTR,
+			   status, 0),
+      (void)0);
+  TRY(ctxt, SQLSetStmtAttr(ctxt->hstmt, SQL_ATTR_PARAMS_PROCESSED_PTR,
+			   processed, 0),
+      (void)0);
 
-  for(def=sql_c_types; def->text; def++)
-  { if ( def->type == type )
-      return (const char*)def->text;
+  for(prm=ctxt->params, pn=0; pn<ctxt->NumParams; pn++, prm++)
+  { TRY(ctxt, SQLBindParameter(ctxt->hstmt,		/* hstmt */
+			       (SWORD)(pn+1),		/* ipar */
+			       SQL_PARAM_INPUT,		/* fParamType */
+			       prm->cTypeID,		/* fCType */
+			       prm->sqlTypeID,		/* fSqlType */
+			       prm->length_ind,		/* cbColDef */
+			       prm->scale,		/* ibScale */
+			       arrays[pn].values,	/* rgbValue */
+			       arrays[pn].element_size,	/* cbValueMax */
+			       arrays[pn].lengths),	/* pcbValue */
+	(void)0);
   }
 
-  return "?";
+  return TRUE;
 }
 
 
+/* Restore the single-row parameter bindings made by declare_parameters().
+   Errors are ignored as there may be a pending exception.
+*/
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-Declare parameters for prepared statements.
+static void
+unbind_param_arrays(context *ctxt)
+{ parameter *prm;
+  int pn;
+
+  SQLSetStmtAttr(ctxt->hstmt, SQL_ATTR_PARAMSET_SIZE, (SQLPOINTER)1, 0);
+  SQLSetStmtAttr(ctxt->hstmt, SQL_ATTR_PARAM_STATUS_PTR, NULL, 0);
+  SQLSetStmtAttr(ctxt->hstmt, SQL_ATTR_PARAMS_PROCESSED_PTR, NULL, 0);
+
+  for(prm=ctxt->params, pn=0; pn<ctxt->NumParams; pn++, prm++)
+  { SQLBindParameter(ctxt->hstmt, (SWORD)(pn+1), SQL_PARAM_INPUT,
+		     prm->cTypeID, prm->sqlTypeID, prm->length_ind,
+		     prm->scale, prm->ptr_value, 0, &prm->len_value);
+  }
+}
 
-odbc_prepare(DSN, 'select * from product where price < ?',
-	     [ integer
-	     ],
-	     Qid,
-	     Options).
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-static int
-declare_parameters(context *ctxt, term_t parms)
-{ int nparams;
-  term_t tail = PL_copy_term_ref(parms);
-  term_t head = PL_new_term_ref();
-  parameter *params;
-  SWORD npar;
-  SWORD pn;
-  int character_size = ((ctxt->connection->encoding == ENC_UTF8)?4:1)*sizeof(char);
+static foreign_t
+odbc_execute_batch(term_t qid, term_t rows, term_t result)
+{ context *ctxt;
+  int self = PL_thread_self();
+  int nrows, chunk, pn;
+  size_t bytes = 0;
+  char *data = NULL;
+  param_array *arrays = NULL;
+  SQLUSMALLINT *status = NULL;
+  SQLSMALLINT *diag = NULL;
+  SQLULEN processed = 0;
+  int64_t affected = 0;
+  term_t tail     = PL_copy_term_ref(rows);
+  term_t row      = PL_new_term_ref();
+  term_t ptail    = PL_new_term_ref();
+  term_t head     = PL_new_term_ref();
+  term_t statuses = PL_new_term_ref();
+  term_t stail    = PL_copy_term_ref(statuses);
+  term_t shead    = PL_new_term_ref();
+  int rc = FALSE;
 
-  TRY(ctxt,
-      SQLNumParams(ctxt->hstmt, &npar),
-      (void)0);
-  if ( (nparams=list_length(parms)) < 0 )
+  if ( !getStmt(qid, &ctxt) )
+    return FALSE;
+  if ( (nrows = list_length(rows)) < 0 )
     return FALSE;
-  if ( npar != nparams )
-    return domain_error(parms, "length"); /* TBD: What error to raise?? */
 
-  ctxt->NumParams = nparams;
-  if ( nparams == 0 )
-    return TRUE;			/* no parameters */
+  for(pn=0; pn<ctxt->NumParams; pn++)
+  { if ( ctxt->params[pn].len_value == SQL_LEN_DATA_AT_EXEC(0) )
+      return permission_error("execute_batch", "statement", qid);
+  }
+  if ( !claim_statement(ctxt) )
+    return context_error(qid, "in_use", "statement");
+  ctxt->stmt_statistics.executions++;
+
+  chunk = (nrows < BATCH_SIZE ? nrows : BATCH_SIZE);
+  if ( chunk == 0 )
+  { rc = PL_unify_term(result,
+		       PL_FUNCTOR, FUNCTOR_batch2,
+			 PL_INT, 0,
+			 PL_NIL);
+    goto out;
+  }
 
-  if ( !(ctxt->params = odbc_malloc(sizeof(parameter)*nparams)) )
-    return FALSE;
-  memset(ctxt->params, 0, sizeof(parameter)*nparams);
-  params = ctxt->params;
+  for(pn=0; pn<ctxt->NumParams; pn++)
+    bytes += chunk*sizeof(SQLLEN) +
+	     ROW_ALIGN(chunk*param_element_size(&ctxt->params[pn]));
+
+  if ( !(arrays = odbc_malloc((ctxt->NumParams+1)*sizeof(*arrays))) ||
+       !(data = odbc_malloc(bytes+1)) ||
+       !(status = odbc_malloc(chunk*sizeof(*status))) ||
+       !(diag = odbc_malloc(chunk*sizeof(*diag))) )
+    goto out;
+
+  bytes = 0;
+  for(pn=0; pn<ctxt->NumParams; pn++)
+  { arrays[pn].element_size = param_element_size(&ctxt->params[pn]);
+    arrays[pn].lengths = (SQLLEN*)(data+bytes);
+    bytes += chunk*sizeof(SQLLEN);
+    arrays[pn].values = data+bytes;
+    bytes += ROW_ALIGN(chunk*arrays[pn].element_size);
+  }
 
-  for(params = ctxt->params, pn = 1;
-      PL_get_list(tail, head, tail);
-      params++, pn++)
-  { atom_t name;
-    size_t arity;
-    SWORD sqlType, fNullable;
-    SQLULEN cbColDef = 0;
-    SWORD plType = SQL_PL_DEFAULT;
-    SQLLEN *vlenptr = NULL;		/* pointer to length */
-    int isvar;
+  if ( !bind_param_arrays(ctxt, arrays, status, &processed) )
+    goto out;
 
-    if ( (isvar=PL_is_variable(head)) )
-    { name = ATOM_default;
-      arity = 0;
-    } else
-    { if ( PL_is_functor(head, FUNCTOR_gt2) )
-      { term_t a = PL_new_term_ref();
+  while( PL_get_list(tail, row, tail) )
+  { SQLULEN count, i;
+    int ok;
 
-	_PL_get_arg(1, head, a);
-	if ( !get_pltype(a, &plType) )
-	  return FALSE;
+    for(count=0; ; )
+    { PL_put_term(ptail, row);
+      for(pn=0; pn<ctxt->NumParams; pn++)
+      { parameter tmp = ctxt->params[pn];
 
-	_PL_get_arg(2, head, head);
+	if ( !PL_get_list(ptail, head, ptail) )
+	{ domain_error(row, "length");
+	  goto out;
+	}
+	tmp.ptr_value = arrays[pn].values + count*arrays[pn].element_size;
+	if ( !bind_parameter(ctxt, &tmp, head) )
+	  goto out;
+	arrays[pn].lengths[count] = tmp.len_value;
       }
+      if ( !PL_get_nil(ptail) )
+      { domain_error(row, "length");
+	goto out;
+      }
+      status[count] = SQL_PARAM_UNUSED;
 
-      if ( !PL_get_name_arity(head, &name, &arity) )
-	return type_error(head, "parameter_type");
+      if ( ++count == (SQLULEN)chunk || !PL_get_list(tail, row, tail) )
+	break;
     }
 
-    if ( name != ATOM_default )
-    { int val;
-
-      if ( !get_sqltype_from_atom(name, &sqlType) )
-	return domain_error(head, "parameter_type");
+    ctxt->rc = SQLSetStmtAttr(ctxt->hstmt, SQL_ATTR_PARAMSET_SIZE,
+			      (SQLPOINTER)count, 0);
+    if ( !report_status(ctxt) )
+      goto out;
 
-					/* char(N) --> cbColDef */
-      if ( get_int_arg(1, head, &val) )	/* TBD: incomplete */
-	cbColDef = val;
-      if ( get_int_arg(2, head, &val) )	/* decimal(cbColDef, scale) */
-	params->scale = val;
-    } else
-    { TRY(ctxt, SQLDescribeParam(ctxt->hstmt,	/* hstmt */
-				 pn,		/* ipar */
-				 &sqlType,
-				 &cbColDef,     /* Characters - not bytes */
-				 &params->scale,
-				 &fNullable),
-	  (void)0);
+    processed = 0;
+    LOCK_CONTEXTS();
+    if ( !mark_context_as_executing(self, ctxt) )
+    { UNLOCK_CONTEXTS();
+      goto out;
     }
+    UNLOCK_CONTEXTS();
+    ctxt->rc = SQLExecute(ctxt->hstmt);
+    LOCK_CONTEXTS();
+    clear(ctxt, CTX_EXECUTING);
+    if ( self >= 0 )
+      executing_contexts[self] = NULL;
+    UNLOCK_CONTEXTS();
+
+    if ( ctxt->rc == SQL_ERROR )
+    { if ( !param_row_errors(status, count) )
+      { report_status(ctxt);		/* the statement failed as a whole */
+	SQLFreeStmt(ctxt->hstmt, SQL_CLOSE);
+	goto out;
+      }
+      param_diag_records(ctxt, diag, count);
+    } else
+    { SQLLEN n = 0;
 
-    params->sqlTypeID = sqlType;
-    params->plTypeID  = plType;
-    params->cTypeID   = CvtSqlToCType(ctxt, params->sqlTypeID, plType);
-    params->ptr_value = (SQLPOINTER)params->buf;
-    if ( isvar &&
-	 !PL_unify_term(head, PL_FUNCTOR, FUNCTOR_gt2,
-				PL_CHARS, pl_type_name(plType),
-				PL_CHARS, sql_type_name(sqlType)) )
-      return FALSE;
-
-    DEBUG(1, Sdprintf("param: SQL:%s, Prolog:%s, C:%s, cbColDef=%d, scale=%d\n",
-		      sql_type_name(sqlType),
-		      pl_type_name(plType),
-		      sql_c_type_name(params->cTypeID),
-		      (int)cbColDef, (int)params->scale));
-
-    switch(params->cTypeID)
-    { case SQL_C_WCHAR:
-	character_size = sizeof(SQLWCHAR);
-	/* FALLTHROUGH */
-      case SQL_C_CHAR:
-      case SQL_C_BINARY:
-	if ( cbColDef > 0 )
-	{ if ( params->sqlTypeID == SQL_DECIMAL ||
-	       params->sqlTypeID == SQL_NUMERIC )
-	  { cbColDef += 2*character_size;	/* decimal dot and '-' sign */
-	  }
-	  if ( (cbColDef+1) * character_size > PARAM_BUFSIZE )
-	  { if ( !(params->ptr_value = odbc_malloc((cbColDef+1)*character_size)) )
-	      return FALSE;
-	  }
-	  params->length_ind = cbColDef * character_size;
-	} else				/* unknown, use SQLPutData() */
-	{ params->ptr_value = (SQLPOINTER)(intptr_t)pn;
-	  params->len_value = SQL_LEN_DATA_AT_EXEC(0);
-	  DEBUG(2, Sdprintf("Using SQLPutData() for column %d\n", pn));
-	}
-	vlenptr = &params->len_value;
-	break;
-      case SQL_C_SLONG:
-	params->len_value = sizeof(SQLINTEGER);
-	vlenptr = &params->len_value;
-	break;
-      case SQL_C_SBIGINT:
-	params->len_value = sizeof(SQLBIGINT);
-	vlenptr = &params->len_value;
-	break;
-      case SQL_C_DOUBLE:
-	params->len_value = sizeof(SQLDOUBLE);
-	vlenptr = &params->len_value;
-	break;
-      case SQL_C_DATE:
-      case SQL_C_TYPE_DATE:
-	if ( !(params->ptr_value = odbc_malloc(sizeof(DATE_STRUCT))) )
-	  return FALSE;
-	params->len_value = sizeof(DATE_STRUCT);
-	vlenptr = &params->len_value;
-	break;
-      case SQL_C_TIME:
-      case SQL_C_TYPE_TIME:
-	if ( !(params->ptr_value = odbc_malloc(sizeof(TIME_STRUCT))) )
-	  return FALSE;
-	params->len_value = sizeof(TIME_STRUCT);
-	vlenptr = &params->len_value;
-	break;
-      case SQL_C_TIMESTAMP:
-	if ( !(params->ptr_value = odbc_malloc(sizeof(SQL_TIMESTAMP_STRUCT))) )
-	  return FALSE;
-	params->len_value = sizeof(SQL_TIMESTAMP_STRUCT);
-	vlenptr = &params->len_value;
-	break;
-      default:
-	Sdprintf("declare_parameters(): cTypeID %d not supported\n",
-		 params->cTypeID);
+      if ( ctxt->rc == SQL_SUCCESS_WITH_INFO && !report_status(ctxt) )
+      { SQLFreeStmt(ctxt->hstmt, SQL_CLOSE);
+	goto out;
+      }
+      if ( SQLRowCount(ctxt->hstmt, &n) == SQL_SUCCESS && n > 0 )
+	affected += n;
+      for(i=0; i<count; i++)
+	diag[i] = 0;
+    }
+
+    for(ok=0, i=0; i<count; i++)	/* before SQL_CLOSE */
+    { if ( status[i] == SQL_PARAM_SUCCESS ||
+	   status[i] == SQL_PARAM_SUCCESS_WITH_INFO )
+	ok++;
+      if ( !PL_unify_list(stail, shead, stail) ||
+	   !unify_param_status(ctxt, shead, status[i], diag[i]) )
+      { SQLFreeStmt(ctxt->hstmt, SQL_CLOSE);
+	goto out;
+      }
     }
+    SQLFreeStmt(ctxt->hstmt, SQL_CLOSE);
 
+    DEBUG(1, Sdprintf("execute_batch(): %lu rows, %lu processed, %d ok\n",
+		      (unsigned long)count, (unsigned long)processed, ok));
+  }
 
-    TRY(ctxt, SQLBindParameter(ctxt->hstmt,		/* hstmt */
-			       (SWORD)pn,		/* ipar */
-			       SQL_PARAM_INPUT,		/* fParamType */
-			       params->cTypeID,		/* fCType */
-			       params->sqlTypeID,	/* fSqlType */
-			       params->length_ind,	/* cbColDef */
-			       params->scale,		/* ibScale */
-			       params->ptr_value,	/* rgbValue */
-			       0,			/* cbValueMax */
-			       vlenptr),		/* pcbValue */
-	(void)0);
+  rc = ( PL_unify_nil(stail) &&
+	 PL_unify_term(result,
+		       PL_FUNCTOR, FUNCTOR_batch2,
+			 PL_INT64, affected,
+			 PL_TERM, statuses) );
+
+out:
+  if ( arrays )
+    unbind_param_arrays(ctxt);
+  if ( status )
+    free(status);
+  if ( diag )
+    free(diag);
+  if ( data )
+    free(data);
+  if ( arrays )
+    free(arrays);
+  if ( !release_context(ctxt) )
+    free_context(ctxt);			/* freed while we were running */
+
+  return rc;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+odbc_load(+Statement, +Stream, -Result, :Options)
+
+Load delimited records from Stream  using   the  prepared  (INSERT)
+Statement.  The fields are parsed  from   the  stream straight into the
+parameter arrays of odbc_execute_batch/3, converting   them to the C
+type of the parameter as declared by declare_parameters().  No Prolog
+terms are created for the records.
+
+A record that cannot be converted   (wrong  number of fields, syntax or
+width) or whose row reports SQL_PARAM_ERROR  is rejected.  Result is
+load(Loaded, Rejected), where Rejected  is  a   list  of  1-based record
+numbers.  The header record is not counted.
+
+A CSV field that is empty and not  quoted   is  NULL, as is the TSV field
+\N.  Empty fields are also NULL for non-text parameters.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define LOAD_CSV	0
+#define LOAD_TSV	1
+
+#define FIELD_EOF	0		/* no more records */
+#define FIELD_SEP	1		/* field followed by separator */
+#define FIELD_EOL	2		/* last field of the record */
+
+typedef struct loader
+{ IOSTREAM    *in;			/* input stream */
+  int	       format;			/* LOAD_* */
+  int	       quoted;			/* field was quoted */
+  int	       null;			/* field is NULL */
+  int	      *codes;			/* code points of the field */
+  size_t       length;			/* # codes in field */
+  size_t       allocated;		/* allocated codes */
+  int64_t     *rejected;		/* rejected record numbers */
+  size_t       nrejected;		/* # rejected */
+  size_t       rejected_allocated;	/* allocated rejected */
+} loader;
+
+
+static int
+add_field_code(loader *ld, int c)
+{ if ( ld->length == ld->allocated )
+  { size_t size = ld->allocated ? ld->allocated*2 : 256;
+    int *codes = realloc(ld->codes, size*sizeof(int));
+
+    if ( !codes )
+      return resource_error("memory");
+    ld->codes = codes;
+    ld->allocated = size;
   }
+  ld->codes[ld->length++] = c;
 
   return TRUE;
 }
 
 
-static foreign_t
-odbc_prepare(term_t conn, term_t sql, term_t parms, term_t qid, term_t options)
-{ connection *cn;
-  context *ctxt;
+static int
+add_rejected(loader *ld, int64_t record)
+{ if ( ld->nrejected == ld->rejected_allocated )
+  { size_t size = ld->rejected_allocated ? ld->rejected_allocated*2 : 64;
+    int64_t *r = realloc(ld->rejected, size*sizeof(int64_t));
+
+    if ( !r )
+      return resource_error("memory");
+    ld->rejected = r;
+    ld->rejected_allocated = size;
+  }
+  ld->rejected[ld->nrejected++] = record;
 
-  if ( !get_connection(conn, &cn) )
-    return FALSE;
+  return TRUE;
+}
 
-  if ( !(ctxt = new_context(cn)) )
-    return FALSE;
-  if ( !get_sql_text(ctxt, sql) )
-  { free_context(ctxt);
-    return FALSE;
+
+static int
+end_of_line(loader *ld, int c)
+{ if ( c == '\r' && Speekcode(ld->in) == '\n' )
+    Sgetcode(ld->in);
+
+  return c == '\n' || c == '\r' || c == -1;
+}
+
+
+/* read_field() reads the next field into ld->codes.  It returns one of
+   FIELD_EOF, FIELD_SEP or FIELD_EOL, or -1 on an I/O or memory error.
+   first is TRUE for the first field of a record.
+*/
+
+static int
+read_field(loader *ld, int first)
+{ IOSTREAM *in = ld->in;
+  int sep = (ld->format == LOAD_TSV ? '\t' : ',');
+  int c = Sgetcode(in);
+
+  ld->length = 0;
+  ld->quoted = FALSE;
+  ld->null = FALSE;
+
+  if ( c == -1 )
+  { if ( Sferror(in) )
+      return -1;
+    if ( first )
+      return FIELD_EOF;
   }
 
-  if ( ctxt->char_width == 1 )
-  { TRY(ctxt,
-	SQLPrepareA(ctxt->hstmt, ctxt->sqltext.a, ctxt->sqllen),
-	close_context(ctxt));
-  } else
-  { TRY(ctxt,
-	SQLPrepareW(ctxt->hstmt, ctxt->sqltext.w, ctxt->sqllen),
-	close_context(ctxt));
+  if ( ld->format == LOAD_CSV && c == '"' )
+  { ld->quoted = TRUE;
+    for(;;)
+    { c = Sgetcode(in);
+      if ( c == -1 )
+	break;				/* unterminated */
+      if ( c == '"' )
+      { if ( (c=Sgetcode(in)) != '"' )
+	  break;
+      }
+      if ( !add_field_code(ld, c) )
+	return -1;
+    }
   }
 
-  if ( !declare_parameters(ctxt, parms) )
-  { free_context(ctxt);
-    return FALSE;
+  for(;;)
+  { if ( c == sep )
+      break;
+    if ( end_of_line(ld, c) )
+    { if ( c == -1 && Sferror(in) )
+	return -1;
+      break;
+    }
+    if ( ld->null )			/* \N followed by more text */
+    { ld->null = FALSE;
+      if ( !add_field_code(ld, '\\') || !add_field_code(ld, 'N') )
+	return -1;
+    }
+    if ( ld->format == LOAD_TSV && c == '\\' )
+    { switch((c=Sgetcode(in)))
+      { case 't': c = '\t'; break;
+	case 'n': c = '\n'; break;
+	case 'r': c = '\r'; break;
+	case 'N':
+	  if ( ld->length == 0 )
+	  { ld->null = TRUE;
+	    c = Sgetcode(in);
+	    continue;
+	  }
+	  break;
+	case -1:
+	  c = '\\';
+	  break;
+      }
+    }
+    if ( !add_field_code(ld, c) )
+      return -1;
+    c = Sgetcode(in);
   }
 
-  ctxt->flags |= CTX_PERSISTENT;
+  return c == sep ? FIELD_SEP : FIELD_EOL;
+}
 
-  if ( !set_statement_options(ctxt, options) )
-  { free_context(ctxt);
+
+/* field_ascii() copies the field to buf as a 0-terminated string.  It
+   fails if the field does not fit or is not ASCII.
+*/
+
+static int
+field_ascii(const loader *ld, char *buf, size_t size)
+{ size_t i;
+
+  if ( ld->length >= size )
     return FALSE;
+  for(i=0; i<ld->length; i++)
+  { if ( ld->codes[i] >= 0x80 )
+      return FALSE;
+    buf[i] = (char)ld->codes[i];
   }
+  buf[i] = '\0';
 
-  return unifyStmt(qid, ctxt);
+  return TRUE;
 }
 
 
-static foreign_t
-odbc_clone_statement(term_t qid, term_t cloneqid)
-{ context *ctxt, *clone;
+static int
+parse_date_text(const char *s, DATE_STRUCT *date, int *n)
+{ int y, m, d;
 
-  if ( !getStmt(qid, &ctxt) )
+  *n = 0;
+  if ( sscanf(s, "%d-%d-%d%n", &y, &m, &d, n) != 3 ||
+       m < 1 || m > 12 || d < 1 || d > 31 )
     return FALSE;
-  if ( !(clone = clone_context(ctxt)) )
-    return FALSE;
-
-  clone->flags |= CTX_PERSISTENT;
+  date->year  = (SQLSMALLINT)y;
+  date->month = (SQLUSMALLINT)m;
+  date->day   = (SQLUSMALLINT)d;
 
-  return unifyStmt(cloneqid, clone);
+  return TRUE;
 }
 
 
-static foreign_t
-odbc_free_statement(term_t qid)
-{ context *ctxt;
+static int
+parse_time_text(const char *s, TIME_STRUCT *time, int *n)
+{ int h, m, sec;
 
-  if ( !getStmt(qid, &ctxt) )
+  *n = 0;
+  if ( sscanf(s, "%d:%d:%d%n", &h, &m, &sec, n) != 3 ||
+       h < 0 || h > 23 || m < 0 || m > 59 || sec < 0 || sec > 60 )
     return FALSE;
-
-  if ( ison(ctxt, CTX_INUSE) )
-    clear(ctxt, CTX_PERSISTENT);	/* oops, delay! */
-  else
-    free_context(ctxt);
+  time->hour   = (SQLUSMALLINT)h;
+  time->minute = (SQLUSMALLINT)m;
+  time->second = (SQLUSMALLINT)sec;
 
   return TRUE;
 }
 
 
-static int
-get_date(term_t head, DATE_STRUCT* date)
-{ if ( PL_is_functor(head, FUNCTOR_date3) )
-  { int v;
+/* parse_timestamp_text() accepts YYYY-MM-DD[( |T)HH:MM:SS[.fraction]]
+*/
 
-    if ( !get_int_arg(1, head, &v) ) return FALSE;
-    date->year = v;
-    if ( !get_int_arg(2, head, &v) ) return FALSE;
-    date->month = v;
-    if ( !get_int_arg(3, head, &v) ) return FALSE;
-    date->day = v;
+static int
+parse_timestamp_text(const char *s, SQL_TIMESTAMP_STRUCT *ts)
+{ DATE_STRUCT date;
+  TIME_STRUCT time = {0};
+  unsigned long fraction = 0;
+  int n, digits = 0;
 
-    return TRUE;
+  if ( !parse_date_text(s, &date, &n) )
+    return FALSE;
+  s += n;
+  if ( *s == ' ' || *s == 'T' )
+  { if ( !parse_time_text(s+1, &time, &n) )
+      return FALSE;
+    s += n+1;
+    if ( *s == '.' )
+    { for(s++; *s >= '0' && *s <= '9'; s++)
+      { if ( digits++ < 9 )
+	  fraction = fraction*10 + (*s-'0');
+      }
+      if ( digits == 0 )
+	return FALSE;
+      for(; digits < 9; digits++)
+	fraction *= 10;
+    }
   }
+  if ( *s )
+    return FALSE;
 
-  return FALSE;
+  ts->year     = date.year;
+  ts->month    = date.month;
+  ts->day      = date.day;
+  ts->hour     = time.hour;
+  ts->minute   = time.minute;
+  ts->second   = time.second;
+  ts->fraction = (SQLUINTEGER)fraction;
+
+  return TRUE;
 }
 
 
+/* load_text() encodes the field for a SQL_C_CHAR, SQL_C_BINARY or
+   SQL_C_WCHAR parameter.  The value buffer holds prm->length_ind bytes
+   plus the terminator (see param_element_size()).
+*/
+
 static int
-get_time(term_t head, TIME_STRUCT* time)
-{ if ( PL_is_functor(head, FUNCTOR_time3) )
-  { int v;
+load_text(const loader *ld, const parameter *prm, int rep,
+	  char *value, SQLLEN *lenp)
+{ char *o = value, *e = value+prm->length_ind;
+  size_t i;
 
-    if ( !get_int_arg(1, head, &v) ) return FALSE;
-    time->hour = v;
-    if ( !get_int_arg(2, head, &v) ) return FALSE;
-    time->minute = v;
-    if ( !get_int_arg(3, head, &v) ) return FALSE;
-    time->second = v;
+  if ( prm->cTypeID == SQL_C_WCHAR )
+  { SQLWCHAR *w = (SQLWCHAR*)value;
+    SQLWCHAR *we = (SQLWCHAR*)e;
+
+    for(i=0; i<ld->length; i++)
+    { int c = ld->codes[i];
+
+#if SIZEOF_SQLWCHAR == 2
+      if ( c > 0xffff )
+      { if ( we-w < 2 )
+	  return FALSE;
+	c -= 0x10000;
+	*w++ = (SQLWCHAR)(0xd800+(c>>10));
+	*w++ = (SQLWCHAR)(0xdc00+(c&0x3ff));
+	continue;
+      }
+#endif
+      if ( w >= we )
+	return FALSE;
+      *w++ = (SQLWCHAR)c;
+    }
+    *w = 0;
+    *lenp = (char*)w - value;
 
     return TRUE;
   }
 
-  return FALSE;
-}
+  if ( rep == REP_MB )
+  { mbstate_t mbs;
 
+    memset(&mbs, 0, sizeof(mbs));
+    for(i=0; i<ld->length; i++)
+    { char buf[MB_LEN_MAX];
+      size_t n = wcrtomb(buf, (wchar_t)ld->codes[i], &mbs);
 
-static int
-get_timestamp(term_t t, SQL_TIMESTAMP_STRUCT* stamp)
-{
-#if defined(HAVE_LOCALTIME) || defined(HAVE_GMTIME)
-  double tf;
-#endif
+      if ( n == (size_t)-1 || (size_t)(e-o) < n )
+	return FALSE;
+      memcpy(o, buf, n);
+      o += n;
+    }
+  } else
+  { for(i=0; i<ld->length; i++)
+    { int c = ld->codes[i];
 
-  if ( PL_is_functor(t, FUNCTOR_timestamp7) )
-  { int v;
+      if ( rep == REP_UTF8 && c >= 0x80 )
+      { int n = c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
 
-    if ( !get_int_arg(1, t, &v) ) return FALSE;
-    stamp->year = v;
-    if ( !get_int_arg(2, t, &v) ) return FALSE;
-    stamp->month = v;
-    if ( !get_int_arg(3, t, &v) ) return FALSE;
-    stamp->day = v;
-    if ( !get_int_arg(4, t, &v) ) return FALSE;
-    stamp->hour = v;
-    if ( !get_int_arg(5, t, &v) ) return FALSE;
-    stamp->minute = v;
-    if ( !get_int_arg(6, t, &v) ) return FALSE;
-    stamp->second = v;
-    if ( !get_int_arg(7, t, &v) ) return FALSE;
-    stamp->fraction = v;
+	if ( e-o < n )
+	  return FALSE;
+	switch(n)
+	{ case 2:
+	    *o++ = (char)(0xc0|(c>>6));
+	    break;
+	  case 3:
+	    *o++ = (char)(0xe0|(c>>12));
+	    *o++ = (char)(0x80|((c>>6)&0x3f));
+	    break;
+	  default:
+	    *o++ = (char)(0xf0|(c>>18));
+	    *o++ = (char)(0x80|((c>>12)&0x3f));
+	    *o++ = (char)(0x80|((c>>6)&0x3f));
+	}
+	*o++ = (char)(0x80|(c&0x3f));
+      } else
+      { if ( c > 0xff || o >= e )
+	  return FALSE;
+	*o++ = (char)c;
+      }
+    }
+  }
+  *o = '\0';
+  *lenp = o - value;
 
-    return TRUE;
-#if defined(HAVE_LOCALTIME) || defined(HAVE_GMTIME)
-  } else if ( PL_get_float(t, &tf) )
-  { time_t t = (time_t)tf;
-    long  ns = (long)((tf - (double)t) * 1000000000.0);
-#if defined(HAVE_GMTIME) && defined USE_UTC
-    struct tm *tm = gmtime(&t);
-#else
-    struct tm *tm = localtime(&t);
-#endif
+  return TRUE;
+}
 
-    if ( fabs(tf - (double)t) > 1.0 )
-      return FALSE;			/* out of range */
 
-    stamp->year	    = tm->tm_year + 1900;
-    stamp->month    = tm->tm_mon + 1;
-    stamp->day	    = tm->tm_mday;
-    stamp->hour	    = tm->tm_hour;
-    stamp->minute   = tm->tm_min;
-    stamp->second   = tm->tm_sec;
-    stamp->fraction = ns;
+/* load_field() converts the current field into value and *lenp.  It
+   returns FALSE if the field cannot be converted.
+*/
 
+static int
+load_field(const loader *ld, context *ctxt, const parameter *prm,
+	   char *value, SQLLEN *lenp)
+{ char buf[64];
+  char *end;
+
+  if ( ld->null ||
+       (ld->length == 0 && ld->format == LOAD_CSV && !ld->quoted) ||
+       (ld->length == 0 && prm->cTypeID != SQL_C_CHAR &&
+	prm->cTypeID != SQL_C_WCHAR && prm->cTypeID != SQL_C_BINARY) )
+  { *lenp = SQL_NULL_DATA;
     return TRUE;
-#endif
-  } else
-    return FALSE;
-}
+  }
 
+  switch(prm->cTypeID)
+  { case SQL_C_CHAR:
+      return load_text(ld, prm, ctxt->connection->rep_flag, value, lenp);
+    case SQL_C_BINARY:
+      return load_text(ld, prm, REP_ISO_LATIN_1, value, lenp);
+    case SQL_C_WCHAR:
+      return load_text(ld, prm, 0, value, lenp);
+    case SQL_C_SLONG:
+    case SQL_C_SBIGINT:
+    { long long v;
+
+      if ( !field_ascii(ld, buf, sizeof(buf)) )
+	return FALSE;
+      errno = 0;
+      v = strtoll(buf, &end, 10);
+      if ( end == buf || *end || errno == ERANGE )
+	return FALSE;
+      if ( prm->cTypeID == SQL_C_SLONG )
+      { SQLINTEGER i = (SQLINTEGER)v;
 
-static int
-try_null(context *ctxt, parameter *prm, term_t val, const char *expected)
-{ if ( is_sql_null(val, ctxt->null) )
-  { prm->len_value = SQL_NULL_DATA;
+	if ( i != v )
+	  return FALSE;
+	memcpy(value, &i, sizeof(i));
+	*lenp = sizeof(i);
+      } else
+      { SQLBIGINT i = v;
 
-    return TRUE;
-  } else
-    return type_error(val, expected);
-}
+	memcpy(value, &i, sizeof(i));
+	*lenp = sizeof(i);
+      }
+      return TRUE;
+    }
+    case SQL_C_DOUBLE:
+    { SQLDOUBLE f;
 
-static unsigned int
-plTypeID_convert_flags(int plTypeID, const char** expected)
-{ unsigned int flags;
+      if ( !field_ascii(ld, buf, sizeof(buf)) )
+	return FALSE;
+      f = strtod(buf, &end);
+      if ( end == buf || *end )
+	return FALSE;
+      memcpy(value, &f, sizeof(f));
+      *lenp = sizeof(f);
+      return TRUE;
+    }
+    case SQL_C_TYPE_DATE:
+    { int n;
 
-  switch(plTypeID)
-  { case SQL_PL_DEFAULT:
-      flags = CVT_ATOM|CVT_STRING;
-      *expected = "text";
-      break;
-    case SQL_PL_ATOM:
-      flags = CVT_ATOM;
-      *expected = "atom";
-      break;
-    case SQL_PL_STRING:
-      flags = CVT_STRING;
-      *expected = "string";
-      break;
-    case SQL_PL_CODES:
-      flags = CVT_LIST;
-      *expected = "code_list";
-      break;
+      if ( !field_ascii(ld, buf, sizeof(buf)) ||
+	   !parse_date_text(buf, (DATE_STRUCT*)value, &n) || buf[n] )
+	return FALSE;
+      *lenp = sizeof(DATE_STRUCT);
+      return TRUE;
+    }
+    case SQL_C_TYPE_TIME:
+    { int n;
+
+      if ( !field_ascii(ld, buf, sizeof(buf)) ||
+	   !parse_time_text(buf, (TIME_STRUCT*)value, &n) || buf[n] )
+	return FALSE;
+      *lenp = sizeof(TIME_STRUCT);
+      return TRUE;
+    }
+    case SQL_C_TIMESTAMP:
+      if ( !field_ascii(ld, buf, sizeof(buf)) ||
+	   !parse_timestamp_text(buf, (SQL_TIMESTAMP_STRUCT*)value) )
+	return FALSE;
+      *lenp = sizeof(SQL_TIMESTAMP_STRUCT);
+      return TRUE;
     default:
-      flags = 0; /* keep compiler happy */
-      assert(0);
+      return FALSE;
+  }
+}
+
+
+/* read_record() reads a record into row `row` of the parameter arrays.
+   It returns FIELD_EOF at the end of the input, TRUE if the record was
+   read, setting *ok to FALSE if it must be rejected, and -1 on errors.
+   Empty lines are skipped.  If arrays is NULL the record is skipped.
+*/
+
+static int
+read_record(loader *ld, context *ctxt, param_array *arrays, SQLULEN row,
+	    int *ok)
+{ int pn, rc;
+
+  for(;;)
+  { *ok = TRUE;
+    for(pn=0; ; pn++)
+    { if ( (rc=read_field(ld, pn == 0)) <= 0 )
+	return rc;
+      if ( pn == 0 && rc == FIELD_EOL &&
+	   ld->length == 0 && !ld->quoted && !ld->null )
+	break;				/* empty line */
+
+      if ( !arrays )
+      { /* skip */
+      } else if ( pn >= ctxt->NumParams )
+      { *ok = FALSE;
+      } else if ( *ok )
+      { param_array *a = &arrays[pn];
+
+	*ok = load_field(ld, ctxt, &ctxt->params[pn],
+			 a->values + row*a->element_size, &a->lengths[row]);
+      }
+
+      if ( rc == FIELD_EOL )
+      { if ( arrays && pn+1 != ctxt->NumParams )
+	  *ok = FALSE;
+	return TRUE;
+      }
+    }
   }
-  return flags;
 }
 
 
 static int
-get_datetime(term_t t, size_t *len, char *s)
-{ SQL_TIMESTAMP_STRUCT stamp;
-
-  if ( get_timestamp(t, &stamp) )
-  { size_t l;
-    char *e;
+call_progress(module_t m, term_t goal, int64_t loaded, int64_t rejected)
+{ static predicate_t pred = 0;
+  fid_t fid;
+  term_t av;
+  int rc = TRUE;
 
-    snprintf(s, *len, "%04d-%02d-%02d %02d:%02d:%02d.%09d",
-	     (int)stamp.year, (int)stamp.month, (int)stamp.day,
-	     (int)stamp.hour, (int)stamp.minute, (int)stamp.second,
-	     (int)stamp.fraction);
-    l = strlen(s);			/* return from snprintf() is not */
-    e = &s[l];
-    while(e[-1] == '0')
-      e--;
-    *e = '\0';
+  if ( !pred )
+    pred = PL_predicate("call", 3, "system");
 
-    *len = e-s;
-    return TRUE;			/* very portable (e.g., Windows) */
-  }
+  if ( !(fid = PL_open_foreign_frame()) )
+    return FALSE;
+  if ( !(av = PL_new_term_refs(3)) ||
+       !PL_put_term(av+0, goal) ||
+       !PL_put_int64(av+1, loaded) ||
+       !PL_put_int64(av+2, rejected) ||
+       (!PL_call_predicate(m, PL_Q_PASS_EXCEPTION, pred, av) &&
+	PL_exception(0)) )
+    rc = FALSE;				/* failure of Goal is ignored */
+  if ( rc )
+    PL_discard_foreign_frame(fid);
+  else
+    PL_close_foreign_frame(fid);	/* keep the exception */
 
-  return FALSE;
+  return rc;
 }
 
 
 static int
-bind_parameters(context *ctxt, term_t parms)
-{ term_t tail = PL_copy_term_ref(parms);
-  term_t head = PL_new_term_ref();
-  parameter *prm;
-
-  for(prm = ctxt->params; PL_get_list(tail, head, tail); prm++)
-  { if ( prm->len_value == SQL_LEN_DATA_AT_EXEC(0) )
-    { DEBUG(2, Sdprintf("bind_parameters(): Delaying column %zd\n",
-                        (size_t)(prm-ctxt->params+1)));
-      prm->put_data = PL_copy_term_ref(head);
-      continue;
-    }
-
-    switch(prm->cTypeID)
-    { case SQL_C_SLONG:
-      { int32_t val;
+load_commit(context *ctxt)
+{ connection *cn = ctxt->connection;
+  RETCODE rc;
 
-	if ( PL_get_integer(head, &val) )
-	{ SQLINTEGER sqlval = val;
-	  memcpy(prm->ptr_value, &sqlval, sizeof(SQLINTEGER));
-	  prm->len_value = sizeof(SQLINTEGER);
-	} else if ( !try_null(ctxt, prm, head, "32 bit integer") )
-	  return FALSE;
-	break;
-      }
-      case SQL_C_SBIGINT:
-      { int64_t val;
+  if ( (rc=SQLTransact(henv, cn->hdbc, SQL_COMMIT)) != SQL_SUCCESS )
+    return odbc_report(henv, cn->hdbc, NULL, rc);
 
-	if ( PL_get_int64(head, &val) )
-	{ SQLBIGINT sqlval = val;
-	  memcpy(prm->ptr_value, &sqlval, sizeof(SQLBIGINT));
-	  prm->len_value = sizeof(SQLBIGINT);
-	} else if ( !try_null(ctxt, prm, head, "64 bit integer") )
-	  return FALSE;
-	break;
-      }
-      case SQL_C_DOUBLE:
-	if ( PL_get_float(head, (double *)prm->ptr_value) )
-	  prm->len_value = sizeof(double);
-	else if ( !try_null(ctxt, prm, head, "float") )
-	  return FALSE;
-	break;
-      case SQL_C_CHAR:
-      case SQL_C_WCHAR:
-      case SQL_C_BINARY:
-      { SQLLEN len;
-	size_t l;
-	char *s;
-	const char *expected = "text";
-	unsigned int flags = plTypeID_convert_flags(prm->plTypeID, &expected);
+  return TRUE;
+}
 
-					/* check for NULL */
-	if ( is_sql_null(head, ctxt->null) )
-	{ prm->len_value = SQL_NULL_DATA;
-	  break;
-	}
-	if ( prm->cTypeID == SQL_C_WCHAR )
-	{ wchar_t *ws;
-	  size_t ls;
-
-	  if ( !PL_get_wchars(head, &ls, &ws, flags) )
-	    return type_error(head, expected);
-	  len = ls*sizeof(SQLWCHAR);
-	  if (  len > prm->length_ind )
-	  { DEBUG(1, Sdprintf("Column-width (SQL_C_WCHAR) = %zd\n",
-			      (size_t)prm->length_ind));
-	    return representation_error(head, "column_width");
-	  }
-	  prm->len_value = len;
-#if SIZEOF_SQLWCHAR == SIZEOF_WCHAR_T
-	  memcpy(prm->ptr_value, ws, (ls+1)*sizeof(SQLWCHAR));
-#else
-	{ wchar_t *es = ws+ls;
-	  SQLWCHAR *o;
 
-	  for(o=(SQLWCHAR*)prm->ptr_value; ws<es;)
-	    *o++ = *ws++;
-	  *o = 0;
-	}
-#endif
-	} else
-	{ char datetime_str[128];
-	  int rep = (prm->cTypeID == SQL_C_CHAR ? ctxt->connection->rep_flag
-						: REP_ISO_LATIN_1);
-
-	  l = sizeof(datetime_str);
-	  s = datetime_str;
-	  if ( !PL_get_nchars(head, &l, &s, flags|rep) &&
-	       !get_datetime(head, &l, s) )
-	    return type_error(head, expected);
-	  len = l;
-	  if ( len > prm->length_ind )
-	  { DEBUG(1, Sdprintf("Column-width (SQL_C_CHAR) = %zd\n",
-			      (size_t)prm->length_ind));
-	    return representation_error(head, "column_width");
-	  }
-	  memcpy(prm->ptr_value, s, len+1);
-	  prm->len_value = len;
-	}
+/* param_row_done() is true if row i of an array execution that
+   returned rc was executed.  Some drivers do not fill the status array
+   after a successful SQLExecute(), leaving SQL_PARAM_UNUSED.
+*/
 
-	break;
-      }
-      case SQL_C_TYPE_DATE:
-      { if ( get_date(head, (DATE_STRUCT*)prm->ptr_value) )
-	  prm->len_value = sizeof(DATE_STRUCT);
-	else if ( !try_null(ctxt, prm, head, "date") )
-	  return FALSE;
-	break;
-      }
-      case SQL_C_TYPE_TIME:
-      { if ( get_time(head, (TIME_STRUCT*)prm->ptr_value) )
-	  prm->len_value = sizeof(TIME_STRUCT);
-	else if ( !try_null(ctxt, prm, head, "time") )
-	  return FALSE;
-	break;
-      }
-      case SQL_C_TIMESTAMP:
-      { if ( get_timestamp(head, (SQL_TIMESTAMP_STRUCT*)prm->ptr_value) )
-	  prm->len_value = sizeof(SQL_TIMESTAMP_STRUCT);
-	else if ( !try_null(ctxt, prm, head, "timestamp") )
-	  return FALSE;
-	break;
-      }
-      default:
-	return PL_warning("Unknown parameter type: %d", prm->cTypeID);
-    }
+static int
+param_row_done(RETCODE rc, SQLUSMALLINT status, SQLULEN i, SQLULEN processed)
+{ switch(status)
+  { case SQL_PARAM_SUCCESS:
+    case SQL_PARAM_SUCCESS_WITH_INFO:
+      return TRUE;
+    case SQL_PARAM_DIAG_UNAVAILABLE:
+    case SQL_PARAM_UNUSED:
+      return rc != SQL_ERROR;
+    default:
+      return rc == SQL_SUCCESS && i < processed;
   }
-  if ( !PL_get_nil(tail) )
-    return type_error(tail, "list");
-
-  return TRUE;
 }
 
+
 static foreign_t
-odbc_execute(term_t qid, term_t args, term_t row, control_t handle)
-{ switch( PL_foreign_control(handle) )
-  { case PL_FIRST_CALL:
-    { context *ctxt;
-      int self = PL_thread_self();
-      if ( !getStmt(qid, &ctxt) )
-	return FALSE;
-      if ( ison(ctxt, CTX_INUSE) )
-      { context *clone;
+odbc_load(term_t qid, term_t stream, term_t result, term_t options)
+{ context *ctxt;
+  loader ld;
+  int self = PL_thread_self();
+  int chunk = BATCH_SIZE, pn;
+  int header = FALSE;
+  int64_t commit_every = 0, since_commit = 0;
+  int64_t record = 0, loaded = 0;
+  size_t bytes = 0;
+  char *data = NULL;
+  param_array *arrays = NULL;
+  SQLUSMALLINT *status = NULL;
+  int64_t *records = NULL;
+  SQLULEN processed = 0;
+  module_t m = NULL;
+  term_t progress = 0;
+  term_t tail = PL_new_term_ref();
+  term_t head = PL_new_term_ref();
+  term_t list = PL_new_term_ref();
+  IOSTREAM *in = NULL;
+  int eof = FALSE;
+  int rc = FALSE;
 
-	if ( ison(ctxt, CTX_NOAUTO) || !(clone = clone_context(ctxt)) )
-	  return context_error(qid, "in_use", "statement");
-	else
-	  ctxt = clone;
-      }
+  memset(&ld, 0, sizeof(ld));
+  if ( !PL_strip_module(options, &m, tail) )
+    return FALSE;
+  while(PL_get_list(tail, head, tail))
+  { if ( PL_is_functor(head, FUNCTOR_format1) )
+    { atom_t a;
 
-      if ( !bind_parameters(ctxt, args) )
+      if ( !get_atom_arg_ex(1, head, &a) )
+	return FALSE;
+      if ( a == ATOM_csv )
+	ld.format = LOAD_CSV;
+      else if ( a == ATOM_tsv )
+	ld.format = LOAD_TSV;
+      else
+      { term_t a = PL_new_term_ref();
+	_PL_get_arg(1, head, a);
+	return domain_error(a, "load_format");
+      }
+    } else if ( PL_is_functor(head, FUNCTOR_header1) )
+    { if ( !get_bool_arg_ex(1, head, &header) )
 	return FALSE;
+    } else if ( PL_is_functor(head, FUNCTOR_batch_size1) )
+    { if ( !get_int_arg_ex(1, head, &chunk) )
+	return FALSE;
+      if ( chunk < 1 )
+	return domain_error(head, "batch_size");
+    } else if ( PL_is_functor(head, FUNCTOR_commit1) )
+    { int n;
 
-      set(ctxt, CTX_INUSE);
-      clear(ctxt, CTX_PREFETCHED);
-      LOCK_CONTEXTS();
-      if (!mark_context_as_executing(self, ctxt))
-      { UNLOCK_CONTEXTS();
+      if ( !get_int_arg_ex(1, head, &n) )
 	return FALSE;
-      }
-      UNLOCK_CONTEXTS();
-      ctxt->rc = SQLExecute(ctxt->hstmt);
-      LOCK_CONTEXTS();
-      clear(ctxt, CTX_EXECUTING);
-      if ( self >= 0 )
-	executing_contexts[self] = NULL;
-      UNLOCK_CONTEXTS();
-      while( ctxt->rc == SQL_NEED_DATA )
-      { PTR token;
+      if ( n < 1 )
+	return domain_error(head, "commit");
+      commit_every = n;
+    } else if ( PL_is_functor(head, FUNCTOR_progress1) )
+    { progress = PL_new_term_ref();
+      _PL_get_arg(1, head, progress);
+    } else
+      return domain_error(head, "load_option");
+  }
+  if ( !PL_get_nil(tail) )
+    return type_error(tail, "list");
 
-	if ( (ctxt->rc = SQLParamData(ctxt->hstmt, &token)) == SQL_NEED_DATA )
-	{ parameter *p = &ctxt->params[(intptr_t)token - 1];
-	  size_t len;
-	  char *s;
+  if ( !getStmt(qid, &ctxt) )
+    return FALSE;
+  if ( ctxt->NumParams == 0 )
+    return permission_error("load", "statement", qid);
+  for(pn=0; pn<ctxt->NumParams; pn++)
+  { if ( ctxt->params[pn].len_value == SQL_LEN_DATA_AT_EXEC(0) )
+      return permission_error("load", "statement", qid);
+  }
+  if ( !claim_statement(ctxt) )
+    return context_error(qid, "in_use", "statement");
+
+  for(pn=0; pn<ctxt->NumParams; pn++)
+    bytes += chunk*sizeof(SQLLEN) +
+	     ROW_ALIGN(chunk*param_element_size(&ctxt->params[pn]));
+
+  if ( !(arrays = odbc_malloc((ctxt->NumParams+1)*sizeof(*arrays))) ||
+       !(data = odbc_malloc(bytes+1)) ||
+       !(status = odbc_malloc(chunk*sizeof(*status))) ||
+       !(records = odbc_malloc(chunk*sizeof(*records))) )
+    goto out;
+
+  bytes = 0;
+  for(pn=0; pn<ctxt->NumParams; pn++)
+  { arrays[pn].element_size = param_element_size(&ctxt->params[pn]);
+    arrays[pn].lengths = (SQLLEN*)(data+bytes);
+    bytes += chunk*sizeof(SQLLEN);
+    arrays[pn].values = data+bytes;
+    bytes += ROW_ALIGN(chunk*arrays[pn].element_size);
+  }
 
-	  if ( is_sql_null(p->put_data, ctxt->null) )
-	  { s = NULL;
-	    len = SQL_NULL_DATA;
-	    SQLPutData(ctxt->hstmt, s, len);
-	  } else
-	  { const char *expected = "text";
-	    unsigned int flags = plTypeID_convert_flags(p->plTypeID, &expected);
+  if ( !PL_get_stream(stream, &in, SIO_INPUT) )
+    goto out;
+  ld.in = in;
 
-	    if ( p->cTypeID == SQL_C_WCHAR )
-	    { wchar_t *ws;
+  if ( header )
+  { int ok;
 
-	      if ( !PL_get_wchars(p->put_data, &len, &ws, flags) )
-	      { SQLCancel(ctxt->hstmt);
-		return type_error(p->put_data, expected);
-	      }
-#if SIZEOF_SQLWCHAR == SIZEOF_WCHAR_T
-	      SQLPutData(ctxt->hstmt, ws, len*sizeof(SQLWCHAR));
-#else
-	    { SQLWCHAR fast[256];
-	      SQLWCHAR *tmp;
-	      wchar_t *es = ws+len;
-	      SQLWCHAR *o;
+    if ( read_record(&ld, ctxt, NULL, 0, &ok) < 0 )
+      goto out;
+  }
 
-	      if ( len+1 <= sizeof(fast)/sizeof(SQLWCHAR) )
-	      { tmp = fast;
-	      } else
-	      { if ( !(tmp = odbc_malloc((len+1)*sizeof(SQLWCHAR))) )
-		{ SQLCancel(ctxt->hstmt);
-		  return FALSE;
-		}
-	      }
+  if ( !bind_param_arrays(ctxt, arrays, status, &processed) )
+    goto out;
+  ctxt->stmt_statistics.executions++;
 
-	      for(o=tmp; ws<es;)
-		*o++ = *ws++;
-	      *o = 0;
-	      SQLPutData(ctxt->hstmt, tmp, len*sizeof(SQLWCHAR));
+  while( !eof )
+  { SQLULEN count = 0, i;
+    int ok;
 
-	      if ( tmp != fast )
-		free(tmp);
-	    }
-#endif
-	    } else
-	    { int rep = (p->cTypeID == SQL_C_BINARY ? REP_ISO_LATIN_1
-						    : ctxt->connection->rep_flag);
+    while( count < (SQLULEN)chunk )
+    { int r = read_record(&ld, ctxt, arrays, count, &ok);
 
-	      if ( !PL_get_nchars(p->put_data, &len, &s, flags|rep) )
-	      { SQLCancel(ctxt->hstmt);
-		return type_error(p->put_data, expected);
-	      }
-	      SQLPutData(ctxt->hstmt, s, len);
-	    }
-	  }
-	}
+      if ( r < 0 )
+	goto out;
+      if ( r == FIELD_EOF )
+      { eof = TRUE;
+	break;
       }
-      if ( !report_status(ctxt) )
-      { close_context(ctxt);
-	return FALSE;
+      if ( (++record % SIGNAL_CHECK_ROWS) == 0 && PL_handle_signals() < 0 )
+	goto out;
+      if ( ok )
+      { status[count] = SQL_PARAM_UNUSED;
+	records[count++] = record;
+      } else if ( !add_rejected(&ld, record) )
+	goto out;
+    }
+    if ( count == 0 )
+      break;
+
+    ctxt->rc = SQLSetStmtAttr(ctxt->hstmt, SQL_ATTR_PARAMSET_SIZE,
+			      (SQLPOINTER)count, 0);
+    if ( !report_status(ctxt) )
+      goto out;
+
+    processed = 0;
+    LOCK_CONTEXTS();
+    if ( !mark_context_as_executing(self, ctxt) )
+    { UNLOCK_CONTEXTS();
+      goto out;
+    }
+    UNLOCK_CONTEXTS();
+    ctxt->rc = SQLExecute(ctxt->hstmt);
+    LOCK_CONTEXTS();
+    clear(ctxt, CTX_EXECUTING);
+    if ( self >= 0 )
+      executing_contexts[self] = NULL;
+    UNLOCK_CONTEXTS();
+
+    if ( ctxt->rc == SQL_ERROR )
+    { if ( !param_row_errors(status, count) )
+      { report_status(ctxt);		/* the statement failed as a whole */
+	SQLFreeStmt(ctxt->hstmt, SQL_CLOSE);
+	goto out;
       }
+    } else if ( ctxt->rc == SQL_SUCCESS_WITH_INFO && !report_status(ctxt) )
+    { SQLFreeStmt(ctxt->hstmt, SQL_CLOSE);
+      goto out;
+    }
+    SQLFreeStmt(ctxt->hstmt, SQL_CLOSE);
+
+    for(i=0; i<count; i++)
+    { if ( param_row_done(ctxt->rc, status[i], i, processed) )
+      { loaded++;
+	since_commit++;
+      } else if ( !add_rejected(&ld, records[i]) )
+	goto out;
+    }
 
-      if ( ison(ctxt, CTX_NOAUTO) )
-	return TRUE;
+    DEBUG(1, Sdprintf("odbc_load(): %lu rows, %lu processed, %lld loaded\n",
+		      (unsigned long)count, (unsigned long)processed,
+		      (long long)loaded));
 
-      return odbc_row(ctxt, row);
+    if ( commit_every && since_commit >= commit_every )
+    { if ( !load_commit(ctxt) )
+	goto out;
+      since_commit = 0;
     }
+    if ( progress && !call_progress(m, progress, loaded, ld.nrejected) )
+      goto out;
+  }
 
-    case PL_REDO:
-      return odbc_row(PL_foreign_context_address(handle), row);
+  if ( commit_every && since_commit > 0 && !load_commit(ctxt) )
+    goto out;
 
-    case PL_PRUNED:
-      close_context(PL_foreign_context_address(handle));
-      return TRUE;
+  { size_t i;
+    term_t ltail = PL_copy_term_ref(list);
 
-    default:
-      assert(0);
-      return FALSE;
+    for(i=0; i<ld.nrejected; i++)
+    { if ( !PL_unify_list(ltail, head, ltail) ||
+	   !PL_unify_int64(head, ld.rejected[i]) )
+	goto out;
+    }
+    rc = ( PL_unify_nil(ltail) &&
+	   PL_unify_term(result,
+			 PL_FUNCTOR, FUNCTOR_load2,
+			   PL_INT64, loaded,
+			   PL_TERM, list) );
   }
+
+out:
+  if ( in && !PL_release_stream(in) )
+    rc = FALSE;
+  if ( arrays )
+    unbind_param_arrays(ctxt);
+  if ( records )
+    free(records);
+  if ( status )
+    free(status);
+  if ( data )
+    free(data);
+  if ( arrays )
+    free(arrays);
+  if ( ld.codes )
+    free(ld.codes);
+  if ( ld.rejected )
+    free(ld.rejected);
+  if ( !release_context(ctxt) )
+    free_context(ctxt);			/* freed by the progress goal */
+
+  return rc;
 }
 
 
@@ -3920,8 +9338,13 @@ odbc_next_result_set(term_t qid, control_t handle)
      re-prepare them for the new result set
   */
   SQLFreeStmt(ctxt->hstmt, SQL_UNBIND);
+  free_rowset(ctxt);
   free_parameters(ctxt->NumCols, ctxt->result);
   ctxt->result = NULL;
+  if ( ctxt->dict )
+  { free_dict_layout(ctxt->dict);
+    ctxt->dict = NULL;
+  }
   clear(ctxt, CTX_BOUND);
 
   switch (rc)
@@ -3957,6 +9380,9 @@ odbc_fetch(term_t qid, term_t row, term_t options)
   { if ( !prepare_result(ctxt) )
       return FALSE;
     set(ctxt, CTX_BOUND);
+  } else if ( ctxt->rowset )		/* bound by odbc_query/3 */
+  { if ( !bind_columns(ctxt) )
+      return FALSE;
   }
 
   if ( !ctxt->result )			/* not a SELECT statement */
@@ -4007,28 +9433,160 @@ odbc_fetch(term_t qid, term_t row, term_t options)
 	return FALSE;			/* with pending exception */
       }
 
-      return PL_unify(local_trow, row);
-    default:
-      if ( !report_status(ctxt) )
-      { close_context(ctxt);
-	return FALSE;
-      }
+      return PL_unify(local_trow, row);
+    default:
+      if ( !report_status(ctxt) )
+      { close_context(ctxt);
+	return FALSE;
+      }
+
+      return TRUE;
+  }
+}
+
+
+static foreign_t
+odbc_close_statement(term_t qid)
+{ context *ctxt;
+
+  if ( !getStmt(qid, &ctxt) )
+    return FALSE;
+
+  close_context(ctxt);
+
+  return TRUE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Lazy result sets (odbc_query_lazy/4 in odbc.pl)
+
+'$odbc_lazy_open'(+Conn, +SQL, +Options, -Statement) executes SQL and
+returns the statement as a handle for '$odbc_lazy_fetch'/4, which is
+the callback of lazy_list/2.  The context is not persistent, so it is
+freed by close_context() after the last row.  It is only CTX_INUSE
+while fetching, such that the release hook of the handle frees it if
+the lazy list is abandoned before the end.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static foreign_t
+odbc_lazy_open(term_t conn, term_t tquery, term_t options, term_t qid)
+{ connection *cn;
+  context *ctxt;
+  int self = PL_thread_self();
+
+  if ( !get_connection(conn, &cn) )
+    return FALSE;
+  if ( !(ctxt = new_context(cn)) )
+    return FALSE;
+  if ( !get_sql_text(ctxt, tquery) ||
+       !set_statement_options(ctxt, options) )
+  { free_context(ctxt);
+    return FALSE;
+  }
+  if ( ctxt->findall || ctxt->aggregate ||
+       ison(ctxt, CTX_COLUMN_LISTS|CTX_STREAMS) )
+  { free_context(ctxt);
+    return permission_error("lazy_list", "odbc_option", options);
+  }
+
+  set(ctxt, CTX_INUSE);
+  start_deadline(ctxt);
+  LOCK_CONTEXTS();
+  if ( !mark_context_as_executing(self, ctxt) )
+  { UNLOCK_CONTEXTS();
+    close_context(ctxt);
+    return FALSE;
+  }
+  UNLOCK_CONTEXTS();
+  if ( ctxt->char_width == 1 )
+  { TRY(ctxt,
+	SQLExecDirectA(ctxt->hstmt, ctxt->sqltext.a, ctxt->sqllen),
+	unmark_and_close_context(ctxt));
+  } else
+  { TRY(ctxt,
+	SQLExecDirectW(ctxt->hstmt, ctxt->sqltext.w, ctxt->sqllen),
+	unmark_and_close_context(ctxt));
+  }
+  LOCK_CONTEXTS();
+  clear(ctxt, CTX_EXECUTING);
+  if ( self >= 0 )
+    executing_contexts[self] = NULL;
+  UNLOCK_CONTEXTS();
+
+  if ( !prepare_result(ctxt) )
+  { close_context(ctxt);
+    return FALSE;
+  }
+  set(ctxt, CTX_BOUND);
+  clear(ctxt, CTX_INUSE);
 
-      return TRUE;
+  if ( !unifyStmt(qid, ctxt) )
+  { free_context(ctxt);
+    return FALSE;
   }
+
+  return TRUE;
 }
 
 
+/* '$odbc_lazy_fetch'(+Statement, +Max, -List, -Tail) unifies List with
+   a list of at most Max rows ending in Tail.  At the end of the result
+   set, Tail is unified with [] and the statement is closed.
+*/
+
 static foreign_t
-odbc_close_statement(term_t qid)
+odbc_lazy_fetch(term_t qid, term_t max, term_t list, term_t tail)
 { context *ctxt;
+  term_t ltail = PL_copy_term_ref(list);
+  term_t head = PL_new_term_ref();
+  term_t tmp = PL_new_term_ref();
+  int n, i;
 
   if ( !getStmt(qid, &ctxt) )
     return FALSE;
+  if ( !PL_get_integer_ex(max, &n) )
+    return FALSE;
+  if ( n < 1 )
+    return domain_error(max, "positive_integer");
+  if ( !claim_statement(ctxt) )
+    return context_error(qid, "in_use", "statement");
 
-  close_context(ctxt);
+  if ( !ctxt->result || ctxt->rc == SQL_NO_DATA_FOUND )
+  { close_context(ctxt);
+    return PL_unify_nil(list) && PL_unify_nil(tail);
+  }
+  if ( !mark_fetching(ctxt) )		/* close_context() unmarks */
+  { close_context(ctxt);
+    return FALSE;
+  }
 
-  return TRUE;
+  for(i=0; i<n; i++)
+  { switch(fetch_row(ctxt))
+    { case FALSE:
+	close_context(ctxt);
+	return PL_unify_nil(ltail) && PL_unify_nil(tail);
+      case TRUE:
+	break;
+      default:
+	close_context(ctxt);
+	return FALSE;
+    }
+
+    if ( !pl_put_row(tmp, ctxt) ||
+	 !PL_unify_list(ltail, head, ltail) ||
+	 !PL_unify(head, tmp) )
+    { close_context(ctxt);
+      return FALSE;
+    }
+  }
+
+  unmark_fetching(ctxt);
+  LOCK();				/* not persistent: no release_context() */
+  clear(ctxt, CTX_INUSE);
+  UNLOCK();
+
+  return PL_unify(ltail, tail);
 }
 
 #ifdef O_PLMT
@@ -4059,6 +9617,12 @@ $odbc_statistics/1
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
 static functor_t FUNCTOR_statements2;	/* statements(created,freed) */
+static functor_t FUNCTOR_handles2;	/* handles(allocated,reused) */
+static functor_t FUNCTOR_collected1;	/* collected(statements) */
+static functor_t FUNCTOR_getdata_buffers2; /* getdata_buffers(Bytes, Allocs) */
+static functor_t FUNCTOR_executions1;	/* executions(Count) */
+static functor_t FUNCTOR_rows1;		/* rows(Count) */
+static functor_t FUNCTOR_clones1;	/* clones(Count) */
 
 static int
 unify_int_arg(int pos, term_t t, long val)
@@ -4080,6 +9644,17 @@ odbc_statistics(term_t what)
   { if ( unify_int_arg(1, what, statistics.statements_created) &&
 	 unify_int_arg(2, what, statistics.statements_freed) )
       return TRUE;
+  } else if ( PL_is_functor(what, FUNCTOR_handles2) )
+  { if ( unify_int_arg(1, what, statistics.handles_allocated) &&
+	 unify_int_arg(2, what, statistics.handles_reused) )
+      return TRUE;
+  } else if ( PL_is_functor(what, FUNCTOR_collected1) )
+  { if ( unify_int_arg(1, what, statistics.statements_collected) )
+      return TRUE;
+  } else if ( PL_is_functor(what, FUNCTOR_getdata_buffers2) )
+  { if ( unify_int_arg(1, what, statistics.getdata_bytes) &&
+	 unify_int_arg(2, what, statistics.getdata_allocations) )
+      return TRUE;
   } else
     return domain_error(what, "odbc_statistics");
 
@@ -4087,6 +9662,45 @@ odbc_statistics(term_t what)
 }
 
 
+/* Statistics of a single prepared statement.  Rows fetched by pooled
+   clones are accounted to the statement they were cloned from.
+*/
+
+static foreign_t
+odbc_statement_statistics(term_t qid, term_t what)
+{ context *ctxt, *c;
+
+  if ( !getStmt(qid, &ctxt) )
+    return FALSE;
+  if ( !PL_is_compound(what) )
+    return type_error(what, "compound");
+
+  if ( PL_is_functor(what, FUNCTOR_executions1) )
+  { return unify_int_arg(1, what, (long)ctxt->stmt_statistics.executions);
+  } else if ( PL_is_functor(what, FUNCTOR_rows1) )
+  { int64_t rows = ctxt->stmt_statistics.rows;
+
+    LOCK();
+    for(c=ctxt->clones; c; c=c->next_clone)
+      rows += c->stmt_statistics.rows;
+    UNLOCK();
+
+    return unify_int_arg(1, what, (long)rows);
+  } else if ( PL_is_functor(what, FUNCTOR_clones1) )
+  { long count = 0;
+
+    LOCK();
+    for(c=ctxt->clones; c; c=c->next_clone)
+      count++;
+    UNLOCK();
+
+    return unify_int_arg(1, what, count);
+  }
+
+  return domain_error(what, "odbc_statement_statistics");
+}
+
+
 static foreign_t
 odbc_debug(term_t level)
 { if ( !PL_get_integer(level, &odbc_debuglevel) )
@@ -4159,6 +9773,30 @@ install_odbc4pl()
    ATOM_bookmark      = PL_new_atom("bookmark");
    ATOM_strict        = PL_new_atom("strict");
    ATOM_relaxed       = PL_new_atom("relaxed");
+   ATOM_column        = PL_new_atom("column");
+   ATOM_text	      =	PL_new_atom("text");
+   ATOM_rational      =	PL_new_atom("rational");
+   ATOM_success       = PL_new_atom("success");
+   ATOM_success_with_info = PL_new_atom("success_with_info");
+   ATOM_error         = PL_new_atom("error");
+   ATOM_unused        = PL_new_atom("unused");
+   ATOM_no_info       = PL_new_atom("no_info");
+   ATOM_infinite      = PL_new_atom("infinite");
+   ATOM_time_limit_exceeded = PL_new_atom("time_limit_exceeded");
+   ATOM_local		      =	PL_new_atom("local");
+   ATOM_utc		      =	PL_new_atom("utc");
+   ATOM_dict          = PL_new_atom("dict");
+   ATOM_columns       = PL_new_atom("columns");
+   ATOM_csv           = PL_new_atom("csv");
+   ATOM_tsv           = PL_new_atom("tsv");
+   ATOM_json          = PL_new_atom("json");
+   ATOM_truncate      = PL_new_atom("truncate");
+   ATOM_count         = PL_new_atom("count");
+   ATOM_sum           = PL_new_atom("sum");
+   ATOM_min           = PL_new_atom("min");
+   ATOM_max           = PL_new_atom("max");
+   ATOM_bag           = PL_new_atom("bag");
+   ATOM_set           = PL_new_atom("set");
 
    FUNCTOR_timestamp7		 = MKFUNCTOR("timestamp", 7);
    FUNCTOR_time3		 = MKFUNCTOR("time", 3);
@@ -4171,8 +9809,6 @@ install_odbc4pl()
    FUNCTOR_resource_error1	 = MKFUNCTOR("resource_error", 1);
    FUNCTOR_permission_error3	 = MKFUNCTOR("permission_error", 3);
    FUNCTOR_representation_error1 = MKFUNCTOR("representation_error", 1);
-   FUNCTOR_odbc_statement1	 = MKFUNCTOR("$odbc_statement", 1);
-   FUNCTOR_odbc_connection1	 = MKFUNCTOR("$odbc_connection", 1);
    FUNCTOR_encoding1		 = MKFUNCTOR("encoding", 1);
    FUNCTOR_user1		 = MKFUNCTOR("user", 1);
    FUNCTOR_password1		 = MKFUNCTOR("password", 1);
@@ -4189,6 +9825,12 @@ install_odbc4pl()
    FUNCTOR_gt2			 = MKFUNCTOR(">", 2);
    FUNCTOR_context_error3	 = MKFUNCTOR("context_error", 3);
    FUNCTOR_statements2		 = MKFUNCTOR("statements", 2);
+   FUNCTOR_handles2		 = MKFUNCTOR("handles", 2);
+   FUNCTOR_collected1		 = MKFUNCTOR("collected", 1);
+   FUNCTOR_getdata_buffers2	 = MKFUNCTOR("getdata_buffers", 2);
+   FUNCTOR_executions1		 = MKFUNCTOR("executions", 1);
+   FUNCTOR_rows1		 = MKFUNCTOR("rows", 1);
+   FUNCTOR_clones1		 = MKFUNCTOR("clones", 1);
    FUNCTOR_data_source2		 = MKFUNCTOR("data_source", 2);
    FUNCTOR_null1		 = MKFUNCTOR("null", 1);
    FUNCTOR_source1		 = MKFUNCTOR("source", 1);
@@ -4200,6 +9842,40 @@ install_odbc4pl()
    FUNCTOR_affected1		 = MKFUNCTOR("affected", 1);
    FUNCTOR_fetch1		 = MKFUNCTOR("fetch", 1);
    FUNCTOR_wide_column_threshold1= MKFUNCTOR("wide_column_threshold", 1);
+   FUNCTOR_fetch_size1		 = MKFUNCTOR("fetch_size", 1);
+   FUNCTOR_binding1		 = MKFUNCTOR("binding", 1);
+   FUNCTOR_batch2		 = MKFUNCTOR("batch", 2);
+   FUNCTOR_load2		 = MKFUNCTOR("load", 2);
+   FUNCTOR_batch_size1		 = MKFUNCTOR("batch_size", 1);
+   FUNCTOR_commit1		 = MKFUNCTOR("commit", 1);
+   FUNCTOR_progress1		 = MKFUNCTOR("progress", 1);
+   FUNCTOR_statement_cache1	 = MKFUNCTOR("statement_cache", 1);
+   FUNCTOR_statement_cache_threshold1 =
+				   MKFUNCTOR("statement_cache_threshold", 1);
+   FUNCTOR_statement_pool1	 = MKFUNCTOR("statement_pool", 1);
+   FUNCTOR_size1		 = MKFUNCTOR("size", 1);
+   FUNCTOR_entries1		 = MKFUNCTOR("entries", 1);
+   FUNCTOR_hits1		 = MKFUNCTOR("hits", 1);
+   FUNCTOR_misses1		 = MKFUNCTOR("misses", 1);
+   FUNCTOR_evictions1		 = MKFUNCTOR("evictions", 1);
+   FUNCTOR_min_size1		 = MKFUNCTOR("min_size", 1);
+   FUNCTOR_max_size1		 = MKFUNCTOR("max_size", 1);
+   FUNCTOR_idle_timeout1	 = MKFUNCTOR("idle_timeout", 1);
+   FUNCTOR_wait_timeout1	 = MKFUNCTOR("wait_timeout", 1);
+   FUNCTOR_validate1		 = MKFUNCTOR("validate", 1);
+   FUNCTOR_timeout1		 = MKFUNCTOR("timeout", 1);
+   FUNCTOR_timezone1		 = MKFUNCTOR("timezone", 1);
+   FUNCTOR_decimal1		 = MKFUNCTOR("decimal", 1);
+   FUNCTOR_row_format1		 = MKFUNCTOR("row_format", 1);
+   FUNCTOR_duplicate_key1	 = MKFUNCTOR("duplicate_key", 1);
+   FUNCTOR_aggregate2		 = MKFUNCTOR("aggregate", 2);
+   FUNCTOR_plus2		 = MKFUNCTOR("+", 2);
+   FUNCTOR_format1		 = MKFUNCTOR("format", 1);
+   FUNCTOR_header1		 = MKFUNCTOR("header", 1);
+   FUNCTOR_max_rows1		 = MKFUNCTOR("max_rows", 1);
+   FUNCTOR_max_bytes1		 = MKFUNCTOR("max_bytes", 1);
+   FUNCTOR_on_limit1		 = MKFUNCTOR("on_limit", 1);
+   FUNCTOR_stream1		 = MKFUNCTOR("stream", 1);
 
    DET("odbc_set_option",	   1, pl_odbc_set_option);
    DET("odbc_connect",		   3, pl_odbc_connect);
@@ -4213,20 +9889,32 @@ install_odbc4pl()
    DET("odbc_clone_statement",	   2, odbc_clone_statement);
    DET("odbc_free_statement",	   1, odbc_free_statement);
    NDET("odbc_execute",		   3, odbc_execute);
+   DET("odbc_execute_batch",	   3, odbc_execute_batch);
+   DET("odbc_load",		   4, odbc_load);
    DET("odbc_fetch",		   3, odbc_fetch);
    DET("odbc_next_result_set",	   1, odbc_next_result_set);
    DET("odbc_close_statement",	   1, odbc_close_statement);
+   DET("$odbc_lazy_open",	   4, odbc_lazy_open);
+   DET("$odbc_lazy_fetch",	   4, odbc_lazy_fetch);
 #ifdef O_PLMT
    DET("odbc_cancel_thread",	   1, odbc_cancel_thread);
 #endif
 
    NDET("odbc_query",		   4, pl_odbc_query);
+   DET("odbc_export",		   4, odbc_export);
+   DET("$odbc_export_decimal",	   2, odbc_export_decimal);
    NDET("odbc_tables",		   2, odbc_tables);
    NDET("odbc_column",		   3, pl_odbc_column);
    NDET("odbc_types",		   3, odbc_types);
    DET("odbc_data_sources",	   1, odbc_data_sources);
 
    DET("$odbc_statistics",	   1, odbc_statistics);
+   DET("$odbc_statement_statistics", 2, odbc_statement_statistics);
+   DET("odbc_pool_create",	   3, odbc_pool_create);
+   DET("odbc_pool_destroy",	   1, odbc_pool_destroy);
+   DET("$odbc_pool_acquire",	   2, odbc_pool_acquire);
+   DET("$odbc_pool_release",	   2, odbc_pool_release);
+   DET("$odbc_pool_statistics",	   2, odbc_pool_statistics);
    DET("odbc_debug",		   1, odbc_debug);
 
    NDET("odbc_primary_key",	   3, odbc_primary_key);
@@ -4311,6 +9999,7 @@ CvtSqlToCType(context *ctxt, SQLSMALLINT fSqlType, SQLSMALLINT plTypeID)
     case SQL_PL_ATOM:
     case SQL_PL_STRING:
     case SQL_PL_CODES:
+    case SQL_PL_STREAM:
       switch (fSqlType)
       { case SQL_BINARY:
 	case SQL_VARBINARY:
@@ -4353,6 +10042,346 @@ CvtSqlToCType(context *ctxt, SQLSMALLINT fSqlType, SQLSMALLINT plTypeID)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Columns of type `stream` are not materialised.  Instead, the value is
+bound to an input stream that fetches the data in chunks of the stream's
+buffer size using SQLGetData().  The stream is only valid for the
+current row: fetch_row(), close_context() and free_context() call
+invalidate_column_streams(), after which reading the remainder raises
+an I/O error.  The first chunk is read when the stream is created to
+map SQL NULL to the null value of the statement.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct column_stream
+{ context      *ctxt;			/* statement (NULL: invalidated) */
+  IOSTREAM     *stream;			/* the Prolog stream */
+  SQLUSMALLINT column;			/* 1-based column number */
+  SWORD	       cTypeID;			/* C type for SQLGetData() */
+  int	       eof;			/* read the last chunk */
+  int	       null;			/* value is SQL NULL */
+  size_t       first_len;		/* bytes in first[] */
+  size_t       first_off;		/* bytes of first[] consumed */
+  struct column_stream *next;		/* next stream of ctxt */
+  char	       first[256];		/* first chunk */
+} column_stream;
+
+
+static void
+invalidate_column_streams(context *ctxt)
+{ column_stream *cs, *next;
+
+  for(cs=ctxt->streams; cs; cs=next)
+  { next = cs->next;
+    cs->ctxt = NULL;
+    cs->next = NULL;
+  }
+  ctxt->streams = NULL;
+}
+
+
+/* get_column_chunk() reads the next chunk of at most size bytes.  It
+   returns the number of bytes read, 0 at the end and -1 on an error.
+   SQLGetData() 0-terminates SQL_C_CHAR and SQL_C_WCHAR data, so these
+   leave room for the terminator.
+*/
+
+static ssize_t
+get_column_chunk(column_stream *cs, char *buf, size_t size)
+{ context *ctxt = cs->ctxt;
+  size_t pad;
+  SQLLEN len;
+
+  if ( cs->eof )
+    return 0;
+
+  switch(cs->cTypeID)
+  { case SQL_C_CHAR:
+      pad = sizeof(SQLCHAR);
+      break;
+    case SQL_C_WCHAR:
+      pad = sizeof(SQLWCHAR);
+      size -= size%sizeof(SQLWCHAR);
+      break;
+    default:
+      pad = 0;
+  }
+  if ( size <= pad )
+    return -1;
+
+  ctxt->rc = SQLGetData(ctxt->hstmt, cs->column, cs->cTypeID,
+			buf, size, &len);
+  switch(ctxt->rc)
+  { case SQL_NO_DATA:
+      cs->eof = TRUE;
+      return 0;
+    case SQL_SUCCESS:
+    case SQL_SUCCESS_WITH_INFO:
+      if ( len == SQL_NULL_DATA )
+      { cs->null = TRUE;
+	cs->eof = TRUE;
+	return 0;
+      }
+      if ( len != SQL_NO_TOTAL && (size_t)len+pad <= size )
+      { cs->eof = TRUE;			/* this is the last chunk */
+	return len;
+      }
+      return size-pad;
+    default:
+      return -1;
+  }
+}
+
+
+static ssize_t
+Sread_column(void *handle, char *buf, size_t size)
+{ column_stream *cs = handle;
+  ssize_t n;
+
+  if ( cs->first_off < cs->first_len )
+  { n = cs->first_len - cs->first_off;
+    if ( (size_t)n > size )
+      n = size;
+    memcpy(buf, &cs->first[cs->first_off], n);
+    cs->first_off += n;
+
+    return n;
+  }
+
+  if ( cs->eof )
+    return 0;
+  if ( !cs->ctxt )
+  { Sseterr(cs->stream, SIO_FERR, "ODBC column stream is no longer valid");
+    return -1;
+  }
+  if ( (n=get_column_chunk(cs, buf, size)) < 0 )
+    Sseterr(cs->stream, SIO_FERR, "ODBC: SQLGetData() failed");
+
+  return n;
+}
+
+
+static int
+Sclose_column(void *handle)
+{ column_stream *cs = handle;
+
+  if ( cs->ctxt )
+  { column_stream **csp;
+
+    for(csp = &cs->ctxt->streams; *csp; csp = &(*csp)->next)
+    { if ( *csp == cs )
+      { *csp = cs->next;
+	break;
+      }
+    }
+  }
+  free(cs);
+
+  return 0;
+}
+
+
+static IOFUNCTIONS column_stream_functions =
+{ Sread_column,
+  NULL,					/* write */
+  NULL,					/* seek */
+  Sclose_column
+};
+
+
+static int
+put_column_stream(context *c, int nth, term_t val)
+{ parameter *p = &c->result[nth];
+  column_stream *cs;
+  IOSTREAM *s;
+  ssize_t n;
+  int flags = SIO_INPUT|SIO_FBUF|SIO_RECORDPOS;
+
+  if ( !(cs = odbc_malloc(sizeof(*cs))) )
+    return FALSE;
+  memset(cs, 0, sizeof(*cs));
+  cs->ctxt    = c;
+  cs->column  = (SQLUSMALLINT)(nth+1);
+  cs->cTypeID = p->cTypeID;
+
+  if ( (n=get_column_chunk(cs, cs->first, sizeof(cs->first))) < 0 )
+  { free(cs);
+    return report_status(c);
+  }
+  if ( cs->null )
+  { free(cs);
+    return put_sql_null(val, c->null);
+  }
+  cs->first_len = n;
+
+  if ( p->cTypeID != SQL_C_BINARY )
+    flags |= SIO_TEXT;
+  if ( !(s = Snew(cs, flags, &column_stream_functions)) )
+  { free(cs);
+    return resource_error("memory");
+  }
+  switch(p->cTypeID)
+  { case SQL_C_BINARY:
+      s->encoding = ENC_OCTET;
+      break;
+    case SQL_C_WCHAR:
+      s->encoding = ENC_SQLWCHAR;
+      break;
+    default:
+      s->encoding = ( c->connection->encoding == ENC_SQLWCHAR
+			? ENC_ISO_LATIN_1
+			: c->connection->encoding );
+  }
+  cs->stream = s;
+  cs->next = c->streams;
+  c->streams = cs;
+
+  if ( !PL_unify_stream(val, s) )
+  { Sclose(s);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Columns that are not bound are read using SQLGetData() into a scratch
+buffer that is kept with the column description, so it is reused for
+all rows and executions of the statement.  The buffer only grows while
+reading, starting at the octet length reported by the driver if this is
+small.  Every GETDATA_SHRINK_ROWS rows the buffer is shrunk if it is
+more than four times the largest value seen in that window, such that a
+single huge value does not pin memory for the lifetime of a prepared
+statement.  The total is accounted in statistics.getdata_bytes.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+resize_getdata_buffer(parameter *p, size_t size)
+{ char *data;
+
+  size = ROW_ALIGN(size);
+  if ( !(data = odbc_realloc(p->getdata.data, size)) )
+  { statistics.getdata_bytes -= (long)p->getdata.size;
+    p->getdata.data = NULL;		/* odbc_realloc() freed it */
+    p->getdata.size = 0;
+    return FALSE;
+  }
+  statistics.getdata_bytes += (long)size - (long)p->getdata.size;
+  statistics.getdata_allocations++;
+  p->getdata.data = data;
+  p->getdata.size = size;
+
+  return TRUE;
+}
+
+
+static void
+shrink_getdata_buffer(parameter *p)
+{ size_t size = 2*p->getdata.peak;
+  char *data;
+
+  if ( size < GETDATA_MIN_SIZE )
+    size = GETDATA_MIN_SIZE;
+  size = ROW_ALIGN(size);
+
+  if ( p->getdata.size > size &&
+       p->getdata.size > 4*p->getdata.peak &&
+       (data = realloc(p->getdata.data, size)) )
+  { statistics.getdata_bytes -= (long)(p->getdata.size - size);
+    p->getdata.data = data;
+    p->getdata.size = size;
+  }
+}
+
+
+/* get_column_data() reads the value of column nth into the scratch
+   buffer of the column.  *lenp is set to the length in bytes or to
+   SQL_NULL_DATA.
+*/
+
+static int
+get_column_data(context *c, int nth, SQLLEN *lenp)
+{ parameter *p = &c->result[nth];
+  size_t pad, offset = 0;
+  SQLLEN len;
+
+  switch(p->cTypeID)
+  { case SQL_C_CHAR:
+      pad = sizeof(SQLCHAR);
+      break;
+    case SQL_C_WCHAR:
+      pad = sizeof(SQLWCHAR);
+      break;
+    default:
+      pad = 0;
+  }
+
+  if ( ++p->getdata.rows >= GETDATA_SHRINK_ROWS )
+  { if ( p->getdata.data )
+      shrink_getdata_buffer(p);
+    p->getdata.rows = 0;
+    p->getdata.peak = 0;
+  }
+  if ( !p->getdata.data &&
+       !resize_getdata_buffer(p, ( p->getdata.hint > GETDATA_MIN_SIZE
+				     ? p->getdata.hint
+				     : GETDATA_MIN_SIZE )) )
+    return FALSE;
+
+  for(;;)
+  { size_t avail = p->getdata.size - offset;
+
+    if ( offset > 0 && PL_handle_signals() < 0 )
+      return FALSE;
+
+    c->rc = SQLGetData(c->hstmt, (UWORD)(nth+1), p->cTypeID,
+		       p->getdata.data+offset, avail, &len);
+    DEBUG(2, Sdprintf("SQLGetData(): rc=%d, len=%ld at offset %zd\n",
+		      c->rc, (long)len, offset));
+
+    switch(c->rc)
+    { case SQL_NO_DATA:
+	*lenp = offset;
+	goto out;
+      case SQL_SUCCESS:
+      case SQL_SUCCESS_WITH_INFO:
+	if ( len == SQL_NULL_DATA )
+	{ *lenp = SQL_NULL_DATA;
+	  return TRUE;
+	}
+	if ( len != SQL_NO_TOTAL && (size_t)len+pad <= avail )
+	{ *lenp = offset+len;		/* this was the last part */
+	  goto out;
+	} else
+	{ size_t got = avail-pad;
+	  size_t need;
+
+	  offset += got;
+	  if ( len != SQL_NO_TOTAL )
+	    need = offset + (len-got) + pad;
+	  else
+	    need = 0;
+	  if ( need <= p->getdata.size )
+	    need = p->getdata.size*2;
+	  if ( !resize_getdata_buffer(p, need) )
+	    return FALSE;
+	}
+	break;
+      default:
+	report_status(c);
+	return FALSE;
+    }
+  }
+
+out:
+  if ( (size_t)*lenp+pad > p->getdata.peak )
+    p->getdata.peak = *lenp+pad;
+  c->bytes_counted += *lenp;
+
+  return TRUE;
+}
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 pl_put_column(context *c, int nth, term_t col)
 
@@ -4390,6 +10419,26 @@ put_chars(term_t val, int plTypeID, int rep, size_t len, const char *chars)
 }
 
 
+/* put_column_chars() is put_chars() for a bound result column, using
+   the atom cache of the column for atoms.
+*/
+
+WUNUSED static int
+put_column_chars(term_t val, parameter *p, int rep,
+		 size_t len, const char *chars)
+{ if ( p->plTypeID == SQL_PL_DEFAULT || p->plTypeID == SQL_PL_ATOM )
+  { atom_t a = cached_atom(p, rep, len, chars);
+
+    if ( a )
+    { PL_put_atom(val, a);
+      return TRUE;
+    }
+  }
+
+  return put_chars(val, p->plTypeID, rep, len, chars);
+}
+
+
 WUNUSED static int
 put_wchars(term_t val, int plTypeID, size_t len, const SQLWCHAR *chars)
 { int pltype = plTypeID_to_pltype(plTypeID);
@@ -4422,11 +10471,118 @@ put_wchars(term_t val, int plTypeID, size_t len, const SQLWCHAR *chars)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+put_decimal() converts the text of   a   DECIMAL  or  NUMERIC column to a
+Prolog number according to the decimal   mode  (see get_decimal_mode()).
+Values with no fraction (after removing trailing zeros) become integers.
+Otherwise DECIMAL_FLOAT creates a float and DECIMAL_RATIONAL an exact
+rational.  Values that fit in 64 bits are converted directly.  Larger
+values are handed to the Prolog reader as an integer or in the rational
+syntax NrD.  Text we do not understand is returned as an atom.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static const double pow10_tab[] =
+{ 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10,
+  1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21,
+  1e22
+};
+
+static int
+put_decimal(term_t val, int mode, int rep, size_t len, const char *s)
+{ const char *e = s+len;
+  const char *q = s;
+  char digits[128];
+  size_t ndigits = 0;
+  int neg = FALSE, dot = FALSE, overflow = FALSE, any = FALSE;
+  uint64_t mant = 0;
+  int scale = 0;
+
+  while(q < e && *q == ' ')
+    q++;
+  if ( q < e && (*q == '-' || *q == '+') )
+    neg = (*q++ == '-');
+  for(; q < e; q++)
+  { if ( *q >= '0' && *q <= '9' )
+    { if ( ndigits+1 >= sizeof(digits) )
+	goto as_text;
+      any = TRUE;
+      if ( ndigits > 0 || *q != '0' )
+	digits[ndigits++] = *q;
+      if ( mant > (UINT64_MAX-9)/10 )
+	overflow = TRUE;
+      mant = mant*10 + (*q-'0');
+      if ( dot )
+	scale++;
+    } else if ( *q == '.' && !dot )
+    { dot = TRUE;
+    } else
+      break;
+  }
+  while(q < e && *q == ' ')
+    q++;
+  if ( q != e || !any )
+    goto as_text;
+  if ( ndigits == 0 )
+    scale = 0;				/* zero */
+
+  while( scale > 0 && ndigits > 0 && digits[ndigits-1] == '0' )
+  { ndigits--;				/* remove trailing zeros */
+    scale--;
+    mant /= 10;
+  }
+
+  if ( !overflow && mant <= (uint64_t)INT64_MAX )
+  { int64_t v = neg ? -(int64_t)mant : (int64_t)mant;
+
+    if ( scale == 0 )
+      return PL_put_int64(val, v);
+    if ( mode == DECIMAL_FLOAT && mant < ((uint64_t)1<<53) && scale <= 22 )
+      return PL_put_float(val, (double)v/pow10_tab[scale]);
+  }
+
+  if ( mode == DECIMAL_FLOAT && scale > 0 )
+  { char buf[160];
+
+    if ( len >= sizeof(buf) )
+      goto as_text;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    return PL_put_float(val, strtod(buf, NULL));
+  } else
+  { char buf[300];
+    char *o = buf;
+
+    if ( neg )
+      *o++ = '-';
+    if ( ndigits == 0 )
+      *o++ = '0';
+    memcpy(o, digits, ndigits);
+    o += ndigits;
+    if ( scale > 0 )
+    { *o++ = 'r';
+      *o++ = '1';
+      memset(o, '0', scale);
+      o += scale;
+    }
+
+    return PL_put_term_from_chars(val, REP_ISO_LATIN_1, o-buf, buf);
+  }
+
+as_text:
+  return put_chars(val, SQL_PL_ATOM, rep, len, s);
+}
+
+
 static int
 pl_put_column(context *c, int nth, term_t col)
 { parameter *p = &c->result[nth];
   term_t cell;
   term_t val;
+  SQLPOINTER value;
+  SQLLEN length;
+
+  if ( c->row_values )			/* fetched by row_filter_matches() */
+    return PL_put_term(col, c->row_values+nth);
 
   if ( ison(c, CTX_SOURCE) )
   { cell = PL_new_term_refs(3);
@@ -4439,133 +10595,46 @@ pl_put_column(context *c, int nth, term_t col)
     cell = 0;				/* make compiler happy */
   }
 
-  if ( !p->ptr_value )			/* use SQLGetData() */
-  { char buf[256];
-    char *data = buf;
-    SQLLEN len;
-
-    DEBUG(2, Sdprintf("Fetching value for column %d using SQLGetData()\n",
-		      nth+1));
-
-    c->rc = SQLGetData(c->hstmt, (UWORD)(nth+1), p->cTypeID,
-		       buf, sizeof(buf), &len);
-
-    if ( c->rc == SQL_SUCCESS || c->rc == SQL_SUCCESS_WITH_INFO )
-    { DEBUG(2, Sdprintf("Got %ld bytes\n", len));
-      if ( len == SQL_NULL_DATA )
-      { if ( !put_sql_null(val, c->null) )
-	  return FALSE;
-	goto ok;
-      } else if ( len == SQL_NO_TOTAL )
-      { int pad = p->cTypeID == SQL_C_CHAR ? 1 : 0;
-	size_t readsofar = sizeof(buf) - pad;
-	SQLLEN bufsize = 2048;			/* must be > sizeof(buf) */
-
-	if ( !(data = odbc_malloc(bufsize)) )
-	  return FALSE;
-	memcpy(data, buf, sizeof(buf));
-
-	do /* Read blocks */
-	{ c->rc = SQLGetData(c->hstmt, (UWORD)(nth+1), p->cTypeID,
-			     &data[readsofar], bufsize-readsofar, &len);
-	  if ( c->rc == SQL_ERROR )
-	  { DEBUG(1, Sdprintf("SQLGetData() returned %d\n", c->rc));
-	    return report_status(c);
-	  } else if ( len == SQL_NO_DATA )	/* Previous block was final one */
-	  { len += readsofar;
-	    goto got_all_data;
-	  } else if ( len == SQL_NO_TOTAL )	/* More blocks are yet to come */
-	  { size_t chunk = bufsize-readsofar-pad;
-	    readsofar += chunk;
-	    bufsize *= 2;
-	    if ( !(data = odbc_realloc(data, bufsize)) )
-	      return FALSE;
-	  } else if ( (ssize_t)len <= (ssize_t)(bufsize-readsofar) )
-	  { len += readsofar;			/* This block is the last one */
-	    goto got_all_data;
-	  } else				/* Is this possible? */
-	  { readsofar+= len;			/* It is analgous to the case */
-	    bufsize *= 2;			/* below where SQL_NO_TOTAL is */
-	    if ( !(data = odbc_realloc(data, bufsize)) ) /* not returned */
-	      return FALSE;
-	  }
-	} while(c->rc != SQL_SUCCESS && c->rc != SQL_NO_DATA);
-	len = readsofar;
-      } else if ( len >= (SDWORD)sizeof(buf) )
-      { int pad;
-	size_t todo;
-	SQLLEN len2;
-	char *ep;
-	int part = 2;
-
-	switch(p->cTypeID)
-	{ case SQL_C_CHAR:
-	    pad = sizeof(SQLCHAR);
-	    break;
-	  case SQL_C_WCHAR:
-	    pad = sizeof(SQLWCHAR);
-	    break;
-	  default:
-	    pad = 0;
-	}
-	todo = len-sizeof(buf)+2*pad;
-	if ( !(data = odbc_malloc(len+pad)) )
-	  return FALSE;
-	memcpy(data, buf, sizeof(buf));	/* you don't get the data twice! */
-	ep = data+sizeof(buf)-pad;
-
-	while(todo > 0)
-	{ c->rc = SQLGetData(c->hstmt, (UWORD)(nth+1), p->cTypeID,
-			     ep, todo, &len2);
-	  DEBUG(2, Sdprintf("Requested %zd bytes for part %d; \
-			     pad=%d; got %ld\n",
-			    todo, part, pad, len2));
-	  todo -= len2;
-	  ep += len2;
-	  part++;
-
-	  switch( c->rc )
-	  { case SQL_SUCCESS:
-	      len = ep-data;
-	      goto got_all_data;
-	    case SQL_SUCCESS_WITH_INFO:
-	      break;
-	    default:
-	    { Sdprintf("ERROR: %d\n", c->rc);
-	      free(data);
-	      return report_status(c);
-	    }
-	  }
-	}
-      }
-    } else
-    { DEBUG(1, Sdprintf("SQLGetData() returned %d\n", c->rc));
-      return report_status(c);
-    }
+  if ( p->plTypeID == SQL_PL_STREAM )
+  { if ( !put_column_stream(c, nth, val) )
+      return FALSE;
+    goto ok;
+  }
 
-  got_all_data:
-    if ( p->cTypeID == SQL_C_WCHAR )
-    { if ( !put_wchars(val, p->plTypeID, len/sizeof(SQLWCHAR), (SQLWCHAR*)data) )
-      { if ( data != buf )
-	  free(data);
-	return FALSE;
-      }
+  if ( !p->ptr_value )			/* use SQLGetData() */
+  { SQLLEN len;
+    int rc;
+
+    DEBUG(2, Sdprintf("Fetching value for column %d using SQLGetData()\n",
+		      nth+1));
+
+    if ( !get_column_data(c, nth, &len) )
+      return FALSE;
+
+    if ( len == SQL_NULL_DATA )
+    { rc = put_sql_null(val, c->null);
+    } else if ( p->cTypeID == SQL_C_WCHAR )
+    { rc = put_wchars(val, p->plTypeID,
+		      len/sizeof(SQLWCHAR), (SQLWCHAR*)p->getdata.data);
+    } else if ( c->decimal != DECIMAL_TEXT && p->cTypeID == SQL_C_CHAR &&
+		p->plTypeID == SQL_PL_DEFAULT && IS_DECIMAL_TYPE(p->sqlTypeID) )
+    { rc = put_decimal(val, c->decimal, c->connection->rep_flag,
+		       len, p->getdata.data);
     } else
     { int rep = (p->cTypeID == SQL_C_BINARY ? REP_ISO_LATIN_1
 					    : c->connection->rep_flag);
 
-      if ( !put_chars(val, p->plTypeID, rep, len, data) )
-      { if ( data != buf )
-	  free(data);
-	return FALSE;
-      }
+      rc = put_chars(val, p->plTypeID, rep, len, p->getdata.data);
     }
-    if ( data != buf )
-      free(data);
+    if ( !rc )
+      return FALSE;
     goto ok;
   }
 
-  if ( p->length_ind == SQL_NULL_DATA )
+  value  = column_value(c, p);
+  length = column_length(c, p);
+
+  if ( length == SQL_NULL_DATA )
   { if ( !put_sql_null(val, c->null) )
       return FALSE;
   } else
@@ -4573,28 +10642,33 @@ pl_put_column(context *c, int nth, term_t col)
 
     switch( p->cTypeID )
     { case SQL_C_CHAR:
-	rc = put_chars(val, p->plTypeID, c->connection->rep_flag,
-		       p->length_ind, (char*)p->ptr_value);
+	if ( c->decimal != DECIMAL_TEXT && p->plTypeID == SQL_PL_DEFAULT &&
+	     IS_DECIMAL_TYPE(p->sqlTypeID) )
+	  rc = put_decimal(val, c->decimal, c->connection->rep_flag,
+			   length, (char*)value);
+	else
+	  rc = put_column_chars(val, p, c->connection->rep_flag,
+				length, (char*)value);
 	break;
       case SQL_C_WCHAR:
 	rc = put_wchars(val, p->plTypeID,
-			p->length_ind/sizeof(SQLWCHAR), (SQLWCHAR*)p->ptr_value);
+			length/sizeof(SQLWCHAR), (SQLWCHAR*)value);
 	break;
       case SQL_C_BINARY:
-	rc = put_chars(val, p->plTypeID, REP_ISO_LATIN_1,
-		       p->length_ind, (char*)p->ptr_value);
+	rc = put_column_chars(val, p, REP_ISO_LATIN_1,
+			      length, (char*)value);
 	break;
       case SQL_C_SLONG:
-	rc = PL_put_integer(val,*(SQLINTEGER *)p->ptr_value);
+	rc = PL_put_integer(val,*(SQLINTEGER *)value);
 	break;
       case SQL_C_SBIGINT:
-	rc = PL_put_int64(val, *(SQLBIGINT *)p->ptr_value);
+	rc = PL_put_int64(val, *(SQLBIGINT *)value);
 	break;
       case SQL_C_DOUBLE:
-	rc = PL_put_float(val,*(SQLDOUBLE *)p->ptr_value);
+	rc = PL_put_float(val,*(SQLDOUBLE *)value);
 	break;
       case SQL_C_TYPE_DATE:
-      { DATE_STRUCT* ds = (DATE_STRUCT*)p->ptr_value;
+      { DATE_STRUCT* ds = (DATE_STRUCT*)value;
 	term_t av;
 
 	rc = ( (av=PL_new_term_refs(3)) &&
@@ -4606,7 +10680,7 @@ pl_put_column(context *c, int nth, term_t col)
 	break;
       }
       case SQL_C_TYPE_TIME:
-      { TIME_STRUCT* ts = (TIME_STRUCT*)p->ptr_value;
+      { TIME_STRUCT* ts = (TIME_STRUCT*)value;
 	term_t av;
 
 	rc = ( (av=PL_new_term_refs(3)) &&
@@ -4618,7 +10692,7 @@ pl_put_column(context *c, int nth, term_t col)
 	break;
       }
       case SQL_C_TIMESTAMP:
-      { SQL_TIMESTAMP_STRUCT* ts = (SQL_TIMESTAMP_STRUCT*)p->ptr_value;
+      { SQL_TIMESTAMP_STRUCT* ts = (SQL_TIMESTAMP_STRUCT*)value;
 
 	switch( p->plTypeID )
 	{ case SQL_PL_DEFAULT:
@@ -4639,38 +10713,14 @@ pl_put_column(context *c, int nth, term_t col)
 	  }
 	  case SQL_PL_INTEGER:
 	  case SQL_PL_FLOAT:
-#ifdef HAVE_TIMEGM
-	  { struct tm tm;
-	    time_t t;
-
-#ifndef USE_UTC
-	    t = time(NULL);
-	    tm = *localtime(&t);
-#else
-	    memset(&tm, 0, sizeof(tm));
-#endif
-	    tm.tm_year  = ts->year - 1900;
-	    tm.tm_mon   = ts->month-1;
-	    tm.tm_mday  = ts->day;
-	    tm.tm_hour  = ts->hour;
-	    tm.tm_min   = ts->minute;
-	    tm.tm_sec   = ts->second;
-
-#ifdef USE_UTC
-	    t = timegm(&tm);
-#else
-	    t = mktime(&tm);
-#endif
+	  { int64_t t = stamp_to_epoch(ts, c->connection);
 
 	    if ( p->plTypeID == SQL_PL_INTEGER )
 	      rc = PL_put_int64(val, t);
 	    else
-	      rc = PL_put_float(val, (double)t); /* TBD: fraction */
-	  }
-#else
-	    return PL_warning("System doesn't support mktime()/timegm()");
-#endif
+	      rc = PL_put_float(val, (double)t + ts->fraction/1000000000.0);
 	    break;
+	  }
 	  default:
 	    rc = 0; /* keep compiler happy */
 	    assert(0);
@@ -4696,7 +10746,7 @@ ok:
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-Store a row
+Store a row, either as row(Col1, ...) or as a dict (see DICT ROWS)
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
 static int
@@ -4704,6 +10754,17 @@ pl_put_row(term_t row, context *c)
 { term_t columns = PL_new_term_refs(c->NumCols);
   SQLSMALLINT i;
 
+  if ( c->dict )
+  { const int *slots = c->dict->slots;
+
+    for (i=0; i<c->NumCols; i++)
+    { if ( !pl_put_column(c, i, columns+slots[i]) )
+	return FALSE;
+    }
+
+    return PL_put_dict(row, 0, c->NumCols, c->dict->keys, columns);
+  }
+
   for (i=0; i<c->NumCols; i++)
   { if ( !pl_put_column(c, i, columns+i) )
       return FALSE;			/* with exception */
@@ -4713,34 +10774,578 @@ pl_put_row(term_t row, context *c)
 }
 
 
-#ifdef EMULATE_TIMEGM
+		 /*******************************
+		 *	      EXPORT		*
+		 *******************************/
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-timegm() is provided by glibc and the inverse of gmtime().  The glibc
-library suggests using mktime with TZ=UTC as alternative.
+odbc_export(+Connection, +SQL, +Stream, +Options) executes SQL and writes
+the result-set to Stream as CSV, TSV or JSON lines.  The cells are
+written from the column buffers using the type dispatch of
+pl_put_column(), but no Prolog terms are created.  Options not handled
+here are passed to set_statement_options(), so fetch_size(N) fetches in
+blocks.
+
+Text is decoded from the column data (SQL_C_CHAR in the encoding of the
+connection, SQL_C_WCHAR as SQLWCHAR units and binary data as ISO
+Latin-1) and written using Sputcode(), such that the encoding of Stream
+applies.  CSV (RFC 4180) quotes all text and ends lines with CRLF.  NULL
+is written as an empty unquoted field.  TSV escapes tab, newline,
+carriage return and backslash and writes NULL as \N.  JSON lines writes
+an object per row, using the column names as keys.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-static time_t
-timegm(struct tm *tm)
-{ char *otz = getenv("TZ");
-  time_t t;
-  char oenv[20];
+#define EXPORT_CSV	0
+#define EXPORT_TSV	1
+#define EXPORT_JSON	2
+
+typedef struct
+{ IOSTREAM    *out;			/* output stream */
+  int	       format;			/* EXPORT_* */
+  int	       ascii;			/* JSON: escape non-ASCII */
+  int	       ncols;			/* # columns */
+  SQLSMALLINT *name_length;		/* byte length of column names */
+  char	      *names;			/* NameBufferLength per column */
+} exporter;
+
+
+static int
+export_code(exporter *ex, int c)
+{ IOSTREAM *out = ex->out;
+
+  switch(ex->format)
+  { case EXPORT_CSV:
+      if ( c == '"' && Sputcode('"', out) < 0 )
+	return FALSE;
+      break;
+    case EXPORT_TSV:
+      switch(c)
+      { case '\t': return Sfputs("\\t", out) >= 0;
+	case '\n': return Sfputs("\\n", out) >= 0;
+	case '\r': return Sfputs("\\r", out) >= 0;
+	case '\\': return Sfputs("\\\\", out) >= 0;
+      }
+      break;
+    case EXPORT_JSON:
+      switch(c)
+      { case '"':  return Sfputs("\\\"", out) >= 0;
+	case '\\': return Sfputs("\\\\", out) >= 0;
+	case '\n': return Sfputs("\\n", out) >= 0;
+	case '\r': return Sfputs("\\r", out) >= 0;
+	case '\t': return Sfputs("\\t", out) >= 0;
+      }
+      if ( c < 0x20 || (c > 0x7e && ex->ascii) )
+      { if ( c > 0xffff )		/* UTF-16 surrogate pair */
+	{ c -= 0x10000;
+	  return Sfprintf(out, "\\u%04x\\u%04x",
+			  0xd800+(c>>10), 0xdc00+(c&0x3ff)) >= 0;
+	}
+	return Sfprintf(out, "\\u%04x", c) >= 0;
+      }
+      break;
+  }
+
+  return Sputcode(c, out) >= 0;
+}
+
+
+/* utf8_code() decodes the UTF-8 sequence starting with lead byte c,
+   the continuation bytes starting at *inp.  Invalid sequences map the
+   lead byte to itself.
+*/
+
+static int
+utf8_code(const unsigned char **inp, const unsigned char *e, int c)
+{ const unsigned char *in = *inp;
+  int i, n, code;
+
+  if ( (c&0xe0) == 0xc0 )
+  { n = 1; code = c&0x1f;
+  } else if ( (c&0xf0) == 0xe0 )
+  { n = 2; code = c&0x0f;
+  } else if ( (c&0xf8) == 0xf0 )
+  { n = 3; code = c&0x07;
+  } else
+    return c;
+
+  if ( e-in < n )
+    return c;
+  for(i=0; i<n; i++)
+  { if ( (in[i]&0xc0) != 0x80 )
+      return c;
+    code = (code<<6)|(in[i]&0x3f);
+  }
+  *inp = in+n;
+
+  return code;
+}
+
+
+static int
+export_chars(exporter *ex, const char *s, size_t len, int rep)
+{ const unsigned char *in = (const unsigned char*)s;
+  const unsigned char *e = in+len;
+
+  if ( rep == REP_MB )
+  { mbstate_t state;
+
+    memset(&state, 0, sizeof(state));
+    while(in < e)
+    { wchar_t wc;
+      size_t n = mbrtowc(&wc, (const char*)in, e-in, &state);
+
+      if ( n == (size_t)-1 || n == (size_t)-2 )
+      { wc = *in;			/* invalid: use the byte */
+	n = 1;
+	memset(&state, 0, sizeof(state));
+      } else if ( n == 0 )
+      { n = 1;				/* embedded NUL */
+      }
+      if ( !export_code(ex, (int)wc) )
+	return FALSE;
+      in += n;
+    }
+
+    return TRUE;
+  }
 
-  if ( otz && strlen(otz) < 10 )	/* avoid buffer overflow */
-  { putenv("TZ=UTC");
-    t = mktime(tm);
-    strcpy(oenv, "TZ=");
-    strcat(oenv, otz);
-    putenv(oenv);
-  } else if ( otz )
-  { Sdprintf("Too long value for TZ: %s", otz);
-    t = mktime(tm);
-  } else				/* not set, what to do? */
-  { t = mktime(tm);
+  while(in < e)
+  { int c = *in++;
+
+    if ( c >= 0x80 && rep == REP_UTF8 )
+      c = utf8_code(&in, e, c);
+    if ( !export_code(ex, c) )
+      return FALSE;
   }
 
-  return t;
+  return TRUE;
 }
 
 
+static int
+export_wchars(exporter *ex, const SQLWCHAR *s, size_t len)
+{ const SQLWCHAR *e = s+len;
+
+  while(s < e)
+  { int c = *s++;
+
+#if SIZEOF_SQLWCHAR == 2
+    if ( c >= 0xd800 && c <= 0xdbff && s < e && *s >= 0xdc00 && *s <= 0xdfff )
+      c = 0x10000 + ((c-0xd800)<<10) + (*s++ - 0xdc00);
 #endif
+    if ( !export_code(ex, c) )
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+static int
+export_quote(exporter *ex)
+{ if ( ex->format == EXPORT_TSV )
+    return TRUE;
+  return Sputcode('"', ex->out) >= 0;
+}
+
+
+/* export_plain() writes text that needs no escaping, such as a number
+   or date.  JSON strings are quoted if quoted is TRUE.
+*/
+
+static int
+export_plain(exporter *ex, const char *s, int quoted)
+{ if ( quoted && ex->format == EXPORT_JSON )
+    return Sfprintf(ex->out, "\"%s\"", s) >= 0;
+  return Sfputs(s, ex->out) >= 0;
+}
+
+
+static int
+export_null(exporter *ex)
+{ switch(ex->format)
+  { case EXPORT_TSV:
+      return Sfputs("\\N", ex->out) >= 0;
+    case EXPORT_JSON:
+      return Sfputs("null", ex->out) >= 0;
+    default:
+      return TRUE;
+  }
+}
+
+
+static int
+export_float(exporter *ex, double f)
+{ char buf[40];
+
+  if ( isnan(f) )
+    return export_plain(ex, ex->format == EXPORT_JSON ? "null" : "nan", FALSE);
+  if ( isinf(f) )
+    return export_plain(ex, ex->format == EXPORT_JSON ? "null" :
+			    f < 0 ? "-inf" : "inf", FALSE);
+
+  snprintf(buf, sizeof(buf), "%.15g", f);
+  if ( strtod(buf, NULL) != f )
+    snprintf(buf, sizeof(buf), "%.17g", f);
+
+  return export_plain(ex, buf, FALSE);
+}
+
+
+/* export_decimal() writes the text of a DECIMAL or NUMERIC column.  For
+   JSON the text is first validated as [+-]digits[.digits] with at least
+   one digit and written as a JSON number: without '+', leading zeros or
+   a trailing '.' and with a 0 before a leading '.'.  Otherwise it is
+   written as a string.
+*/
+
+static int
+export_decimal(exporter *ex, const char *s, size_t len, int rep)
+{ if ( ex->format == EXPORT_JSON )
+  { const char *e = s+len, *q = s;
+    const char *i0, *i1, *f0, *f1;
+    int neg = FALSE;
+
+    if ( q < e && (*q == '-' || *q == '+') )
+      neg = (*q++ == '-');
+    for(i0=q; q < e && *q >= '0' && *q <= '9'; q++)
+      ;
+    i1 = f0 = f1 = q;
+    if ( q < e && *q == '.' )
+    { for(f0=++q; q < e && *q >= '0' && *q <= '9'; q++)
+	;
+      f1 = q;
+    }
+
+    if ( q != e || (i1 == i0 && f1 == f0) )
+      return ( export_quote(ex) &&
+	       export_chars(ex, s, len, rep) &&
+	       export_quote(ex) );
+
+    while( i1-i0 > 1 && *i0 == '0' )
+      i0++;
+    return ( (!neg || Sputcode('-', ex->out) >= 0) &&
+	     (i1 > i0 ? export_chars(ex, i0, i1-i0, rep)
+		      : Sputcode('0', ex->out) >= 0) &&
+	     (f1 == f0 || (Sputcode('.', ex->out) >= 0 &&
+			   export_chars(ex, f0, f1-f0, rep))) );
+  }
+
+  return export_chars(ex, s, len, rep);
+}
+
+
+static int
+export_column(exporter *ex, context *c, int nth)
+{ parameter *p = &c->result[nth];
+  SQLPOINTER value;
+  SQLLEN length;
+  char buf[64];
+
+  if ( !p->ptr_value )			/* use SQLGetData() */
+  { if ( !get_column_data(c, nth, &length) )
+      return FALSE;
+    value = p->getdata.data;
+  } else
+  { value  = column_value(c, p);
+    length = column_length(c, p);
+  }
+
+  if ( length == SQL_NULL_DATA )
+    return export_null(ex);
+
+  switch(p->cTypeID)
+  { case SQL_C_CHAR:
+      if ( IS_DECIMAL_TYPE(p->sqlTypeID) )
+	return export_decimal(ex, value, length, c->connection->rep_flag);
+      return ( export_quote(ex) &&
+	       export_chars(ex, value, length, c->connection->rep_flag) &&
+	       export_quote(ex) );
+    case SQL_C_BINARY:
+      return ( export_quote(ex) &&
+	       export_chars(ex, value, length, REP_ISO_LATIN_1) &&
+	       export_quote(ex) );
+    case SQL_C_WCHAR:
+      return ( export_quote(ex) &&
+	       export_wchars(ex, value, length/sizeof(SQLWCHAR)) &&
+	       export_quote(ex) );
+    case SQL_C_SLONG:
+      snprintf(buf, sizeof(buf), "%ld", (long)*(SQLINTEGER*)value);
+      return export_plain(ex, buf, FALSE);
+    case SQL_C_SBIGINT:
+      snprintf(buf, sizeof(buf), "%lld", (long long)*(SQLBIGINT*)value);
+      return export_plain(ex, buf, FALSE);
+    case SQL_C_DOUBLE:
+      return export_float(ex, *(SQLDOUBLE*)value);
+    case SQL_C_TYPE_DATE:
+    { DATE_STRUCT *ds = value;
+
+      snprintf(buf, sizeof(buf), "%04d-%02d-%02d",
+	       ds->year, ds->month, ds->day);
+      return export_plain(ex, buf, TRUE);
+    }
+    case SQL_C_TYPE_TIME:
+    { TIME_STRUCT *ts = value;
+
+      snprintf(buf, sizeof(buf), "%02d:%02d:%02d",
+	       ts->hour, ts->minute, ts->second);
+      return export_plain(ex, buf, TRUE);
+    }
+    case SQL_C_TIMESTAMP:
+    { SQL_TIMESTAMP_STRUCT *ts = value;
+
+      switch(p->plTypeID)
+      { case SQL_PL_INTEGER:
+	  snprintf(buf, sizeof(buf), "%lld",
+		   (long long)stamp_to_epoch(ts, c->connection));
+	  return export_plain(ex, buf, FALSE);
+	case SQL_PL_FLOAT:
+	  return export_float(ex, (double)stamp_to_epoch(ts, c->connection) +
+				  ts->fraction/1000000000.0);
+	default:
+	  format_timestamp(ts, buf);
+	  return export_plain(ex, buf, TRUE);
+      }
+    }
+    default:
+      return PL_warning("ODBC: Unknown cTypeID: %d", p->cTypeID);
+  }
+}
+
+
+static int
+export_name(exporter *ex, context *c, int nth)
+{ return ( export_quote(ex) &&
+	   export_chars(ex, &ex->names[nth*NameBufferLength],
+			ex->name_length[nth], c->connection->rep_flag) &&
+	   export_quote(ex) );
+}
+
+
+static int
+export_row(exporter *ex, context *c, int header)
+{ IOSTREAM *out = ex->out;
+  int i;
+
+  if ( ex->format == EXPORT_JSON && Sputcode('{', out) < 0 )
+    return FALSE;
+
+  for(i=0; i<ex->ncols; i++)
+  { if ( i > 0 && Sputcode(ex->format == EXPORT_TSV ? '\t' : ',', out) < 0 )
+      return FALSE;
+    if ( ex->format == EXPORT_JSON &&
+	 !(export_name(ex, c, i) && Sputcode(':', out) >= 0) )
+      return FALSE;
+    if ( !(header ? export_name(ex, c, i) : export_column(ex, c, i)) )
+      return FALSE;
+  }
+
+  switch(ex->format)
+  { case EXPORT_CSV:
+      return Sfputs("\r\n", out) >= 0;
+    case EXPORT_JSON:
+      return Sfputs("}\n", out) >= 0;
+    default:
+      return Sputcode('\n', out) >= 0;
+  }
+}
+
+
+static int
+export_column_names(exporter *ex, context *ctxt)
+{ SQLSMALLINT i, dataType, decimalDigits, nullable;
+  SQLULEN columnSize;
+
+  ex->ncols = ctxt->NumCols;
+  if ( !(ex->names = odbc_malloc((size_t)ex->ncols*NameBufferLength)) ||
+       !(ex->name_length = odbc_malloc(ex->ncols*sizeof(SQLSMALLINT))) )
+    return FALSE;
+
+  for(i=0; i<ex->ncols; i++)
+  { SQLSMALLINT *lp = &ex->name_length[i];
+
+    ctxt->rc = SQLDescribeCol(ctxt->hstmt, i+1,
+			      (SQLCHAR*)&ex->names[i*NameBufferLength],
+			      NameBufferLength, lp,
+			      &dataType, &columnSize, &decimalDigits,
+			      &nullable);
+    if ( !report_status(ctxt) )
+      return FALSE;
+    if ( *lp >= NameBufferLength )
+      *lp = NameBufferLength-1;		/* truncated */
+  }
+
+  return TRUE;
+}
+
+
+static int
+export_result(exporter *ex, context *ctxt, int header)
+{ int self = PL_thread_self();
+  unsigned int n = 0;
+  int rc = FALSE;
+
+  set(ctxt, CTX_INUSE);
+  start_deadline(ctxt);
+  LOCK_CONTEXTS();
+  if ( !mark_context_as_executing(self, ctxt) )
+  { UNLOCK_CONTEXTS();
+    close_context(ctxt);
+    return FALSE;
+  }
+  UNLOCK_CONTEXTS();
+  if ( ctxt->char_width == 1 )
+  { TRY(ctxt,
+	SQLExecDirectA(ctxt->hstmt, ctxt->sqltext.a, ctxt->sqllen),
+	unmark_and_close_context(ctxt));
+  } else
+  { TRY(ctxt,
+	SQLExecDirectW(ctxt->hstmt, ctxt->sqltext.w, ctxt->sqllen),
+	unmark_and_close_context(ctxt));
+  }
+  LOCK_CONTEXTS();
+  clear(ctxt, CTX_EXECUTING);
+  if ( self >= 0 )
+    executing_contexts[self] = NULL;
+  UNLOCK_CONTEXTS();
+
+  if ( !prepare_result(ctxt) )
+  { close_context(ctxt);
+    return FALSE;
+  }
+  set(ctxt, CTX_BOUND);
+  if ( !ctxt->result )			/* not a SELECT statement */
+  { close_context(ctxt);
+    return TRUE;
+  }
+
+  if ( !export_column_names(ex, ctxt) ||
+       !mark_fetching(ctxt) )		/* close_context() unmarks */
+    goto out;
+  if ( header && ex->format != EXPORT_JSON && !export_row(ex, ctxt, TRUE) )
+    goto out;
+
+  for(;;)
+  { if ( (++n % SIGNAL_CHECK_ROWS) == 0 && PL_handle_signals() < 0 )
+      goto out;
+
+    switch(fetch_row(ctxt))
+    { case FALSE:
+	rc = TRUE;
+	goto out;
+      case TRUE:
+	break;
+      default:
+	goto out;
+    }
+
+    if ( !export_row(ex, ctxt, FALSE) )
+      goto out;
+  }
+
+out:
+  close_context(ctxt);
+  return rc;
+}
+
+
+static foreign_t
+odbc_export(term_t conn, term_t tquery, term_t stream, term_t options)
+{ connection *cn;
+  context *ctxt;
+  exporter ex;
+  IOSTREAM *out;
+  term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t rest = PL_new_term_ref();	/* statement options */
+  int header = TRUE;
+  int rc;
+
+  if ( !get_connection(conn, &cn) )
+    return FALSE;
+
+  memset(&ex, 0, sizeof(ex));
+  PL_put_nil(rest);
+  while(PL_get_list(tail, head, tail))
+  { if ( PL_is_functor(head, FUNCTOR_format1) )
+    { atom_t a;
+
+      if ( !get_atom_arg_ex(1, head, &a) )
+	return FALSE;
+      if ( a == ATOM_csv )
+	ex.format = EXPORT_CSV;
+      else if ( a == ATOM_tsv )
+	ex.format = EXPORT_TSV;
+      else if ( a == ATOM_json )
+	ex.format = EXPORT_JSON;
+      else
+      { term_t a = PL_new_term_ref();
+	_PL_get_arg(1, head, a);
+	return domain_error(a, "export_format");
+      }
+    } else if ( PL_is_functor(head, FUNCTOR_header1) )
+    { if ( !get_bool_arg_ex(1, head, &header) )
+	return FALSE;
+    } else if ( !PL_cons_list(rest, head, rest) )
+    { return FALSE;
+    }
+  }
+  if ( !PL_get_nil(tail) )
+    return type_error(tail, "list");
+
+  if ( !PL_get_stream(stream, &out, SIO_OUTPUT) )
+    return FALSE;
+  ex.out = out;
+  ex.ascii = !( out->encoding == ENC_UTF8 ||
+		out->encoding == ENC_UNICODE_BE ||
+		out->encoding == ENC_UNICODE_LE ||
+		out->encoding == ENC_WCHAR );
+
+  if ( !(ctxt = new_context(cn)) )
+  { rc = FALSE;
+  } else if ( !get_sql_text(ctxt, tquery) ||
+	      !set_statement_options(ctxt, rest) )
+  { free_context(ctxt);
+    rc = FALSE;
+  } else
+  { rc = export_result(&ex, ctxt, header);
+  }
+
+  if ( ex.names )
+    free(ex.names);
+  if ( ex.name_length )
+    free(ex.name_length);
+  if ( !PL_release_stream(out) )
+    return FALSE;
+
+  return rc;
+}
+
+
+/* '$odbc_export_decimal'(+Stream, +Text) writes Text as the JSON value
+   of a DECIMAL column.  Used by the tests.
+*/
+
+static foreign_t
+odbc_export_decimal(term_t stream, term_t text)
+{ exporter ex;
+  IOSTREAM *out;
+  char *s;
+  size_t len;
+  int rc;
+
+  if ( !PL_get_nchars(text, &len, &s,
+		      CVT_ATOM|CVT_STRING|CVT_EXCEPTION|REP_MB) )
+    return FALSE;
+  if ( !PL_get_stream(stream, &out, SIO_OUTPUT) )
+    return FALSE;
+
+  memset(&ex, 0, sizeof(ex));
+  ex.out = out;
+  ex.format = EXPORT_JSON;
+  rc = export_decimal(&ex, s, len, REP_MB);
+  if ( !PL_release_stream(out) )
+    return FALSE;
+
+  return rc;
+}
@@ -41,19 +41,29 @@
 	    odbc_get_connection/2,      % +Conn, ?Option
 	    odbc_end_transaction/2,     % +Conn, +CommitRollback
 
+	    odbc_pool_create/3,         % +DSN, -Pool, +Options
+	    odbc_pool_destroy/1,        % +Pool
+	    odbc_with_connection/3,     % +Pool, -Conn, :Goal
+	    odbc_pool_statistics/2,     % +Pool, ?Key
+
 	    odbc_query/4,               % +Conn, +SQL, -Row, +Options
 	    odbc_query/3,               % +Conn, +SQL, -Row
 	    odbc_query/2,               % +Conn, +SQL
+	    odbc_export/4,              % +Conn, +SQL, +Stream, +Options
+	    odbc_query_lazy/4,          % +Conn, +SQL, -List, +Options
 
 	    odbc_prepare/4,             % +Conn, +SQL, +Parms, -Qid
 	    odbc_prepare/5,             % +Conn, +SQL, +Parms, -Qid, +Options
 	    odbc_execute/2,             % +Qid, +Parms
 	    odbc_execute/3,             % +Qid, +Parms, -Row
+	    odbc_execute_batch/3,       % +Qid, +ListOfParms, -Result
+	    odbc_load/4,                % +Qid, +Stream, -Result, :Options
 	    odbc_fetch/3,               % +Qid, -Row, +Options
 	    odbc_next_result_set/1,     % +Qid
 	    odbc_close_statement/1,     % +Statement
 	    odbc_clone_statement/2,     % +Statement, -Clone
 	    odbc_free_statement/1,      % +Statement
+	    odbc_statement_statistics/2, % +Statement, ?Key
 					% DB dictionary info
 	    odbc_current_table/2,       % +Conn, -Table
 	    odbc_current_table/3,       % +Conn, -Table, ?Facet
@@ -70,6 +80,13 @@
 	    odbc_debug/1                % +Level
 	  ]).
 :- autoload(library(lists),[member/2]).
+:- autoload(library(lazy_lists),[lazy_list/2]).
+:- autoload(library(option),[select_option/4,option/2]).
+:- autoload(library(error),[must_be/2]).
+
+:- meta_predicate
+    odbc_with_connection(+, -, 0),
+    odbc_load(+, +, -, :).
 
 :- use_foreign_library(foreign(odbc4pl)).
 
@@ -121,6 +138,23 @@ odbc_query(Connection, SQL) :-
     ;   print_message(warning, odbc(unexpected_result(Row)))
     ).
 
+%!  odbc_query_lazy(+Connection, +SQL, -List, +Options) is det.
+%
+%   List is a lazy list (see library(lazy_lists)) of the result rows
+%   of SQL.  The list is extended by fetching chunk(N) rows at a time
+%   (default 100).  Unless fetch_size(N) is given, the rows are fetched
+%   in blocks of the same size.  Other options are as odbc_query/4.
+
+odbc_query_lazy(Connection, SQL, List, Options) :-
+    select_option(chunk(Chunk), Options, Options1, 100),
+    must_be(positive_integer, Chunk),
+    (   option(fetch_size(_), Options1)
+    ->  Options2 = Options1
+    ;   Options2 = [fetch_size(Chunk)|Options1]
+    ),
+    '$odbc_lazy_open'(Connection, SQL, Options2, Statement),
+    lazy_list('$odbc_lazy_fetch'(Statement, Chunk), List).
+
 odbc_execute(Statement, Parameters) :-
     odbc_execute(Statement, Parameters, Row),
     !,
@@ -132,6 +166,30 @@ odbc_execute(Statement, Parameters) :-
 odbc_prepare(Connection, SQL, Parameters, Statement) :-
     odbc_prepare(Connection, SQL, Parameters, Statement, []).
 
+
+		 /*******************************
+		 *       CONNECTION POOLS       *
+		 *******************************/
+
+%!  odbc_with_connection(+Pool, -Connection, :Goal)
+%
+%   Run Goal with Connection checked out from Pool.  The connection
+%   is returned to the pool if Goal terminates.
+
+odbc_with_connection(Pool, Connection, Goal) :-
+    setup_call_cleanup(
+        '$odbc_pool_acquire'(Pool, Connection),
+        Goal,
+        '$odbc_pool_release'(Pool, Connection)).
+
+%!  odbc_pool_statistics(+Pool, ?Key) is nondet.
+%
+%   Statistics on a connection pool.
+
+odbc_pool_statistics(Pool, Key) :-
+    '$odbc_pool_statistics'(Pool, Stats),
+    member(Key, Stats).
+
 		 /*******************************
 		 *          SCHEMA STUFF        *
 		 *******************************/
@@ -321,6 +379,21 @@ odbc_statistics(Key) :-
     '$odbc_statistics'(Key).
 
 statistics_key(statements(_Created, _Freed)).
+statistics_key(handles(_Allocated, _Reused)).
+statistics_key(collected(_Statements)).
+statistics_key(getdata_buffers(_Bytes, _Allocations)).
+
+%!  odbc_statement_statistics(+Statement, ?Key) is nondet.
+%
+%   Statistics on a prepared statement.
+
+odbc_statement_statistics(Statement, Key) :-
+    statement_statistics_key(Key),
+    '$odbc_statement_statistics'(Statement, Key).
+
+statement_statistics_key(executions(_Count)).
+statement_statistics_key(rows(_Count)).
+statement_statistics_key(clones(_Count)).
 
 
 		 /*******************************
@@ -123,6 +123,14 @@ open_db :-
     !,
     open_db(Params).
 
+pool_params(DSN, Options) :-
+    params(Params),
+    (   Params = DSN-Options
+    ->  true
+    ;   DSN = (-),
+        Options = [driver_string(Params)]
+    ).
+
 delete_db_file(ConnectString) :-
     atomic(ConnectString),
     split_string(ConnectString, ";", " ", Parts),
@@ -165,6 +173,391 @@ test(cursor,
      ]) :-
     call_cleanup(same_mark(Name1, Name2),
                  delete_statements).
+test(fetch_size,
+     [ setup(create_fetch_table),
+       L == Expected
+     ]) :-
+    numlist(1, 100, Expected),
+    odbc_query(test, 'select (testval) from test order by testval',
+               L, [findall(X, row(X)), fetch_size(7)]).
+test(fetch_size_nondet,
+     [ setup(create_fetch_table),
+       all(X == Expected)
+     ]) :-
+    numlist(1, 100, Expected),
+    odbc_query(test, 'select (testval) from test order by testval',
+               row(X), [fetch_size(16)]).
+test(column_binding,
+     [ setup(create_fetch_table),
+       L == Expected
+     ]) :-
+    numlist(1, 100, Expected),
+    odbc_query(test, 'select (testval) from test order by testval',
+               L, [findall(X, row(X)), fetch_size(9), binding(column)]).
+test(execute_batch,
+     [ setup((open_db, create_test_table(integer))),
+       L == Expected
+     ]) :-
+    numlist(1, 2500, Expected),
+    findall([X], member(X, Expected), Rows),
+    odbc_prepare(test,
+                 'insert into test (testval) values (?)',
+                 [ integer ],
+                 Statement),
+    odbc_execute_batch(Statement, Rows, batch(Affected, Status)),
+    odbc_free_statement(Statement),
+    assertion(Affected == 2500),
+    assertion(length(Status, 2500)),
+    assertion(forall(member(S, Status), memberchk(S, [success,no_info]))),
+    odbc_query(test, 'select (testval) from test order by testval',
+               L, [findall(Y, row(Y))]).
+test(execute_batch_row_error,
+     [ setup((open_db, create_test_table('integer primary key')))
+     ]) :-
+    odbc_prepare(test,
+                 'insert into test (testval) values (?)',
+                 [ integer ],
+                 Statement),
+    catch(odbc_execute_batch(Statement, [[1],[2],[1]], Result),
+          error(odbc(_,_,_), _),
+          Result = raised),         % no per-row diagnostics
+    odbc_free_statement(Statement),
+    (   Result = batch(_, [_,_,S3])
+    ->  assertion((S3 == error ; S3 = error(odbc(_,_,_), _)))
+    ;   assertion(Result == raised)
+    ).
+test(statement_cache,
+     [ setup(create_fetch_table),
+       cleanup(odbc_set_connection(test, statement_cache(0))),
+       Hits-Sums == 3-[5050,5050,5050,5050,5050]
+     ]) :-
+    odbc_set_connection(test, statement_cache(4)),
+    odbc_get_connection(test, statement_cache_statistics(S0)),
+    memberchk(hits(H0), S0),
+    findall(Sum,
+            ( between(1, 5, _),
+              odbc_query(test, 'select sum(testval) from test', row(Sum))
+            ),
+            Sums),
+    odbc_get_connection(test, statement_cache_statistics(S1)),
+    memberchk(hits(H1), S1),
+    Hits is H1-H0.
+test(statement_cache_variant,
+     [ setup(create_fetch_table),
+       cleanup(odbc_set_connection(test, statement_cache(0))),
+       Hits == [1,0]
+     ]) :-
+    odbc_set_connection(test, statement_cache(4)),
+    cache_hits(3, H1),
+    odbc_set_connection(test, fetch_size(1)),
+    cache_hits(1, H2),
+    Hits = [H1,H2].
+test(clone_pool,
+     [ setup(make_mark_table),
+       cleanup(delete_statements),
+       Created == 0
+     ]) :-
+    findall(N1-N2, same_mark(N1, N2), _),
+    odbc_statistics(statements(C0, _)),
+    findall(N1-N2, same_mark(N1, N2), _),
+    odbc_statistics(statements(C1, _)),
+    Created is C1-C0.
+test(statement_pool,
+     [ setup(create_fetch_table),
+       Reused >= 9
+     ]) :-
+    odbc_statistics(handles(_, R0)),
+    forall(between(1, 10, _),
+           odbc_query(test, 'select count(*) from test', row(_))),
+    odbc_statistics(handles(_, R1)),
+    Reused is R1-R0.
+test(statement_blob,
+     [ setup(create_fetch_table),
+       error(existence_error(odbc_statement_handle, Statement))
+     ]) :-
+    odbc_prepare(test, 'select (testval) from test where testval < ?',
+                 [integer], Statement),
+    assertion(blob(Statement, odbc_statement)),
+    forall(between(1, 3, _),
+           findall(X, odbc_execute(Statement, [11], row(X)), _)),
+    odbc_statement_statistics(Statement, executions(Executions)),
+    odbc_statement_statistics(Statement, rows(Rows)),
+    assertion(Executions-Rows == 3-30),
+    odbc_free_statement(Statement),
+    odbc_execute(Statement, [11], _).
+test(disconnect_statements,
+     [ setup(create_fetch_table),
+       error(existence_error(odbc_statement_handle, Statement))
+     ]) :-
+    pool_params(DSN, Options),
+    odbc_connect(DSN, Connection, Options),
+    odbc_prepare(Connection, 'select count(*) from test', [], Statement),
+    odbc_disconnect(Connection),
+    odbc_execute(Statement, [], _).
+test(connection_pool,
+     [ setup(create_fetch_table),
+       cleanup(odbc_pool_destroy(Pool)),
+       Sums-Connects == [5050,5050,5050]-1
+     ]) :-
+    pool_params(DSN, Options),
+    odbc_pool_create(DSN, Pool, [max_size(2)|Options]),
+    findall(Sum,
+            ( between(1, 3, _),
+              odbc_with_connection(
+                  Pool, C,
+                  odbc_query(C, 'select sum(testval) from test', row(Sum)))
+            ),
+            Sums),
+    odbc_pool_statistics(Pool, connects(Connects)).
+test(timeout,
+     [ setup(create_fetch_table),
+       throws(time_limit_exceeded)
+     ]) :-
+    odbc_query(test, 'select (testval) from test',
+               _, [findall(X, row(X)), timeout(0.000001)]).
+test(stream_column,
+     [ setup((open_db, create_test_table(varchar(2000)))),
+       Read == Text
+     ]) :-
+    length(Codes, 1500),
+    maplist(=(0'x), Codes),
+    atom_codes(Text, Codes),
+    odbc_query(test, 'insert into test (testval) values (\'~w\')'-[Text]),
+    once(( odbc_query(test, 'select (testval) from test', row(In),
+                      [types([stream])]),
+           call_cleanup(read_string(In, _, String), close(In))
+         )),
+    atom_string(Read, String).
+test(stream_parameter,
+     [ setup((open_db, create_test_table(longvarchar))),
+       Read == Text
+     ]) :-
+    length(Codes, 20000),
+    maplist(=(0'y), Codes),
+    atom_codes(Text, Codes),
+    odbc_prepare(test, 'insert into test (testval) values (?)',
+                 [longvarchar], Statement),
+    setup_call_cleanup(
+        open_string(Text, In),
+        odbc_execute(Statement, [stream(In)]),
+        close(In)),
+    odbc_free_statement(Statement),
+    odbc_query(test, 'select (testval) from test', row(Read)).
+test(stream_parameter_empty,
+     [ setup((open_db, create_test_table(longvarchar))),
+       Read == ''
+     ]) :-
+    odbc_prepare(test, 'insert into test (testval) values (?)',
+                 [longvarchar], Statement),
+    setup_call_cleanup(
+        open_string("", In),
+        odbc_execute(Statement, [stream(In)]),
+        close(In)),
+    odbc_free_statement(Statement),
+    odbc_query(test, 'select (testval) from test', row(Read)).
+test(getdata_buffers,
+     [ setup((open_db, create_test_table(varchar(2000)))),
+       Allocs < 10
+     ]) :-
+    length(Codes, 1500),
+    maplist(=(0'w), Codes),
+    atom_codes(Wide, Codes),
+    forall(between(1, 10, _),
+           odbc_query(test,
+                      'insert into test (testval) values (\'~w\')'-[Wide])),
+    odbc_statistics(getdata_buffers(_, Allocs0)),
+    findall(X, odbc_query(test, 'select (testval) from test', row(X)), Rows),
+    odbc_statistics(getdata_buffers(_, Allocs1)),
+    assertion((length(Rows, 10), forall(member(R, Rows), R == Wide))),
+    Allocs is Allocs1-Allocs0,
+    assertion(Allocs > 0).
+test(timestamp_utc,
+     [ setup((open_db, create_test_table(timestamp))),
+       cleanup(odbc_set_connection(test, timezone(local))),
+       [Stamp, Float] == [timestamp(2001,2,3,4,5,6,0), 981173106.25]
+     ]) :-
+    odbc_set_connection(test, timezone(utc)),
+    odbc_prepare(test, 'insert into test (testval) values (?)',
+                 [timestamp], Statement),
+    odbc_execute(Statement, [981173106.25]),
+    odbc_free_statement(Statement),
+    odbc_query(test, 'select (testval) from test', row(Float),
+               [types([float])]),
+    odbc_query(test, 'select (testval) from test', row(timestamp(Y,M,D,H,Mi,S,_)),
+               [types([timestamp])]),
+    Stamp = timestamp(Y,M,D,H,Mi,S,0).
+test(decimal_rational,
+     [ setup((open_db, create_test_table(decimal(14,2)))),
+       Values == [1745r100, 17]
+     ]) :-
+    odbc_prepare(test, 'insert into test (testval) values (?)',
+                 [decimal(14,2)], Statement),
+    odbc_execute(Statement, [349r20]),
+    odbc_execute(Statement, [17]),
+    odbc_free_statement(Statement),
+    odbc_query(test, 'select (testval) from test order by testval desc',
+               Values, [findall(X, row(X)), decimal(rational)]).
+test(row_format_dict,
+     [ setup((open_db, create_test_table(integer))),
+       Values == [1, 2]
+     ]) :-
+    odbc_query(test, 'insert into test (testval) values (1)', _),
+    odbc_query(test, 'insert into test (testval) values (2)', _),
+    findall(Value,
+            ( odbc_query(test, 'select testval as v from test order by v',
+                         Row, [row_format(dict)]),
+              dict_pairs(Row, _, [v-Value])
+            ),
+            Values).
+test(row_filter,
+     [ setup((open_db, create_test_table(integer))),
+       L == [x]
+     ]) :-
+    forall(between(1, 3, I),
+           odbc_query(test, 'insert into test (testval) values (~w)'-[I], _)),
+    odbc_query(test, 'select (testval) from test', row(2)),
+    \+ odbc_query(test, 'select (testval) from test', row(4)),
+    odbc_query(test, 'select (testval) from test', L,
+               [findall(x, row(2))]).
+test(row_filter_getdata,
+     [ setup((open_db, create_test_table(varchar(2000)))),
+       L-Count == [wide]-1
+     ]) :-
+    odbc_query(test, 'insert into test (testval) values (\'wide\')'),
+    odbc_query(test, 'insert into test (testval) values (\'other\')'),
+    odbc_query(test, 'select testval, testval from test', L,
+               [findall(X, row(X, wide))]),
+    odbc_query(test, 'select testval, testval from test', Count,
+               [aggregate(count, row(_, wide))]).
+test(aggregate,
+     [ setup((open_db, create_test_table(integer))),
+       all(A == [3, 6, 1, 3, [1,2,3], [1,2,3], 1])
+     ]) :-
+    forall(between(1, 3, I),
+           odbc_query(test, 'insert into test (testval) values (~w)'-[I], _)),
+    member(Spec-Row, [ count-row(_),
+                       sum(X)-row(X),
+                       min(X)-row(X),
+                       max(X)-row(X),
+                       bag(X)-row(X),
+                       set(X)-row(X),
+                       count-row(2)
+                     ]),
+    odbc_query(test, 'select (testval) from test order by testval', A,
+               [aggregate(Spec, Row)]).
+test(aggregate_free,
+     [ setup((open_db, create_test_table(integer))),
+       Counts == [0,1,2,3]
+     ]) :-
+    findall(Count,
+            ( between(0, 3, I),
+              (   I > 0
+              ->  odbc_query(test,
+                             'insert into test (testval) values (~w)'-[I], _)
+              ;   true
+              ),
+              odbc_query(test, 'select (testval) from test', Count,
+                         [aggregate(count, row(_))])
+            ),
+            Counts),
+    \+ odbc_query(test, 'select (testval) from test where testval > 3', _,
+                  [aggregate(max(X), row(X))]).
+test(row_format_columns,
+     [ setup((open_db, create_test_table(integer))),
+       Columns == [[1,2,3], [2,4,6]]
+     ]) :-
+    forall(between(1, 3, I),
+           odbc_query(test, 'insert into test (testval) values (~w)'-[I], _)),
+    odbc_query(test, 'select testval, testval*2 from test order by testval',
+               Columns, [row_format(columns)]).
+test(export_csv,
+     [ setup((open_db, create_test_table(integer))),
+       String == "1\r\n2\r\n"
+     ]) :-
+    forall(between(1, 2, I),
+           odbc_query(test, 'insert into test (testval) values (~w)'-[I], _)),
+    with_output_to(string(String),
+                   odbc_export(test, 'select testval from test order by testval',
+                               current_output, [format(csv), header(false)])).
+test(export_decimal_json,
+     [ JSON == ["0.5", "-0.5", "\".\"", "\"1.2.3\"", "12", "0.25"]
+     ]) :-
+    maplist(export_decimal_json, [".5", "-.5", ".", "1.2.3", "+012.", "00.25"],
+            JSON).
+test(load_csv,
+     [ setup((open_db, create_test_table(integer))),
+       L-Rejected == [1,2,4]-[3]
+     ]) :-
+    odbc_prepare(test,
+                 'insert into test (testval) values (?)',
+                 [ integer ],
+                 Statement),
+    setup_call_cleanup(
+        open_string("testval\n1\n2\nthree\n4\n", In),
+        odbc_load(Statement, In, load(3, Rejected), [header(true)]),
+        close(In)),
+    odbc_free_statement(Statement),
+    odbc_query(test, 'select (testval) from test order by testval',
+               L, [findall(X, row(X))]).
+test(load_in_use,
+     [ setup((open_db, create_test_table(integer))),
+       error(context_error(Statement, in_use, statement))
+     ]) :-
+    odbc_prepare(test,
+                 'insert into test (testval) values (?)',
+                 [ integer ],
+                 Statement),
+    setup_call_cleanup(
+        open_string("1\n2\n", In),
+        odbc_load(Statement, In, _, [progress(insert_batch(Statement))]),
+        ( close(In),
+          odbc_free_statement(Statement)
+        )).
+test(query_lazy,
+     [ setup((open_db, create_test_table(integer))),
+       Sum == 5050
+     ]) :-
+    forall(between(1, 100, I),
+           odbc_query(test, 'insert into test (testval) values (~w)'-[I], _)),
+    odbc_query_lazy(test, 'select (testval) from test order by testval',
+                    List, [chunk(7)]),
+    foldl(add_row, List, 0, Sum).
+test(max_rows,
+     [ setup((open_db, create_test_table(integer))),
+       throws(error(resource_error(max_rows), _))
+     ]) :-
+    forall(between(1, 5, I),
+           odbc_query(test, 'insert into test (testval) values (~w)'-[I], _)),
+    odbc_query(test, 'select (testval) from test order by testval',
+               _, [findall(X, row(X)), max_rows(2)]).
+test(max_rows_truncate,
+     [ setup((open_db, create_test_table(integer))),
+       L-All == [1,2]-[1,2,3,4,5]
+     ]) :-
+    forall(between(1, 5, I),
+           odbc_query(test, 'insert into test (testval) values (~w)'-[I], _)),
+    odbc_query(test, 'select (testval) from test order by testval',
+               L, [findall(X, row(X)), max_rows(2), on_limit(truncate)]),
+    odbc_query(test, 'select (testval) from test order by testval',
+               All, [findall(X, row(X))]).
+test(atom_cache,
+     [ setup((open_db, create_test_table(varchar(20)))),
+       Sorted == Expected
+     ]) :-
+    findall(V, ( between(1, 5, _), between(10, 19, I), atom_concat(a, I, V) ),
+            Repeated),
+    findall(V, ( between(1000, 1037, I), atom_concat(d, I, V) ), Fill),
+    findall(V, ( between(1000, 2099, I), atom_concat(e, I, V) ), Distinct),
+    append([Repeated, Fill, Repeated, Distinct, Repeated], Values),
+    findall([V], member(V, Values), Rows),
+    odbc_prepare(test, 'insert into test (testval) values (?)',
+                 [varchar(20)], Statement),
+    odbc_execute_batch(Statement, Rows, _),
+    odbc_free_statement(Statement),
+    odbc_query(test, 'select (testval) from test', L,
+               [findall(X, row(X))]),
+    msort(L, Sorted),
+    msort(Values, Expected).
 
 :- end_tests(odbc).
 
@@ -582,13 +975,36 @@ marks(L) :-
                'select * from marks', L,
                [findall(mark(X,Y), row(X,Y))]).
 
-with_mark(Mark, L) :-                   % doesn't work yet
+with_mark(Mark, L) :-
     open_db,
     odbc_query(test,
                'select * from marks', L,
                [ findall(Name, row(Name, Mark))
                ]).
 
+insert_batch(Statement, _Loaded, _Rejected) :-
+    odbc_execute_batch(Statement, [[3]], _).
+
+add_row(row(X), S0, S) :-
+    S is S0+X.
+
+export_decimal_json(Text, JSON) :-
+    with_output_to(string(JSON),
+                   odbc:'$odbc_export_decimal'(current_output, Text)).
+
+%   cache_hits(+Times, -Hits) runs a findall/2 query Times times and
+%   returns the number of statement cache hits.
+
+cache_hits(Times, Hits) :-
+    odbc_get_connection(test, statement_cache_statistics(S0)),
+    memberchk(hits(H0), S0),
+    forall(between(1, Times, _),
+           odbc_query(test, 'select (testval) from test where testval < 4',
+                      [1,2,3], [findall(X, row(X))])),
+    odbc_get_connection(test, statement_cache_statistics(S1)),
+    memberchk(hits(H1), S1),
+    Hits is H1-H0.
+
 tmark :-
     open_db,
     odbc_query(test, 'SELECT * from marks', row(X, 6)),